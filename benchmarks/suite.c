@@ -0,0 +1,239 @@
+/*
+ * Measures the throughput of the main paths of picozip and prints the results as JSON, to stdout
+ * or to the file given as the first argument, so they can be compared between versions:
+ * - "crc32": CRC-32 of a buffer in memory
+ * - "small_entries": tiny in-memory entries added one by one and with picozip_new_entries_mem
+ * - "large_entry": one large entry written to the mem, FILE* and path backends
+ * - "end": time spent building the archive (adding the entries, whose central directory records
+ *   are encoded as they are added, then picozip_end_ex) and in picozip_end_ex alone, and peak
+ *   memory allocated, by number of entries
+ */
+#define PICOZIP_IMPLEMENTATION
+#include "picozip.h"
+#include <stdio.h>
+
+#define BENCH_CRC_SIZE (64 * 1024 * 1024)
+#define BENCH_CRC_ROUNDS 8
+#define BENCH_SMALL_COUNT 200000
+#define BENCH_SMALL_SIZE 64
+#define BENCH_LARGE_SIZE (64 * 1024 * 1024)
+#define BENCH_LARGE_ROUNDS 4
+#define BENCH_ZIP "bench.zip"
+#define BENCH_INPUT "bench_input.bin"
+
+static double now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static double rate(double start, double amount)
+{
+    double secs = now() - start;
+    return secs > 0 ? amount / secs : 0;
+}
+
+/* allocator that keeps track of the bytes picozip has allocated */
+static size_t mem_current = 0, mem_peak = 0;
+
+static void *counting_alloc(void *userdata, size_t size)
+{
+    size_t *mem = (size_t *)malloc(sizeof(size_t) * 2 + size);
+    (void)(userdata);
+    if (!mem)
+        return NULL;
+    mem[0] = size;
+    mem_current += size;
+    if (mem_current > mem_peak)
+        mem_peak = mem_current;
+    return mem + 2;
+}
+
+static void counting_free(void *userdata, void *mem)
+{
+    (void)(userdata);
+    if (!mem)
+        return;
+    mem_current -= ((size_t *)mem - 2)[0];
+    free((size_t *)mem - 2);
+}
+
+static size_t discard_write(void *userdata, const void *mem, size_t size)
+{
+    (void)(userdata);
+    (void)(mem);
+    return size;
+}
+
+static int bench_crc32(FILE *out, const uint8_t *src)
+{
+    uint32_t crc = PICOZIP__CRC_START;
+    double start;
+    size_t i;
+
+    /* each round continues the CRC of the one before, so the check is the CRC of the rounds back to back */
+    start = now();
+    for (i = 0; i < BENCH_CRC_ROUNDS; i++)
+        crc = picozip__crc32(src, BENCH_CRC_SIZE, crc);
+    fprintf(out, "  \"crc32\": {\"bytes\": %lu, \"gbps\": %.3f, \"check\": %lu},\n",
+            (unsigned long)BENCH_CRC_SIZE, rate(start, (double)BENCH_CRC_SIZE * BENCH_CRC_ROUNDS) / 1e9, (unsigned long)crc);
+    return 0;
+}
+
+static int bench_small_entries(FILE *out, const uint8_t *src)
+{
+    static char names[BENCH_SMALL_COUNT][32];
+    static picozip_entry_desc descs[BENCH_SMALL_COUNT];
+    double start, single, batch;
+    picozip_file *f;
+    size_t i;
+
+    for (i = 0; i < BENCH_SMALL_COUNT; i++)
+    {
+        sprintf(names[i], "%lu.txt", (unsigned long)i);
+        descs[i].path = names[i];
+        descs[i].data = src + (i % 1024);
+        descs[i].size = BENCH_SMALL_SIZE;
+        descs[i].mod_time = 1700000000;
+        descs[i].comment = NULL;
+        descs[i].comment_len = 0;
+    }
+
+    start = now();
+    if (picozip_new_mem(&f) != PICOZIP_OK)
+        return 1;
+    for (i = 0; i < BENCH_SMALL_COUNT; i++)
+    {
+        if (picozip_new_entry_mem_ex(f, descs[i].path, descs[i].data, descs[i].size, descs[i].mod_time, NULL, 0) != PICOZIP_OK)
+            return 1;
+    }
+    if (picozip_end(f) != PICOZIP_OK)
+        return 1;
+    single = rate(start, BENCH_SMALL_COUNT);
+    picozip_free_mem(f);
+
+    start = now();
+    if (picozip_new_mem(&f) != PICOZIP_OK || picozip_new_entries_mem(f, descs, BENCH_SMALL_COUNT, NULL) != PICOZIP_OK || picozip_end(f) != PICOZIP_OK)
+        return 1;
+    batch = rate(start, BENCH_SMALL_COUNT);
+    picozip_free_mem(f);
+
+    fprintf(out, "  \"small_entries\": {\"entries\": %lu, \"size\": %lu, \"entries_per_sec\": %.0f, \"batch_entries_per_sec\": %.0f},\n",
+            (unsigned long)BENCH_SMALL_COUNT, (unsigned long)BENCH_SMALL_SIZE, single, batch);
+    return 0;
+}
+
+static int bench_large_entry(FILE *out, const uint8_t *src)
+{
+    double start, mem_gbps, file_gbps, path_gbps, bytes;
+    picozip_file *f;
+    FILE *fptr;
+    size_t i;
+
+    bytes = (double)BENCH_LARGE_SIZE * BENCH_LARGE_ROUNDS;
+
+    start = now();
+    for (i = 0; i < BENCH_LARGE_ROUNDS; i++)
+    {
+        if (picozip_new_mem(&f) != PICOZIP_OK || picozip_new_entry_mem(f, "large.bin", src, BENCH_LARGE_SIZE) != PICOZIP_OK || picozip_end(f) != PICOZIP_OK)
+            return 1;
+        picozip_free_mem(f);
+    }
+    mem_gbps = rate(start, bytes) / 1e9;
+
+    start = now();
+    for (i = 0; i < BENCH_LARGE_ROUNDS; i++)
+    {
+        if (!(fptr = fopen(BENCH_ZIP, "wb")))
+            return 1;
+        if (picozip_new_file(&f, fptr) != PICOZIP_OK || picozip_new_entry_mem(f, "large.bin", src, BENCH_LARGE_SIZE) != PICOZIP_OK || picozip_end(f) != PICOZIP_OK)
+            return 1;
+        picozip_free(f);
+        fclose(fptr);
+    }
+    file_gbps = rate(start, bytes) / 1e9;
+
+    /* the input is most likely in the page cache, this measures the copy rather than the disk */
+    if (!(fptr = fopen(BENCH_INPUT, "wb")) || fwrite(src, 1, BENCH_LARGE_SIZE, fptr) != BENCH_LARGE_SIZE)
+        return 1;
+    fclose(fptr);
+    start = now();
+    for (i = 0; i < BENCH_LARGE_ROUNDS; i++)
+    {
+        if (picozip_new_path(&f, BENCH_ZIP, "wb") != PICOZIP_OK || picozip_new_entry_path(f, "large.bin", BENCH_INPUT, NULL, 0) != PICOZIP_OK || picozip_end(f) != PICOZIP_OK)
+            return 1;
+        picozip_free_path(f);
+    }
+    path_gbps = rate(start, bytes) / 1e9;
+    remove(BENCH_INPUT);
+    remove(BENCH_ZIP);
+
+    fprintf(out, "  \"large_entry\": {\"bytes\": %lu, \"mem_gbps\": %.3f, \"file_gbps\": %.3f, \"path_gbps\": %.3f},\n",
+            (unsigned long)BENCH_LARGE_SIZE, mem_gbps, file_gbps, path_gbps);
+    return 0;
+}
+
+static int bench_end(FILE *out, const uint8_t *src)
+{
+    static const size_t counts[] = {1000, 10000, 100000, 1000000};
+    char name[32];
+    picozip_file *f;
+    double start, build, end;
+    size_t i, j;
+
+    fprintf(out, "  \"end\": [");
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        mem_current = mem_peak = 0;
+        if (picozip_new(&f, discard_write, counting_alloc, counting_free, NULL) != PICOZIP_OK)
+            return 1;
+        build = now();
+        for (j = 0; j < counts[i]; j++)
+        {
+            sprintf(name, "%lu.txt", (unsigned long)j);
+            if (picozip_new_entry_mem_ex(f, name, src, 16, 1700000000, NULL, 0) != PICOZIP_OK)
+                return 1;
+        }
+        start = now();
+        if (picozip_end(f) != PICOZIP_OK)
+            return 1;
+        end = now();
+        build = end - build;
+        end -= start;
+        picozip_free(f);
+        fprintf(out, "%s\n    {\"entries\": %lu, \"build_seconds\": %.6f, \"end_seconds\": %.6f, \"peak_bytes\": %lu}",
+                i ? "," : "", (unsigned long)counts[i], build, end, (unsigned long)mem_peak);
+    }
+    fprintf(out, "\n  ]\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *src;
+    FILE *out;
+    size_t i;
+    int err;
+
+    out = argc > 1 ? fopen(argv[1], "w") : stdout;
+    if (!out)
+        return 1;
+    if (!(src = (uint8_t *)malloc(BENCH_CRC_SIZE > BENCH_LARGE_SIZE ? BENCH_CRC_SIZE : BENCH_LARGE_SIZE)))
+        return 1;
+    for (i = 0; i < BENCH_CRC_SIZE || i < BENCH_LARGE_SIZE; i++)
+        src[i] = (uint8_t)(i * 31 + (i >> 12));
+
+    fprintf(out, "{\n");
+    err = bench_crc32(out, src) || bench_small_entries(out, src) || bench_large_entry(out, src) || bench_end(out, src);
+    fprintf(out, "}\n");
+
+    free(src);
+    if (out != stdout)
+        fclose(out);
+    return err;
+}
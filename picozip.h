@@ -1,8 +1,8 @@
 /**
- * picozip.h v1.0.0 - A simple library to write uncompressed ZIP files.
+ * picozip.h v1.0.0 - A simple library to write ZIP files.
  *
  * This is just some code I wrote to create really simple ZIP files
- * with no compression and the extended timestamp attribute,
+ * (stored or DEFLATE-compressed) with the extended timestamp attribute,
  * which I consider a bare minimum for a ZIP file.
  * The code is reasonably portable, and I plan to keep compatibility with C99.
  * Currently the code is compatible with C89, but no guarantees there.
@@ -24,9 +24,12 @@
  *
  * Optionally, you may wish to define PICOZIP_NO_STDIO to disable file IO
  * capabilities, or PICOZIP_NO_OS_MTIME to disable support for getting file
- * modification times via stat() and equivalent functions. You can also redefine
- * PICOZIP_READ_BUF to use a larger / smaller buffer when reading files
- * (only relevant when using picozip_new_entry_path and picozip_new_entry_file).
+ * modification times via stat() and equivalent functions. You can also define
+ * PICOZIP_READ_BUF to change the default size of the buffer used to read files and streams,
+ * which picozip_set_read_buffer changes at runtime.
+ * CRC-32 is computed with PCLMULQDQ (x86) or the CRC32 instructions (ARMv8) when the CPU
+ * supports them, falling back to slicing-by-8 tables. Define PICOZIP_NO_SIMD to always use
+ * the portable tables.
  *
  * picozip uses callbacks to write data to the destination. When calling picozip_new,
  * you need to pass a callback to allocate and free any memory used by the library,
@@ -48,7 +51,7 @@
  *
  *
  * Each picozip function returns an int, where 0 indicates success. picozip generally uses constants
- * defined by errno.h, and only explicitly defines PICOZIP_EINVAL, PICOZIP_ENOMEM and PICOZIP_EIO.
+ * defined by errno.h, and only explicitly defines PICOZIP_EINVAL, PICOZIP_ENOMEM, PICOZIP_EIO and PICOZIP_EAGAIN.
  * picozip functions does not set errno (except when errno is set by an underlying libc function).
  *
  * To create a ZIP file, you can call picozip_new, picozip_new_mem, picozip_new_file or picozip_new_path.
@@ -62,12 +65,198 @@
  * by calling picozip_free_mem and picozip_free_path respectively to free their underlying resources.
  * When using picozip_new_file, the file pointer will not be closed automatically.
  *
+ * picozip_open_append opens an existing archive at <path> to add entries to it, and must be freed
+ * with picozip_free_path. The central directory is loaded as it is; new entries are written over
+ * it and picozip_end writes the old records followed by the new ones, then cuts the file where
+ * the archive now ends. The archive comment is not kept, pass it again to picozip_end_ex. If the
+ * handle is freed before picozip_end succeeds, picozip_free_path writes the old records and the
+ * old comment back after whatever was added, so the file still holds the original entries.
+ * Archives split over several disks, or with data before the first entry (such as
+ * self-extracting archives) are rejected with PICOZIP_EINVAL.
+ *
+ * picozip_add_tree adds the files and directories under <root>, named relative to it, in byte
+ * order of their names with the content of each directory right after it. Files are added like
+ * picozip_new_entry_path does and directories as empty entries ending with a slash. <filter_cb>,
+ * if not NULL, sees each name as it would be in the archive and returns 0 to leave it (and the
+ * content of a directory) out. Links to directories and special files are skipped. To hide
+ * latency, the OS is asked with posix_fadvise() to read up to PICOZIP_TREE_WINDOW files ahead of
+ * the one being added into the page cache, where it supports it; each file is still only read
+ * once, by the entry. It can't be used on non-blocking files, and needs the OS
+ * (it returns PICOZIP_EINVAL with PICOZIP_NO_OS_MTIME).
+ *
  * You can now call picozip_new_entry_mem, picozip_new_entry_mem_ex, picozip_new_entry_file
  * or picozip_new_entry_path to create files and directories in the ZIP files.
  * To create directories, you can call picozip_new_entry_mem with <size> of 0, <mem> set to NULL
  * and append a forward slash (/) in the path.
  * When PICOZIP_NO_OS_MTIME is not defined, picozip will try to get a file's modification time
  * via stat() and equivalent when using picozip_new_entry_file and picozip_new_entry_path.
+ * picozip_new_entry_path maps regular files in memory (mmap() or CreateFileMapping()) and writes
+ * them like picozip_new_entry_mem_ex does, with the sizes and CRC in the local header instead of
+ * a data descriptor. Files that can't be mapped are read with picozip_new_entry_file instead.
+ * Define PICOZIP_NO_MMAP to always read files with stdio. As with any mapping, truncating the file
+ * while it is being added is undefined behavior.
+ * On Linux, when the archive is written to a file by picozip_new_file or picozip_new_path, the content
+ * of large files is copied by the kernel with copy_file_range() (when built with _GNU_SOURCE) or
+ * sendfile() after the CRC is computed from the mapping. Define PICOZIP_NO_KERNEL_COPY to disable it.
+ * Define PICOZIP_IO_URING on Linux to write archives opened by picozip_new_path, and read files of
+ * 256 KiB or more in picozip_new_entry_file, through io_uring (with raw system calls, no liburing):
+ * a few requests of 128 KiB are kept in flight in registered buffers, so the content is checksummed
+ * and written while the next part is read. Archives opened for appending, and systems where
+ * io_uring can't be set up, use stdio.
+ *
+ * When the CRC-32 of the content is already known (e.g. from a content-addressed store),
+ * picozip_new_entry_mem_ex2 and picozip_new_entry_stream take it with the size and skip
+ * checksumming the content altogether. picozip_new_entry_stream reads exactly <size> bytes
+ * from <fptr>, which may be copied by the kernel as picozip_new_entry_path does; it returns
+ * PICOZIP_EIO if the stream ends early. Define PICOZIP_VERIFY_CRC to have both functions
+ * check the CRC anyway and fail with PICOZIP_EINVAL on a mismatch, leaving the entry out.
+ *
+ * picozip_new_entry_cb reads the content from <read_cb> until it returns 0, through a buffer of
+ * <buf_size> bytes (the read buffer of picozip_set_read_buffer if 0), so the size doesn't
+ * need to be known. The sizes and CRC are written in a data descriptor. If the callback returns
+ * PICOZIP_READ_ERROR, it fails with PICOZIP_EIO and the entry is left out of the central directory.
+ *
+ * picozip_new_entries_mem adds <n> in-memory entries described by <descs>, as picozip_new_entry_mem_ex
+ * would. Stored entries are written in groups, with the headers and content of a group handed to
+ * the output in a single (gathered) write. All descriptions are checked before anything is written.
+ * With a codec or worker threads, the entries are added one by one. A failure can
+ * leave the entries before it in the archive (the groups before it, or the entries before it when
+ * they are added one by one), since they are in the output already: if <oadded> is not NULL, it is
+ * set to the number of entries added, so a retry should start at <descs> + *<oadded>.
+ *
+ * Once an entry is written, its central directory record is encoded right away into blocks
+ * of 64 KiB and the entry itself is freed, so an entry only costs the size of
+ * its record until picozip_end, which writes the blocks out as they are.
+ * To bound memory whatever the number of entries, picozip_set_spill moves the oldest blocks out
+ * through <write_cb> once the records take more than <budget> bytes, and picozip_end reads
+ * them back in the same order with <read_cb>, from the start. Without callbacks, a temporary
+ * file from tmpfile() is used (not available with PICOZIP_NO_STDIO). If the spill fails,
+ * picozip_end returns PICOZIP_EIO. Stages and pull readers can't spill.
+ *
+ * If the number of entries or the size of the archive is known up front, picozip_reserve
+ * preallocates the central directory (and the output buffer of picozip_new_mem) in one go.
+ * <expected_entries> and <expected_bytes> count the whole archive, not just what is left to add.
+ *
+ * picozip_new_entry_file, picozip_new_entry_stream and picozip_new_entry_cb read their input
+ * in a buffer of PICOZIP_READ_BUF bytes, allocated with the alloc callback when it is first
+ * needed and reused for every entry. picozip_set_read_buffer changes its size (0 restores the
+ * default); larger buffers mean fewer read and write callbacks per entry. On POSIX systems, files
+ * are read with the POSIX_FADV_SEQUENTIAL hint, and picozip_new_entry_path drops the pages of
+ * each file from the page cache once it is archived (POSIX_FADV_DONTNEED).
+ *
+ * When adding many small entries, picozip_set_arena makes picozip carve entries out of
+ * large slabs (of <slab_size> bytes, or PICOZIP_ARENA_SLAB if 0) allocated with the alloc
+ * callback, instead of allocating each entry separately. It must be called before adding entries.
+ *
+ * Modification times are converted to DOS time with localtime() by default. To avoid calling
+ * into the C library (and its timezone lock), picozip_set_timezone sets a fixed offset from UTC
+ * in seconds (0 for UTC); PICOZIP_TZ_LOCAL restores the default.
+ *
+ * picozip_set_writev_callback sets an optional callback that receives several chunks at once,
+ * which picozip uses to write a header, its metadata and the content (or a batch of central
+ * directory records) in a single call. It should return the total number of bytes written.
+ * picozip falls back to calling picozip_write_callback for every chunk when it is not set.
+ *
+ * picozip_set_buffer enables an output buffer of <size> bytes (0 disables it), in which small
+ * writes such as headers are coalesced before reaching the write callback. Chunks at least as
+ * large as the buffer bypass it. The buffer is flushed by picozip_end; picozip_free discards
+ * anything still buffered. With buffering, a write error may only be reported by a later call.
+ *
+ * By default a write callback that writes fewer bytes than requested fails the call with
+ * PICOZIP_EIO. picozip_set_nonblocking(file, 1, <limit>) lets the callbacks write less (or
+ * nothing) when the output would block, and return PICOZIP_WRITE_ERROR on errors instead. The
+ * output that wasn't taken is queued in a backlog, and picozip_pump writes as much of it as
+ * the output takes, returning PICOZIP_OK once it is empty, or PICOZIP_EAGAIN if the output
+ * would still block. While the backlog holds more than <limit> bytes, functions that add entries
+ * and picozip_end return PICOZIP_EAGAIN without doing anything, and should be called again after
+ * picozip_pump. Entries read from a callback or a FILE (picozip_new_entry_cb, picozip_new_entry_file,
+ * picozip_new_entry_path and picozip_new_entry_stream) stop reading once the backlog passes <limit>
+ * and return PICOZIP_EAGAIN with the entry started: picozip_pump reads on where it stopped once the
+ * backlog is back under <limit>, and only returns PICOZIP_OK once the entry is done, so the
+ * callback or FILE has to stay usable until then. Until it is done, adding entries, picozip_end and
+ * picozip_set_codec return PICOZIP_EAGAIN, and picozip_set_nonblocking(file, 0, 0) finishes it with
+ * blocking writes. Such entries are never compressed by worker threads in nonblocking mode. In-memory
+ * entries are queued in whole, so the backlog can grow past <limit> by the size of one (or of a
+ * picozip_new_entries_mem batch), or by a read buffer for streamed entries. After picozip_end, call
+ * picozip_pump until it returns PICOZIP_OK before freeing the file. picozip_set_nonblocking(file, 0, 0)
+ * restores blocking writes, and returns PICOZIP_EAGAIN if the backlog can't be written out.
+ *
+ * Entries are stored uncompressed by default. picozip_set_codec picks the codec and level used
+ * for the entries added after it (NULL stores them again), so every entry can have its own.
+ * picozip_codec_deflate returns the built-in DEFLATE compressor, whose levels go from 0 (stored
+ * blocks) to 9, PICOZIP_LEVEL_DEFAULT being 6; define PICOZIP_NO_DEFLATE to leave it out.
+ * Other compressors (zlib, libdeflate, zstd...) can be plugged in with a picozip_codec:
+ * begin creates a compressor with the given level and allocator, returning NULL on failure.
+ * compress consumes <size> bytes and passes the compressed output to <write_cb>, which returns
+ * the number of bytes written; PICOZIP_FLUSH_SYNC ends on a byte boundary and PICOZIP_FLUSH_FINISH
+ * ends the stream. It returns PICOZIP_OK or an error. end frees the compressor.
+ * Compressed entries are always followed by a data descriptor with their sizes and CRC.
+ *
+ * When built with PICOZIP_THREADS, picozip_set_threads starts <num_threads> worker threads
+ * (0 or 1 stops them) that compress entries pigz-style: the content is split in blocks of
+ * PICOZIP_THREAD_BLOCK bytes, each compressed as its own stream ending with PICOZIP_FLUSH_SYNC
+ * (or PICOZIP_FLUSH_FINISH for the last one) and checksummed separately, then written in order
+ * through the write callback with the CRCs combined. This only applies to codecs whose <concat>
+ * is set, which the built-in DEFLATE compressor does. Entries up to a block in size are copied
+ * and written in the background, so several small entries are compressed at once; anything else
+ * (large in-memory entries, stored entries, picozip_end...) waits for them first. The allocator
+ * and the codec are called from the worker threads, so they must be thread safe. Since the blocks
+ * don't share their history, the output is slightly larger than without threads, and an error
+ * may only be reported by a later call.
+ * The workers also split the CRC of stored in-memory (and mapped) entries of at least
+ * PICOZIP_THREAD_CRC_MIN bytes in slices, which are combined before the header is written.
+ *
+ * To add entries from several threads, create a stage for each with picozip_new_stage. A stage
+ * is an in-memory picozip_file inheriting the codec, timezone and alloc callbacks of <file> (which
+ * must then be thread safe); entries added to it are compressed into its buffer, and picozip_commit_stage appends them to <file> in a single
+ * write, moving their offsets and central directory records over. The stage is then empty and
+ * can be reused; free it with picozip_free_mem. Stages should be created before they are handed to
+ * other threads. With PICOZIP_THREADS, picozip_commit_stage can be called from several threads at
+ * once (commits are serialized); no other function may be called on <file> while a commit is running.
+ *
+ * picozip_new_reader creates an archive that is pulled instead of pushed to a write callback.
+ * Entries are queued up front with picozip_queue_entry_mem (the content must stay valid until it
+ * is read), picozip_queue_entry_cb (the content is read with <read_cb>, which returns the number
+ * of bytes read, 0 at the end or PICOZIP_READ_ERROR) and picozip_queue_entry_path (the file is only
+ * opened when its entry is reached). Each queued entry uses the codec set when it was queued.
+ * picozip_read then fills <buf> with up to <size> bytes of the archive, generating the headers,
+ * content and central directory as it goes, and sets <oread> to 0 at the end of the archive.
+ * Entries can't be queued after the first picozip_read, and the content is always followed by a
+ * data descriptor. Free the reader with picozip_free_reader.
+ *
+ * When all entries are stored, with a size known up front (in-memory and file entries, and
+ * picozip_queue_entry_pread, which reads <size> bytes of content at any offset and takes its CRC),
+ * picozip_plan lays out the archive before any of it is generated. It sets <osize> to the size of
+ * the archive and, if <offsets> is not NULL, each entry's local header offset in queue order.
+ * These entries are written without a data descriptor. picozip_read_at then generates <size>
+ * bytes of the archive at <offset> on their own, reading only the content they cover (and, once,
+ * the content of in-memory and file entries whose CRC they need), setting <oread> to the number of
+ * bytes generated. picozip_read keeps working on a planned archive, from its start.
+ * picozip_read_at is not thread safe: the calls share the reader's open file, chunk and scratch
+ * buffers (and compute missing CRCs into its entries), so calls on one reader must be serialized.
+ * Serve parallel range requests from a reader per thread, queued and planned the same way.
+ *
+ * When built with PICOZIP_STATS, picozip_get_stats copies the counters of <file> to <stats>: the bytes
+ * written, the calls to the write and writev callbacks and the time spent in them, the calls
+ * to the alloc callback and the bytes requested, and the time spent in CRC-32, converting
+ * modification times and picozip_end_ex (in nanoseconds, from a monotonic clock where there is
+ * one), along with how many entries had their sizes in the local header or a data descriptor.
+ * Counters are never reset. The work done by worker threads is not counted, except for the CRC
+ * slices the caller waits for. picozip_set_trace sets <trace_cb> (NULL removes it), which is called
+ * with PICOZIP_TRACE_BEGIN when an entry is started, PICOZIP_TRACE_END once its data is all
+ * written (before the function adding it returns, or with PICOZIP_THREADS once its last block is
+ * written), or PICOZIP_TRACE_ABORT if it fails and is left out. Its central directory record is
+ * encoded later, when the next entry is started or in picozip_end. <path> is not NUL-terminated. Committed stages trace their entries in
+ * <file>; stages and pull readers can't be traced themselves. Without PICOZIP_STATS, the callbacks
+ * are called directly and nothing is measured.
+ *
+ * ZIP64 records are written automatically, only where they are needed: entries of 4 GiB or
+ * more whose size is known up front get a ZIP64 extra field in their local header. Entries with
+ * a data descriptor whose content may reach 4 GiB (streamed from a callback or a pipe, or
+ * compressed from nearly as much) get a zero-filled one instead, version 4.5 and 64-bit sizes in
+ * their data descriptor, so streaming readers know its layout up front. The central directory
+ * moves sizes and offsets that don't fit to a ZIP64 extra field. Archives with 65535 entries or
+ * more, or whose central directory is past 4 GiB, end with the ZIP64 EOCD record and locator.
  *
  * After adding all the files and directories, you can finalize the ZIP file by calling
  * picozip_end or picozip_end_ex. This will write all the global headers. Note that you
@@ -88,22 +277,43 @@ extern "C"
 #if defined(_WIN32)
 #define PICOZIP__WIN
 #include <sys/stat.h>
+#include <io.h>
 
     typedef struct _stat picozip__stat;
 #define picozip__fileno _fileno
 #define picozip__fstat _fstat
+#define picozip__pathstat _stat
+#define picozip__isreg(M) (((M) & _S_IFMT) == _S_IFREG)
 
 #elif defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+/* the includer (or a system header it included first) may have picked the features already */
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 600
+#endif
+#ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200112L
+#endif
 #define PICOZIP__UNIX
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
     typedef struct stat picozip__stat;
 #define picozip__fileno fileno
 #define picozip__fstat fstat
+#define picozip__pathstat stat
+#define picozip__isreg(M) S_ISREG(M)
+
+#endif
+#endif
 
+#if !defined(PICOZIP_NO_MMAP) && !defined(PICOZIP_NO_STDIO) && (defined(PICOZIP__WIN) || defined(PICOZIP__UNIX))
+#define PICOZIP__MMAP
 #endif
+
+/* io_uring is driven with raw system calls, and needs the compiler's atomics for the rings */
+#if defined(PICOZIP_IO_URING) && !defined(PICOZIP_NO_STDIO) && defined(PICOZIP__UNIX) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#define PICOZIP__URING
 #endif
 
 #include <stdlib.h>
@@ -111,26 +321,130 @@ extern "C"
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
 
 #ifndef PICOZIP_NO_STDIO
 #include <stdio.h>
 #endif
 
-/** Buffer size used to read files. */
-#define PICOZIP_READ_BUF 2048
+#ifndef PICOZIP_READ_BUF
+/** Default size of the buffer used to read files and streams. */
+#define PICOZIP_READ_BUF 65536
+#endif
+
+/** Default slab size used by picozip_set_arena. */
+#define PICOZIP_ARENA_SLAB 65536
+
+/** Timezone used to convert modification times to DOS time by default. */
+#define PICOZIP_TZ_LOCAL LONG_MIN
+
+/** Compression methods. */
+#define PICOZIP_METHOD_STORE 0
+#define PICOZIP_METHOD_DEFLATE 8
+#define PICOZIP_METHOD_ZSTD 93
+
+/** Size of the blocks compressed by each worker thread. */
+#define PICOZIP_THREAD_BLOCK 131072
+
+/** Smallest in-memory entry whose CRC is split across the worker threads. */
+#define PICOZIP_THREAD_CRC_MIN 1048576
+
+/** Number of files picozip_add_tree prefetches ahead of the one being added. */
+#ifndef PICOZIP_TREE_WINDOW
+#define PICOZIP_TREE_WINDOW 64
+#endif
+
+/** Compression level picked by the codec. */
+#define PICOZIP_LEVEL_DEFAULT (-1)
+
+/** Flush modes passed to picozip_codec compress. */
+#define PICOZIP_FLUSH_NONE 0
+#define PICOZIP_FLUSH_SYNC 1
+#define PICOZIP_FLUSH_FINISH 2
 
 /** Error types. */
 #define PICOZIP_OK 0
 #define PICOZIP_EINVAL EINVAL
 #define PICOZIP_ENOMEM ENOMEM
 #define PICOZIP_EIO EIO
+#define PICOZIP_EAGAIN EAGAIN
+
+/** Returned by non-blocking write callbacks when the output fails. */
+#define PICOZIP_WRITE_ERROR ((size_t)-1)
+
+/** Returned by read callbacks when the input fails. */
+#define PICOZIP_READ_ERROR ((size_t)-1)
+
+#ifdef PICOZIP_STATS
+/** Events passed to picozip_trace_callback. */
+#define PICOZIP_TRACE_BEGIN 0 /* the entry is started */
+#define PICOZIP_TRACE_END 1   /* the data of the entry is all written */
+#define PICOZIP_TRACE_ABORT 2 /* the entry failed and is left out of the archive */
+#endif
 
     /** Callbacks to allocate, free and write data. */
     typedef void *(*picozip_alloc_callback)(void *userdata, size_t size);
     typedef void (*picozip_free_callback)(void *userdata, void *mem);
     typedef size_t (*picozip_write_callback)(void *userdata, const void *mem, size_t size);
 
+    /** A chunk of data passed to picozip_writev_callback. */
+    typedef struct picozip_iovec
+    {
+        const void *base;
+        size_t len;
+    } picozip_iovec;
+    typedef size_t (*picozip_writev_callback)(void *userdata, const picozip_iovec *iov, size_t iovcnt);
+
+    /** Callbacks to read the content of an entry, in order or at <offset>. */
+    typedef size_t (*picozip_read_callback)(void *userdata, void *mem, size_t size);
+    typedef size_t (*picozip_pread_callback)(void *userdata, void *mem, size_t size, uint64_t offset);
+
+    /** Callback deciding whether picozip_add_tree adds <path>, returning 0 to skip it (and its content). */
+    typedef int (*picozip_filter_callback)(void *userdata, const char *path, int is_dir);
+
+    /** A compressor for a ZIP compression method. */
+    typedef struct picozip_codec
+    {
+        uint16_t method;  /* compression method, e.g. PICOZIP_METHOD_DEFLATE */
+        uint16_t version; /* version needed to extract, e.g. 20 for DEFLATE and 63 for Zstandard */
+        void *userdata;
+        void *(*begin)(void *userdata, int level, picozip_alloc_callback alloc_cb, picozip_free_callback free_cb, void *alloc_userdata);
+        int (*compress)(void *state, const uint8_t *data, size_t size, int flush, picozip_write_callback write_cb, void *write_userdata);
+        void (*end)(void *state);
+        int concat; /* 1 if streams ended with PICOZIP_FLUSH_SYNC can be followed by another stream */
+    } picozip_codec;
+
+    /** An in-memory entry added by picozip_new_entries_mem. */
+    typedef struct picozip_entry_desc
+    {
+        const char *path;
+        const uint8_t *data;
+        size_t size;
+        time_t mod_time;
+        const char *comment;
+        size_t comment_len;
+    } picozip_entry_desc;
+
     /** Stores data for a ZIP file. */
+#ifdef PICOZIP_STATS
+    /** Counters reported by picozip_get_stats; times are in nanoseconds. */
+    typedef struct picozip_stats
+    {
+        uint64_t bytes_written;    /* bytes taken by the write callbacks, or copied by the kernel */
+        uint64_t write_calls;      /* calls to the write and writev callbacks */
+        uint64_t write_ns;         /* time spent in the write and writev callbacks */
+        uint64_t alloc_calls;      /* calls to the alloc callback */
+        uint64_t alloc_bytes;      /* bytes requested from the alloc callback */
+        uint64_t crc_ns;           /* time spent computing CRC-32 */
+        uint64_t dostime_ns;       /* time spent converting modification times to DOS time */
+        uint64_t end_ns;           /* time spent in picozip_end_ex */
+        uint64_t sized_entries;    /* entries with their sizes and CRC in the local header */
+        uint64_t datadesc_entries; /* entries followed by a data descriptor */
+    } picozip_stats;
+
+    typedef void (*picozip_trace_callback)(void *userdata, int event, const char *path, size_t path_len);
+#endif
+
     typedef struct picozip__file picozip_file;
 
     /** Library functions */
@@ -144,6 +458,34 @@ extern "C"
     extern int picozip_new_entry_mem_ex(picozip_file *file, const char *const path,
                                         const uint8_t *data, size_t size, time_t mod_time,
                                         const char *const comment, size_t comment_len);
+    extern int picozip_new_entry_mem_ex2(picozip_file *file, const char *const path,
+                                         const uint8_t *data, size_t size, uint32_t crc32, time_t mod_time,
+                                         const char *const comment, size_t comment_len);
+    extern int picozip_new_entry_cb(picozip_file *file, const char *const path,
+                                    picozip_read_callback read_cb, void *userdata, size_t buf_size,
+                                    time_t mod_time, const char *const comment, size_t comment_len);
+    extern int picozip_new_entries_mem(picozip_file *file, const picozip_entry_desc *descs, size_t n, size_t *oadded);
+    extern int picozip_reserve(picozip_file *file, size_t expected_entries, size_t expected_bytes);
+    extern int picozip_set_arena(picozip_file *file, size_t slab_size);
+    extern int picozip_set_timezone(picozip_file *file, long utc_offset);
+    extern int picozip_set_writev_callback(picozip_file *file, picozip_writev_callback writev_cb);
+    extern int picozip_set_buffer(picozip_file *file, size_t size);
+    extern int picozip_set_read_buffer(picozip_file *file, size_t size);
+    extern int picozip_set_spill(picozip_file *file, size_t budget, picozip_write_callback write_cb,
+                                 picozip_read_callback read_cb, void *userdata);
+    extern int picozip_set_nonblocking(picozip_file *file, int nonblocking, size_t limit);
+    extern int picozip_pump(picozip_file *file);
+    extern int picozip_set_codec(picozip_file *file, const picozip_codec *codec, int level);
+#ifndef PICOZIP_NO_DEFLATE
+    extern const picozip_codec *picozip_codec_deflate(void);
+#endif
+#ifdef PICOZIP_THREADS
+    extern int picozip_set_threads(picozip_file *file, size_t num_threads);
+#endif
+#ifdef PICOZIP_STATS
+    extern int picozip_get_stats(picozip_file *file, picozip_stats *stats);
+    extern int picozip_set_trace(picozip_file *file, picozip_trace_callback trace_cb, void *userdata);
+#endif
     extern int picozip_end(picozip_file *file);
     extern int picozip_end_ex(picozip_file *file, const char *const comment, size_t comment_len);
     extern int picozip_free(picozip_file *file);
@@ -152,6 +494,25 @@ extern "C"
     extern int picozip_new_mem(picozip_file **ofile);
     extern size_t picozip_get_mem(picozip_file *file, void **mem);
     extern int picozip_free_mem(picozip_file *file);
+    extern int picozip_new_stage(picozip_file *file, picozip_file **ostage);
+    extern int picozip_commit_stage(picozip_file *file, picozip_file *stage);
+
+    /** Pull reader functions */
+    extern int picozip_new_reader(picozip_file **ofile);
+    extern int picozip_queue_entry_mem(picozip_file *file, const char *const path,
+                                       const uint8_t *data, size_t size, time_t mod_time,
+                                       const char *const comment, size_t comment_len);
+    extern int picozip_queue_entry_cb(picozip_file *file, const char *const path,
+                                      picozip_read_callback read_cb, void *userdata, time_t mod_time,
+                                      const char *const comment, size_t comment_len);
+    extern int picozip_queue_entry_pread(picozip_file *file, const char *const path,
+                                         picozip_pread_callback pread_cb, void *userdata,
+                                         uint64_t size, uint32_t crc32, time_t mod_time,
+                                         const char *const comment, size_t comment_len);
+    extern int picozip_read(picozip_file *file, void *buf, size_t size, size_t *oread);
+    extern int picozip_plan(picozip_file *file, uint64_t *osize, uint64_t *offsets);
+    extern int picozip_read_at(picozip_file *file, uint64_t offset, void *buf, size_t size, size_t *oread);
+    extern int picozip_free_reader(picozip_file *file);
 
 /** File IO functions */
 #ifndef PICOZIP_NO_STDIO
@@ -161,7 +522,15 @@ extern "C"
                                       const char *const comment, size_t comment_len);
     extern int picozip_new_entry_file(picozip_file *file, const char *const path, FILE *fptr,
                                       const char *const comment, size_t comment_len);
+    extern int picozip_new_entry_stream(picozip_file *file, const char *const path, FILE *fptr,
+                                        size_t size, uint32_t crc32, time_t mod_time,
+                                        const char *const comment, size_t comment_len);
+    extern int picozip_queue_entry_path(picozip_file *file, const char *const path, const char *const file_path,
+                                        const char *const comment, size_t comment_len);
     extern int picozip_free_path(picozip_file *file);
+    extern int picozip_open_append(picozip_file **ofile, const char *const path);
+    extern int picozip_add_tree(picozip_file *file, const char *const root,
+                                picozip_filter_callback filter_cb, void *userdata);
 #endif
 
 #ifdef PICOZIP_IMPLEMENTATION
@@ -174,6 +543,16 @@ extern "C"
 #define PICOZIP__TIMESTAMP_MAGIC 0x5455
 #define PICOZIP__DATADESC_MAGIC 0x08074b50
 #define PICOZIP__FLAG_DATADESC (1 << 3)
+#define PICOZIP__ZIP64_MAGIC 0x0001
+#define PICOZIP__ZIP64_EOCD_MAGIC 0x06064b50
+#define PICOZIP__ZIP64_LOCATOR_MAGIC 0x07064b50
+#define PICOZIP__ZIP64_VERSION 45
+
+/* values from this one on are moved to the ZIP64 records */
+#define PICOZIP__ZIP64_LIMIT 0xFFFFFFFFUL
+#define PICOZIP__ZIP64_ENTRIES_LIMIT 0xFFFF
+/* content followed by a data descriptor may reach the limit once compressed from this size on */
+#define PICOZIP__ZIP64_DESC_LIMIT (PICOZIP__ZIP64_LIMIT - (PICOZIP__ZIP64_LIMIT >> 6))
 
 /* header sizes */
 #define PICOZIP__LOCAL_HEADER_SIZE 30
@@ -183,11 +562,63 @@ extern "C"
 #define PICOZIP__LOCAL_TIMESTAMP_SIZE 5
 #define PICOZIP__CD_TIMESTAMP_SIZE 5
 #define PICOZIP__DATADESC_SIZE 16
+#define PICOZIP__DATADESC64_SIZE 24
+#define PICOZIP__ZIP64_LOCAL_SIZE 20
+#define PICOZIP__ZIP64_CD_SIZE 28
+#define PICOZIP__ZIP64_EOCD_SIZE 56
+#define PICOZIP__ZIP64_LOCATOR_SIZE 20
 
 /* big enough for all zip headers */
 #define PICOZIP__SCRATCH_BUFFER_SIZE 64
 
-/* write data to bytes */
+/* size of a central directory record with a one byte filename */
+#define PICOZIP__CD_RECORD_MIN (PICOZIP__CD_HEADER_SIZE + 1 + PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE)
+
+/* size of the blocks central directory records are encoded into */
+#define PICOZIP__CD_BLOCK 65536
+
+/* number of central directory blocks gathered into one write */
+#define PICOZIP__CD_BATCH 32
+
+/* number of entries picozip_new_entries_mem gathers into one write */
+#define PICOZIP__ENTRY_BATCH 32
+
+/* smallest allocation made by picozip__vec_alloc */
+#define PICOZIP__VEC_MIN_CAP 64
+
+/* alignment of entries carved from arena slabs */
+#define PICOZIP__ARENA_ALIGN 16
+#define PICOZIP__ARENA_ROUND(N) (((N) + (PICOZIP__ARENA_ALIGN - 1)) & ~(size_t)(PICOZIP__ARENA_ALIGN - 1))
+
+/* targets where integers are stored in the byte order of the ZIP format */
+#if (defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
+    defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM) || defined(_M_ARM64)
+#define PICOZIP__LE
+#endif
+
+/* write data to bytes, with a single (unaligned) store on little-endian targets */
+#ifdef PICOZIP__LE
+#define PICOZIP__WRITE_LE16(A, O, V)         \
+    do                                       \
+    {                                        \
+        uint16_t picozip__v = (uint16_t)(V); \
+        memcpy((A) + (O), &picozip__v, 2);   \
+    } while (0)
+
+#define PICOZIP__WRITE_LE32(A, O, V)         \
+    do                                       \
+    {                                        \
+        uint32_t picozip__v = (uint32_t)(V); \
+        memcpy((A) + (O), &picozip__v, 4);   \
+    } while (0)
+
+#define PICOZIP__WRITE_LE64(A, O, V)         \
+    do                                       \
+    {                                        \
+        uint64_t picozip__v = (uint64_t)(V); \
+        memcpy((A) + (O), &picozip__v, 8);   \
+    } while (0)
+#else
 #define PICOZIP__WRITE_LE16(A, O, V)      \
     do                                    \
     {                                     \
@@ -204,27 +635,100 @@ extern "C"
         A[(O) + 3] = (uint8_t)((V) >> 24); \
     } while (0)
 
+#define PICOZIP__WRITE_LE64(A, O, V)                                 \
+    do                                                               \
+    {                                                                \
+        PICOZIP__WRITE_LE32(A, O, (uint32_t)((V) & 0xFFFFFFFFUL));   \
+        PICOZIP__WRITE_LE32(A, (O) + 4, (uint32_t)((uint64_t)(V) >> 32)); \
+    } while (0)
+#endif
+
+/* read data from bytes */
+#define PICOZIP__READ_LE16(A, O) ((uint16_t)((A)[(O) + 0] | ((A)[(O) + 1] << 8)))
+#define PICOZIP__READ_LE32(A, O) ((uint32_t)(A)[(O) + 0] | ((uint32_t)(A)[(O) + 1] << 8) | ((uint32_t)(A)[(O) + 2] << 16) | ((uint32_t)(A)[(O) + 3] << 24))
+#define PICOZIP__READ_LE64(A, O) ((uint64_t)PICOZIP__READ_LE32(A, O) | ((uint64_t)PICOZIP__READ_LE32(A, (O) + 4) << 32))
+
+/* 32-bit fields hold PICOZIP__ZIP64_LIMIT when the value is in a ZIP64 record */
+#define PICOZIP__CLAMP32(V) ((V) >= PICOZIP__ZIP64_LIMIT ? PICOZIP__ZIP64_LIMIT : (uint32_t)(V))
+
     /* utilities to convert UNIX time to DOS time */
-    static void picozip__time_to_dostime(time_t current_time, uint16_t *dos_date, uint16_t *dos_time)
+    static void picozip__date_to_dostime(long year, int mon, int mday, int hour, int min, int sec, uint16_t *dos_date, uint16_t *dos_time)
     {
-        struct tm *tm = localtime(&current_time);
-        if (tm->tm_year < 80)
+        if (year < 1980)
         {
             /* clamp the timestamp to 1980-1-1 00:00:00 to avoid any underflow */
-            tm->tm_year = 80;
-            tm->tm_sec = tm->tm_min = tm->tm_hour = tm->tm_mon = 0;
-            tm->tm_mday = 1;
+            year = 1980;
+            mon = mday = 1;
+            hour = min = sec = 0;
+        }
+        *dos_time = (uint16_t)(((hour << 11) & 0xf800) | ((min << 5) & 0x7e0) | ((sec >> 1) & 0x1f));
+        *dos_date = (uint16_t)((((year - 1980) << 9) & 0xfe00) | ((mon << 5) & 0x1e0) | (mday & 0x1f));
+    }
+
+    /* converts with the local timezone of the C library */
+    static void picozip__local_to_dostime(time_t current_time, uint16_t *dos_date, uint16_t *dos_time)
+    {
+        struct tm tm_buf, *tm;
+#if defined(_MSC_VER)
+        tm = localtime_s(&tm_buf, &current_time) == 0 ? &tm_buf : NULL;
+#elif defined(PICOZIP__UNIX)
+        tm = localtime_r(&current_time, &tm_buf);
+#else
+        tm = localtime(&current_time);
+        (void)tm_buf;
+#endif
+        if (!tm)
+            picozip__date_to_dostime(0, 0, 0, 0, 0, 0, dos_date, dos_time);
+        else
+            picozip__date_to_dostime(tm->tm_year + 1900L, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, dos_date, dos_time);
+    }
+
+    /*
+     * converts with a fixed offset from UTC, without calling into the C library.
+     * http://howardhinnant.github.io/date_algorithms.html#civil_from_days
+     */
+    static void picozip__utc_to_dostime(time_t current_time, long utc_offset, uint16_t *dos_date, uint16_t *dos_time)
+    {
+        long days, secs, era, doe, yoe, doy, mp, year;
+        double t;
+
+        t = (double)current_time + (double)utc_offset;
+        if (t < 315532800.0 || t > 4354819199.0)
+        {
+            /* outside of what DOS time can represent (1980-2107) */
+            picozip__date_to_dostime(t < 315532800.0 ? 0 : 2107, 12, 31, 23, 59, 59, dos_date, dos_time);
+            return;
         }
-        *dos_time = (uint16_t)(((tm->tm_hour << 11) & 0xf800) | ((tm->tm_min << 5) & 0x7e0) | ((tm->tm_sec >> 1) & 0x1f));
-        *dos_date = (uint16_t)((((tm->tm_year + 1900 - 1980) << 9) & 0xfe00) | (((tm->tm_mon + 1) << 5) & 0x1e0) | (tm->tm_mday & 0x1f));
+        days = (long)(t / 86400);
+        secs = (long)(t - (double)days * 86400);
+
+        days += 719468;
+        era = days / 146097;
+        doe = days - era * 146097;
+        yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        year = yoe + era * 400;
+        doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        mp = (5 * doy + 2) / 153;
+        if (mp >= 10)
+            year++;
+
+        picozip__date_to_dostime(year, (int)(mp < 10 ? mp + 3 : mp - 9), (int)(doy - (153 * mp + 2) / 5 + 1),
+                                 (int)(secs / 3600), (int)(secs / 60 % 60), (int)(secs % 60), dos_date, dos_time);
     }
 
 /* https://create.stephan-brumme.com/crc32 */
 #define PICOZIP__CRC_START 0
+#define PICOZIP__CRC_POLY 0xEDB88320
 
-    static uint32_t picozip__crc32(const uint8_t *ptr, size_t buf_len, uint32_t crc)
-    {
-        static const uint32_t s_crc_table[256] = {
+    /*
+     * CRC kernels operate on the raw (pre-inverted) CRC register.
+     * When <dst> is not NULL, the input is copied to it in the same pass.
+     */
+    typedef uint32_t (*picozip__crc_kernel)(uint8_t *dst, const uint8_t *ptr, size_t buf_len, uint32_t crc);
+
+    /* slicing-by-8 tables: [0] is the byte-wise table, [k] advances [k - 1] by a zero byte */
+    static const uint32_t picozip__crc_table[8][256] = {
+        {
             0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535,
             0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD,
             0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D,
@@ -261,501 +765,5845 @@ extern "C"
             0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5,
             0x47B2CF7F, 0x30B5FFE9, 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605,
             0xCDD70693, 0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-            0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D};
+            0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+        },
+        {
+            0x00000000, 0x191B3141, 0x32366282, 0x2B2D53C3, 0x646CC504, 0x7D77F445, 0x565AA786,
+            0x4F4196C7, 0xC8D98A08, 0xD1C2BB49, 0xFAEFE88A, 0xE3F4D9CB, 0xACB54F0C, 0xB5AE7E4D,
+            0x9E832D8E, 0x87981CCF, 0x4AC21251, 0x53D92310, 0x78F470D3, 0x61EF4192, 0x2EAED755,
+            0x37B5E614, 0x1C98B5D7, 0x05838496, 0x821B9859, 0x9B00A918, 0xB02DFADB, 0xA936CB9A,
+            0xE6775D5D, 0xFF6C6C1C, 0xD4413FDF, 0xCD5A0E9E, 0x958424A2, 0x8C9F15E3, 0xA7B24620,
+            0xBEA97761, 0xF1E8E1A6, 0xE8F3D0E7, 0xC3DE8324, 0xDAC5B265, 0x5D5DAEAA, 0x44469FEB,
+            0x6F6BCC28, 0x7670FD69, 0x39316BAE, 0x202A5AEF, 0x0B07092C, 0x121C386D, 0xDF4636F3,
+            0xC65D07B2, 0xED705471, 0xF46B6530, 0xBB2AF3F7, 0xA231C2B6, 0x891C9175, 0x9007A034,
+            0x179FBCFB, 0x0E848DBA, 0x25A9DE79, 0x3CB2EF38, 0x73F379FF, 0x6AE848BE, 0x41C51B7D,
+            0x58DE2A3C, 0xF0794F05, 0xE9627E44, 0xC24F2D87, 0xDB541CC6, 0x94158A01, 0x8D0EBB40,
+            0xA623E883, 0xBF38D9C2, 0x38A0C50D, 0x21BBF44C, 0x0A96A78F, 0x138D96CE, 0x5CCC0009,
+            0x45D73148, 0x6EFA628B, 0x77E153CA, 0xBABB5D54, 0xA3A06C15, 0x888D3FD6, 0x91960E97,
+            0xDED79850, 0xC7CCA911, 0xECE1FAD2, 0xF5FACB93, 0x7262D75C, 0x6B79E61D, 0x4054B5DE,
+            0x594F849F, 0x160E1258, 0x0F152319, 0x243870DA, 0x3D23419B, 0x65FD6BA7, 0x7CE65AE6,
+            0x57CB0925, 0x4ED03864, 0x0191AEA3, 0x188A9FE2, 0x33A7CC21, 0x2ABCFD60, 0xAD24E1AF,
+            0xB43FD0EE, 0x9F12832D, 0x8609B26C, 0xC94824AB, 0xD05315EA, 0xFB7E4629, 0xE2657768,
+            0x2F3F79F6, 0x362448B7, 0x1D091B74, 0x04122A35, 0x4B53BCF2, 0x52488DB3, 0x7965DE70,
+            0x607EEF31, 0xE7E6F3FE, 0xFEFDC2BF, 0xD5D0917C, 0xCCCBA03D, 0x838A36FA, 0x9A9107BB,
+            0xB1BC5478, 0xA8A76539, 0x3B83984B, 0x2298A90A, 0x09B5FAC9, 0x10AECB88, 0x5FEF5D4F,
+            0x46F46C0E, 0x6DD93FCD, 0x74C20E8C, 0xF35A1243, 0xEA412302, 0xC16C70C1, 0xD8774180,
+            0x9736D747, 0x8E2DE606, 0xA500B5C5, 0xBC1B8484, 0x71418A1A, 0x685ABB5B, 0x4377E898,
+            0x5A6CD9D9, 0x152D4F1E, 0x0C367E5F, 0x271B2D9C, 0x3E001CDD, 0xB9980012, 0xA0833153,
+            0x8BAE6290, 0x92B553D1, 0xDDF4C516, 0xC4EFF457, 0xEFC2A794, 0xF6D996D5, 0xAE07BCE9,
+            0xB71C8DA8, 0x9C31DE6B, 0x852AEF2A, 0xCA6B79ED, 0xD37048AC, 0xF85D1B6F, 0xE1462A2E,
+            0x66DE36E1, 0x7FC507A0, 0x54E85463, 0x4DF36522, 0x02B2F3E5, 0x1BA9C2A4, 0x30849167,
+            0x299FA026, 0xE4C5AEB8, 0xFDDE9FF9, 0xD6F3CC3A, 0xCFE8FD7B, 0x80A96BBC, 0x99B25AFD,
+            0xB29F093E, 0xAB84387F, 0x2C1C24B0, 0x350715F1, 0x1E2A4632, 0x07317773, 0x4870E1B4,
+            0x516BD0F5, 0x7A468336, 0x635DB277, 0xCBFAD74E, 0xD2E1E60F, 0xF9CCB5CC, 0xE0D7848D,
+            0xAF96124A, 0xB68D230B, 0x9DA070C8, 0x84BB4189, 0x03235D46, 0x1A386C07, 0x31153FC4,
+            0x280E0E85, 0x674F9842, 0x7E54A903, 0x5579FAC0, 0x4C62CB81, 0x8138C51F, 0x9823F45E,
+            0xB30EA79D, 0xAA1596DC, 0xE554001B, 0xFC4F315A, 0xD7626299, 0xCE7953D8, 0x49E14F17,
+            0x50FA7E56, 0x7BD72D95, 0x62CC1CD4, 0x2D8D8A13, 0x3496BB52, 0x1FBBE891, 0x06A0D9D0,
+            0x5E7EF3EC, 0x4765C2AD, 0x6C48916E, 0x7553A02F, 0x3A1236E8, 0x230907A9, 0x0824546A,
+            0x113F652B, 0x96A779E4, 0x8FBC48A5, 0xA4911B66, 0xBD8A2A27, 0xF2CBBCE0, 0xEBD08DA1,
+            0xC0FDDE62, 0xD9E6EF23, 0x14BCE1BD, 0x0DA7D0FC, 0x268A833F, 0x3F91B27E, 0x70D024B9,
+            0x69CB15F8, 0x42E6463B, 0x5BFD777A, 0xDC656BB5, 0xC57E5AF4, 0xEE530937, 0xF7483876,
+            0xB809AEB1, 0xA1129FF0, 0x8A3FCC33, 0x9324FD72
+        },
+        {
+            0x00000000, 0x01C26A37, 0x0384D46E, 0x0246BE59, 0x0709A8DC, 0x06CBC2EB, 0x048D7CB2,
+            0x054F1685, 0x0E1351B8, 0x0FD13B8F, 0x0D9785D6, 0x0C55EFE1, 0x091AF964, 0x08D89353,
+            0x0A9E2D0A, 0x0B5C473D, 0x1C26A370, 0x1DE4C947, 0x1FA2771E, 0x1E601D29, 0x1B2F0BAC,
+            0x1AED619B, 0x18ABDFC2, 0x1969B5F5, 0x1235F2C8, 0x13F798FF, 0x11B126A6, 0x10734C91,
+            0x153C5A14, 0x14FE3023, 0x16B88E7A, 0x177AE44D, 0x384D46E0, 0x398F2CD7, 0x3BC9928E,
+            0x3A0BF8B9, 0x3F44EE3C, 0x3E86840B, 0x3CC03A52, 0x3D025065, 0x365E1758, 0x379C7D6F,
+            0x35DAC336, 0x3418A901, 0x3157BF84, 0x3095D5B3, 0x32D36BEA, 0x331101DD, 0x246BE590,
+            0x25A98FA7, 0x27EF31FE, 0x262D5BC9, 0x23624D4C, 0x22A0277B, 0x20E69922, 0x2124F315,
+            0x2A78B428, 0x2BBADE1F, 0x29FC6046, 0x283E0A71, 0x2D711CF4, 0x2CB376C3, 0x2EF5C89A,
+            0x2F37A2AD, 0x709A8DC0, 0x7158E7F7, 0x731E59AE, 0x72DC3399, 0x7793251C, 0x76514F2B,
+            0x7417F172, 0x75D59B45, 0x7E89DC78, 0x7F4BB64F, 0x7D0D0816, 0x7CCF6221, 0x798074A4,
+            0x78421E93, 0x7A04A0CA, 0x7BC6CAFD, 0x6CBC2EB0, 0x6D7E4487, 0x6F38FADE, 0x6EFA90E9,
+            0x6BB5866C, 0x6A77EC5B, 0x68315202, 0x69F33835, 0x62AF7F08, 0x636D153F, 0x612BAB66,
+            0x60E9C151, 0x65A6D7D4, 0x6464BDE3, 0x662203BA, 0x67E0698D, 0x48D7CB20, 0x4915A117,
+            0x4B531F4E, 0x4A917579, 0x4FDE63FC, 0x4E1C09CB, 0x4C5AB792, 0x4D98DDA5, 0x46C49A98,
+            0x4706F0AF, 0x45404EF6, 0x448224C1, 0x41CD3244, 0x400F5873, 0x4249E62A, 0x438B8C1D,
+            0x54F16850, 0x55330267, 0x5775BC3E, 0x56B7D609, 0x53F8C08C, 0x523AAABB, 0x507C14E2,
+            0x51BE7ED5, 0x5AE239E8, 0x5B2053DF, 0x5966ED86, 0x58A487B1, 0x5DEB9134, 0x5C29FB03,
+            0x5E6F455A, 0x5FAD2F6D, 0xE1351B80, 0xE0F771B7, 0xE2B1CFEE, 0xE373A5D9, 0xE63CB35C,
+            0xE7FED96B, 0xE5B86732, 0xE47A0D05, 0xEF264A38, 0xEEE4200F, 0xECA29E56, 0xED60F461,
+            0xE82FE2E4, 0xE9ED88D3, 0xEBAB368A, 0xEA695CBD, 0xFD13B8F0, 0xFCD1D2C7, 0xFE976C9E,
+            0xFF5506A9, 0xFA1A102C, 0xFBD87A1B, 0xF99EC442, 0xF85CAE75, 0xF300E948, 0xF2C2837F,
+            0xF0843D26, 0xF1465711, 0xF4094194, 0xF5CB2BA3, 0xF78D95FA, 0xF64FFFCD, 0xD9785D60,
+            0xD8BA3757, 0xDAFC890E, 0xDB3EE339, 0xDE71F5BC, 0xDFB39F8B, 0xDDF521D2, 0xDC374BE5,
+            0xD76B0CD8, 0xD6A966EF, 0xD4EFD8B6, 0xD52DB281, 0xD062A404, 0xD1A0CE33, 0xD3E6706A,
+            0xD2241A5D, 0xC55EFE10, 0xC49C9427, 0xC6DA2A7E, 0xC7184049, 0xC25756CC, 0xC3953CFB,
+            0xC1D382A2, 0xC011E895, 0xCB4DAFA8, 0xCA8FC59F, 0xC8C97BC6, 0xC90B11F1, 0xCC440774,
+            0xCD866D43, 0xCFC0D31A, 0xCE02B92D, 0x91AF9640, 0x906DFC77, 0x922B422E, 0x93E92819,
+            0x96A63E9C, 0x976454AB, 0x9522EAF2, 0x94E080C5, 0x9FBCC7F8, 0x9E7EADCF, 0x9C381396,
+            0x9DFA79A1, 0x98B56F24, 0x99770513, 0x9B31BB4A, 0x9AF3D17D, 0x8D893530, 0x8C4B5F07,
+            0x8E0DE15E, 0x8FCF8B69, 0x8A809DEC, 0x8B42F7DB, 0x89044982, 0x88C623B5, 0x839A6488,
+            0x82580EBF, 0x801EB0E6, 0x81DCDAD1, 0x8493CC54, 0x8551A663, 0x8717183A, 0x86D5720D,
+            0xA9E2D0A0, 0xA820BA97, 0xAA6604CE, 0xABA46EF9, 0xAEEB787C, 0xAF29124B, 0xAD6FAC12,
+            0xACADC625, 0xA7F18118, 0xA633EB2F, 0xA4755576, 0xA5B73F41, 0xA0F829C4, 0xA13A43F3,
+            0xA37CFDAA, 0xA2BE979D, 0xB5C473D0, 0xB40619E7, 0xB640A7BE, 0xB782CD89, 0xB2CDDB0C,
+            0xB30FB13B, 0xB1490F62, 0xB08B6555, 0xBBD72268, 0xBA15485F, 0xB853F606, 0xB9919C31,
+            0xBCDE8AB4, 0xBD1CE083, 0xBF5A5EDA, 0xBE9834ED
+        },
+        {
+            0x00000000, 0xB8BC6765, 0xAA09C88B, 0x12B5AFEE, 0x8F629757, 0x37DEF032, 0x256B5FDC,
+            0x9DD738B9, 0xC5B428EF, 0x7D084F8A, 0x6FBDE064, 0xD7018701, 0x4AD6BFB8, 0xF26AD8DD,
+            0xE0DF7733, 0x58631056, 0x5019579F, 0xE8A530FA, 0xFA109F14, 0x42ACF871, 0xDF7BC0C8,
+            0x67C7A7AD, 0x75720843, 0xCDCE6F26, 0x95AD7F70, 0x2D111815, 0x3FA4B7FB, 0x8718D09E,
+            0x1ACFE827, 0xA2738F42, 0xB0C620AC, 0x087A47C9, 0xA032AF3E, 0x188EC85B, 0x0A3B67B5,
+            0xB28700D0, 0x2F503869, 0x97EC5F0C, 0x8559F0E2, 0x3DE59787, 0x658687D1, 0xDD3AE0B4,
+            0xCF8F4F5A, 0x7733283F, 0xEAE41086, 0x525877E3, 0x40EDD80D, 0xF851BF68, 0xF02BF8A1,
+            0x48979FC4, 0x5A22302A, 0xE29E574F, 0x7F496FF6, 0xC7F50893, 0xD540A77D, 0x6DFCC018,
+            0x359FD04E, 0x8D23B72B, 0x9F9618C5, 0x272A7FA0, 0xBAFD4719, 0x0241207C, 0x10F48F92,
+            0xA848E8F7, 0x9B14583D, 0x23A83F58, 0x311D90B6, 0x89A1F7D3, 0x1476CF6A, 0xACCAA80F,
+            0xBE7F07E1, 0x06C36084, 0x5EA070D2, 0xE61C17B7, 0xF4A9B859, 0x4C15DF3C, 0xD1C2E785,
+            0x697E80E0, 0x7BCB2F0E, 0xC377486B, 0xCB0D0FA2, 0x73B168C7, 0x6104C729, 0xD9B8A04C,
+            0x446F98F5, 0xFCD3FF90, 0xEE66507E, 0x56DA371B, 0x0EB9274D, 0xB6054028, 0xA4B0EFC6,
+            0x1C0C88A3, 0x81DBB01A, 0x3967D77F, 0x2BD27891, 0x936E1FF4, 0x3B26F703, 0x839A9066,
+            0x912F3F88, 0x299358ED, 0xB4446054, 0x0CF80731, 0x1E4DA8DF, 0xA6F1CFBA, 0xFE92DFEC,
+            0x462EB889, 0x549B1767, 0xEC277002, 0x71F048BB, 0xC94C2FDE, 0xDBF98030, 0x6345E755,
+            0x6B3FA09C, 0xD383C7F9, 0xC1366817, 0x798A0F72, 0xE45D37CB, 0x5CE150AE, 0x4E54FF40,
+            0xF6E89825, 0xAE8B8873, 0x1637EF16, 0x048240F8, 0xBC3E279D, 0x21E91F24, 0x99557841,
+            0x8BE0D7AF, 0x335CB0CA, 0xED59B63B, 0x55E5D15E, 0x47507EB0, 0xFFEC19D5, 0x623B216C,
+            0xDA874609, 0xC832E9E7, 0x708E8E82, 0x28ED9ED4, 0x9051F9B1, 0x82E4565F, 0x3A58313A,
+            0xA78F0983, 0x1F336EE6, 0x0D86C108, 0xB53AA66D, 0xBD40E1A4, 0x05FC86C1, 0x1749292F,
+            0xAFF54E4A, 0x322276F3, 0x8A9E1196, 0x982BBE78, 0x2097D91D, 0x78F4C94B, 0xC048AE2E,
+            0xD2FD01C0, 0x6A4166A5, 0xF7965E1C, 0x4F2A3979, 0x5D9F9697, 0xE523F1F2, 0x4D6B1905,
+            0xF5D77E60, 0xE762D18E, 0x5FDEB6EB, 0xC2098E52, 0x7AB5E937, 0x680046D9, 0xD0BC21BC,
+            0x88DF31EA, 0x3063568F, 0x22D6F961, 0x9A6A9E04, 0x07BDA6BD, 0xBF01C1D8, 0xADB46E36,
+            0x15080953, 0x1D724E9A, 0xA5CE29FF, 0xB77B8611, 0x0FC7E174, 0x9210D9CD, 0x2AACBEA8,
+            0x38191146, 0x80A57623, 0xD8C66675, 0x607A0110, 0x72CFAEFE, 0xCA73C99B, 0x57A4F122,
+            0xEF189647, 0xFDAD39A9, 0x45115ECC, 0x764DEE06, 0xCEF18963, 0xDC44268D, 0x64F841E8,
+            0xF92F7951, 0x41931E34, 0x5326B1DA, 0xEB9AD6BF, 0xB3F9C6E9, 0x0B45A18C, 0x19F00E62,
+            0xA14C6907, 0x3C9B51BE, 0x842736DB, 0x96929935, 0x2E2EFE50, 0x2654B999, 0x9EE8DEFC,
+            0x8C5D7112, 0x34E11677, 0xA9362ECE, 0x118A49AB, 0x033FE645, 0xBB838120, 0xE3E09176,
+            0x5B5CF613, 0x49E959FD, 0xF1553E98, 0x6C820621, 0xD43E6144, 0xC68BCEAA, 0x7E37A9CF,
+            0xD67F4138, 0x6EC3265D, 0x7C7689B3, 0xC4CAEED6, 0x591DD66F, 0xE1A1B10A, 0xF3141EE4,
+            0x4BA87981, 0x13CB69D7, 0xAB770EB2, 0xB9C2A15C, 0x017EC639, 0x9CA9FE80, 0x241599E5,
+            0x36A0360B, 0x8E1C516E, 0x866616A7, 0x3EDA71C2, 0x2C6FDE2C, 0x94D3B949, 0x090481F0,
+            0xB1B8E695, 0xA30D497B, 0x1BB12E1E, 0x43D23E48, 0xFB6E592D, 0xE9DBF6C3, 0x516791A6,
+            0xCCB0A91F, 0x740CCE7A, 0x66B96194, 0xDE0506F1
+        },
+        {
+            0x00000000, 0x3D6029B0, 0x7AC05360, 0x47A07AD0, 0xF580A6C0, 0xC8E08F70, 0x8F40F5A0,
+            0xB220DC10, 0x30704BC1, 0x0D106271, 0x4AB018A1, 0x77D03111, 0xC5F0ED01, 0xF890C4B1,
+            0xBF30BE61, 0x825097D1, 0x60E09782, 0x5D80BE32, 0x1A20C4E2, 0x2740ED52, 0x95603142,
+            0xA80018F2, 0xEFA06222, 0xD2C04B92, 0x5090DC43, 0x6DF0F5F3, 0x2A508F23, 0x1730A693,
+            0xA5107A83, 0x98705333, 0xDFD029E3, 0xE2B00053, 0xC1C12F04, 0xFCA106B4, 0xBB017C64,
+            0x866155D4, 0x344189C4, 0x0921A074, 0x4E81DAA4, 0x73E1F314, 0xF1B164C5, 0xCCD14D75,
+            0x8B7137A5, 0xB6111E15, 0x0431C205, 0x3951EBB5, 0x7EF19165, 0x4391B8D5, 0xA121B886,
+            0x9C419136, 0xDBE1EBE6, 0xE681C256, 0x54A11E46, 0x69C137F6, 0x2E614D26, 0x13016496,
+            0x9151F347, 0xAC31DAF7, 0xEB91A027, 0xD6F18997, 0x64D15587, 0x59B17C37, 0x1E1106E7,
+            0x23712F57, 0x58F35849, 0x659371F9, 0x22330B29, 0x1F532299, 0xAD73FE89, 0x9013D739,
+            0xD7B3ADE9, 0xEAD38459, 0x68831388, 0x55E33A38, 0x124340E8, 0x2F236958, 0x9D03B548,
+            0xA0639CF8, 0xE7C3E628, 0xDAA3CF98, 0x3813CFCB, 0x0573E67B, 0x42D39CAB, 0x7FB3B51B,
+            0xCD93690B, 0xF0F340BB, 0xB7533A6B, 0x8A3313DB, 0x0863840A, 0x3503ADBA, 0x72A3D76A,
+            0x4FC3FEDA, 0xFDE322CA, 0xC0830B7A, 0x872371AA, 0xBA43581A, 0x9932774D, 0xA4525EFD,
+            0xE3F2242D, 0xDE920D9D, 0x6CB2D18D, 0x51D2F83D, 0x167282ED, 0x2B12AB5D, 0xA9423C8C,
+            0x9422153C, 0xD3826FEC, 0xEEE2465C, 0x5CC29A4C, 0x61A2B3FC, 0x2602C92C, 0x1B62E09C,
+            0xF9D2E0CF, 0xC4B2C97F, 0x8312B3AF, 0xBE729A1F, 0x0C52460F, 0x31326FBF, 0x7692156F,
+            0x4BF23CDF, 0xC9A2AB0E, 0xF4C282BE, 0xB362F86E, 0x8E02D1DE, 0x3C220DCE, 0x0142247E,
+            0x46E25EAE, 0x7B82771E, 0xB1E6B092, 0x8C869922, 0xCB26E3F2, 0xF646CA42, 0x44661652,
+            0x79063FE2, 0x3EA64532, 0x03C66C82, 0x8196FB53, 0xBCF6D2E3, 0xFB56A833, 0xC6368183,
+            0x74165D93, 0x49767423, 0x0ED60EF3, 0x33B62743, 0xD1062710, 0xEC660EA0, 0xABC67470,
+            0x96A65DC0, 0x248681D0, 0x19E6A860, 0x5E46D2B0, 0x6326FB00, 0xE1766CD1, 0xDC164561,
+            0x9BB63FB1, 0xA6D61601, 0x14F6CA11, 0x2996E3A1, 0x6E369971, 0x5356B0C1, 0x70279F96,
+            0x4D47B626, 0x0AE7CCF6, 0x3787E546, 0x85A73956, 0xB8C710E6, 0xFF676A36, 0xC2074386,
+            0x4057D457, 0x7D37FDE7, 0x3A978737, 0x07F7AE87, 0xB5D77297, 0x88B75B27, 0xCF1721F7,
+            0xF2770847, 0x10C70814, 0x2DA721A4, 0x6A075B74, 0x576772C4, 0xE547AED4, 0xD8278764,
+            0x9F87FDB4, 0xA2E7D404, 0x20B743D5, 0x1DD76A65, 0x5A7710B5, 0x67173905, 0xD537E515,
+            0xE857CCA5, 0xAFF7B675, 0x92979FC5, 0xE915E8DB, 0xD475C16B, 0x93D5BBBB, 0xAEB5920B,
+            0x1C954E1B, 0x21F567AB, 0x66551D7B, 0x5B3534CB, 0xD965A31A, 0xE4058AAA, 0xA3A5F07A,
+            0x9EC5D9CA, 0x2CE505DA, 0x11852C6A, 0x562556BA, 0x6B457F0A, 0x89F57F59, 0xB49556E9,
+            0xF3352C39, 0xCE550589, 0x7C75D999, 0x4115F029, 0x06B58AF9, 0x3BD5A349, 0xB9853498,
+            0x84E51D28, 0xC34567F8, 0xFE254E48, 0x4C059258, 0x7165BBE8, 0x36C5C138, 0x0BA5E888,
+            0x28D4C7DF, 0x15B4EE6F, 0x521494BF, 0x6F74BD0F, 0xDD54611F, 0xE03448AF, 0xA794327F,
+            0x9AF41BCF, 0x18A48C1E, 0x25C4A5AE, 0x6264DF7E, 0x5F04F6CE, 0xED242ADE, 0xD044036E,
+            0x97E479BE, 0xAA84500E, 0x4834505D, 0x755479ED, 0x32F4033D, 0x0F942A8D, 0xBDB4F69D,
+            0x80D4DF2D, 0xC774A5FD, 0xFA148C4D, 0x78441B9C, 0x4524322C, 0x028448FC, 0x3FE4614C,
+            0x8DC4BD5C, 0xB0A494EC, 0xF704EE3C, 0xCA64C78C
+        },
+        {
+            0x00000000, 0xCB5CD3A5, 0x4DC8A10B, 0x869472AE, 0x9B914216, 0x50CD91B3, 0xD659E31D,
+            0x1D0530B8, 0xEC53826D, 0x270F51C8, 0xA19B2366, 0x6AC7F0C3, 0x77C2C07B, 0xBC9E13DE,
+            0x3A0A6170, 0xF156B2D5, 0x03D6029B, 0xC88AD13E, 0x4E1EA390, 0x85427035, 0x9847408D,
+            0x531B9328, 0xD58FE186, 0x1ED33223, 0xEF8580F6, 0x24D95353, 0xA24D21FD, 0x6911F258,
+            0x7414C2E0, 0xBF481145, 0x39DC63EB, 0xF280B04E, 0x07AC0536, 0xCCF0D693, 0x4A64A43D,
+            0x81387798, 0x9C3D4720, 0x57619485, 0xD1F5E62B, 0x1AA9358E, 0xEBFF875B, 0x20A354FE,
+            0xA6372650, 0x6D6BF5F5, 0x706EC54D, 0xBB3216E8, 0x3DA66446, 0xF6FAB7E3, 0x047A07AD,
+            0xCF26D408, 0x49B2A6A6, 0x82EE7503, 0x9FEB45BB, 0x54B7961E, 0xD223E4B0, 0x197F3715,
+            0xE82985C0, 0x23755665, 0xA5E124CB, 0x6EBDF76E, 0x73B8C7D6, 0xB8E41473, 0x3E7066DD,
+            0xF52CB578, 0x0F580A6C, 0xC404D9C9, 0x4290AB67, 0x89CC78C2, 0x94C9487A, 0x5F959BDF,
+            0xD901E971, 0x125D3AD4, 0xE30B8801, 0x28575BA4, 0xAEC3290A, 0x659FFAAF, 0x789ACA17,
+            0xB3C619B2, 0x35526B1C, 0xFE0EB8B9, 0x0C8E08F7, 0xC7D2DB52, 0x4146A9FC, 0x8A1A7A59,
+            0x971F4AE1, 0x5C439944, 0xDAD7EBEA, 0x118B384F, 0xE0DD8A9A, 0x2B81593F, 0xAD152B91,
+            0x6649F834, 0x7B4CC88C, 0xB0101B29, 0x36846987, 0xFDD8BA22, 0x08F40F5A, 0xC3A8DCFF,
+            0x453CAE51, 0x8E607DF4, 0x93654D4C, 0x58399EE9, 0xDEADEC47, 0x15F13FE2, 0xE4A78D37,
+            0x2FFB5E92, 0xA96F2C3C, 0x6233FF99, 0x7F36CF21, 0xB46A1C84, 0x32FE6E2A, 0xF9A2BD8F,
+            0x0B220DC1, 0xC07EDE64, 0x46EAACCA, 0x8DB67F6F, 0x90B34FD7, 0x5BEF9C72, 0xDD7BEEDC,
+            0x16273D79, 0xE7718FAC, 0x2C2D5C09, 0xAAB92EA7, 0x61E5FD02, 0x7CE0CDBA, 0xB7BC1E1F,
+            0x31286CB1, 0xFA74BF14, 0x1EB014D8, 0xD5ECC77D, 0x5378B5D3, 0x98246676, 0x852156CE,
+            0x4E7D856B, 0xC8E9F7C5, 0x03B52460, 0xF2E396B5, 0x39BF4510, 0xBF2B37BE, 0x7477E41B,
+            0x6972D4A3, 0xA22E0706, 0x24BA75A8, 0xEFE6A60D, 0x1D661643, 0xD63AC5E6, 0x50AEB748,
+            0x9BF264ED, 0x86F75455, 0x4DAB87F0, 0xCB3FF55E, 0x006326FB, 0xF135942E, 0x3A69478B,
+            0xBCFD3525, 0x77A1E680, 0x6AA4D638, 0xA1F8059D, 0x276C7733, 0xEC30A496, 0x191C11EE,
+            0xD240C24B, 0x54D4B0E5, 0x9F886340, 0x828D53F8, 0x49D1805D, 0xCF45F2F3, 0x04192156,
+            0xF54F9383, 0x3E134026, 0xB8873288, 0x73DBE12D, 0x6EDED195, 0xA5820230, 0x2316709E,
+            0xE84AA33B, 0x1ACA1375, 0xD196C0D0, 0x5702B27E, 0x9C5E61DB, 0x815B5163, 0x4A0782C6,
+            0xCC93F068, 0x07CF23CD, 0xF6999118, 0x3DC542BD, 0xBB513013, 0x700DE3B6, 0x6D08D30E,
+            0xA65400AB, 0x20C07205, 0xEB9CA1A0, 0x11E81EB4, 0xDAB4CD11, 0x5C20BFBF, 0x977C6C1A,
+            0x8A795CA2, 0x41258F07, 0xC7B1FDA9, 0x0CED2E0C, 0xFDBB9CD9, 0x36E74F7C, 0xB0733DD2,
+            0x7B2FEE77, 0x662ADECF, 0xAD760D6A, 0x2BE27FC4, 0xE0BEAC61, 0x123E1C2F, 0xD962CF8A,
+            0x5FF6BD24, 0x94AA6E81, 0x89AF5E39, 0x42F38D9C, 0xC467FF32, 0x0F3B2C97, 0xFE6D9E42,
+            0x35314DE7, 0xB3A53F49, 0x78F9ECEC, 0x65FCDC54, 0xAEA00FF1, 0x28347D5F, 0xE368AEFA,
+            0x16441B82, 0xDD18C827, 0x5B8CBA89, 0x90D0692C, 0x8DD55994, 0x46898A31, 0xC01DF89F,
+            0x0B412B3A, 0xFA1799EF, 0x314B4A4A, 0xB7DF38E4, 0x7C83EB41, 0x6186DBF9, 0xAADA085C,
+            0x2C4E7AF2, 0xE712A957, 0x15921919, 0xDECECABC, 0x585AB812, 0x93066BB7, 0x8E035B0F,
+            0x455F88AA, 0xC3CBFA04, 0x089729A1, 0xF9C19B74, 0x329D48D1, 0xB4093A7F, 0x7F55E9DA,
+            0x6250D962, 0xA90C0AC7, 0x2F987869, 0xE4C4ABCC
+        },
+        {
+            0x00000000, 0xA6770BB4, 0x979F1129, 0x31E81A9D, 0xF44F2413, 0x52382FA7, 0x63D0353A,
+            0xC5A73E8E, 0x33EF4E67, 0x959845D3, 0xA4705F4E, 0x020754FA, 0xC7A06A74, 0x61D761C0,
+            0x503F7B5D, 0xF64870E9, 0x67DE9CCE, 0xC1A9977A, 0xF0418DE7, 0x56368653, 0x9391B8DD,
+            0x35E6B369, 0x040EA9F4, 0xA279A240, 0x5431D2A9, 0xF246D91D, 0xC3AEC380, 0x65D9C834,
+            0xA07EF6BA, 0x0609FD0E, 0x37E1E793, 0x9196EC27, 0xCFBD399C, 0x69CA3228, 0x582228B5,
+            0xFE552301, 0x3BF21D8F, 0x9D85163B, 0xAC6D0CA6, 0x0A1A0712, 0xFC5277FB, 0x5A257C4F,
+            0x6BCD66D2, 0xCDBA6D66, 0x081D53E8, 0xAE6A585C, 0x9F8242C1, 0x39F54975, 0xA863A552,
+            0x0E14AEE6, 0x3FFCB47B, 0x998BBFCF, 0x5C2C8141, 0xFA5B8AF5, 0xCBB39068, 0x6DC49BDC,
+            0x9B8CEB35, 0x3DFBE081, 0x0C13FA1C, 0xAA64F1A8, 0x6FC3CF26, 0xC9B4C492, 0xF85CDE0F,
+            0x5E2BD5BB, 0x440B7579, 0xE27C7ECD, 0xD3946450, 0x75E36FE4, 0xB044516A, 0x16335ADE,
+            0x27DB4043, 0x81AC4BF7, 0x77E43B1E, 0xD19330AA, 0xE07B2A37, 0x460C2183, 0x83AB1F0D,
+            0x25DC14B9, 0x14340E24, 0xB2430590, 0x23D5E9B7, 0x85A2E203, 0xB44AF89E, 0x123DF32A,
+            0xD79ACDA4, 0x71EDC610, 0x4005DC8D, 0xE672D739, 0x103AA7D0, 0xB64DAC64, 0x87A5B6F9,
+            0x21D2BD4D, 0xE47583C3, 0x42028877, 0x73EA92EA, 0xD59D995E, 0x8BB64CE5, 0x2DC14751,
+            0x1C295DCC, 0xBA5E5678, 0x7FF968F6, 0xD98E6342, 0xE86679DF, 0x4E11726B, 0xB8590282,
+            0x1E2E0936, 0x2FC613AB, 0x89B1181F, 0x4C162691, 0xEA612D25, 0xDB8937B8, 0x7DFE3C0C,
+            0xEC68D02B, 0x4A1FDB9F, 0x7BF7C102, 0xDD80CAB6, 0x1827F438, 0xBE50FF8C, 0x8FB8E511,
+            0x29CFEEA5, 0xDF879E4C, 0x79F095F8, 0x48188F65, 0xEE6F84D1, 0x2BC8BA5F, 0x8DBFB1EB,
+            0xBC57AB76, 0x1A20A0C2, 0x8816EAF2, 0x2E61E146, 0x1F89FBDB, 0xB9FEF06F, 0x7C59CEE1,
+            0xDA2EC555, 0xEBC6DFC8, 0x4DB1D47C, 0xBBF9A495, 0x1D8EAF21, 0x2C66B5BC, 0x8A11BE08,
+            0x4FB68086, 0xE9C18B32, 0xD82991AF, 0x7E5E9A1B, 0xEFC8763C, 0x49BF7D88, 0x78576715,
+            0xDE206CA1, 0x1B87522F, 0xBDF0599B, 0x8C184306, 0x2A6F48B2, 0xDC27385B, 0x7A5033EF,
+            0x4BB82972, 0xEDCF22C6, 0x28681C48, 0x8E1F17FC, 0xBFF70D61, 0x198006D5, 0x47ABD36E,
+            0xE1DCD8DA, 0xD034C247, 0x7643C9F3, 0xB3E4F77D, 0x1593FCC9, 0x247BE654, 0x820CEDE0,
+            0x74449D09, 0xD23396BD, 0xE3DB8C20, 0x45AC8794, 0x800BB91A, 0x267CB2AE, 0x1794A833,
+            0xB1E3A387, 0x20754FA0, 0x86024414, 0xB7EA5E89, 0x119D553D, 0xD43A6BB3, 0x724D6007,
+            0x43A57A9A, 0xE5D2712E, 0x139A01C7, 0xB5ED0A73, 0x840510EE, 0x22721B5A, 0xE7D525D4,
+            0x41A22E60, 0x704A34FD, 0xD63D3F49, 0xCC1D9F8B, 0x6A6A943F, 0x5B828EA2, 0xFDF58516,
+            0x3852BB98, 0x9E25B02C, 0xAFCDAAB1, 0x09BAA105, 0xFFF2D1EC, 0x5985DA58, 0x686DC0C5,
+            0xCE1ACB71, 0x0BBDF5FF, 0xADCAFE4B, 0x9C22E4D6, 0x3A55EF62, 0xABC30345, 0x0DB408F1,
+            0x3C5C126C, 0x9A2B19D8, 0x5F8C2756, 0xF9FB2CE2, 0xC813367F, 0x6E643DCB, 0x982C4D22,
+            0x3E5B4696, 0x0FB35C0B, 0xA9C457BF, 0x6C636931, 0xCA146285, 0xFBFC7818, 0x5D8B73AC,
+            0x03A0A617, 0xA5D7ADA3, 0x943FB73E, 0x3248BC8A, 0xF7EF8204, 0x519889B0, 0x6070932D,
+            0xC6079899, 0x304FE870, 0x9638E3C4, 0xA7D0F959, 0x01A7F2ED, 0xC400CC63, 0x6277C7D7,
+            0x539FDD4A, 0xF5E8D6FE, 0x647E3AD9, 0xC209316D, 0xF3E12BF0, 0x55962044, 0x90311ECA,
+            0x3646157E, 0x07AE0FE3, 0xA1D90457, 0x579174BE, 0xF1E67F0A, 0xC00E6597, 0x66796E23,
+            0xA3DE50AD, 0x05A95B19, 0x34414184, 0x92364A30
+        },
+        {
+            0x00000000, 0xCCAA009E, 0x4225077D, 0x8E8F07E3, 0x844A0EFA, 0x48E00E64, 0xC66F0987,
+            0x0AC50919, 0xD3E51BB5, 0x1F4F1B2B, 0x91C01CC8, 0x5D6A1C56, 0x57AF154F, 0x9B0515D1,
+            0x158A1232, 0xD92012AC, 0x7CBB312B, 0xB01131B5, 0x3E9E3656, 0xF23436C8, 0xF8F13FD1,
+            0x345B3F4F, 0xBAD438AC, 0x767E3832, 0xAF5E2A9E, 0x63F42A00, 0xED7B2DE3, 0x21D12D7D,
+            0x2B142464, 0xE7BE24FA, 0x69312319, 0xA59B2387, 0xF9766256, 0x35DC62C8, 0xBB53652B,
+            0x77F965B5, 0x7D3C6CAC, 0xB1966C32, 0x3F196BD1, 0xF3B36B4F, 0x2A9379E3, 0xE639797D,
+            0x68B67E9E, 0xA41C7E00, 0xAED97719, 0x62737787, 0xECFC7064, 0x205670FA, 0x85CD537D,
+            0x496753E3, 0xC7E85400, 0x0B42549E, 0x01875D87, 0xCD2D5D19, 0x43A25AFA, 0x8F085A64,
+            0x562848C8, 0x9A824856, 0x140D4FB5, 0xD8A74F2B, 0xD2624632, 0x1EC846AC, 0x9047414F,
+            0x5CED41D1, 0x299DC2ED, 0xE537C273, 0x6BB8C590, 0xA712C50E, 0xADD7CC17, 0x617DCC89,
+            0xEFF2CB6A, 0x2358CBF4, 0xFA78D958, 0x36D2D9C6, 0xB85DDE25, 0x74F7DEBB, 0x7E32D7A2,
+            0xB298D73C, 0x3C17D0DF, 0xF0BDD041, 0x5526F3C6, 0x998CF358, 0x1703F4BB, 0xDBA9F425,
+            0xD16CFD3C, 0x1DC6FDA2, 0x9349FA41, 0x5FE3FADF, 0x86C3E873, 0x4A69E8ED, 0xC4E6EF0E,
+            0x084CEF90, 0x0289E689, 0xCE23E617, 0x40ACE1F4, 0x8C06E16A, 0xD0EBA0BB, 0x1C41A025,
+            0x92CEA7C6, 0x5E64A758, 0x54A1AE41, 0x980BAEDF, 0x1684A93C, 0xDA2EA9A2, 0x030EBB0E,
+            0xCFA4BB90, 0x412BBC73, 0x8D81BCED, 0x8744B5F4, 0x4BEEB56A, 0xC561B289, 0x09CBB217,
+            0xAC509190, 0x60FA910E, 0xEE7596ED, 0x22DF9673, 0x281A9F6A, 0xE4B09FF4, 0x6A3F9817,
+            0xA6959889, 0x7FB58A25, 0xB31F8ABB, 0x3D908D58, 0xF13A8DC6, 0xFBFF84DF, 0x37558441,
+            0xB9DA83A2, 0x7570833C, 0x533B85DA, 0x9F918544, 0x111E82A7, 0xDDB48239, 0xD7718B20,
+            0x1BDB8BBE, 0x95548C5D, 0x59FE8CC3, 0x80DE9E6F, 0x4C749EF1, 0xC2FB9912, 0x0E51998C,
+            0x04949095, 0xC83E900B, 0x46B197E8, 0x8A1B9776, 0x2F80B4F1, 0xE32AB46F, 0x6DA5B38C,
+            0xA10FB312, 0xABCABA0B, 0x6760BA95, 0xE9EFBD76, 0x2545BDE8, 0xFC65AF44, 0x30CFAFDA,
+            0xBE40A839, 0x72EAA8A7, 0x782FA1BE, 0xB485A120, 0x3A0AA6C3, 0xF6A0A65D, 0xAA4DE78C,
+            0x66E7E712, 0xE868E0F1, 0x24C2E06F, 0x2E07E976, 0xE2ADE9E8, 0x6C22EE0B, 0xA088EE95,
+            0x79A8FC39, 0xB502FCA7, 0x3B8DFB44, 0xF727FBDA, 0xFDE2F2C3, 0x3148F25D, 0xBFC7F5BE,
+            0x736DF520, 0xD6F6D6A7, 0x1A5CD639, 0x94D3D1DA, 0x5879D144, 0x52BCD85D, 0x9E16D8C3,
+            0x1099DF20, 0xDC33DFBE, 0x0513CD12, 0xC9B9CD8C, 0x4736CA6F, 0x8B9CCAF1, 0x8159C3E8,
+            0x4DF3C376, 0xC37CC495, 0x0FD6C40B, 0x7AA64737, 0xB60C47A9, 0x3883404A, 0xF42940D4,
+            0xFEEC49CD, 0x32464953, 0xBCC94EB0, 0x70634E2E, 0xA9435C82, 0x65E95C1C, 0xEB665BFF,
+            0x27CC5B61, 0x2D095278, 0xE1A352E6, 0x6F2C5505, 0xA386559B, 0x061D761C, 0xCAB77682,
+            0x44387161, 0x889271FF, 0x825778E6, 0x4EFD7878, 0xC0727F9B, 0x0CD87F05, 0xD5F86DA9,
+            0x19526D37, 0x97DD6AD4, 0x5B776A4A, 0x51B26353, 0x9D1863CD, 0x1397642E, 0xDF3D64B0,
+            0x83D02561, 0x4F7A25FF, 0xC1F5221C, 0x0D5F2282, 0x079A2B9B, 0xCB302B05, 0x45BF2CE6,
+            0x89152C78, 0x50353ED4, 0x9C9F3E4A, 0x121039A9, 0xDEBA3937, 0xD47F302E, 0x18D530B0,
+            0x965A3753, 0x5AF037CD, 0xFF6B144A, 0x33C114D4, 0xBD4E1337, 0x71E413A9, 0x7B211AB0,
+            0xB78B1A2E, 0x39041DCD, 0xF5AE1D53, 0x2C8E0FFF, 0xE0240F61, 0x6EAB0882, 0xA201081C,
+            0xA8C40105, 0x646E019B, 0xEAE10678, 0x264B06E6
+        }
+    };
+
+    /* the kernel for this machine, picked on first use by picozip__crc_init() */
+    static picozip__crc_kernel picozip__crc_impl = NULL;
 
-        uint32_t crc32 = (uint32_t)crc ^ 0xFFFFFFFF;
+/* threads racing to pick the kernel store the same pointer, and the tables it reads are constant */
+#if defined(__GNUC__) || defined(__clang__)
+#define PICOZIP__CRC_IMPL() __atomic_load_n(&picozip__crc_impl, __ATOMIC_ACQUIRE)
+#define PICOZIP__CRC_SET_IMPL(K) __atomic_store_n(&picozip__crc_impl, (K), __ATOMIC_RELEASE)
+#else
+#define PICOZIP__CRC_IMPL() (*(picozip__crc_kernel volatile *)&picozip__crc_impl)
+#define PICOZIP__CRC_SET_IMPL(K) (*(picozip__crc_kernel volatile *)&picozip__crc_impl = (K))
+#endif
+
+    static uint32_t picozip__crc32_slice8(uint8_t *dst, const uint8_t *ptr, size_t buf_len, uint32_t crc)
+    {
+        uint32_t lo, hi;
 
-        while (buf_len >= 4)
+        while (buf_len >= 8)
         {
-            crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ ptr[0]) & 0xFF];
-            crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ ptr[1]) & 0xFF];
-            crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ ptr[2]) & 0xFF];
-            crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ ptr[3]) & 0xFF];
-            ptr += 4;
-            buf_len -= 4;
+            lo = crc ^ ((uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+            hi = (uint32_t)ptr[4] | ((uint32_t)ptr[5] << 8) | ((uint32_t)ptr[6] << 16) | ((uint32_t)ptr[7] << 24);
+            crc = picozip__crc_table[7][lo & 0xFF] ^ picozip__crc_table[6][(lo >> 8) & 0xFF] ^
+                  picozip__crc_table[5][(lo >> 16) & 0xFF] ^ picozip__crc_table[4][lo >> 24] ^
+                  picozip__crc_table[3][hi & 0xFF] ^ picozip__crc_table[2][(hi >> 8) & 0xFF] ^
+                  picozip__crc_table[1][(hi >> 16) & 0xFF] ^ picozip__crc_table[0][hi >> 24];
+            if (dst)
+            {
+                memcpy(dst, ptr, 8);
+                dst += 8;
+            }
+            ptr += 8;
+            buf_len -= 8;
         }
 
         while (buf_len)
         {
-            crc32 = (crc32 >> 8) ^ s_crc_table[(crc32 ^ ptr[0]) & 0xFF];
+            crc = (crc >> 8) ^ picozip__crc_table[0][(crc ^ ptr[0]) & 0xFF];
+            if (dst)
+                *dst++ = ptr[0];
             ++ptr;
             --buf_len;
         }
 
-        return ~crc32;
+        return crc;
     }
 
-    /** A dynamic array. */
-    typedef struct picozip__vec
-    {
-        void *data;
-        size_t cap, size;
-    } picozip__vec;
+#ifndef PICOZIP_NO_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PICOZIP__CRC_CLMUL
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define PICOZIP__TARGET_CLMUL __attribute__((target("pclmul,sse2")))
+#elif defined(_MSC_VER) && !defined(__clang__) && (defined(_M_X64) || defined(_M_IX86))
+#define PICOZIP__CRC_CLMUL
+#include <intrin.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define PICOZIP__TARGET_CLMUL
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__) && !defined(__AARCH64EB__)
+#if defined(__ARM_FEATURE_CRC32)
+#define PICOZIP__CRC_ARMV8
+#define PICOZIP__TARGET_CRC
+#elif defined(__linux__)
+#define PICOZIP__CRC_ARMV8
+#define PICOZIP__CRC_ARMV8_HWCAP
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#if defined(__clang__)
+#define PICOZIP__TARGET_CRC __attribute__((target("crc")))
+#else
+#define PICOZIP__TARGET_CRC __attribute__((target("+crc")))
+#endif
+#endif
+#ifdef PICOZIP__CRC_ARMV8
+#include <arm_acle.h>
+#endif
+#endif
+#endif /* ifndef PICOZIP_NO_SIMD */
 
-    /** File entry. */
-    typedef struct picozip__entry
+#ifdef PICOZIP__CRC_CLMUL
+    /*
+     * Folding with carry-less multiplication, from Intel's "Fast CRC Computation for
+     * Generic Polynomials Using PCLMULQDQ Instruction". <buf_len> must be at least 64
+     * and a multiple of 16. The constants are the bit-reflected k1-k5, mu and P(x).
+     */
+    PICOZIP__TARGET_CLMUL static uint32_t picozip__crc32_clmul_fold(uint8_t *dst, const uint8_t *buf, size_t buf_len, uint32_t crc)
     {
-        uint16_t version_made, version_extract, flags, comp_method;
-        time_t mod_time;
-        uint32_t crc32, comp_size, uncomp_size;
-        uint16_t filename_len, extra_field_len, comment_len, internal_attr;
-        uint32_t external_attr, header_offset;
-        uint8_t metadata[1];
-    } picozip__entry;
+        __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
 
-    /** The zip file. */
-    struct picozip__file
-    {
-        picozip_alloc_callback alloc_cb;
-        picozip_write_callback write_cb;
-        picozip_free_callback free_cb;
-        size_t offset, num_entries;
-        picozip__vec entries;
-        void *userdata;
-        uint8_t scratch[PICOZIP__SCRATCH_BUFFER_SIZE];
-    };
+        x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        if (dst)
+        {
+            _mm_storeu_si128((__m128i *)(dst + 0x00), x1);
+            _mm_storeu_si128((__m128i *)(dst + 0x10), x2);
+            _mm_storeu_si128((__m128i *)(dst + 0x20), x3);
+            _mm_storeu_si128((__m128i *)(dst + 0x30), x4);
+            dst += 64;
+        }
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+        x0 = _mm_set_epi32(0x00000001, (int)0xC6E41596, 0x00000001, 0x54442BD4); /* k2:k1 */
+        buf += 64;
+        buf_len -= 64;
 
-    typedef struct picozip__mem_file
-    {
-        picozip_file *file;
-        picozip__vec mem;
-    } picozip__mem_file;
+        /* fold 4x128 bits at a time */
+        while (buf_len >= 64)
+        {
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+            x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+            x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+            y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+            y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+            y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+            y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+            if (dst)
+            {
+                _mm_storeu_si128((__m128i *)(dst + 0x00), y5);
+                _mm_storeu_si128((__m128i *)(dst + 0x10), y6);
+                _mm_storeu_si128((__m128i *)(dst + 0x20), y7);
+                _mm_storeu_si128((__m128i *)(dst + 0x30), y8);
+                dst += 64;
+            }
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+            buf += 64;
+            buf_len -= 64;
+        }
 
-    static void *picozip__vec_alloc(picozip__vec *vec, size_t size, picozip_alloc_callback alloc, picozip_free_callback free, void *userdata)
-    {
-        size_t new_cap;
-        void *new_data;
+        /* fold the 4 lanes into one */
+        x0 = _mm_set_epi32(0x00000000, (int)0xCCAA009E, 0x00000001, 0x751997D0); /* k4:k3 */
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
 
-        if (vec->size + size > vec->cap)
+        /* fold the remaining 128 bit blocks */
+        while (buf_len >= 16)
         {
-            new_cap = vec->size + size;
-            new_data = alloc(userdata, new_cap);
-            if (!new_data)
-                return NULL;
-            memcpy(new_data, vec->data, vec->size);
-            free(userdata, vec->data);
-            vec->data = new_data;
-            vec->cap = new_cap;
+            x2 = _mm_loadu_si128((const __m128i *)buf);
+            if (dst)
+            {
+                _mm_storeu_si128((__m128i *)dst, x2);
+                dst += 16;
+            }
+            x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+            buf += 16;
+            buf_len -= 16;
         }
-        return vec->data;
+
+        /* fold 128 bits to 64 bits */
+        x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+        x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+        x1 = _mm_srli_si128(x1, 8);
+        x1 = _mm_xor_si128(x1, x2);
+        x0 = _mm_set_epi32(0x00000000, 0x00000000, 0x00000001, 0x63CD6124); /* k5 */
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, x3);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        /* Barrett reduction to 32 bits */
+        x0 = _mm_set_epi32(0x00000001, (int)0xF7011641, 0x00000001, (int)0xDB710641); /* mu:P(x) */
+        x2 = _mm_and_si128(x1, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+        x2 = _mm_and_si128(x2, x3);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+
+        return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
     }
 
-    int picozip_new(picozip_file **ofile, picozip_write_callback write_cb, picozip_alloc_callback alloc_cb, picozip_free_callback free_cb, void *userdata)
+    static uint32_t picozip__crc32_clmul(uint8_t *dst, const uint8_t *ptr, size_t buf_len, uint32_t crc)
     {
-        picozip_file *file;
+        size_t chunk;
 
-        if (!ofile || !write_cb || !alloc_cb || !free_cb)
-            return PICOZIP_EINVAL;
+        if (buf_len >= 64)
+        {
+            chunk = buf_len & ~(size_t)15;
+            crc = picozip__crc32_clmul_fold(dst, ptr, chunk, crc);
+            ptr += chunk;
+            buf_len -= chunk;
+            if (dst)
+                dst += chunk;
+        }
+        return picozip__crc32_slice8(dst, ptr, buf_len, crc);
+    }
 
-        if (!(file = (picozip_file *)alloc_cb(userdata, sizeof(picozip_file))))
-            return PICOZIP_ENOMEM;
+    static int picozip__crc_has_hw(void)
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 1)) != 0; /* PCLMULQDQ */
+#else
+        unsigned int eax, ebx, ecx, edx;
+        return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL);
+#endif
+    }
+#endif /* ifdef PICOZIP__CRC_CLMUL */
 
-        memset(file, 0, sizeof(picozip_file));
-        file->alloc_cb = alloc_cb;
-        file->write_cb = write_cb;
-        file->free_cb = free_cb;
-        file->userdata = userdata;
-        *ofile = file;
+#ifdef PICOZIP__CRC_ARMV8
+    /* ARMv8 CRC32 instructions, 8 bytes per instruction. */
+    PICOZIP__TARGET_CRC static uint32_t picozip__crc32_armv8(uint8_t *dst, const uint8_t *ptr, size_t buf_len, uint32_t crc)
+    {
+        uint64_t v;
 
-        return PICOZIP_OK;
+        while (buf_len && ((uintptr_t)ptr & 7))
+        {
+            crc = __crc32b(crc, *ptr);
+            if (dst)
+                *dst++ = *ptr;
+            ++ptr;
+            --buf_len;
+        }
+        while (buf_len >= 8)
+        {
+            memcpy(&v, ptr, sizeof(v));
+            crc = __crc32d(crc, v);
+            if (dst)
+            {
+                memcpy(dst, &v, sizeof(v));
+                dst += 8;
+            }
+            ptr += 8;
+            buf_len -= 8;
+        }
+        while (buf_len)
+        {
+            crc = __crc32b(crc, *ptr);
+            if (dst)
+                *dst++ = *ptr;
+            ++ptr;
+            --buf_len;
+        }
+        return crc;
     }
 
-    static picozip__entry *picozip__alloc_entry(picozip_file *file, size_t metadata_len)
+    static int picozip__crc_has_hw(void)
     {
-        picozip__entry *entry, **entries;
-
-        if (!(entries = (picozip__entry **)picozip__vec_alloc(&file->entries, sizeof(picozip__entry *), file->alloc_cb, file->free_cb, file->userdata)))
-            return NULL;
+#ifdef PICOZIP__CRC_ARMV8_HWCAP
+        return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+        return 1;
+#endif
+    }
+#endif /* ifdef PICOZIP__CRC_ARMV8 */
 
-        entry = (picozip__entry *)file->alloc_cb(file->userdata, sizeof(picozip__entry) + metadata_len);
-        if (!entry)
-            return NULL;
+#ifdef PICOZIP_THREADS
+    /* x^(2^n) modulo the CRC polynomial */
+    static const uint32_t picozip__crc_x2n_table[32] = {
+        0x40000000, 0x20000000, 0x08000000, 0x00800000, 0x00008000, 0xEDB88320, 0xB1E6B092,
+        0xA06A2517, 0xED627DAE, 0x88D14467, 0xD7BBFE6A, 0xEC447F11, 0x8E7EA170, 0x6427800E,
+        0x4D47BAE0, 0x09FE548F, 0x83852D0F, 0x30362F1A, 0x7B5A9CC3, 0x31FEC169, 0x9FEC022A,
+        0x6C8DEDC4, 0x15D6874D, 0x5FDE7A4E, 0xBAD90E37, 0x2E4E5EEF, 0x4EABA214, 0xA8A472C0,
+        0x429A969E, 0x148D302A, 0xC40BA6D0, 0xC4E22C3C
+    };
 
-        entries[file->num_entries++] = entry;
-        file->entries.size += sizeof(picozip__entry *);
+    /* multiplies <a> by <b> modulo the CRC polynomial (https://github.com/madler/zlib/blob/develop/crc32.c) */
+    static uint32_t picozip__crc_multmodp(uint32_t a, uint32_t b)
+    {
+        uint32_t m, p;
 
-        return entry;
+        m = (uint32_t)1 << 31;
+        p = 0;
+        for (;;)
+        {
+            if (a & m)
+            {
+                p ^= b;
+                if ((a & (m - 1)) == 0)
+                    break;
+            }
+            m >>= 1;
+            b = b & 1 ? (b >> 1) ^ PICOZIP__CRC_POLY : b >> 1;
+        }
+        return p;
     }
 
-    static void picozip__free_last_entry(picozip_file *file)
+    /* returns the CRC of two concatenated chunks from their CRCs and the length of the second one */
+    static uint32_t picozip__crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
     {
-        if (file->num_entries)
+        uint32_t p;
+        int k;
+
+        /* x^(8 * len2) */
+        p = (uint32_t)1 << 31;
+        for (k = 3; len2; len2 >>= 1, k++)
         {
-            file->free_cb(file->userdata, ((picozip__entry **)file->entries.data)[--file->num_entries]);
-            file->entries.size -= sizeof(picozip__entry *);
+            if (len2 & 1)
+                p = picozip__crc_multmodp(picozip__crc_x2n_table[k & 31], p);
         }
+        return picozip__crc_multmodp(p, crc1) ^ crc2;
     }
+#endif
 
-#define PICOZIP__FLUSH(FILE, SRC, SIZE, IFFAIL)                                          \
-    do                                                                                   \
-    {                                                                                    \
-        if ((FILE)->write_cb((FILE)->userdata, (SRC), (size_t)(SIZE)) != (size_t)(SIZE)) \
-            IFFAIL(FILE)->offset += (size_t)(SIZE);                                      \
-    } while (0)
-
-    static int picozip__write_local_entry(picozip_file *file, picozip__entry *entry)
+    /* picks the fastest kernel for this machine, returning it */
+    static picozip__crc_kernel picozip__crc_init(void)
     {
-        uint16_t dos_date, dos_time;
-        /* write the entry to the output */
-        PICOZIP__WRITE_LE32(file->scratch, 0, PICOZIP__LOCAL_MAGIC);
-        PICOZIP__WRITE_LE16(file->scratch, 4, entry->version_extract);
-        PICOZIP__WRITE_LE16(file->scratch, 6, entry->flags);
-        PICOZIP__WRITE_LE16(file->scratch, 8, entry->comp_method);
-        picozip__time_to_dostime(entry->mod_time, &dos_date, &dos_time);
-        PICOZIP__WRITE_LE16(file->scratch, 10, dos_time);
-        PICOZIP__WRITE_LE16(file->scratch, 12, dos_date);
-        PICOZIP__WRITE_LE32(file->scratch, 14, entry->crc32);
-        PICOZIP__WRITE_LE32(file->scratch, 18, entry->comp_size);
-        PICOZIP__WRITE_LE32(file->scratch, 22, entry->uncomp_size);
-        PICOZIP__WRITE_LE16(file->scratch, 26, entry->filename_len);
-        PICOZIP__WRITE_LE16(file->scratch, 28, entry->extra_field_len);
+        picozip__crc_kernel impl;
 
-        /* write header + extra field */
-        PICOZIP__FLUSH(file, file->scratch, PICOZIP__LOCAL_HEADER_SIZE, { return PICOZIP_EIO; });
-        PICOZIP__FLUSH(file, entry->metadata, entry->filename_len + entry->extra_field_len, { return PICOZIP_EIO; });
+        if ((impl = PICOZIP__CRC_IMPL()))
+            return impl;
+#if defined(PICOZIP__CRC_CLMUL)
+        impl = picozip__crc_has_hw() ? picozip__crc32_clmul : picozip__crc32_slice8;
+#elif defined(PICOZIP__CRC_ARMV8)
+        impl = picozip__crc_has_hw() ? picozip__crc32_armv8 : picozip__crc32_slice8;
+#else
+        impl = picozip__crc32_slice8;
+#endif
+        PICOZIP__CRC_SET_IMPL(impl);
+        return impl;
+    }
 
-        return PICOZIP_OK;
+    static uint32_t picozip__crc32(const uint8_t *ptr, size_t buf_len, uint32_t crc)
+    {
+        return ~picozip__crc_init()(NULL, ptr, buf_len, ~crc);
     }
 
-    int picozip_new_entry_mem_ex(picozip_file *file, const char *const path, const uint8_t *data, size_t size, time_t mod_time, const char *const comment, size_t comment_len)
+    /* copies <buf_len> bytes from <ptr> to <dst> while computing the CRC, touching each byte once */
+    static uint32_t picozip__crc32_copy(uint8_t *dst, const uint8_t *ptr, size_t buf_len, uint32_t crc)
     {
-        int err;
-        size_t filename_len;
-        picozip__entry *entry;
+        return ~picozip__crc_init()(dst, ptr, buf_len, ~crc);
+    }
 
-        if (!file || !path || (size && !data) || (comment_len && !comment))
-            return PICOZIP_EINVAL;
+#ifndef PICOZIP_NO_DEFLATE
+/* DEFLATE parameters */
+#define PICOZIP__DEFLATE_WSIZE 32768
+#define PICOZIP__DEFLATE_WMASK (PICOZIP__DEFLATE_WSIZE - 1)
+#define PICOZIP__DEFLATE_HASH_BITS 15
+#define PICOZIP__DEFLATE_HASH_SIZE (1 << PICOZIP__DEFLATE_HASH_BITS)
+#define PICOZIP__DEFLATE_MIN_MATCH 3
+#define PICOZIP__DEFLATE_MAX_MATCH 258
+#define PICOZIP__DEFLATE_LOOKAHEAD (PICOZIP__DEFLATE_MAX_MATCH + PICOZIP__DEFLATE_MIN_MATCH + 1)
+#define PICOZIP__DEFLATE_MAX_DIST (PICOZIP__DEFLATE_WSIZE - PICOZIP__DEFLATE_LOOKAHEAD)
+#define PICOZIP__DEFLATE_SYMS 16384
+#define PICOZIP__DEFLATE_OUT 16384
+#define PICOZIP__DEFLATE_STORED_MAX 65535
+#define PICOZIP__DEFLATE_DEFAULT_LEVEL 6
 
-        filename_len = strlen(path);
-        entry = picozip__alloc_entry(file, filename_len + comment_len + PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE);
-        if (!entry)
-            return PICOZIP_ENOMEM;
+/* alphabet sizes */
+#define PICOZIP__HUFF_LITS 288
+#define PICOZIP__HUFF_USED_LITS 286
+#define PICOZIP__HUFF_DISTS 30
+#define PICOZIP__HUFF_CODELENS 19
+#define PICOZIP__HUFF_MAX_BITS 15
+#define PICOZIP__HUFF_MAX_CODELEN_BITS 7
+#define PICOZIP__HUFF_EOB 256
 
-        /* populate the entry */
-        entry->version_made = 0;
-        entry->version_extract = PICOZIP__MIN_VERSION;
-        entry->flags = entry->comp_method = 0;
-        entry->internal_attr = entry->external_attr = 0;
-        entry->header_offset = file->offset;
-        entry->mod_time = mod_time;
-        entry->comp_size = entry->uncomp_size = size;
-        entry->filename_len = filename_len;
-        entry->extra_field_len = PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE;
-        entry->comment_len = comment_len;
-        /* calculate the CRC */
-        entry->crc32 = picozip__crc32(data, size, PICOZIP__CRC_START);
-        /* write the filename */
-        memcpy(entry->metadata, path, filename_len);
-        /* write the timestamp field */
-        PICOZIP__WRITE_LE16(entry->metadata, filename_len, PICOZIP__TIMESTAMP_MAGIC);
-        PICOZIP__WRITE_LE16(entry->metadata, filename_len + 2, PICOZIP__LOCAL_TIMESTAMP_SIZE);
-        entry->metadata[filename_len + 4] = 1; /* modtime flag set */
-        PICOZIP__WRITE_LE32(entry->metadata, filename_len + 5, ((uint32_t)entry->mod_time));
-        /* write the comment */
-        memcpy(entry->metadata + filename_len + PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE, comment, comment_len);
+    static const uint16_t picozip__len_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t picozip__len_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t picozip__dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const uint8_t picozip__dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    static const uint8_t picozip__codelen_order[PICOZIP__HUFF_CODELENS] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 
-        /* write the header to the output */
-        if ((err = picozip__write_local_entry(file, entry)) != PICOZIP_OK)
-        {
-            picozip__free_last_entry(file);
-            return err;
-        }
+    /* lookup tables generated by picozip__deflate_init */
+    static uint8_t picozip__len_code[PICOZIP__DEFLATE_MAX_MATCH + 1];
+    static uint8_t picozip__dist_code[512];
+    static uint8_t picozip__fixed_lit_lens[PICOZIP__HUFF_LITS], picozip__fixed_dist_lens[PICOZIP__HUFF_DISTS];
+    static uint16_t picozip__fixed_lit_codes[PICOZIP__HUFF_LITS], picozip__fixed_dist_codes[PICOZIP__HUFF_DISTS];
+    static int picozip__deflate_ready = 0;
 
-        /* write file content */
-        PICOZIP__FLUSH(file, data, size, {
+/* distance (1-32768) to distance code */
+#define PICOZIP__DIST_CODE(D) ((D) <= 256 ? picozip__dist_code[(D) - 1] : picozip__dist_code[256 + (((D) - 1) >> 7)])
+
+    /** A symbol while building Huffman codes, <key> is its frequency and later its code length. */
+    typedef struct picozip__huff_sym
+    {
+        uint32_t key;
+        uint16_t sym;
+    } picozip__huff_sym;
+
+    /** State of the DEFLATE compressor. */
+    typedef struct picozip__deflate
+    {
+        picozip_free_callback free_cb;
+        void *alloc_userdata;
+        picozip_write_callback write_cb; /* set by every call to picozip__deflate_compress */
+        void *write_userdata;
+        int level, lazy, err;
+        size_t max_chain, nice;
+        size_t pos, lookahead, block_start, ins; /* positions in the window */
+        size_t num_syms;
+        uint32_t bits;
+        size_t num_bits, out_used;
+        uint32_t head[PICOZIP__DEFLATE_HASH_SIZE]; /* position + 1 of the latest 3-byte string, 0 if none */
+        uint32_t prev[PICOZIP__DEFLATE_WSIZE];     /* previous position + 1 with the same hash */
+        uint16_t sym_len[PICOZIP__DEFLATE_SYMS];   /* literal or match length */
+        uint16_t sym_dist[PICOZIP__DEFLATE_SYMS];  /* 0 for literals */
+        uint8_t window[2 * PICOZIP__DEFLATE_WSIZE];
+        uint8_t out[PICOZIP__DEFLATE_OUT];
+    } picozip__deflate;
+
+    /* assigns canonical codes to <lens>, bit-reversed as DEFLATE writes them LSB first */
+    static void picozip__huff_codes(const uint8_t *lens, size_t n, uint16_t *codes)
+    {
+        uint16_t count[PICOZIP__HUFF_MAX_BITS + 1], next[PICOZIP__HUFF_MAX_BITS + 1];
+        uint16_t code, rev;
+        size_t i, j;
+
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < n; i++)
+            count[lens[i]]++;
+        count[0] = 0;
+        for (code = 0, i = 1; i <= PICOZIP__HUFF_MAX_BITS; i++)
+        {
+            code = (uint16_t)((code + count[i - 1]) << 1);
+            next[i] = code;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (!lens[i])
+                continue;
+            code = next[lens[i]]++;
+            for (rev = 0, j = 0; j < lens[i]; j++, code >>= 1)
+                rev = (uint16_t)((rev << 1) | (code & 1));
+            codes[i] = rev;
+        }
+    }
+
+    static int picozip__huff_compare(const void *a, const void *b)
+    {
+        const picozip__huff_sym *x = (const picozip__huff_sym *)a, *y = (const picozip__huff_sym *)b;
+        if (x->key != y->key)
+            return x->key < y->key ? -1 : 1;
+        return x->sym < y->sym ? -1 : 1;
+    }
+
+    /* computes code lengths no longer than <max_bits> for <n> symbols */
+    static void picozip__huff_lengths(const uint32_t *freq, size_t n, size_t max_bits, uint8_t *lens)
+    {
+        picozip__huff_sym syms[PICOZIP__HUFF_LITS];
+        size_t count[33], used, i, l;
+        long root, leaf, next, avbl, nodes, depth;
+        uint32_t total;
+
+        memset(lens, 0, n);
+        for (used = i = 0; i < n; i++)
+        {
+            if (freq[i])
+            {
+                syms[used].key = freq[i];
+                syms[used++].sym = (uint16_t)i;
+            }
+        }
+        /* decoders want at least two codes, even if only one is used */
+        for (i = 0; used < 2 && i < n; i++)
+        {
+            if (!freq[i])
+            {
+                syms[used].key = 1;
+                syms[used++].sym = (uint16_t)i;
+            }
+        }
+        qsort(syms, used, sizeof(picozip__huff_sym), picozip__huff_compare);
+
+        /* in-place minimum redundancy code lengths (Moffat & Katajainen) */
+        syms[0].key += syms[1].key;
+        root = 0;
+        leaf = 2;
+        for (next = 1; next < (long)used - 1; next++)
+        {
+            if (leaf >= (long)used || syms[root].key < syms[leaf].key)
+            {
+                syms[next].key = syms[root].key;
+                syms[root++].key = (uint32_t)next;
+            }
+            else
+            {
+                syms[next].key = syms[leaf++].key;
+            }
+            if (leaf >= (long)used || (root < next && syms[root].key < syms[leaf].key))
+            {
+                syms[next].key += syms[root].key;
+                syms[root++].key = (uint32_t)next;
+            }
+            else
+            {
+                syms[next].key += syms[leaf++].key;
+            }
+        }
+        syms[used - 2].key = 0;
+        for (next = (long)used - 3; next >= 0; next--)
+            syms[next].key = syms[syms[next].key].key + 1;
+        avbl = 1;
+        nodes = depth = 0;
+        root = (long)used - 2;
+        next = (long)used - 1;
+        while (avbl > 0)
+        {
+            while (root >= 0 && (long)syms[root].key == depth)
+            {
+                nodes++;
+                root--;
+            }
+            while (avbl > nodes)
+            {
+                syms[next--].key = (uint32_t)depth;
+                avbl--;
+            }
+            avbl = 2 * nodes;
+            depth++;
+            nodes = 0;
+        }
+
+        /* limit the code lengths, keeping the code complete */
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < used; i++)
+            count[syms[i].key > 32 ? 32 : syms[i].key]++;
+        for (i = max_bits + 1; i <= 32; i++)
+        {
+            count[max_bits] += count[i];
+            count[i] = 0;
+        }
+        for (total = 0, i = max_bits; i > 0; i--)
+            total += (uint32_t)count[i] << (max_bits - i);
+        while (total != ((uint32_t)1 << max_bits))
+        {
+            count[max_bits]--;
+            for (i = max_bits - 1; i > 0; i--)
+            {
+                if (count[i])
+                {
+                    count[i]--;
+                    count[i + 1] += 2;
+                    break;
+                }
+            }
+            total--;
+        }
+
+        /* the most frequent symbols get the shortest codes */
+        for (i = 1, next = (long)used; i <= max_bits; i++)
+        {
+            for (l = count[i]; l > 0; l--)
+                lens[syms[--next].sym] = (uint8_t)i;
+        }
+    }
+
+    /* generates the lookup tables and the fixed Huffman codes */
+    static void picozip__deflate_init(void)
+    {
+        size_t i, j;
+
+        if (picozip__deflate_ready)
+            return;
+
+        for (i = 0; i < 29; i++)
+        {
+            for (j = picozip__len_base[i]; j < (size_t)picozip__len_base[i] + (1u << picozip__len_extra[i]) && j <= PICOZIP__DEFLATE_MAX_MATCH; j++)
+                picozip__len_code[j] = (uint8_t)i;
+        }
+        picozip__len_code[PICOZIP__DEFLATE_MAX_MATCH] = 28;
+        for (i = 0; i < 30; i++)
+        {
+            for (j = picozip__dist_base[i]; j < (size_t)picozip__dist_base[i] + (1u << picozip__dist_extra[i]); j++)
+            {
+                if (j <= 256)
+                    picozip__dist_code[j - 1] = (uint8_t)i;
+                else
+                    picozip__dist_code[256 + ((j - 1) >> 7)] = (uint8_t)i;
+            }
+        }
+
+        for (i = 0; i < PICOZIP__HUFF_LITS; i++)
+            picozip__fixed_lit_lens[i] = (uint8_t)(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+        for (i = 0; i < PICOZIP__HUFF_DISTS; i++)
+            picozip__fixed_dist_lens[i] = 5;
+        picozip__huff_codes(picozip__fixed_lit_lens, PICOZIP__HUFF_LITS, picozip__fixed_lit_codes);
+        picozip__huff_codes(picozip__fixed_dist_lens, PICOZIP__HUFF_DISTS, picozip__fixed_dist_codes);
+        picozip__deflate_ready = 1;
+    }
+
+    static void picozip__deflate_flush_out(picozip__deflate *s)
+    {
+        if (s->out_used && !s->err && s->write_cb(s->write_userdata, s->out, s->out_used) != s->out_used)
+            s->err = PICOZIP_EIO;
+        s->out_used = 0;
+    }
+
+    /* writes the lowest <n> (up to 16) bits of <value> */
+    static void picozip__deflate_bits(picozip__deflate *s, uint32_t value, size_t n)
+    {
+        s->bits |= value << s->num_bits;
+        s->num_bits += n;
+        while (s->num_bits >= 8)
+        {
+            s->out[s->out_used++] = (uint8_t)s->bits;
+            s->bits >>= 8;
+            s->num_bits -= 8;
+        }
+        if (s->out_used >= PICOZIP__DEFLATE_OUT - 4)
+            picozip__deflate_flush_out(s);
+    }
+
+    /* pads the output to a byte boundary */
+    static void picozip__deflate_align(picozip__deflate *s)
+    {
+        if (s->num_bits)
+            picozip__deflate_bits(s, 0, 8 - s->num_bits);
+    }
+
+    /* counts the bits of the symbols in the block with the given code lengths */
+    static size_t picozip__deflate_cost(const uint32_t *lit_freq, const uint32_t *dist_freq, const uint8_t *lit_lens, const uint8_t *dist_lens)
+    {
+        size_t i, bits;
+
+        for (bits = 0, i = 0; i < PICOZIP__HUFF_USED_LITS; i++)
+            bits += lit_freq[i] * (lit_lens[i] + (i > PICOZIP__HUFF_EOB ? picozip__len_extra[i - 257] : 0));
+        for (i = 0; i < PICOZIP__HUFF_DISTS; i++)
+            bits += dist_freq[i] * (dist_lens[i] + picozip__dist_extra[i]);
+        return bits;
+    }
+
+    static void picozip__deflate_emit(picozip__deflate *s, const uint8_t *lit_lens, const uint16_t *lit_codes, const uint8_t *dist_lens, const uint16_t *dist_codes)
+    {
+        size_t i, lc, dc, len, dist;
+
+        for (i = 0; i < s->num_syms; i++)
+        {
+            len = s->sym_len[i];
+            dist = s->sym_dist[i];
+            if (!dist)
+            {
+                picozip__deflate_bits(s, lit_codes[len], lit_lens[len]);
+                continue;
+            }
+            lc = picozip__len_code[len];
+            picozip__deflate_bits(s, lit_codes[257 + lc], lit_lens[257 + lc]);
+            if (picozip__len_extra[lc])
+                picozip__deflate_bits(s, (uint32_t)(len - picozip__len_base[lc]), picozip__len_extra[lc]);
+            dc = PICOZIP__DIST_CODE(dist);
+            picozip__deflate_bits(s, dist_codes[dc], dist_lens[dc]);
+            if (picozip__dist_extra[dc])
+                picozip__deflate_bits(s, (uint32_t)(dist - picozip__dist_base[dc]), picozip__dist_extra[dc]);
+        }
+        picozip__deflate_bits(s, lit_codes[PICOZIP__HUFF_EOB], lit_lens[PICOZIP__HUFF_EOB]);
+    }
+
+    /* writes the input from block_start to pos as stored blocks */
+    static void picozip__deflate_stored(picozip__deflate *s, int final)
+    {
+        size_t start, len;
+
+        start = s->block_start;
+        do
+        {
+            len = s->pos - start > PICOZIP__DEFLATE_STORED_MAX ? PICOZIP__DEFLATE_STORED_MAX : s->pos - start;
+            picozip__deflate_bits(s, final && start + len == s->pos, 1);
+            picozip__deflate_bits(s, 0, 2);
+            picozip__deflate_align(s);
+            picozip__deflate_bits(s, (uint32_t)len, 16);
+            picozip__deflate_bits(s, (uint32_t)(~len & 0xFFFF), 16);
+            picozip__deflate_flush_out(s);
+            if (len && !s->err && s->write_cb(s->write_userdata, s->window + start, len) != len)
+                s->err = PICOZIP_EIO;
+            start += len;
+        } while (start < s->pos);
+    }
+
+    /* writes the pending symbols as a block with whichever encoding is the smallest */
+    static void picozip__deflate_block(picozip__deflate *s, int final)
+    {
+        uint32_t lit_freq[PICOZIP__HUFF_LITS], dist_freq[PICOZIP__HUFF_DISTS], cl_freq[PICOZIP__HUFF_CODELENS];
+        uint8_t lit_lens[PICOZIP__HUFF_LITS], dist_lens[PICOZIP__HUFF_DISTS], cl_lens[PICOZIP__HUFF_CODELENS];
+        uint16_t lit_codes[PICOZIP__HUFF_LITS], dist_codes[PICOZIP__HUFF_DISTS], cl_codes[PICOZIP__HUFF_CODELENS];
+        uint8_t lens[PICOZIP__HUFF_USED_LITS + PICOZIP__HUFF_DISTS], rle[PICOZIP__HUFF_USED_LITS + PICOZIP__HUFF_DISTS], rle_extra[PICOZIP__HUFF_USED_LITS + PICOZIP__HUFF_DISTS];
+        size_t i, j, run, n_lens, n_rle, hlit, hdist, hclen, dyn_bits, fixed_bits, stored_bits;
+
+        if (s->level == 0)
+        {
+            picozip__deflate_stored(s, final);
+            goto done;
+        }
+
+        memset(lit_freq, 0, sizeof(lit_freq));
+        memset(dist_freq, 0, sizeof(dist_freq));
+        memset(cl_freq, 0, sizeof(cl_freq));
+        for (i = 0; i < s->num_syms; i++)
+        {
+            if (!s->sym_dist[i])
+            {
+                lit_freq[s->sym_len[i]]++;
+            }
+            else
+            {
+                lit_freq[257 + picozip__len_code[s->sym_len[i]]]++;
+                dist_freq[PICOZIP__DIST_CODE(s->sym_dist[i])]++;
+            }
+        }
+        lit_freq[PICOZIP__HUFF_EOB] = 1;
+        picozip__huff_lengths(lit_freq, PICOZIP__HUFF_USED_LITS, PICOZIP__HUFF_MAX_BITS, lit_lens);
+        picozip__huff_lengths(dist_freq, PICOZIP__HUFF_DISTS, PICOZIP__HUFF_MAX_BITS, dist_lens);
+        lit_lens[286] = lit_lens[287] = 0;
+
+        for (hlit = PICOZIP__HUFF_USED_LITS; hlit > 257 && !lit_lens[hlit - 1]; hlit--)
+            ;
+        for (hdist = PICOZIP__HUFF_DISTS; hdist > 1 && !dist_lens[hdist - 1]; hdist--)
+            ;
+        memcpy(lens, lit_lens, hlit);
+        memcpy(lens + hlit, dist_lens, hdist);
+        n_lens = hlit + hdist;
+
+        /* run-length encode the code lengths */
+        for (n_rle = i = 0; i < n_lens; i += run)
+        {
+            for (run = 1; i + run < n_lens && lens[i + run] == lens[i]; run++)
+                ;
+            if (!lens[i] && run >= 3)
+            {
+                run = run > 138 ? 138 : run;
+                rle[n_rle] = (uint8_t)(run >= 11 ? 18 : 17);
+                rle_extra[n_rle++] = (uint8_t)(run - (run >= 11 ? 11 : 3));
+            }
+            else if (lens[i] && run >= 4)
+            {
+                run = run > 7 ? 7 : run;
+                rle[n_rle] = lens[i];
+                rle_extra[n_rle++] = 0;
+                rle[n_rle] = 16;
+                rle_extra[n_rle++] = (uint8_t)(run - 4);
+            }
+            else
+            {
+                run = 1;
+                rle[n_rle] = lens[i];
+                rle_extra[n_rle++] = 0;
+            }
+        }
+        for (i = 0; i < n_rle; i++)
+            cl_freq[rle[i]]++;
+        picozip__huff_lengths(cl_freq, PICOZIP__HUFF_CODELENS, PICOZIP__HUFF_MAX_CODELEN_BITS, cl_lens);
+        for (hclen = PICOZIP__HUFF_CODELENS; hclen > 4 && !cl_lens[picozip__codelen_order[hclen - 1]]; hclen--)
+            ;
+
+        /* pick the smallest encoding */
+        dyn_bits = 3 + 5 + 5 + 4 + 3 * hclen + picozip__deflate_cost(lit_freq, dist_freq, lit_lens, dist_lens);
+        for (i = 0; i < n_rle; i++)
+            dyn_bits += cl_lens[rle[i]] + (rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : rle[i] == 18 ? 7 : 0);
+        fixed_bits = 3 + picozip__deflate_cost(lit_freq, dist_freq, picozip__fixed_lit_lens, picozip__fixed_dist_lens);
+        stored_bits = ((s->pos - s->block_start) / PICOZIP__DEFLATE_STORED_MAX + 1) * (3 + 7 + 32) + 8 * (s->pos - s->block_start);
+
+        if (stored_bits <= dyn_bits && stored_bits <= fixed_bits)
+        {
+            picozip__deflate_stored(s, final);
+        }
+        else if (fixed_bits <= dyn_bits)
+        {
+            picozip__deflate_bits(s, final ? 1 : 0, 1);
+            picozip__deflate_bits(s, 1, 2);
+            picozip__deflate_emit(s, picozip__fixed_lit_lens, picozip__fixed_lit_codes, picozip__fixed_dist_lens, picozip__fixed_dist_codes);
+        }
+        else
+        {
+            picozip__huff_codes(lit_lens, PICOZIP__HUFF_LITS, lit_codes);
+            picozip__huff_codes(dist_lens, PICOZIP__HUFF_DISTS, dist_codes);
+            picozip__huff_codes(cl_lens, PICOZIP__HUFF_CODELENS, cl_codes);
+            picozip__deflate_bits(s, final ? 1 : 0, 1);
+            picozip__deflate_bits(s, 2, 2);
+            picozip__deflate_bits(s, (uint32_t)(hlit - 257), 5);
+            picozip__deflate_bits(s, (uint32_t)(hdist - 1), 5);
+            picozip__deflate_bits(s, (uint32_t)(hclen - 4), 4);
+            for (i = 0; i < hclen; i++)
+                picozip__deflate_bits(s, cl_lens[picozip__codelen_order[i]], 3);
+            for (i = 0; i < n_rle; i++)
+            {
+                j = rle[i];
+                picozip__deflate_bits(s, cl_codes[j], cl_lens[j]);
+                if (j >= 16)
+                    picozip__deflate_bits(s, rle_extra[i], j == 16 ? 2 : j == 17 ? 3 : 7);
+            }
+            picozip__deflate_emit(s, lit_lens, lit_codes, dist_lens, dist_codes);
+        }
+
+    done:
+        s->num_syms = 0;
+        s->block_start = s->pos;
+    }
+
+    /* inserts the string at <p> in the hash chains, returning the previous string with the same hash */
+    static uint32_t picozip__deflate_insert(picozip__deflate *s, size_t p)
+    {
+        uint32_t h, prev;
+
+        h = (((uint32_t)s->window[p] << 10) ^ ((uint32_t)s->window[p + 1] << 5) ^ s->window[p + 2]) & (PICOZIP__DEFLATE_HASH_SIZE - 1);
+        prev = s->head[h];
+        s->prev[p & PICOZIP__DEFLATE_WMASK] = prev;
+        s->head[h] = (uint32_t)(p + 1);
+        return prev;
+    }
+
+    /* finds the longest match for the string at <p> in the chain starting at <cand> */
+    static size_t picozip__deflate_match(picozip__deflate *s, size_t p, size_t avail, uint32_t cand, size_t *odist)
+    {
+        const uint8_t *cur, *ref;
+        size_t best, len, max_len, chain, limit, c;
+
+        best = PICOZIP__DEFLATE_MIN_MATCH - 1;
+        max_len = avail > PICOZIP__DEFLATE_MAX_MATCH ? PICOZIP__DEFLATE_MAX_MATCH : avail;
+        limit = p > PICOZIP__DEFLATE_MAX_DIST ? p - PICOZIP__DEFLATE_MAX_DIST : 0;
+        cur = s->window + p;
+        for (chain = s->max_chain; cand && chain; chain--)
+        {
+            c = cand - 1;
+            if (c < limit)
+                break;
+            ref = s->window + c;
+            if (ref[best] == cur[best] && ref[0] == cur[0] && ref[1] == cur[1])
+            {
+                for (len = 2; len < max_len && ref[len] == cur[len]; len++)
+                    ;
+                if (len > best)
+                {
+                    best = len;
+                    *odist = p - c;
+                    if (len >= s->nice || len == max_len)
+                        break;
+                }
+            }
+            if (s->prev[c & PICOZIP__DEFLATE_WMASK] >= cand)
+                break;
+            cand = s->prev[c & PICOZIP__DEFLATE_WMASK];
+        }
+        return best >= PICOZIP__DEFLATE_MIN_MATCH ? best : 0;
+    }
+
+#define PICOZIP__DEFLATE_TALLY(S, LEN, DIST)            \
+    do                                                  \
+    {                                                   \
+        (S)->sym_len[(S)->num_syms] = (uint16_t)(LEN);  \
+        (S)->sym_dist[(S)->num_syms] = (uint16_t)(DIST); \
+        (S)->num_syms++;                                \
+    } while (0)
+
+    /* compresses the window until less than a match of lookahead is left (or all of it) */
+    static void picozip__deflate_run(picozip__deflate *s, int finishing)
+    {
+        size_t min_lookahead, len, len2, dist, dist2;
+        uint32_t cand;
+
+        min_lookahead = finishing ? 1 : PICOZIP__DEFLATE_LOOKAHEAD;
+        if (s->level == 0)
+        {
+            if (s->lookahead >= min_lookahead)
+            {
+                s->pos += s->lookahead;
+                s->lookahead = 0;
+            }
+            return;
+        }
+
+        while (s->lookahead >= min_lookahead)
+        {
+            len = dist = 0;
+            if (s->lookahead >= PICOZIP__DEFLATE_MIN_MATCH)
+            {
+                /* catch up with the strings skipped by the last match */
+                for (; s->ins < s->pos; s->ins++)
+                    picozip__deflate_insert(s, s->ins);
+                cand = picozip__deflate_insert(s, s->pos);
+                s->ins = s->pos + 1;
+                len = picozip__deflate_match(s, s->pos, s->lookahead, cand, &dist);
+
+                /* lazy matching: prefer a longer match at the next byte */
+                if (s->lazy && len && len < s->nice && s->lookahead > PICOZIP__DEFLATE_MIN_MATCH)
+                {
+                    cand = picozip__deflate_insert(s, s->pos + 1);
+                    s->ins = s->pos + 2;
+                    if ((len2 = picozip__deflate_match(s, s->pos + 1, s->lookahead - 1, cand, &dist2)) > len)
+                    {
+                        PICOZIP__DEFLATE_TALLY(s, s->window[s->pos], 0);
+                        s->pos++;
+                        s->lookahead--;
+                        len = len2;
+                        dist = dist2;
+                        if (s->num_syms == PICOZIP__DEFLATE_SYMS)
+                            picozip__deflate_block(s, 0);
+                    }
+                }
+            }
+
+            if (len)
+            {
+                PICOZIP__DEFLATE_TALLY(s, len, dist);
+                /* fast levels don't index the middle of long matches */
+                if (!s->lazy && len > s->nice)
+                    s->ins = s->pos + len;
+                s->pos += len;
+                s->lookahead -= len;
+            }
+            else
+            {
+                PICOZIP__DEFLATE_TALLY(s, s->window[s->pos], 0);
+                s->pos++;
+                s->lookahead--;
+            }
+            if (s->num_syms == PICOZIP__DEFLATE_SYMS)
+                picozip__deflate_block(s, 0);
+        }
+    }
+
+    /* ends the current block and moves the upper half of the window down */
+    static void picozip__deflate_slide(picozip__deflate *s)
+    {
+        size_t i;
+
+        if (s->num_syms || s->pos > s->block_start)
+            picozip__deflate_block(s, 0);
+        memcpy(s->window, s->window + PICOZIP__DEFLATE_WSIZE, PICOZIP__DEFLATE_WSIZE);
+        s->pos -= PICOZIP__DEFLATE_WSIZE;
+        s->block_start = s->pos;
+        s->ins = s->ins > PICOZIP__DEFLATE_WSIZE ? s->ins - PICOZIP__DEFLATE_WSIZE : 0;
+        for (i = 0; i < PICOZIP__DEFLATE_HASH_SIZE; i++)
+            s->head[i] = s->head[i] > PICOZIP__DEFLATE_WSIZE ? s->head[i] - PICOZIP__DEFLATE_WSIZE : 0;
+        for (i = 0; i < PICOZIP__DEFLATE_WSIZE; i++)
+            s->prev[i] = s->prev[i] > PICOZIP__DEFLATE_WSIZE ? s->prev[i] - PICOZIP__DEFLATE_WSIZE : 0;
+    }
+
+    static void *picozip__deflate_begin(void *userdata, int level, picozip_alloc_callback alloc_cb, picozip_free_callback free_cb, void *alloc_userdata)
+    {
+        /* chain length, nice length and lazy matching for each level */
+        static const uint16_t params[10][3] = {{0, 0, 0}, {4, 8, 0}, {8, 16, 0}, {16, 32, 0}, {16, 32, 1}, {32, 64, 1}, {128, 128, 1}, {256, 128, 1}, {1024, 258, 1}, {4096, 258, 1}};
+        picozip__deflate *s;
+
+        (void)userdata;
+        if (level < 0)
+            level = PICOZIP__DEFLATE_DEFAULT_LEVEL;
+        if (level > 9)
+            level = 9;
+        if (!(s = (picozip__deflate *)alloc_cb(alloc_userdata, sizeof(picozip__deflate))))
+            return NULL;
+
+        picozip__deflate_init();
+        memset(s->head, 0, sizeof(s->head));
+        memset(s->prev, 0, sizeof(s->prev));
+        s->free_cb = free_cb;
+        s->alloc_userdata = alloc_userdata;
+        s->level = level;
+        s->max_chain = params[level][0];
+        s->nice = params[level][1];
+        s->lazy = params[level][2];
+        s->err = PICOZIP_OK;
+        s->pos = s->lookahead = s->block_start = s->ins = 0;
+        s->num_syms = s->num_bits = s->out_used = 0;
+        s->bits = 0;
+        return s;
+    }
+
+    static int picozip__deflate_compress(void *state, const uint8_t *data, size_t size, int flush, picozip_write_callback write_cb, void *write_userdata)
+    {
+        picozip__deflate *s;
+        size_t n;
+
+        s = (picozip__deflate *)state;
+        s->write_cb = write_cb;
+        s->write_userdata = write_userdata;
+        do
+        {
+            /* fill the window */
+            n = 2 * PICOZIP__DEFLATE_WSIZE - (s->pos + s->lookahead);
+            n = n > size ? size : n;
+            if (n)
+                memcpy(s->window + s->pos + s->lookahead, data, n);
+            data += n;
+            size -= n;
+            s->lookahead += n;
+
+            picozip__deflate_run(s, !size && flush != PICOZIP_FLUSH_NONE);
+            if (s->pos + s->lookahead == 2 * PICOZIP__DEFLATE_WSIZE)
+                picozip__deflate_slide(s);
+        } while (size && !s->err);
+
+        if (flush != PICOZIP_FLUSH_NONE)
+        {
+            picozip__deflate_block(s, flush == PICOZIP_FLUSH_FINISH);
+            if (flush == PICOZIP_FLUSH_SYNC)
+            {
+                /* an empty stored block aligns the output to a byte boundary */
+                picozip__deflate_bits(s, 0, 3);
+                picozip__deflate_align(s);
+                picozip__deflate_bits(s, 0, 16);
+                picozip__deflate_bits(s, 0xFFFF, 16);
+            }
+            picozip__deflate_align(s);
+            picozip__deflate_flush_out(s);
+        }
+        return s->err;
+    }
+
+    static void picozip__deflate_end(void *state)
+    {
+        picozip__deflate *s = (picozip__deflate *)state;
+        s->free_cb(s->alloc_userdata, s);
+    }
+
+    static const picozip_codec picozip__deflate_codec = {
+        PICOZIP_METHOD_DEFLATE,
+        PICOZIP__MIN_VERSION,
+        NULL,
+        picozip__deflate_begin,
+        picozip__deflate_compress,
+        picozip__deflate_end,
+        1,
+    };
+
+    const picozip_codec *picozip_codec_deflate(void)
+    {
+        return &picozip__deflate_codec;
+    }
+#endif /* ifndef PICOZIP_NO_DEFLATE */
+
+#ifdef PICOZIP_THREADS
+#if defined(_WIN32)
+#include <windows.h>
+
+    typedef CRITICAL_SECTION picozip__mutex;
+    typedef CONDITION_VARIABLE picozip__cond;
+    typedef HANDLE picozip__thread;
+#define PICOZIP__THREAD_RETURN DWORD WINAPI
+#define picozip__mutex_init(M) InitializeCriticalSection(M)
+#define picozip__mutex_destroy(M) DeleteCriticalSection(M)
+#define picozip__mutex_lock(M) EnterCriticalSection(M)
+#define picozip__mutex_unlock(M) LeaveCriticalSection(M)
+#define picozip__cond_init(C) InitializeConditionVariable(C)
+#define picozip__cond_destroy(C) ((void)(C))
+#define picozip__cond_wait(C, M) SleepConditionVariableCS(C, M, INFINITE)
+#define picozip__cond_signal(C) WakeConditionVariable(C)
+#define picozip__cond_broadcast(C) WakeAllConditionVariable(C)
+#define picozip__thread_create(T, F, A) ((*(T) = CreateThread(NULL, 0, F, A, 0, NULL)) ? 0 : -1)
+#define picozip__thread_join(T) (WaitForSingleObject(T, INFINITE), CloseHandle(T))
+
+#else
+#include <pthread.h>
+
+    typedef pthread_mutex_t picozip__mutex;
+    typedef pthread_cond_t picozip__cond;
+    typedef pthread_t picozip__thread;
+#define PICOZIP__THREAD_RETURN void *
+#define picozip__mutex_init(M) pthread_mutex_init(M, NULL)
+#define picozip__mutex_destroy(M) pthread_mutex_destroy(M)
+#define picozip__mutex_lock(M) pthread_mutex_lock(M)
+#define picozip__mutex_unlock(M) pthread_mutex_unlock(M)
+#define picozip__cond_init(C) pthread_cond_init(C, NULL)
+#define picozip__cond_destroy(C) pthread_cond_destroy(C)
+#define picozip__cond_wait(C, M) pthread_cond_wait(C, M)
+#define picozip__cond_signal(C) pthread_cond_signal(C)
+#define picozip__cond_broadcast(C) pthread_cond_broadcast(C)
+#define picozip__thread_create(T, F, A) pthread_create(T, NULL, F, A)
+#define picozip__thread_join(T) pthread_join(T, NULL)
+#endif
+#endif /* ifdef PICOZIP_THREADS */
+
+    /** A dynamic array. */
+    typedef struct picozip__vec
+    {
+        void *data;
+        size_t cap, size;
+    } picozip__vec;
+
+    /** File entry. */
+    typedef struct picozip__entry
+    {
+        uint16_t version_made, version_extract, flags, comp_method, dos_time, dos_date;
+        int zip64_desc; /* the local header has a zero-filled ZIP64 extra field, and the data descriptor 64-bit sizes */
+        uint32_t crc32;
+        time_t mod_time;
+        uint64_t comp_size, uncomp_size;
+        uint16_t filename_len, extra_field_len, comment_len, internal_attr;
+        uint32_t external_attr;
+        uint64_t header_offset;
+        uint8_t metadata[1];
+    } picozip__entry;
+
+    /** A block of memory entries are carved from when the arena is enabled. */
+    typedef struct picozip__slab
+    {
+        struct picozip__slab *next;
+        size_t size, used;
+    } picozip__slab;
+
+/* the slab header, padded so that the entries after it stay aligned */
+#define PICOZIP__SLAB_HEADER_SIZE PICOZIP__ARENA_ROUND(sizeof(picozip__slab))
+#define PICOZIP__SLAB_DATA(SLAB) ((uint8_t *)(SLAB) + PICOZIP__SLAB_HEADER_SIZE)
+
+    /** An entry streamed in nonblocking mode, which stops once the backlog passes its limit and is carried on by picozip_pump. */
+    typedef struct picozip__stream
+    {
+        picozip__entry *entry; /* NULL unless an entry is being streamed */
+        picozip_read_callback read_cb;
+        void *userdata;
+        uint8_t *buf;          /* freed once the entry is done, unless it is the input buffer of the file */
+        size_t buf_size;
+        uint64_t left;         /* most bytes still to read */
+        void *state;           /* codec state, NULL for stored content */
+        uint32_t crc32;        /* CRC of the content read so far, if <checksum> is set */
+        uint32_t given;        /* CRC passed by the caller, used unless <checksum> is set and checked if <verify> is */
+        int checksum, verify;
+        int exact;             /* the content is exactly <left> bytes, given in the local header of stored content */
+        int header;            /* the local header of stored content is still to be written */
+#ifndef PICOZIP_NO_STDIO
+        FILE *fptr;            /* opened by picozip_new_entry_path, and closed once the entry is done */
+#endif
+    } picozip__stream;
+
+    /** The zip file. */
+    struct picozip__file
+    {
+        picozip_alloc_callback alloc_cb;
+        picozip_write_callback write_cb;
+        picozip_free_callback free_cb;
+        picozip_writev_callback writev_cb; /* optional */
+        uint8_t *buf;                      /* optional output buffer */
+        size_t buf_size, buf_used;
+        uint8_t *read_buf;                 /* input buffer, allocated on first use */
+        size_t read_buf_size;
+        int nonblocking;       /* short writes are queued in the backlog */
+        size_t backlog_limit;  /* entries are refused with PICOZIP_EAGAIN past this many queued bytes */
+        picozip__vec backlog;  /* output that the write callbacks didn't take yet */
+        size_t backlog_pos;    /* bytes of the backlog already written */
+        picozip__stream stream; /* entry that stopped at the backlog limit */
+        uint64_t offset;
+        size_t num_entries;   /* entries still being written, or kept whole */
+        picozip__vec entries;
+        picozip__slab *cd_head, *cd_tail; /* central directory records of the entries already written */
+        uint64_t cd_size;
+        size_t num_sealed;    /* number of records in the blocks */
+        uint64_t cd_spilled;  /* bytes of records moved from the blocks to the spill */
+        size_t spill_budget;  /* bytes of records kept in memory before spilling */
+        picozip_write_callback spill_write; /* NULL unless records are spilled */
+        picozip_read_callback spill_read;
+        void *spill_userdata;
+        int spill_err;        /* the spill failed, so the archive can't be finished */
+#ifndef PICOZIP_NO_STDIO
+        FILE *spill_file;     /* temporary file used as the spill by default */
+        int appending;        /* opened by picozip_open_append and not ended yet, so picozip_free_path restores the archive */
+        uint64_t old_cd_size, old_cd_offset; /* the records loaded by picozip_open_append, first in the central directory */
+        size_t old_count;
+        picozip__vec old_comment; /* comment of the archive, written back with its records */
+#endif
+#ifdef PICOZIP_STATS
+        picozip_stats stats;
+        picozip_trace_callback trace_cb; /* optional */
+        void *trace_userdata;
+        size_t num_done; /* entries at the start of <entries> whose data is all written, and traced as such */
+#endif
+#ifdef PICOZIP__URING
+        struct picozip__uring *uring_in; /* reads files for picozip_new_entry_file, allocated on first use */
+        int uring_failed;     /* io_uring isn't available, files are read with stdio */
+#endif
+        int keep_entries;     /* stages and readers need their entries until they're freed */
+        picozip__slab *slabs; /* most recent slab first */
+        size_t slab_size;     /* 0 if the arena is disabled */
+        long utc_offset;      /* seconds east of UTC, or PICOZIP_TZ_LOCAL */
+        time_t memo_time;     /* last converted modification time */
+        uint16_t memo_date, memo_dostime;
+        int memo_valid;
+        const picozip_codec *codec; /* NULL to store entries */
+        int codec_level;
+#ifdef PICOZIP_THREADS
+        struct picozip__pool *pool;                      /* NULL without worker threads */
+        struct picozip__job *pending_head, *pending_tail; /* compressed blocks not written yet, in order */
+        size_t num_pending;
+        int pool_err; /* first error hit by a block written in the background */
+        picozip__mutex lock; /* serializes picozip_commit_stage */
+#endif
+        void *userdata;
+        uint8_t scratch[PICOZIP__SCRATCH_BUFFER_SIZE];
+    };
+
+    typedef struct picozip__mem_file
+    {
+        picozip_file *file;
+        picozip__vec mem;
+        picozip_alloc_callback alloc_cb; /* where this and the buffers of <file> come from */
+        picozip_free_callback free_cb;
+        void *userdata;
+    } picozip__mem_file;
+
+    static size_t picozip__mem_write(void *userdata, const void *mem, size_t len);
+#ifdef PICOZIP__URING
+    struct picozip__uring;
+    static size_t picozip__uring_write(void *userdata, const void *mem, size_t len);
+    static int picozip__uring_flush(struct picozip__uring *ring);
+    static void picozip__uring_free(struct picozip__uring *ring, picozip_free_callback free_cb, void *userdata);
+#endif
+    static int picozip__mem_write_crc(picozip_file *file, picozip__entry *entry, const uint8_t *data, size_t size);
+
+/* whether the output goes to the in-memory backend, which can copy and CRC in one pass */
+#define PICOZIP__IS_MEM(FILE) ((FILE)->write_cb == picozip__mem_write)
+
+    /* grows the capacity of <vec> to exactly <cap> bytes, if it is smaller */
+    static void *picozip__vec_reserve(picozip__vec *vec, size_t cap, picozip_alloc_callback alloc, picozip_free_callback free, void *userdata)
+    {
+        void *new_data;
+
+        if (cap > vec->cap)
+        {
+            new_data = alloc(userdata, cap);
+            if (!new_data)
+                return NULL;
+            if (vec->size)
+                memcpy(new_data, vec->data, vec->size);
+            free(userdata, vec->data);
+            vec->data = new_data;
+            vec->cap = cap;
+        }
+        return vec->data;
+    }
+
+    /* makes room for <size> more bytes, growing the capacity geometrically to keep appends amortized O(1) */
+    static void *picozip__vec_alloc(picozip__vec *vec, size_t size, picozip_alloc_callback alloc, picozip_free_callback free, void *userdata)
+    {
+        size_t new_cap;
+
+        if (vec->size + size < vec->size)
+            return NULL;
+
+        if (vec->size + size > vec->cap)
+        {
+            new_cap = vec->cap < PICOZIP__VEC_MIN_CAP ? PICOZIP__VEC_MIN_CAP : vec->cap;
+            while (new_cap < vec->size + size)
+                new_cap = new_cap > ((size_t)-1) / 2 ? vec->size + size : new_cap * 2;
+            return picozip__vec_reserve(vec, new_cap, alloc, free, userdata);
+        }
+        return vec->data;
+    }
+
+#ifdef PICOZIP_STATS
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+    /* reads a monotonic clock, in nanoseconds */
+    static uint64_t picozip__now(void)
+    {
+#if defined(_WIN32)
+        LARGE_INTEGER count, freq;
+        QueryPerformanceCounter(&count);
+        QueryPerformanceFrequency(&freq);
+        return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#elif defined(PICOZIP__UNIX) && defined(CLOCK_MONOTONIC)
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+        return (uint64_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
+    }
+
+    static void *picozip__alloc(picozip_file *file, size_t size)
+    {
+        file->stats.alloc_calls++;
+        file->stats.alloc_bytes += size;
+        return file->alloc_cb(file->userdata, size);
+    }
+
+    /* allocator passed to vectors and codecs, with the file as its userdata so its allocations are counted */
+    static void *picozip__stats_alloc(void *userdata, size_t size)
+    {
+        return picozip__alloc((picozip_file *)userdata, size);
+    }
+
+    static void picozip__stats_free(void *userdata, void *mem)
+    {
+        picozip_file *file = (picozip_file *)userdata;
+        file->free_cb(file->userdata, mem);
+    }
+
+    static size_t picozip__write_cb(picozip_file *file, const void *mem, size_t size)
+    {
+        uint64_t start;
+        size_t n;
+
+        start = picozip__now();
+        n = file->write_cb(file->userdata, mem, size);
+        file->stats.write_ns += picozip__now() - start;
+        file->stats.write_calls++;
+        if (n != PICOZIP_WRITE_ERROR)
+            file->stats.bytes_written += n;
+        return n;
+    }
+
+    static size_t picozip__writev_cb(picozip_file *file, const picozip_iovec *iov, size_t iovcnt)
+    {
+        uint64_t start;
+        size_t n;
+
+        start = picozip__now();
+        n = file->writev_cb(file->userdata, iov, iovcnt);
+        file->stats.write_ns += picozip__now() - start;
+        file->stats.write_calls++;
+        if (n != PICOZIP_WRITE_ERROR)
+            file->stats.bytes_written += n;
+        return n;
+    }
+
+    static uint32_t picozip__file_crc32(picozip_file *file, const uint8_t *ptr, size_t buf_len, uint32_t crc)
+    {
+        uint64_t start;
+
+        start = picozip__now();
+        crc = picozip__crc32(ptr, buf_len, crc);
+        file->stats.crc_ns += picozip__now() - start;
+        return crc;
+    }
+
+    static uint32_t picozip__file_crc32_copy(picozip_file *file, uint8_t *dst, const uint8_t *ptr, size_t buf_len, uint32_t crc)
+    {
+        uint64_t start;
+
+        start = picozip__now();
+        crc = picozip__crc32_copy(dst, ptr, buf_len, crc);
+        file->stats.crc_ns += picozip__now() - start;
+        return crc;
+    }
+
+#define PICOZIP__ALLOCATOR(FILE) picozip__stats_alloc, picozip__stats_free, (void *)(FILE)
+#define PICOZIP__STAT_ADD(FILE, FIELD, N) ((FILE)->stats.FIELD += (N))
+#define PICOZIP__TRACE(FILE, EVENT, ENTRY) \
+    ((FILE)->trace_cb ? (FILE)->trace_cb((FILE)->trace_userdata, EVENT, (const char *)(ENTRY)->metadata, (ENTRY)->filename_len) : (void)0)
+#else
+/* without PICOZIP_STATS, the callbacks are called directly and nothing is counted */
+#define picozip__alloc(FILE, SIZE) (FILE)->alloc_cb((FILE)->userdata, SIZE)
+#define picozip__write_cb(FILE, MEM, SIZE) (FILE)->write_cb((FILE)->userdata, MEM, SIZE)
+#define picozip__writev_cb(FILE, IOV, IOVCNT) (FILE)->writev_cb((FILE)->userdata, IOV, IOVCNT)
+#define picozip__file_crc32(FILE, PTR, LEN, CRC) picozip__crc32(PTR, LEN, CRC)
+#define picozip__file_crc32_copy(FILE, DST, PTR, LEN, CRC) picozip__crc32_copy(DST, PTR, LEN, CRC)
+#define PICOZIP__ALLOCATOR(FILE) (FILE)->alloc_cb, (FILE)->free_cb, (FILE)->userdata
+#define PICOZIP__STAT_ADD(FILE, FIELD, N) ((void)0)
+#define PICOZIP__TRACE(FILE, EVENT, ENTRY) ((void)0)
+#endif /* ifdef PICOZIP_STATS */
+
+    int picozip_new(picozip_file **ofile, picozip_write_callback write_cb, picozip_alloc_callback alloc_cb, picozip_free_callback free_cb, void *userdata)
+    {
+        picozip_file *file;
+
+        if (!ofile || !write_cb || !alloc_cb || !free_cb)
+            return PICOZIP_EINVAL;
+
+        if (!(file = (picozip_file *)alloc_cb(userdata, sizeof(picozip_file))))
+            return PICOZIP_ENOMEM;
+
+        memset(file, 0, sizeof(picozip_file));
+        PICOZIP__STAT_ADD(file, alloc_calls, 1);
+        PICOZIP__STAT_ADD(file, alloc_bytes, sizeof(picozip_file));
+        file->alloc_cb = alloc_cb;
+        file->write_cb = write_cb;
+        file->free_cb = free_cb;
+        file->userdata = userdata;
+        file->utc_offset = PICOZIP_TZ_LOCAL;
+        file->read_buf_size = PICOZIP_READ_BUF;
+#ifdef PICOZIP_THREADS
+        picozip__mutex_init(&file->lock);
+#endif
+        *ofile = file;
+
+        return PICOZIP_OK;
+    }
+
+    int picozip_set_timezone(picozip_file *file, long utc_offset)
+    {
+        /* DOS time can't be more than a day off */
+        if (!file || (utc_offset != PICOZIP_TZ_LOCAL && (utc_offset < -86400 || utc_offset > 86400)))
+            return PICOZIP_EINVAL;
+
+        file->utc_offset = utc_offset;
+        file->memo_valid = 0;
+        return PICOZIP_OK;
+    }
+
+    /* converts the modification time of a new entry, reusing the last result for runs of identical times */
+    static void picozip__entry_dostime(picozip_file *file, picozip__entry *entry)
+    {
+        if (!file->memo_valid || file->memo_time != entry->mod_time)
+        {
+#ifdef PICOZIP_STATS
+            uint64_t start = picozip__now();
+#endif
+            if (file->utc_offset == PICOZIP_TZ_LOCAL)
+                picozip__local_to_dostime(entry->mod_time, &file->memo_date, &file->memo_dostime);
+            else
+                picozip__utc_to_dostime(entry->mod_time, file->utc_offset, &file->memo_date, &file->memo_dostime);
+            file->memo_time = entry->mod_time;
+            file->memo_valid = 1;
+            PICOZIP__STAT_ADD(file, dostime_ns, picozip__now() - start);
+        }
+        entry->dos_date = file->memo_date;
+        entry->dos_time = file->memo_dostime;
+    }
+
+    int picozip_set_arena(picozip_file *file, size_t slab_size)
+    {
+        /* entries allocated before can't be told apart from slabs */
+        if (!file || file->num_entries || file->num_sealed)
+            return PICOZIP_EINVAL;
+
+        file->slab_size = slab_size ? PICOZIP__ARENA_ROUND(slab_size) : PICOZIP_ARENA_SLAB;
+        return PICOZIP_OK;
+    }
+
+    /* bump-allocates <size> bytes from the current slab, starting a new slab when it is full */
+    static void *picozip__arena_alloc(picozip_file *file, size_t size)
+    {
+        picozip__slab *slab;
+        size_t slab_size;
+        void *mem;
+
+        size = PICOZIP__ARENA_ROUND(size);
+        slab = file->slabs;
+        if (!slab || slab->size - slab->used < size)
+        {
+            /* oversized entries get a slab of their own */
+            slab_size = size > file->slab_size ? size : file->slab_size;
+            if (!(slab = (picozip__slab *)picozip__alloc(file, PICOZIP__SLAB_HEADER_SIZE + slab_size)))
+                return NULL;
+            slab->size = slab_size;
+            slab->used = 0;
+            slab->next = file->slabs;
+            file->slabs = slab;
+        }
+
+        mem = PICOZIP__SLAB_DATA(slab) + slab->used;
+        slab->used += size;
+        return mem;
+    }
+
+    /* starts a new block of at least <size> bytes in the central directory store */
+    static picozip__slab *picozip__cd_block(picozip_file *file, size_t size)
+    {
+        picozip__slab *block;
+
+        if (size < PICOZIP__CD_BLOCK)
+            size = PICOZIP__CD_BLOCK;
+        if (!(block = (picozip__slab *)picozip__alloc(file, PICOZIP__SLAB_HEADER_SIZE + size)))
+            return NULL;
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+        if (file->cd_tail)
+            file->cd_tail->next = block;
+        else
+            file->cd_head = block;
+        file->cd_tail = block;
+        return block;
+    }
+
+    static picozip__entry *picozip__alloc_entry(picozip_file *file, size_t metadata_len)
+    {
+        picozip__entry *entry, **entries;
+
+        if (!(entries = (picozip__entry **)picozip__vec_alloc(&file->entries, sizeof(picozip__entry *), PICOZIP__ALLOCATOR(file))))
+            return NULL;
+
+        if (file->slab_size)
+            entry = (picozip__entry *)picozip__arena_alloc(file, sizeof(picozip__entry) + metadata_len);
+        else
+            entry = (picozip__entry *)picozip__alloc(file, sizeof(picozip__entry) + metadata_len);
+        if (!entry)
+            return NULL;
+
+        entries[file->num_entries++] = entry;
+        file->entries.size += sizeof(picozip__entry *);
+
+        return entry;
+    }
+
+    static void picozip__free_last_entry(picozip_file *file)
+    {
+        picozip__slab *slab;
+        uint8_t *entry;
+
+        if (file->num_entries)
+        {
+            entry = (uint8_t *)((picozip__entry **)file->entries.data)[--file->num_entries];
+            PICOZIP__TRACE(file, PICOZIP_TRACE_ABORT, (picozip__entry *)entry);
+#ifdef PICOZIP_STATS
+            if (file->num_done > file->num_entries)
+                file->num_done = file->num_entries;
+#endif
+            file->entries.size -= sizeof(picozip__entry *);
+            /* the last entry is always the last allocation in the newest slab, once the slabs emptied before are dropped */
+            if (file->slab_size)
+            {
+                while (!file->slabs->used && (slab = file->slabs->next))
+                {
+                    file->free_cb(file->userdata, file->slabs);
+                    file->slabs = slab;
+                }
+                file->slabs->used = (size_t)(entry - PICOZIP__SLAB_DATA(file->slabs));
+            }
+            else
+                file->free_cb(file->userdata, entry);
+        }
+    }
+
+#ifdef PICOZIP_STATS
+    static void picozip__entries_done(picozip_file *file);
+#else
+#define picozip__entries_done(FILE) ((void)0)
+#endif
+
+    /* finishes the entry added last: it is left out of the archive after an error, and its end is traced otherwise */
+    static int picozip__end_entry(picozip_file *file, int err)
+    {
+        if (err != PICOZIP_OK)
+            picozip__free_last_entry(file);
+        else
+            picozip__entries_done(file);
+        return err;
+    }
+
+    int picozip_set_writev_callback(picozip_file *file, picozip_writev_callback writev_cb)
+    {
+        if (!file)
+            return PICOZIP_EINVAL;
+
+        file->writev_cb = writev_cb;
+        return PICOZIP_OK;
+    }
+
+    /* writes as much of the backlog as the output takes */
+    static int picozip__backlog_write(picozip_file *file)
+    {
+        size_t n, left;
+
+        while ((left = file->backlog.size - file->backlog_pos) > 0)
+        {
+            n = picozip__write_cb(file, (uint8_t *)file->backlog.data + file->backlog_pos, left);
+            if (n == PICOZIP_WRITE_ERROR || n > left)
+                return PICOZIP_EIO;
+            if (!n)
+                return PICOZIP_EAGAIN;
+            file->backlog_pos += n;
+        }
+        file->backlog.size = file->backlog_pos = 0;
+        return PICOZIP_OK;
+    }
+
+    /* queues the chunks in the backlog, from byte <skip> on */
+    static int picozip__backlog_push(picozip_file *file, const picozip_iovec *iov, size_t iovcnt, size_t skip)
+    {
+        uint8_t *data;
+        size_t i, len;
+
+        /* move the unwritten part to the front once it is no larger than what was written */
+        if (file->backlog_pos && file->backlog_pos >= file->backlog.size - file->backlog_pos)
+        {
+            data = (uint8_t *)file->backlog.data;
+            memmove(data, data + file->backlog_pos, file->backlog.size - file->backlog_pos);
+            file->backlog.size -= file->backlog_pos;
+            file->backlog_pos = 0;
+        }
+
+        for (i = 0; i < iovcnt; i++)
+        {
+            if (skip >= iov[i].len)
+            {
+                skip -= iov[i].len;
+                continue;
+            }
+            len = iov[i].len - skip;
+            if (!(data = (uint8_t *)picozip__vec_alloc(&file->backlog, len, PICOZIP__ALLOCATOR(file))))
+                return PICOZIP_ENOMEM;
+            memcpy(data + file->backlog.size, (const uint8_t *)iov[i].base + skip, len);
+            file->backlog.size += len;
+            skip = 0;
+        }
+        return PICOZIP_OK;
+    }
+
+    /* writes what the output takes right away, and queues the rest in the backlog */
+    static int picozip__sink_writev_nonblocking(picozip_file *file, const picozip_iovec *iov, size_t iovcnt)
+    {
+        size_t i, n, done, total;
+        int err;
+
+        /* queued output goes first, so nothing is written out of order */
+        done = 0;
+        if ((err = picozip__backlog_write(file)) == PICOZIP_OK)
+        {
+            if (file->writev_cb)
+            {
+                for (total = i = 0; i < iovcnt; i++)
+                    total += iov[i].len;
+                if ((done = picozip__writev_cb(file, iov, iovcnt)) == PICOZIP_WRITE_ERROR || done > total)
+                    return PICOZIP_EIO;
+            }
+            else
+            {
+                for (i = 0; i < iovcnt; i++)
+                {
+                    if (!iov[i].len)
+                        continue;
+                    if ((n = picozip__write_cb(file, iov[i].base, iov[i].len)) == PICOZIP_WRITE_ERROR || n > iov[i].len)
+                        return PICOZIP_EIO;
+                    done += n;
+                    if (n < iov[i].len)
+                        break;
+                }
+            }
+        }
+        else if (err != PICOZIP_EAGAIN)
+        {
+            return err;
+        }
+        return picozip__backlog_push(file, iov, iovcnt, done);
+    }
+
+/* whether the backlog holds more than its limit, which streamed entries stop at */
+#define PICOZIP__BACKLOG_FULL(FILE) ((FILE)->nonblocking && (FILE)->backlog.size - (FILE)->backlog_pos > (FILE)->backlog_limit)
+
+    /* returns PICOZIP_EAGAIN if the backlog is too large to start another entry, or an entry is still streamed */
+    static int picozip__backlog_ready(picozip_file *file)
+    {
+        int err;
+
+        if (file->stream.entry)
+            return PICOZIP_EAGAIN;
+        if (!PICOZIP__BACKLOG_FULL(file))
+            return PICOZIP_OK;
+        if ((err = picozip__backlog_write(file)) != PICOZIP_OK && err != PICOZIP_EAGAIN)
+            return err;
+        return PICOZIP__BACKLOG_FULL(file) ? PICOZIP_EAGAIN : PICOZIP_OK;
+    }
+
+    static int picozip__stream_resume(picozip_file *file);
+
+    int picozip_set_nonblocking(picozip_file *file, int nonblocking, size_t limit)
+    {
+        int err;
+
+        if (!file)
+            return PICOZIP_EINVAL;
+
+        /* blocking writes can't start before the backlog is out, and the entry being streamed is finished with them */
+        if (!nonblocking && file->nonblocking)
+        {
+            if ((err = picozip__backlog_write(file)) != PICOZIP_OK)
+                return err;
+            file->nonblocking = 0;
+            if (file->stream.entry && (err = picozip__end_entry(file, picozip__stream_resume(file))) != PICOZIP_OK)
+                return err;
+        }
+
+        file->nonblocking = nonblocking != 0;
+        file->backlog_limit = limit;
+        return PICOZIP_OK;
+    }
+
+    int picozip_pump(picozip_file *file)
+    {
+        int err;
+
+        if (!file)
+            return PICOZIP_EINVAL;
+        if (!file->nonblocking)
+            return PICOZIP_OK;
+
+        if ((err = picozip__backlog_write(file)) != PICOZIP_OK && err != PICOZIP_EAGAIN)
+            return err;
+        /* the entry that stopped at the limit goes on once the backlog is back under it */
+        if (!file->stream.entry || PICOZIP__BACKLOG_FULL(file))
+            return err;
+        if ((err = picozip__stream_resume(file)) == PICOZIP_EAGAIN || (err = picozip__end_entry(file, err)) != PICOZIP_OK)
+            return err;
+        return picozip__backlog_write(file);
+    }
+
+    /* writes all chunks to the output with a single writev_cb call, or one write_cb call per (non-empty) chunk */
+    static int picozip__sink_writev(picozip_file *file, const picozip_iovec *iov, size_t iovcnt)
+    {
+        size_t i, total;
+
+        if (file->nonblocking)
+            return picozip__sink_writev_nonblocking(file, iov, iovcnt);
+
+        if (file->writev_cb)
+        {
+            for (total = i = 0; i < iovcnt; i++)
+                total += iov[i].len;
+            return picozip__writev_cb(file, iov, iovcnt) == total ? PICOZIP_OK : PICOZIP_EIO;
+        }
+
+        for (i = 0; i < iovcnt; i++)
+        {
+            if (iov[i].len && picozip__write_cb(file, iov[i].base, iov[i].len) != iov[i].len)
+                return PICOZIP_EIO;
+        }
+        return PICOZIP_OK;
+    }
+
+    /* writes out the output buffer; its content is dropped even if the write fails */
+    static int picozip__flush(picozip_file *file)
+    {
+        picozip_iovec iov;
+
+        if (!file->buf_used)
+            return PICOZIP_OK;
+
+        iov.base = file->buf;
+        iov.len = file->buf_used;
+        file->buf_used = 0;
+        return picozip__sink_writev(file, &iov, 1);
+    }
+
+    int picozip_set_buffer(picozip_file *file, size_t size)
+    {
+        uint8_t *buf = NULL;
+
+        if (!file)
+            return PICOZIP_EINVAL;
+
+        if (picozip__flush(file) != PICOZIP_OK)
+            return PICOZIP_EIO;
+
+        if (size && !(buf = (uint8_t *)picozip__alloc(file, size)))
+            return PICOZIP_ENOMEM;
+
+        if (file->buf)
+            file->free_cb(file->userdata, file->buf);
+        file->buf = buf;
+        file->buf_size = size;
+        return PICOZIP_OK;
+    }
+
+    int picozip_set_read_buffer(picozip_file *file, size_t size)
+    {
+        if (!file)
+            return PICOZIP_EINVAL;
+
+        /* the new buffer is allocated by the next entry that reads */
+        if (file->read_buf)
+            file->free_cb(file->userdata, file->read_buf);
+        file->read_buf = NULL;
+        file->read_buf_size = size ? size : PICOZIP_READ_BUF;
+        return PICOZIP_OK;
+    }
+
+#ifndef PICOZIP_NO_STDIO
+    static size_t picozip__spill_fwrite(void *userdata, const void *mem, size_t size)
+    {
+        return fwrite(mem, sizeof(uint8_t), size, (FILE *)userdata);
+    }
+
+    /* reads a FILE for the functions taking a picozip_read_callback, and the default spill */
+    static size_t picozip__fread(void *userdata, void *mem, size_t size)
+    {
+        size_t n = fread(mem, sizeof(uint8_t), size, (FILE *)userdata);
+        return !n && ferror((FILE *)userdata) ? PICOZIP_READ_ERROR : n;
+    }
+#endif
+
+    int picozip_set_spill(picozip_file *file, size_t budget, picozip_write_callback write_cb, picozip_read_callback read_cb, void *userdata)
+    {
+        /* records already spilled can't be moved to another sink */
+        if (!file || file->keep_entries || file->cd_spilled || !write_cb != !read_cb)
+            return PICOZIP_EINVAL;
+
+#ifndef PICOZIP_NO_STDIO
+        if (!write_cb)
+        {
+            if (!file->spill_file && !(file->spill_file = tmpfile()))
+                return errno;
+            write_cb = picozip__spill_fwrite;
+            read_cb = picozip__fread;
+            userdata = file->spill_file;
+        }
+#else
+        if (!write_cb)
+            return PICOZIP_EINVAL;
+#endif
+
+        file->spill_budget = budget;
+        file->spill_write = write_cb;
+        file->spill_read = read_cb;
+        file->spill_userdata = userdata;
+        return PICOZIP_OK;
+    }
+
+    /* returns the input buffer shared by the entries, NULL if it can't be allocated */
+    static uint8_t *picozip__read_buffer(picozip_file *file)
+    {
+        if (!file->read_buf)
+            file->read_buf = (uint8_t *)picozip__alloc(file, file->read_buf_size);
+        return file->read_buf;
+    }
+
+    /* writes all chunks, coalescing small ones in the output buffer when it is enabled */
+    static int picozip__writev(picozip_file *file, const picozip_iovec *iov, size_t iovcnt)
+    {
+        picozip_iovec out[2];
+        size_t i, total;
+        int err;
+
+        for (total = i = 0; i < iovcnt; i++)
+            total += iov[i].len;
+
+        if (!file->buf)
+        {
+            if ((err = picozip__sink_writev(file, iov, iovcnt)) != PICOZIP_OK)
+                return err;
+        }
+        else
+        {
+            for (i = 0; i < iovcnt; i++)
+            {
+                if (!iov[i].len)
+                    continue;
+                if (iov[i].len >= file->buf_size)
+                {
+                    /* large chunks bypass the buffer, and are written together with the buffered data */
+                    out[0].base = file->buf;
+                    out[0].len = file->buf_used;
+                    out[1] = iov[i];
+                    err = picozip__sink_writev(file, file->buf_used ? out : out + 1, file->buf_used ? 2 : 1);
+                    file->buf_used = 0;
+                    if (err != PICOZIP_OK)
+                        return err;
+                    continue;
+                }
+
+                if (iov[i].len > file->buf_size - file->buf_used && (err = picozip__flush(file)) != PICOZIP_OK)
+                    return err;
+                memcpy(file->buf + file->buf_used, iov[i].base, iov[i].len);
+                file->buf_used += iov[i].len;
+            }
+        }
+
+        file->offset += total;
+        return PICOZIP_OK;
+    }
+
+    static uint64_t picozip__iov_len(const picozip_iovec *iov, size_t iovcnt)
+    {
+        uint64_t total = 0;
+
+        while (iovcnt--)
+            total += iov[iovcnt].len;
+        return total;
+    }
+
+    /*
+     * encodes the local header of <entry> into <header>, and points <iov> at it and the metadata.
+     * the sizes of large entries without a data descriptor go in a ZIP64 extra field after the metadata,
+     * which is zero-filled for entries with a data descriptor that may reach 4 GiB.
+     * returns the number of chunks.
+     */
+    static size_t picozip__encode_local_header(const picozip__entry *entry, uint8_t *header, picozip_iovec *iov)
+    {
+        int zip64, datadesc;
+
+        datadesc = entry->flags & PICOZIP__FLAG_DATADESC;
+        zip64 = datadesc ? entry->zip64_desc : entry->comp_size >= PICOZIP__ZIP64_LIMIT || entry->uncomp_size >= PICOZIP__ZIP64_LIMIT;
+        PICOZIP__WRITE_LE32(header, 0, PICOZIP__LOCAL_MAGIC);
+        PICOZIP__WRITE_LE16(header, 4, entry->version_extract);
+        PICOZIP__WRITE_LE16(header, 6, entry->flags);
+        PICOZIP__WRITE_LE16(header, 8, entry->comp_method);
+        PICOZIP__WRITE_LE16(header, 10, entry->dos_time);
+        PICOZIP__WRITE_LE16(header, 12, entry->dos_date);
+        PICOZIP__WRITE_LE32(header, 14, entry->crc32);
+        PICOZIP__WRITE_LE32(header, 18, zip64 ? PICOZIP__ZIP64_LIMIT : entry->comp_size);
+        PICOZIP__WRITE_LE32(header, 22, zip64 ? PICOZIP__ZIP64_LIMIT : entry->uncomp_size);
+        PICOZIP__WRITE_LE16(header, 26, entry->filename_len);
+        PICOZIP__WRITE_LE16(header, 28, entry->extra_field_len + (zip64 ? PICOZIP__ZIP64_LOCAL_SIZE : 0));
+        iov[0].base = header;
+        iov[0].len = PICOZIP__LOCAL_HEADER_SIZE;
+        iov[1].base = entry->metadata;
+        iov[1].len = entry->filename_len + entry->extra_field_len;
+        if (!zip64)
+            return 2;
+
+        PICOZIP__WRITE_LE16(header, PICOZIP__LOCAL_HEADER_SIZE, PICOZIP__ZIP64_MAGIC);
+        PICOZIP__WRITE_LE16(header, PICOZIP__LOCAL_HEADER_SIZE + 2, PICOZIP__ZIP64_LOCAL_SIZE - 4);
+        /* the sizes of a streamed entry may be counted by worker threads as this is encoded */
+        PICOZIP__WRITE_LE64(header, PICOZIP__LOCAL_HEADER_SIZE + 4, datadesc ? 0 : entry->uncomp_size);
+        PICOZIP__WRITE_LE64(header, PICOZIP__LOCAL_HEADER_SIZE + 12, datadesc ? 0 : entry->comp_size);
+        iov[2].base = header + PICOZIP__LOCAL_HEADER_SIZE;
+        iov[2].len = PICOZIP__ZIP64_LOCAL_SIZE;
+        return 3;
+    }
+
+    /* writes the local header of <entry>, followed by <size> bytes of content */
+    static int picozip__write_local_entry(picozip_file *file, picozip__entry *entry, const uint8_t *data, size_t size)
+    {
+        picozip_iovec iov[4];
+        size_t n;
+
+        /* write header + extra field + content */
+        n = picozip__encode_local_header(entry, file->scratch, iov);
+        iov[n].base = data;
+        iov[n].len = size;
+        return picozip__writev(file, iov, size ? n + 1 : n);
+    }
+
+    /*
+     * makes room for 64-bit sizes in the data descriptor of <entry>, if its content of up to <size> bytes may reach 4 GiB.
+     * streamed entries are made with the size bounding their content, or (size_t)-1 when there is none.
+     */
+    static void picozip__prepare_datadesc(picozip__entry *entry, uint64_t size)
+    {
+        if (size < PICOZIP__ZIP64_DESC_LIMIT)
+            return;
+        entry->zip64_desc = 1;
+        if (entry->version_extract < PICOZIP__ZIP64_VERSION)
+            entry->version_extract = PICOZIP__ZIP64_VERSION;
+    }
+
+    /* encodes the data descriptor of <entry> into <desc>, with 64-bit sizes if its local header says so or they don't fit; returns its size */
+    static size_t picozip__encode_datadesc(picozip__entry *entry, uint8_t *desc)
+    {
+        PICOZIP__WRITE_LE32(desc, 0, PICOZIP__DATADESC_MAGIC);
+        PICOZIP__WRITE_LE32(desc, 4, entry->crc32);
+        if (entry->zip64_desc || entry->comp_size >= PICOZIP__ZIP64_LIMIT || entry->uncomp_size >= PICOZIP__ZIP64_LIMIT)
+        {
+            PICOZIP__WRITE_LE64(desc, 8, entry->comp_size);
+            PICOZIP__WRITE_LE64(desc, 16, entry->uncomp_size);
+            return PICOZIP__DATADESC64_SIZE;
+        }
+        PICOZIP__WRITE_LE32(desc, 8, entry->comp_size);
+        PICOZIP__WRITE_LE32(desc, 12, entry->uncomp_size);
+        return PICOZIP__DATADESC_SIZE;
+    }
+
+    int picozip_set_codec(picozip_file *file, const picozip_codec *codec, int level)
+    {
+        if (!file || (codec && (!codec->begin || !codec->compress || !codec->end)))
+            return PICOZIP_EINVAL;
+        /* the entry being streamed keeps compressing with the codec it started with */
+        if (file->stream.entry)
+            return PICOZIP_EAGAIN;
+
+        file->codec = codec;
+        file->codec_level = level;
+        return PICOZIP_OK;
+    }
+
+    /** Where codecs write the compressed content of an entry. */
+    typedef struct picozip__codec_sink
+    {
+        picozip_file *file;
+        picozip__entry *entry;
+    } picozip__codec_sink;
+
+    static size_t picozip__codec_write(void *userdata, const void *mem, size_t len)
+    {
+        picozip__codec_sink *sink;
+        picozip_iovec iov;
+
+        sink = (picozip__codec_sink *)userdata;
+        iov.base = mem;
+        iov.len = len;
+        if (picozip__writev(sink->file, &iov, 1) != PICOZIP_OK)
+            return 0;
+        sink->entry->comp_size += len;
+        return len;
+    }
+
+    /* marks <entry> as compressed with the codec, with its sizes and CRC in the data descriptor */
+    static void picozip__codec_prepare(picozip_file *file, picozip__entry *entry)
+    {
+        entry->flags |= PICOZIP__FLAG_DATADESC;
+        entry->comp_method = file->codec->method;
+        if (file->codec->version > entry->version_extract)
+            entry->version_extract = file->codec->version;
+        picozip__prepare_datadesc(entry, entry->uncomp_size);
+        entry->crc32 = entry->comp_size = entry->uncomp_size = 0; /* set in data descriptor */
+    }
+
+    /* writes the local header of a compressed entry and starts the codec */
+    static int picozip__codec_begin(picozip_file *file, picozip__entry *entry, void **ostate)
+    {
+        int err;
+
+        picozip__codec_prepare(file, entry);
+        if (!(*ostate = file->codec->begin(file->codec->userdata, file->codec_level, PICOZIP__ALLOCATOR(file))))
+            return PICOZIP_ENOMEM;
+        if ((err = picozip__write_local_entry(file, entry, NULL, 0)) != PICOZIP_OK)
+        {
+            file->codec->end(*ostate);
+            return err;
+        }
+        entry->crc32 = PICOZIP__CRC_START;
+        return PICOZIP_OK;
+    }
+
+    /* compresses a chunk of content, updating the CRC when <checksum> is set */
+    static int picozip__codec_feed(picozip_file *file, picozip__entry *entry, void *state, const uint8_t *data, size_t size, int flush, int checksum)
+    {
+        picozip__codec_sink sink;
+
+        sink.file = file;
+        sink.entry = entry;
+        if (checksum)
+            entry->crc32 = picozip__file_crc32(file, data, size, entry->crc32);
+        entry->uncomp_size += size;
+        return file->codec->compress(state, data, size, flush, picozip__codec_write, &sink);
+    }
+
+    /* stops the codec and writes the data descriptor */
+    static int picozip__codec_end(picozip_file *file, picozip__entry *entry, void *state, int err)
+    {
+        uint8_t desc[PICOZIP__DATADESC64_SIZE];
+        picozip_iovec iov;
+
+        file->codec->end(state);
+        if (err != PICOZIP_OK)
+            return err;
+
+        iov.base = desc;
+        iov.len = picozip__encode_datadesc(entry, desc);
+        return picozip__writev(file, &iov, 1);
+    }
+
+    /* writes an entry whose content is in memory with the codec, <crc32> is used if <checksum> is not set */
+    static int picozip__write_compressed(picozip_file *file, picozip__entry *entry, const uint8_t *data, size_t size, int checksum, uint32_t crc32)
+    {
+        void *state;
+        int err;
+
+        if ((err = picozip__codec_begin(file, entry, &state)) != PICOZIP_OK)
+            return err;
+        err = picozip__codec_feed(file, entry, state, data, size, PICOZIP_FLUSH_FINISH, checksum);
+        if (!checksum)
+            entry->crc32 = crc32;
+        return picozip__codec_end(file, entry, state, err);
+    }
+
+    /* fills <buf> with up to <size> bytes from <read_cb>, stopping short only at the end of the input */
+    static int picozip__read_full(picozip_read_callback read_cb, void *userdata, uint8_t *buf, size_t size, size_t *oread)
+    {
+        size_t n;
+
+        for (*oread = 0; *oread < size; *oread += n)
+        {
+            if ((n = read_cb(userdata, buf + *oread, size - *oread)) == PICOZIP_READ_ERROR || n > size - *oread)
+                return PICOZIP_EIO;
+            if (!n)
+                break;
+        }
+        return PICOZIP_OK;
+    }
+
+    /* reads and writes the rest of the streamed entry, stopping with PICOZIP_EAGAIN once the backlog passes its limit */
+    static int picozip__stream_run(picozip_file *file)
+    {
+        picozip__stream *stream = &file->stream;
+        picozip__entry *entry = stream->entry;
+        uint8_t desc[PICOZIP__DATADESC64_SIZE];
+        picozip_iovec iov[5];
+        size_t want, data_read, n;
+        int last, err;
+
+        do
+        {
+            /* nothing is read until the backlog is written out, so the read position is kept by the input */
+            if (PICOZIP__BACKLOG_FULL(file))
+                return PICOZIP_EAGAIN;
+            want = stream->left < stream->buf_size ? (size_t)stream->left : stream->buf_size;
+            if ((err = picozip__read_full(stream->read_cb, stream->userdata, stream->buf, want, &data_read)) != PICOZIP_OK)
+                return err;
+            if (stream->exact && data_read != want)
+                return PICOZIP_EIO;
+            stream->left -= data_read;
+            last = data_read != stream->buf_size || !stream->left;
+
+            /* the header (with no CRC and sizes unless they are known) goes out with the first chunk of stored content */
+            n = stream->header ? picozip__encode_local_header(entry, file->scratch, iov) : 0;
+            stream->header = 0;
+
+            /* the CRC is in the entry before the data descriptor goes out with the last chunk */
+            if (stream->checksum)
+                stream->crc32 = picozip__file_crc32(file, stream->buf, data_read, stream->crc32);
+            if (last)
+            {
+                if (stream->verify && stream->crc32 != stream->given)
+                    return PICOZIP_EINVAL;
+                entry->crc32 = stream->checksum ? stream->crc32 : stream->given;
+            }
+
+            if (stream->state)
+            {
+                err = picozip__codec_feed(file, entry, stream->state, stream->buf, data_read, last ? PICOZIP_FLUSH_FINISH : PICOZIP_FLUSH_NONE, 0);
+                continue;
+            }
+
+            iov[n].base = stream->buf;
+            iov[n++].len = data_read;
+            if (!stream->exact)
+            {
+                entry->comp_size = entry->uncomp_size += data_read;
+                if (last)
+                {
+                    iov[n].base = desc;
+                    iov[n++].len = picozip__encode_datadesc(entry, desc);
+                }
+            }
+            err = picozip__writev(file, iov, n);
+        } while (err == PICOZIP_OK && !last);
+        return err;
+    }
+
+#ifndef PICOZIP_NO_STDIO
+    static void picozip__advise_done(FILE *fptr);
+#endif
+
+    /* ends the streamed entry, writing the data descriptor of compressed content unless <err> is set */
+    static int picozip__stream_end(picozip_file *file, int err)
+    {
+        picozip__stream *stream = &file->stream;
+
+        if (stream->state)
+            err = picozip__codec_end(file, stream->entry, stream->state, err);
+        if (stream->buf != file->read_buf)
+            file->free_cb(file->userdata, stream->buf);
+#ifndef PICOZIP_NO_STDIO
+        if (stream->fptr)
+        {
+            picozip__advise_done(stream->fptr);
+            fclose(stream->fptr);
+        }
+#endif
+        memset(stream, 0, sizeof(picozip__stream));
+        return err;
+    }
+
+    /* carries on with the streamed entry, which is done unless PICOZIP_EAGAIN is returned */
+    static int picozip__stream_resume(picozip_file *file)
+    {
+        int err;
+
+        if ((err = picozip__stream_run(file)) == PICOZIP_EAGAIN)
+            return err;
+        return picozip__stream_end(file, err);
+    }
+
+    /* sets the input of the next streamed entry, up to <left> bytes read in <buf>, whose CRC is computed while reading */
+    static void picozip__stream_input(picozip_file *file, picozip_read_callback read_cb, void *userdata, uint8_t *buf, size_t buf_size, uint64_t left)
+    {
+        picozip__stream *stream = &file->stream;
+
+        stream->read_cb = read_cb;
+        stream->userdata = userdata;
+        stream->buf = buf;
+        stream->buf_size = buf_size;
+        stream->left = left;
+        stream->checksum = 1;
+        stream->header = 1;
+    }
+
+    /*
+     * streams <entry> from the input set by picozip__stream_input, once the caller changed the other fields
+     * of file->stream it needs. compressed entries and stored ones that aren't <exact> have their sizes and
+     * CRC in a data descriptor. returns PICOZIP_EAGAIN if the entry is left for picozip_pump to finish.
+     */
+    static int picozip__stream_begin(picozip_file *file, picozip__entry *entry)
+    {
+        picozip__stream *stream = &file->stream;
+        int err;
+
+        stream->entry = entry;
+        stream->crc32 = PICOZIP__CRC_START;
+        if (file->codec)
+        {
+            if ((err = picozip__codec_begin(file, entry, &stream->state)) != PICOZIP_OK)
+            {
+                stream->state = NULL;
+                return picozip__stream_end(file, err);
+            }
+            stream->header = 0;
+        }
+        else if (stream->exact)
+        {
+            entry->crc32 = stream->given;
+        }
+        else
+        {
+            entry->flags = PICOZIP__FLAG_DATADESC;
+            entry->crc32 = 0; /* set in data descriptor */
+            picozip__prepare_datadesc(entry, entry->uncomp_size);
+            entry->comp_size = entry->uncomp_size = 0;
+        }
+        return picozip__stream_resume(file);
+    }
+
+#ifdef PICOZIP_THREADS
+
+/* blocks in flight (queued, being compressed or waiting to be written) before the caller has to wait */
+#define PICOZIP__POOL_PENDING(POOL) ((POOL)->num_threads * 2 + 2)
+
+    /** A block of content for the worker threads, kept in output order until it is written. */
+    typedef struct picozip__job
+    {
+        struct picozip__job *next;    /* next job in the work queue */
+        struct picozip__job *pending; /* next job in output order */
+        picozip_file *file;
+        picozip__entry *entry;
+        const picozip_codec *codec;
+        int level, flush, checksum, first, last;
+        int done, err; /* set by the worker */
+        const uint8_t *data;
+        size_t size;
+        uint32_t crc32; /* of this block, or of the whole entry for the last block when <checksum> is not set */
+        picozip__vec out;
+    } picozip__job;
+
+    /** The worker threads of a picozip_file. */
+    typedef struct picozip__pool
+    {
+        picozip__mutex lock;
+        picozip__cond work, done; /* signalled when a job is queued and finished */
+        picozip__job *queue_head, *queue_tail;
+        int quit;
+        size_t num_threads;
+        picozip__thread threads[1];
+    } picozip__pool;
+
+    static size_t picozip__job_write(void *userdata, const void *mem, size_t len)
+    {
+        picozip__job *job;
+        uint8_t *out;
+
+        job = (picozip__job *)userdata;
+        if (!(out = (uint8_t *)picozip__vec_alloc(&job->out, len, job->file->alloc_cb, job->file->free_cb, job->file->userdata)))
+            return 0;
+        memcpy(out + job->out.size, mem, len);
+        job->out.size += len;
+        return len;
+    }
+
+    /* compresses a block as a stream of its own, so blocks don't depend on each other */
+    static void picozip__job_run(picozip__job *job)
+    {
+        void *state;
+
+        if (job->checksum)
+            job->crc32 = picozip__crc32(job->data, job->size, PICOZIP__CRC_START);
+        if (!job->codec)
+            return;
+        if (!(state = job->codec->begin(job->codec->userdata, job->level, job->file->alloc_cb, job->file->free_cb, job->file->userdata)))
+        {
+            job->err = PICOZIP_ENOMEM;
+            return;
+        }
+        job->err = job->codec->compress(state, job->data, job->size, job->flush, picozip__job_write, job);
+        job->codec->end(state);
+    }
+
+    static PICOZIP__THREAD_RETURN picozip__worker(void *userdata)
+    {
+        picozip__pool *pool;
+        picozip__job *job;
+
+        pool = (picozip__pool *)userdata;
+        picozip__mutex_lock(&pool->lock);
+        for (;;)
+        {
+            while (!pool->queue_head && !pool->quit)
+                picozip__cond_wait(&pool->work, &pool->lock);
+            if (!(job = pool->queue_head))
+                break;
+            if (!(pool->queue_head = job->next))
+                pool->queue_tail = NULL;
+            picozip__mutex_unlock(&pool->lock);
+
+            picozip__job_run(job);
+
+            picozip__mutex_lock(&pool->lock);
+            job->done = 1;
+            picozip__cond_broadcast(&pool->done);
+        }
+        picozip__mutex_unlock(&pool->lock);
+        return 0;
+    }
+
+    /* waits for the oldest job and writes its output, unless <discard> is set or an earlier write failed */
+    static void picozip__pool_retire(picozip_file *file, int discard)
+    {
+        uint8_t desc[PICOZIP__DATADESC64_SIZE];
+        picozip_iovec iov[4];
+        picozip__entry *entry;
+        picozip__job *job;
+        size_t n;
+        int err;
+
+        job = file->pending_head;
+        picozip__mutex_lock(&file->pool->lock);
+        while (!job->done)
+            picozip__cond_wait(&file->pool->done, &file->pool->lock);
+        picozip__mutex_unlock(&file->pool->lock);
+
+        if (!(file->pending_head = job->pending))
+            file->pending_tail = NULL;
+        file->num_pending--;
+
+        /* the offset of the entry is only known once everything before it is written */
+        entry = job->entry;
+        n = 0;
+        if (job->first)
+        {
+            entry->header_offset = file->offset;
+            n = picozip__encode_local_header(entry, file->scratch, iov);
+        }
+        iov[n].base = job->out.data;
+        iov[n++].len = job->out.size;
+
+        entry->comp_size += job->out.size;
+        entry->uncomp_size += job->size;
+        if (job->checksum)
+            entry->crc32 = job->first ? job->crc32 : picozip__crc32_combine(entry->crc32, job->crc32, job->size);
+        else if (job->last)
+            entry->crc32 = job->crc32;
+
+        err = discard || file->pool_err ? PICOZIP_OK : job->err;
+        if (!discard && !file->pool_err && err == PICOZIP_OK && (err = picozip__writev(file, iov, n)) == PICOZIP_OK && job->last)
+        {
+            iov[0].base = desc;
+            iov[0].len = picozip__encode_datadesc(entry, desc);
+            if ((err = picozip__writev(file, iov, 1)) == PICOZIP_OK)
+                picozip__entries_done(file);
+        }
+        if (err != PICOZIP_OK)
+            file->pool_err = err;
+
+        if (job->out.data)
+            file->free_cb(file->userdata, job->out.data);
+        file->free_cb(file->userdata, job);
+    }
+
+    /* writes all pending jobs, returning the first error any of them hit */
+    static int picozip__pool_drain(picozip_file *file)
+    {
+        while (file->pending_head)
+            picozip__pool_retire(file, 0);
+        return file->pool_err;
+    }
+
+    /* allocates a job for <size> bytes at <data>, copied into the job (if not NULL) when <copy> is set */
+    static picozip__job *picozip__job_new(picozip_file *file, picozip__entry *entry, const uint8_t *data, size_t size, int copy)
+    {
+        picozip__job *job;
+
+        if (!(job = (picozip__job *)picozip__alloc(file, PICOZIP__ARENA_ROUND(sizeof(picozip__job)) + (copy ? size : 0))))
+            return NULL;
+        memset(job, 0, sizeof(picozip__job));
+        job->file = file;
+        job->entry = entry;
+        job->codec = file->codec;
+        job->level = file->codec_level;
+        job->data = data;
+        job->size = size;
+        if (copy)
+        {
+            job->data = (uint8_t *)job + PICOZIP__ARENA_ROUND(sizeof(picozip__job));
+            if (data && size)
+                memcpy((uint8_t *)job->data, data, size);
+        }
+        return job;
+    }
+
+    /* appends a job to the work queue, the lock must be held */
+    static void picozip__pool_queue(picozip__pool *pool, picozip__job *job)
+    {
+        if (pool->queue_tail)
+            pool->queue_tail->next = job;
+        else
+            pool->queue_head = job;
+        pool->queue_tail = job;
+    }
+
+    /* queues a job, writing the oldest ones while too many are in flight */
+    static void picozip__pool_submit(picozip_file *file, picozip__job *job, int first, int last, int checksum)
+    {
+        picozip__pool *pool;
+
+        pool = file->pool;
+        job->first = first;
+        job->last = last;
+        job->checksum = checksum;
+        job->flush = last ? PICOZIP_FLUSH_FINISH : PICOZIP_FLUSH_SYNC;
+
+        if (file->pending_tail)
+            file->pending_tail->pending = job;
+        else
+            file->pending_head = job;
+        file->pending_tail = job;
+        file->num_pending++;
+
+        picozip__mutex_lock(&pool->lock);
+        picozip__pool_queue(pool, job);
+        picozip__cond_signal(&pool->work);
+        picozip__mutex_unlock(&pool->lock);
+
+        while (file->num_pending > PICOZIP__POOL_PENDING(pool))
+            picozip__pool_retire(file, 0);
+    }
+
+/* whether the CRC of <SIZE> bytes is worth splitting across the worker threads */
+#define PICOZIP__POOL_CRC(FILE, SIZE) ((FILE)->pool && (SIZE) >= PICOZIP_THREAD_CRC_MIN)
+
+    /* checksums <size> bytes, splitting large buffers in one slice per worker thread (and one for the caller) */
+    static uint32_t picozip__pool_crc32(picozip_file *file, const uint8_t *data, size_t size)
+    {
+        picozip__pool *pool;
+        picozip__job *jobs;
+        size_t i, n, slice;
+        uint32_t crc;
+#ifdef PICOZIP_STATS
+        uint64_t start;
+#endif
+
+        pool = file->pool;
+        if (!PICOZIP__POOL_CRC(file, size))
+            return picozip__file_crc32(file, data, size, PICOZIP__CRC_START);
+        n = pool->num_threads + 1;
+        if (!(jobs = (picozip__job *)picozip__alloc(file, n * sizeof(picozip__job))))
+            return picozip__file_crc32(file, data, size, PICOZIP__CRC_START);
+
+#ifdef PICOZIP_STATS
+        start = picozip__now();
+#endif
+        memset(jobs, 0, n * sizeof(picozip__job));
+        slice = size / n;
+        for (i = 0; i < n; i++)
+        {
+            jobs[i].file = file;
+            jobs[i].checksum = 1;
+            jobs[i].data = data + i * slice;
+            jobs[i].size = i + 1 < n ? slice : size - i * slice;
+        }
+        picozip__mutex_lock(&pool->lock);
+        for (i = 1; i < n; i++)
+            picozip__pool_queue(pool, &jobs[i]);
+        picozip__cond_broadcast(&pool->work);
+        picozip__mutex_unlock(&pool->lock);
+
+        crc = picozip__crc32(jobs[0].data, jobs[0].size, PICOZIP__CRC_START);
+
+        picozip__mutex_lock(&pool->lock);
+        for (i = 1; i < n; i++)
+        {
+            while (!jobs[i].done)
+                picozip__cond_wait(&pool->done, &pool->lock);
+        }
+        picozip__mutex_unlock(&pool->lock);
+        for (i = 1; i < n; i++)
+            crc = picozip__crc32_combine(crc, jobs[i].crc32, jobs[i].size);
+        PICOZIP__STAT_ADD(file, crc_ns, picozip__now() - start);
+
+        file->free_cb(file->userdata, jobs);
+        return crc;
+    }
+
+    /* whether the next entry can be compressed by the worker threads */
+    static int picozip__pool_usable(picozip_file *file)
+    {
+        return file->pool && file->codec && file->codec->concat;
+    }
+
+    /*
+     * compresses an entry whose content is in memory with the worker threads, <crc32> is used if <checksum> is not set.
+     * small entries are copied and written in the background, larger ones are compressed in place and written before returning.
+     */
+    static int picozip__pool_mem(picozip_file *file, picozip__entry *entry, const uint8_t *data, size_t size, int checksum, uint32_t crc32)
+    {
+        picozip__job *job;
+        size_t offset, len;
+        int copy;
+
+        if (file->pool_err)
+            return file->pool_err;
+
+        picozip__codec_prepare(file, entry);
+        copy = size <= PICOZIP_THREAD_BLOCK;
+        offset = 0;
+        do
+        {
+            len = size - offset > PICOZIP_THREAD_BLOCK ? PICOZIP_THREAD_BLOCK : size - offset;
+            if (!(job = picozip__job_new(file, entry, data + offset, len, copy)))
+            {
+                /* the blocks already queued would leave the entry unfinished */
+                picozip__pool_drain(file);
+                return offset ? (file->pool_err = PICOZIP_ENOMEM) : PICOZIP_ENOMEM;
+            }
+            if (offset + len == size && !checksum)
+                job->crc32 = crc32;
+            picozip__pool_submit(file, job, offset == 0, offset + len == size, checksum);
+            offset += len;
+        } while (offset < size);
+
+        return copy && !file->pool_err ? PICOZIP_OK : picozip__pool_drain(file);
+    }
+
+    /* stops the worker threads, writing the pending jobs unless <discard> is set */
+    static void picozip__pool_destroy(picozip_file *file, int discard)
+    {
+        picozip__pool *pool;
+        size_t i;
+
+        if (!(pool = file->pool))
+            return;
+        while (file->pending_head)
+            picozip__pool_retire(file, discard);
+
+        picozip__mutex_lock(&pool->lock);
+        pool->quit = 1;
+        picozip__cond_broadcast(&pool->work);
+        picozip__mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->num_threads; i++)
+            picozip__thread_join(pool->threads[i]);
+
+        picozip__cond_destroy(&pool->work);
+        picozip__cond_destroy(&pool->done);
+        picozip__mutex_destroy(&pool->lock);
+        file->free_cb(file->userdata, pool);
+        file->pool = NULL;
+    }
+
+    int picozip_set_threads(picozip_file *file, size_t num_threads)
+    {
+        picozip__pool *pool;
+        int err;
+
+        if (!file || num_threads > ((size_t)-1 - sizeof(picozip__pool)) / sizeof(picozip__thread))
+            return PICOZIP_EINVAL;
+
+        picozip__pool_destroy(file, 0);
+        if ((err = file->pool_err) != PICOZIP_OK || num_threads < 2)
+            return err;
+
+#ifndef PICOZIP_NO_DEFLATE
+        /* the static tables must be ready before the workers can race on them */
+        picozip__deflate_init();
+#endif
+
+        if (!(pool = (picozip__pool *)picozip__alloc(file, sizeof(picozip__pool) + (num_threads - 1) * sizeof(picozip__thread))))
+            return PICOZIP_ENOMEM;
+        memset(pool, 0, sizeof(picozip__pool));
+        picozip__mutex_init(&pool->lock);
+        picozip__cond_init(&pool->work);
+        picozip__cond_init(&pool->done);
+        file->pool = pool;
+        for (; pool->num_threads < num_threads; pool->num_threads++)
+        {
+            if (picozip__thread_create(&pool->threads[pool->num_threads], picozip__worker, pool) != 0)
+            {
+                picozip__pool_destroy(file, 0);
+                return PICOZIP_ENOMEM;
+            }
+        }
+        return PICOZIP_OK;
+    }
+    /* reads a block of the input, up to <*limit> bytes, into a new job */
+    static int picozip__pool_read(picozip_file *file, picozip__entry *entry, picozip_read_callback read_cb, void *userdata, size_t *limit, picozip__job **ojob)
+    {
+        picozip__job *job;
+        size_t len;
+        int err;
+
+        len = *limit > PICOZIP_THREAD_BLOCK ? PICOZIP_THREAD_BLOCK : *limit;
+        if (!(job = picozip__job_new(file, entry, NULL, len, 1)))
+            return PICOZIP_ENOMEM;
+        if ((err = picozip__read_full(read_cb, userdata, (uint8_t *)job->data, len, &job->size)) != PICOZIP_OK)
+        {
+            file->free_cb(file->userdata, job);
+            return err;
+        }
+        *limit -= job->size;
+        *ojob = job;
+        return PICOZIP_OK;
+    }
+
+    /*
+     * compresses the rest of the input, up to <limit> bytes, with the worker threads; <crc32> is used if <checksum> is not set.
+     * blocks are read one ahead to tell which one is the last, and written in the background.
+     */
+    static int picozip__pool_stream(picozip_file *file, picozip__entry *entry, picozip_read_callback read_cb, void *userdata, size_t limit, int checksum, uint32_t crc32, size_t *oread)
+    {
+        picozip__job *job, *next;
+        int first, err;
+
+        *oread = 0;
+        if (file->pool_err)
+            return file->pool_err;
+
+        picozip__codec_prepare(file, entry);
+        if ((err = picozip__pool_read(file, entry, read_cb, userdata, &limit, &job)) != PICOZIP_OK)
+            return err;
+        for (first = 1;; first = 0)
+        {
+            next = NULL;
+            if (job->size == PICOZIP_THREAD_BLOCK && limit)
+            {
+                if ((err = picozip__pool_read(file, entry, read_cb, userdata, &limit, &next)) != PICOZIP_OK)
+                    break;
+                if (!next->size)
+                {
+                    file->free_cb(file->userdata, next);
+                    next = NULL;
+                }
+            }
+            *oread += job->size;
+            if (!next && !checksum)
+                job->crc32 = crc32;
+            picozip__pool_submit(file, job, first, !next, checksum);
+            if (!(job = next))
+                return file->pool_err ? picozip__pool_drain(file) : PICOZIP_OK;
+        }
+
+        /* the blocks already queued would leave the entry unfinished */
+        file->free_cb(file->userdata, job);
+        picozip__pool_drain(file);
+        return first ? err : (file->pool_err = err);
+    }
+#else
+/* without threads there is never anything in the background */
+#define picozip__pool_usable(FILE) 0
+#define picozip__pool_drain(FILE) PICOZIP_OK
+#define picozip__pool_mem(FILE, ENTRY, DATA, SIZE, CHECKSUM, CRC32) PICOZIP_EINVAL
+#define picozip__pool_stream(FILE, ENTRY, READ_CB, USERDATA, LIMIT, CHECKSUM, CRC32, OREAD) (*(OREAD) = 0, PICOZIP_EINVAL)
+#define PICOZIP__POOL_CRC(FILE, SIZE) 0
+#define picozip__pool_crc32(FILE, DATA, SIZE) picozip__file_crc32(FILE, DATA, SIZE, PICOZIP__CRC_START)
+#endif /* ifdef PICOZIP_THREADS */
+
+/* whether streamed entries are read by the worker threads, which can't stop at the backlog limit in nonblocking mode */
+#define PICOZIP__POOL_STREAM(FILE) (picozip__pool_usable(FILE) && !(FILE)->nonblocking)
+
+#ifdef PICOZIP_STATS
+    /* counts and traces the end of the entries whose data is all written, up to the first one with blocks still pending */
+    static void picozip__entries_done(picozip_file *file)
+    {
+        picozip__entry **entries;
+        size_t count;
+
+        entries = (picozip__entry **)file->entries.data;
+        count = file->num_entries;
+#ifdef PICOZIP_THREADS
+        if (file->pending_head)
+        {
+            for (count = file->num_done; count < file->num_entries && entries[count] != file->pending_head->entry; count++)
+                ;
+        }
+#endif
+        for (; file->num_done < count; file->num_done++)
+        {
+            if (entries[file->num_done]->flags & PICOZIP__FLAG_DATADESC)
+                file->stats.datadesc_entries++;
+            else
+                file->stats.sized_entries++;
+            PICOZIP__TRACE(file, PICOZIP_TRACE_END, entries[file->num_done]);
+        }
+    }
+#endif
+
+    static int picozip__seal_entries(picozip_file *file, int all);
+
+    /* allocates and populates an entry with a known size, without sealing the entries before it */
+    static picozip__entry *picozip__make_sized_entry(picozip_file *file, const char *const path, size_t size, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        size_t filename_len;
+        picozip__entry *entry;
+
+        filename_len = strlen(path);
+        entry = picozip__alloc_entry(file, filename_len + comment_len + PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE);
+        if (!entry)
+            return NULL;
+
+        /* populate the entry */
+        entry->version_made = 0;
+        entry->version_extract = size >= PICOZIP__ZIP64_LIMIT ? PICOZIP__ZIP64_VERSION : PICOZIP__MIN_VERSION;
+        entry->flags = entry->comp_method = 0;
+        entry->zip64_desc = 0;
+        entry->internal_attr = entry->external_attr = 0;
+        entry->header_offset = file->offset;
+        entry->mod_time = mod_time;
+        picozip__entry_dostime(file, entry);
+        entry->comp_size = entry->uncomp_size = size;
+        entry->filename_len = filename_len;
+        entry->extra_field_len = PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE;
+        entry->comment_len = comment_len;
+        entry->crc32 = PICOZIP__CRC_START;
+        /* write the filename */
+        memcpy(entry->metadata, path, filename_len);
+        /* write the timestamp field */
+        PICOZIP__WRITE_LE16(entry->metadata, filename_len, PICOZIP__TIMESTAMP_MAGIC);
+        PICOZIP__WRITE_LE16(entry->metadata, filename_len + 2, PICOZIP__LOCAL_TIMESTAMP_SIZE);
+        entry->metadata[filename_len + 4] = 1; /* modtime flag set */
+        PICOZIP__WRITE_LE32(entry->metadata, filename_len + 5, ((uint32_t)entry->mod_time));
+        /* write the comment */
+        if (comment_len)
+            memcpy(entry->metadata + filename_len + PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE, comment, comment_len);
+        PICOZIP__TRACE(file, PICOZIP_TRACE_BEGIN, entry);
+        return entry;
+    }
+
+    /* allocates and populates an entry with a known size, leaving the CRC to the caller */
+    static picozip__entry *picozip__new_sized_entry(picozip_file *file, const char *const path, size_t size, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        /* the entries before this one are complete, if that fails they are sealed later */
+        picozip__seal_entries(file, 0);
+        return picozip__make_sized_entry(file, path, size, mod_time, comment, comment_len);
+    }
+
+    /* adds an in-memory entry without checking the backlog, which the caller did for the whole batch */
+    static int picozip__new_entry_mem(picozip_file *file, const char *const path, const uint8_t *data, size_t size, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        picozip__entry *entry;
+        int err;
+
+        /* anything compressed in the background has to be written first */
+        if (!picozip__pool_usable(file) && (err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        entry = picozip__new_sized_entry(file, path, size, mod_time, comment, comment_len);
+        if (!entry)
+            return PICOZIP_ENOMEM;
+
+        /* write the header and file content to the output */
+        if (picozip__pool_usable(file))
+        {
+            err = picozip__pool_mem(file, entry, data, size, 1, 0);
+        }
+        else if (file->codec)
+        {
+            err = picozip__write_compressed(file, entry, data, size, 1, 0);
+        }
+        else if (PICOZIP__IS_MEM(file) && !PICOZIP__POOL_CRC(file, size))
+        {
+            /* the in-memory backend calculates the CRC while copying the content,
+             * but the header has to be in the output before its CRC can be patched */
+            if ((err = picozip__write_local_entry(file, entry, NULL, 0)) == PICOZIP_OK && (err = picozip__flush(file)) == PICOZIP_OK)
+                err = picozip__mem_write_crc(file, entry, data, size);
+        }
+        else
+        {
+            entry->crc32 = picozip__pool_crc32(file, data, size);
+            err = picozip__write_local_entry(file, entry, data, size);
+        }
+
+        return picozip__end_entry(file, err);
+    }
+
+    int picozip_new_entry_mem_ex(picozip_file *file, const char *const path, const uint8_t *data, size_t size, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        int err;
+
+        if (!file || !path || (size && !data) || (comment_len && !comment))
+            return PICOZIP_EINVAL;
+
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+        return picozip__new_entry_mem(file, path, data, size, mod_time, comment, comment_len);
+    }
+
+    int picozip_new_entry_mem_ex2(picozip_file *file, const char *const path, const uint8_t *data, size_t size, uint32_t crc32, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        int err;
+        picozip__entry *entry;
+
+        if (!file || !path || (size && !data) || (comment_len && !comment))
+            return PICOZIP_EINVAL;
+
+#ifdef PICOZIP_VERIFY_CRC
+        if (picozip__pool_crc32(file, data, size) != crc32)
+            return PICOZIP_EINVAL;
+#endif
+
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+        if (!picozip__pool_usable(file) && (err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        entry = picozip__new_sized_entry(file, path, size, mod_time, comment, comment_len);
+        if (!entry)
+            return PICOZIP_ENOMEM;
+
+        entry->crc32 = crc32;
+        if (picozip__pool_usable(file))
+            err = picozip__pool_mem(file, entry, data, size, 0, crc32);
+        else if (file->codec)
+            err = picozip__write_compressed(file, entry, data, size, 0, crc32);
+        else
+            err = picozip__write_local_entry(file, entry, data, size);
+
+        return picozip__end_entry(file, err);
+    }
+
+    int picozip_new_entry_cb(picozip_file *file, const char *const path, picozip_read_callback read_cb, void *userdata, size_t buf_size, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        picozip__entry *entry;
+        uint8_t *buf;
+        size_t data_read;
+        int err;
+
+        if (!file || !path || !read_cb || (comment_len && !comment))
+            return PICOZIP_EINVAL;
+
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+        if (!PICOZIP__POOL_STREAM(file) && (err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        /* nothing bounds the content, which may need ZIP64 sizes */
+        entry = picozip__new_sized_entry(file, path, (size_t)-1, mod_time, comment, comment_len);
+        if (!entry)
+            return PICOZIP_ENOMEM;
+
+        /* the workers read in blocks of their own */
+        if (PICOZIP__POOL_STREAM(file))
+        {
+            err = picozip__pool_stream(file, entry, read_cb, userdata, (size_t)-1, 1, 0, &data_read);
+            return picozip__end_entry(file, err);
+        }
+
+        /* without a size of its own, the entry reads through the file's buffer */
+        if (!buf_size)
+        {
+            buf = picozip__read_buffer(file);
+            buf_size = file->read_buf_size;
+        }
+        else
+            buf = (uint8_t *)picozip__alloc(file, buf_size);
+        if (!buf)
+        {
             picozip__free_last_entry(file);
+            return PICOZIP_ENOMEM;
+        }
+        picozip__stream_input(file, read_cb, userdata, buf, buf_size, (uint64_t)-1);
+        if ((err = picozip__stream_begin(file, entry)) == PICOZIP_EAGAIN)
+            return err;
+
+        return picozip__end_entry(file, err);
+    }
+
+    int picozip_new_entries_mem(picozip_file *file, const picozip_entry_desc *descs, size_t n, size_t *oadded)
+    {
+        uint8_t headers[PICOZIP__ENTRY_BATCH][PICOZIP__LOCAL_HEADER_SIZE + PICOZIP__ZIP64_LOCAL_SIZE];
+        picozip_iovec iov[PICOZIP__ENTRY_BATCH * 4];
+        const picozip_entry_desc *desc;
+        picozip__entry *entry;
+        size_t i, j, k, iovcnt;
+        uint64_t offset;
+        int err;
+
+        if (oadded)
+            *oadded = 0;
+        if (!file || (n && !descs))
+            return PICOZIP_EINVAL;
+        for (i = 0; i < n; i++)
+        {
+            if (!descs[i].path || (descs[i].size && !descs[i].data) || (descs[i].comment_len && !descs[i].comment))
+                return PICOZIP_EINVAL;
+        }
+        if (!n)
+            return PICOZIP_OK;
+
+        /* the backlog is only checked once, so a retry never adds the entries before the one that blocked again */
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+
+        /* compressed and threaded entries don't have their headers ready up front */
+        if (file->codec || picozip__pool_usable(file))
+        {
+            for (i = 0; i < n; i++)
+            {
+                desc = &descs[i];
+                if ((err = picozip__new_entry_mem(file, desc->path, desc->data, desc->size, desc->mod_time, desc->comment, desc->comment_len)) != PICOZIP_OK)
+                    return err;
+                if (oadded)
+                    *oadded = i + 1;
+            }
+            return PICOZIP_OK;
+        }
+
+        if ((err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        /* the entries of each group are sealed once written, unless they are kept */
+        picozip__seal_entries(file, 0);
+        k = file->keep_entries || n < PICOZIP__ENTRY_BATCH ? n : PICOZIP__ENTRY_BATCH;
+        if (k > ((size_t)-1) / sizeof(picozip__entry *) || !picozip__vec_alloc(&file->entries, k * sizeof(picozip__entry *), PICOZIP__ALLOCATOR(file)))
+            return PICOZIP_ENOMEM;
+
+        for (i = 0; i < n; i = j)
+        {
+            /* the headers and content of a group of entries go out in a single write */
+            offset = file->offset;
+            for (iovcnt = 0, j = i; j < n && j - i < PICOZIP__ENTRY_BATCH; j++)
+            {
+                desc = &descs[j];
+                if (!(entry = picozip__make_sized_entry(file, desc->path, desc->size, desc->mod_time, desc->comment, desc->comment_len)))
+                {
+                    err = PICOZIP_ENOMEM;
+                    break;
+                }
+                entry->header_offset = offset;
+                entry->crc32 = picozip__pool_crc32(file, desc->data, desc->size);
+                k = picozip__encode_local_header(entry, headers[j - i], iov + iovcnt);
+                if (desc->size)
+                {
+                    iov[iovcnt + k].base = desc->data;
+                    iov[iovcnt + k++].len = desc->size;
+                }
+                offset += picozip__iov_len(iov + iovcnt, k);
+                iovcnt += k;
+            }
+
+            if (err == PICOZIP_OK)
+                err = picozip__writev(file, iov, iovcnt);
+            if (err != PICOZIP_OK)
+            {
+                /* the groups before are in the output already */
+                for (; j > i; j--)
+                    picozip__free_last_entry(file);
+                return err;
+            }
+            picozip__entries_done(file);
+            picozip__seal_entries(file, 0);
+            if (oadded)
+                *oadded = j;
+        }
+        return PICOZIP_OK;
+    }
+
+    int picozip_new_entry_mem(picozip_file *file, const char *const path, const uint8_t *data, size_t size)
+    {
+        return picozip_new_entry_mem_ex(file, path, data, size, time(NULL), NULL, 0);
+    }
+
+    int picozip_reserve(picozip_file *file, size_t expected_entries, size_t expected_bytes)
+    {
+        picozip__mem_file *mem_file;
+
+        if (!file || expected_entries > ((size_t)-1) / PICOZIP__CD_RECORD_MIN)
+            return PICOZIP_EINVAL;
+
+        /* entries are only kept around by stages and readers, others just keep their records */
+        if (file->keep_entries)
+        {
+            if (!picozip__vec_reserve(&file->entries, expected_entries * sizeof(picozip__entry *), PICOZIP__ALLOCATOR(file)))
+                return PICOZIP_ENOMEM;
+        }
+        else if (!file->cd_head && expected_entries && !picozip__cd_block(file, expected_entries * PICOZIP__CD_RECORD_MIN))
+            return PICOZIP_ENOMEM;
+
+        /* only the in-memory backend owns the output */
+        if (PICOZIP__IS_MEM(file))
+        {
+            mem_file = (picozip__mem_file *)file->userdata;
+            if (!picozip__vec_reserve(&mem_file->mem, expected_bytes, PICOZIP__ALLOCATOR(file)))
+                return PICOZIP_ENOMEM;
+        }
+
+        return PICOZIP_OK;
+    }
+
+    /*
+     * encodes the central directory record of <entry> into <header>, which has room for the ZIP64 extra field,
+     * and points <iov> at it and the metadata. returns the number of chunks.
+     */
+    static size_t picozip__encode_central(const picozip__entry *entry, uint8_t *header, picozip_iovec *iov)
+    {
+        uint8_t *extra;
+        size_t n, name_len, extra_len;
+
+        /* values that don't fit in the header go in a ZIP64 extra field, in this order */
+        extra = header + PICOZIP__CD_HEADER_SIZE;
+        extra_len = 4;
+        if (entry->uncomp_size >= PICOZIP__ZIP64_LIMIT)
+        {
+            PICOZIP__WRITE_LE64(extra, extra_len, entry->uncomp_size);
+            extra_len += 8;
+        }
+        if (entry->comp_size >= PICOZIP__ZIP64_LIMIT)
+        {
+            PICOZIP__WRITE_LE64(extra, extra_len, entry->comp_size);
+            extra_len += 8;
+        }
+        if (entry->header_offset >= PICOZIP__ZIP64_LIMIT)
+        {
+            PICOZIP__WRITE_LE64(extra, extra_len, entry->header_offset);
+            extra_len += 8;
+        }
+        if (extra_len == 4)
+            extra_len = 0;
+        else
+        {
+            PICOZIP__WRITE_LE16(extra, 0, PICOZIP__ZIP64_MAGIC);
+            PICOZIP__WRITE_LE16(extra, 2, extra_len - 4);
+        }
+
+        PICOZIP__WRITE_LE32(header, 0, PICOZIP__CENTRAL_MAGIC);
+        PICOZIP__WRITE_LE16(header, 4, entry->version_made);
+        PICOZIP__WRITE_LE16(header, 6, extra_len && entry->version_extract < PICOZIP__ZIP64_VERSION ? PICOZIP__ZIP64_VERSION : entry->version_extract);
+        PICOZIP__WRITE_LE16(header, 8, entry->flags);
+        PICOZIP__WRITE_LE16(header, 10, entry->comp_method);
+        PICOZIP__WRITE_LE16(header, 12, entry->dos_time);
+        PICOZIP__WRITE_LE16(header, 14, entry->dos_date);
+        PICOZIP__WRITE_LE32(header, 16, entry->crc32);
+        PICOZIP__WRITE_LE32(header, 20, PICOZIP__CLAMP32(entry->comp_size));
+        PICOZIP__WRITE_LE32(header, 24, PICOZIP__CLAMP32(entry->uncomp_size));
+        PICOZIP__WRITE_LE16(header, 28, entry->filename_len);
+        PICOZIP__WRITE_LE16(header, 30, entry->extra_field_len + extra_len);
+        PICOZIP__WRITE_LE16(header, 32, entry->comment_len);
+        PICOZIP__WRITE_LE16(header, 34, 0); /* disk start */
+        PICOZIP__WRITE_LE16(header, 36, entry->internal_attr);
+        PICOZIP__WRITE_LE32(header, 38, entry->external_attr);
+        PICOZIP__WRITE_LE32(header, 42, PICOZIP__CLAMP32(entry->header_offset));
+        n = 0;
+        iov[n].base = header;
+        iov[n++].len = PICOZIP__CD_HEADER_SIZE;
+
+        /* the ZIP64 field goes between the other extra fields and the comment */
+        name_len = entry->filename_len + entry->extra_field_len;
+        iov[n].base = entry->metadata;
+        iov[n++].len = name_len + (extra_len ? 0 : entry->comment_len);
+        if (extra_len)
+        {
+            iov[n].base = extra;
+            iov[n++].len = extra_len;
+            iov[n].base = entry->metadata + name_len;
+            iov[n++].len = entry->comment_len;
+        }
+        return n;
+    }
+
+    /*
+     * encodes the central directory records of the complete entries into the store and frees them,
+     * or of every entry if <all> is set (even if the entries are kept).
+     */
+    static int picozip__seal_entries(picozip_file *file, int all)
+    {
+        uint8_t header[PICOZIP__CD_HEADER_SIZE + PICOZIP__ZIP64_CD_SIZE];
+        picozip_iovec iov[4];
+        picozip__entry **entries;
+        picozip__slab *slab, *block;
+        size_t i, j, n, len, count;
+        uint8_t *cd;
+
+        /* entries are always traced as complete before their record is encoded */
+        picozip__entries_done(file);
+        entries = (picozip__entry **)file->entries.data;
+        count = file->num_entries;
+        if (!all)
+        {
+            if (file->keep_entries)
+                return PICOZIP_OK;
+#ifdef PICOZIP_THREADS
+            /* entries that still have blocks pending don't know their sizes yet */
+            if (file->pending_head)
+            {
+                for (count = 0; entries[count] != file->pending_head->entry; count++)
+                    ;
+            }
+#endif
+        }
+
+        /* records are appended to blocks that are never moved, so growing the store doesn't copy it */
+        for (i = 0; i < count; i++)
+        {
+            n = picozip__encode_central(entries[i], header, iov);
+            len = (size_t)picozip__iov_len(iov, n);
+            block = file->cd_tail;
+            if ((!block || block->size - block->used < len) && !(block = picozip__cd_block(file, len)))
+                break;
+            cd = PICOZIP__SLAB_DATA(block) + block->used;
+            for (j = 0; j < n; j++)
+            {
+                memcpy(cd, iov[j].base, iov[j].len);
+                cd += iov[j].len;
+            }
+            block->used += len;
+            file->cd_size += len;
+        }
+        file->num_sealed += i;
+
+        /* past the budget, the oldest full blocks move to the spill */
+        while (file->spill_write && !file->spill_err && file->cd_head != file->cd_tail && file->cd_size - file->cd_spilled > file->spill_budget)
+        {
+            block = file->cd_head;
+            if (file->spill_write(file->spill_userdata, PICOZIP__SLAB_DATA(block), block->used) != block->used)
+            {
+                file->spill_err = 1;
+                break;
+            }
+            file->cd_spilled += block->used;
+            file->cd_head = block->next;
+            file->free_cb(file->userdata, block);
+        }
+
+        /* the records are self-contained, so the entries can go */
+        if (file->slab_size)
+        {
+            /* slabs can only be reused once nothing in them is alive */
+            if (i == file->num_entries && file->slabs)
+            {
+                while ((slab = file->slabs->next))
+                {
+                    file->free_cb(file->userdata, file->slabs);
+                    file->slabs = slab;
+                }
+                file->slabs->used = 0;
+            }
+        }
+        else
+        {
+            for (j = 0; j < i; j++)
+                file->free_cb(file->userdata, entries[j]);
+        }
+        if (file->num_entries > i)
+            memmove(entries, entries + i, (file->num_entries - i) * sizeof(picozip__entry *));
+        file->num_entries -= i;
+        file->entries.size -= i * sizeof(picozip__entry *);
+#ifdef PICOZIP_STATS
+        file->num_done = file->num_done > i ? file->num_done - i : 0;
+#endif
+        return i == count ? PICOZIP_OK : PICOZIP_ENOMEM;
+    }
+
+    /* encodes the end of the central directory (without the comment) into <eocd>, returning its size */
+    static size_t picozip__encode_eocd(size_t num_entries, uint64_t cd_size, uint64_t cd_offset, size_t comment_len, uint8_t *eocd)
+    {
+        uint8_t *end;
+
+        /* the ZIP64 EOCD and its locator are only written when a value doesn't fit in the EOCD */
+        end = eocd;
+        if (num_entries >= PICOZIP__ZIP64_ENTRIES_LIMIT || cd_size >= PICOZIP__ZIP64_LIMIT || cd_offset >= PICOZIP__ZIP64_LIMIT)
+        {
+            PICOZIP__WRITE_LE32(eocd, 0, PICOZIP__ZIP64_EOCD_MAGIC);
+            PICOZIP__WRITE_LE64(eocd, 4, PICOZIP__ZIP64_EOCD_SIZE - 12); /* size of the rest of the record */
+            PICOZIP__WRITE_LE16(eocd, 12, PICOZIP__ZIP64_VERSION);       /* version made by */
+            PICOZIP__WRITE_LE16(eocd, 14, PICOZIP__ZIP64_VERSION);       /* version needed to extract */
+            PICOZIP__WRITE_LE32(eocd, 16, 0);                            /* disk offset */
+            PICOZIP__WRITE_LE32(eocd, 20, 0);                            /* central directory disk offset */
+            PICOZIP__WRITE_LE64(eocd, 24, (uint64_t)num_entries);        /* total number of records in the disk */
+            PICOZIP__WRITE_LE64(eocd, 32, (uint64_t)num_entries);        /* total number of records */
+            PICOZIP__WRITE_LE64(eocd, 40, cd_size);                      /* central directory size */
+            PICOZIP__WRITE_LE64(eocd, 48, cd_offset);                    /* central directory offset */
+            end += PICOZIP__ZIP64_EOCD_SIZE;
+            PICOZIP__WRITE_LE32(end, 0, PICOZIP__ZIP64_LOCATOR_MAGIC);
+            PICOZIP__WRITE_LE32(end, 4, 0);                   /* ZIP64 EOCD disk offset */
+            PICOZIP__WRITE_LE64(end, 8, cd_offset + cd_size); /* ZIP64 EOCD offset */
+            PICOZIP__WRITE_LE32(end, 16, 1);                  /* number of disks */
+            end += PICOZIP__ZIP64_LOCATOR_SIZE;
+        }
+
+        PICOZIP__WRITE_LE32(end, 0, PICOZIP__EOCD_MAGIC);
+        PICOZIP__WRITE_LE16(end, 4, 0); /* disk offset */
+        PICOZIP__WRITE_LE16(end, 6, 0); /* central directory disk offset */
+        PICOZIP__WRITE_LE16(end, 8, num_entries >= PICOZIP__ZIP64_ENTRIES_LIMIT ? PICOZIP__ZIP64_ENTRIES_LIMIT : num_entries); /* total number of records in the disk */
+        PICOZIP__WRITE_LE16(end, 10, num_entries >= PICOZIP__ZIP64_ENTRIES_LIMIT ? PICOZIP__ZIP64_ENTRIES_LIMIT : num_entries); /* total number of records */
+        PICOZIP__WRITE_LE32(end, 12, PICOZIP__CLAMP32(cd_size));   /* central directory size */
+        PICOZIP__WRITE_LE32(end, 16, PICOZIP__CLAMP32(cd_offset)); /* central directory offset */
+        PICOZIP__WRITE_LE16(end, 20, comment_len);                 /* comment length */
+        return (size_t)(end - eocd) + PICOZIP__EOCD_SIZE;
+    }
+
+    /* writes the first <size> bytes of the central directory, starting with the records that were spilled, then the <tailcnt> chunks of <tail> */
+    static int picozip__write_central(picozip_file *file, uint64_t size, const picozip_iovec *tail, size_t tailcnt)
+    {
+        picozip_iovec iov[PICOZIP__CD_BATCH + 2];
+        picozip__slab *block;
+        uint64_t pos, left, spilled;
+        uint8_t *buf;
+        size_t i, n, len;
+        int err;
+
+        spilled = file->cd_spilled < size ? file->cd_spilled : size;
+        if (spilled)
+        {
+            if (!(buf = picozip__read_buffer(file)))
+                return PICOZIP_ENOMEM;
+#ifndef PICOZIP_NO_STDIO
+            /* the temporary file is rewound here, the callbacks of the caller read back from the start themselves */
+            if (file->spill_read == picozip__fread && fseek((FILE *)file->spill_userdata, 0, SEEK_SET) != 0)
+                return PICOZIP_EIO;
+#endif
+            for (pos = 0; pos < spilled; pos += n)
+            {
+                len = spilled - pos > file->read_buf_size ? file->read_buf_size : (size_t)(spilled - pos);
+                if ((n = file->spill_read(file->spill_userdata, buf, len)) == PICOZIP_READ_ERROR || !n || n > len)
+                    return PICOZIP_EIO;
+                iov[0].base = buf;
+                iov[0].len = n;
+                if ((err = picozip__writev(file, iov, 1)) != PICOZIP_OK)
+                    return err;
+            }
+        }
+        left = size - spilled;
+        for (n = 0, block = file->cd_head; block && left; block = block->next)
+        {
+            iov[n].base = PICOZIP__SLAB_DATA(block);
+            iov[n].len = block->used < left ? block->used : (size_t)left;
+            left -= iov[n++].len;
+
+            /* the last batch is written together with the tail */
+            if (n == PICOZIP__CD_BATCH && block->next && left)
+            {
+                if ((err = picozip__writev(file, iov, n)) != PICOZIP_OK)
+                    return err;
+                n = 0;
+            }
+        }
+
+        for (i = 0; i < tailcnt; i++)
+            iov[n++] = tail[i];
+        return picozip__writev(file, iov, n);
+    }
+
+#ifndef PICOZIP_NO_STDIO
+    static int picozip__cut_file(picozip_file *file);
+#endif
+
+    static int picozip__end(picozip_file *file, const char *const comment, size_t comment_len)
+    {
+        uint8_t eocd[PICOZIP__ZIP64_EOCD_SIZE + PICOZIP__ZIP64_LOCATOR_SIZE + PICOZIP__EOCD_SIZE];
+        picozip_iovec tail[2];
+        int err;
+
+        if (!file || (comment_len && !comment))
+            return PICOZIP_EINVAL;
+
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+        if ((err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        if ((err = picozip__seal_entries(file, 1)) != PICOZIP_OK)
+            return err;
+
+        if (file->spill_err)
+            return PICOZIP_EIO;
+
+        /* the central directory is already encoded, and goes out with the EOCD */
+        tail[0].base = eocd;
+        tail[0].len = picozip__encode_eocd(file->num_sealed, file->cd_size, file->offset, comment_len, eocd);
+        tail[1].base = comment;
+        tail[1].len = comment_len;
+        if ((err = picozip__write_central(file, file->cd_size, tail, 2)) != PICOZIP_OK)
+            return err;
+#ifdef PICOZIP__URING
+        /* the last writes may still be in flight, and their errors are only known once they complete */
+        if (file->write_cb == picozip__uring_write && (err = picozip__flush(file)) == PICOZIP_OK)
+            return picozip__uring_flush((struct picozip__uring *)file->userdata);
+#endif
+        if ((err = picozip__flush(file)) != PICOZIP_OK)
+            return err;
+#ifndef PICOZIP_NO_STDIO
+        /* an archive that was appended to may have been longer than it is now */
+        if (file->appending)
+        {
+            if ((err = picozip__cut_file(file)) != PICOZIP_OK)
+                return err;
+            file->appending = 0;
+        }
+#endif
+        return PICOZIP_OK;
+    }
+
+    int picozip_end_ex(picozip_file *file, const char *const comment, size_t comment_len)
+    {
+#ifdef PICOZIP_STATS
+        uint64_t start;
+        int err;
+
+        start = picozip__now();
+        err = picozip__end(file, comment, comment_len);
+        if (file)
+            file->stats.end_ns += picozip__now() - start;
+        return err;
+#else
+        return picozip__end(file, comment, comment_len);
+#endif
+    }
+
+    int picozip_end(picozip_file *file)
+    {
+        return file ? picozip_end_ex(file, NULL, 0) : PICOZIP_EINVAL;
+    }
+
+#ifdef PICOZIP_STATS
+    int picozip_get_stats(picozip_file *file, picozip_stats *stats)
+    {
+        if (!file || !stats)
+            return PICOZIP_EINVAL;
+
+        *stats = file->stats;
+        return PICOZIP_OK;
+    }
+
+    int picozip_set_trace(picozip_file *file, picozip_trace_callback trace_cb, void *userdata)
+    {
+        /* the entries of stages and readers aren't sealed as they are written */
+        if (!file || file->keep_entries)
+            return PICOZIP_EINVAL;
+
+        file->trace_cb = trace_cb;
+        file->trace_userdata = userdata;
+        return PICOZIP_OK;
+    }
+#endif
+
+    /* frees every entry, keeping the entry list */
+    static void picozip__free_entries(picozip_file *file)
+    {
+        picozip__slab *slab;
+        size_t i;
+
+        if (file->slab_size)
+        {
+            while ((slab = file->slabs))
+            {
+                file->slabs = slab->next;
+                file->free_cb(file->userdata, slab);
+            }
+        }
+        else
+        {
+            for (i = 0; i < file->num_entries; i++)
+            {
+                file->free_cb(file->userdata, ((picozip__entry **)file->entries.data)[i]);
+            }
+        }
+        file->num_entries = 0;
+        file->entries.size = 0;
+#ifdef PICOZIP_STATS
+        file->num_done = 0;
+#endif
+    }
+
+    int picozip_free(picozip_file *file)
+    {
+        picozip__slab *block;
+
+        if (!file)
+            return PICOZIP_EINVAL;
+
+#ifdef PICOZIP_THREADS
+        /* blocks that were not written by picozip_end are thrown away */
+        picozip__pool_destroy(file, 1);
+        picozip__mutex_destroy(&file->lock);
+#endif
+        /* so is an entry still being streamed */
+        if (file->stream.entry)
+            picozip__stream_end(file, PICOZIP_EIO);
+        picozip__free_entries(file);
+        file->free_cb(file->userdata, file->entries.data);
+        while ((block = file->cd_head))
+        {
+            file->cd_head = block->next;
+            file->free_cb(file->userdata, block);
+        }
+        if (file->buf)
+            file->free_cb(file->userdata, file->buf);
+        if (file->read_buf)
+            file->free_cb(file->userdata, file->read_buf);
+        file->free_cb(file->userdata, file->backlog.data);
+#ifndef PICOZIP_NO_STDIO
+        if (file->spill_file)
+            fclose(file->spill_file);
+        file->free_cb(file->userdata, file->old_comment.data);
+#endif
+#ifdef PICOZIP__URING
+        if (file->uring_in)
+            picozip__uring_free(file->uring_in, file->free_cb, file->userdata);
+#endif
+        file->free_cb(file->userdata, file);
+        return PICOZIP_OK;
+    }
+
+    static void *picozip__mem_alloc(void *userdata, size_t size)
+    {
+        (void)(userdata);
+        return malloc(size);
+    }
+
+    static void picozip__mem_free(void *userdata, void *mem)
+    {
+        (void)(userdata);
+        free(mem);
+    }
+
+    /* the allocator of a stage, which passes the calls on to the callbacks of the file it was created for */
+    static void *picozip__stage_alloc(void *userdata, size_t size)
+    {
+        picozip__mem_file *mem_file = (picozip__mem_file *)userdata;
+        return mem_file->alloc_cb(mem_file->userdata, size);
+    }
+
+    static void picozip__stage_free(void *userdata, void *mem)
+    {
+        picozip__mem_file *mem_file = (picozip__mem_file *)userdata;
+        mem_file->free_cb(mem_file->userdata, mem);
+    }
+
+    static size_t picozip__mem_write(void *userdata, const void *mem, size_t len)
+    {
+        picozip__mem_file *file;
+        uint8_t *data;
+
+        file = (picozip__mem_file *)userdata;
+        if (!file)
+            return 0;
+
+        if (!(data = (uint8_t *)picozip__vec_alloc(&file->mem, len, PICOZIP__ALLOCATOR(file->file))))
+            return 0;
+
+        memcpy(data + file->mem.size, mem, len);
+        file->mem.size += len;
+
+        return len;
+    }
+
+    static size_t picozip__mem_writev(void *userdata, const picozip_iovec *iov, size_t iovcnt)
+    {
+        picozip__mem_file *file;
+        uint8_t *data;
+        size_t i, total;
+
+        file = (picozip__mem_file *)userdata;
+        if (!file)
+            return 0;
+
+        for (total = i = 0; i < iovcnt; i++)
+            total += iov[i].len;
+        if (!(data = (uint8_t *)picozip__vec_alloc(&file->mem, total, PICOZIP__ALLOCATOR(file->file))))
+            return 0;
+
+        for (i = 0; i < iovcnt; i++)
+        {
+            if (iov[i].len)
+                memcpy(data + file->mem.size, iov[i].base, iov[i].len);
+            file->mem.size += iov[i].len;
+        }
+
+        return total;
+    }
+
+    /* writes the content of an entry and patches the CRC into its (already written) local header */
+    static int picozip__mem_write_crc(picozip_file *file, picozip__entry *entry, const uint8_t *data, size_t size)
+    {
+        picozip__mem_file *mem_file;
+        uint8_t *mem;
+
+        mem_file = (picozip__mem_file *)file->userdata;
+        if (!(mem = (uint8_t *)picozip__vec_alloc(&mem_file->mem, size, PICOZIP__ALLOCATOR(file))))
+            return PICOZIP_EIO;
+
+        if (size)
+            entry->crc32 = picozip__file_crc32_copy(file, mem + mem_file->mem.size, data, size, PICOZIP__CRC_START);
+        PICOZIP__WRITE_LE32(mem, mem_file->mem.size - (size_t)(file->offset - entry->header_offset) + 14, entry->crc32);
+        mem_file->mem.size += size;
+        file->offset += size;
+        PICOZIP__STAT_ADD(file, bytes_written, size);
+
+        return PICOZIP_OK;
+    }
+
+    /* creates an in-memory file whose memory comes from <alloc_cb> and <free_cb> (malloc and free directly when they are the defaults) */
+    static int picozip__new_mem(picozip_file **ofile, picozip_alloc_callback alloc_cb, picozip_free_callback free_cb, void *userdata)
+    {
+        picozip__mem_file *mem_file;
+        int result;
+
+        if (!(mem_file = (picozip__mem_file *)alloc_cb(userdata, sizeof(picozip__mem_file))))
+            return PICOZIP_ENOMEM;
+        memset(mem_file, 0, sizeof(picozip__mem_file));
+        mem_file->alloc_cb = alloc_cb;
+        mem_file->free_cb = free_cb;
+        mem_file->userdata = userdata;
+
+        if (alloc_cb == picozip__mem_alloc)
+            result = picozip_new(ofile, picozip__mem_write, picozip__mem_alloc, picozip__mem_free, (void *)mem_file);
+        else
+            result = picozip_new(ofile, picozip__mem_write, picozip__stage_alloc, picozip__stage_free, (void *)mem_file);
+        if (result != PICOZIP_OK)
+        {
+            free_cb(userdata, mem_file);
+            return result;
+        }
+        mem_file->file = *ofile;
+        (*ofile)->writev_cb = picozip__mem_writev;
+
+        return PICOZIP_OK;
+    }
+
+    int picozip_new_mem(picozip_file **ofile)
+    {
+        if (!ofile)
+            return PICOZIP_EINVAL;
+
+        return picozip__new_mem(ofile, picozip__mem_alloc, picozip__mem_free, NULL);
+    }
+
+    size_t picozip_get_mem(picozip_file *file, void **mem)
+    {
+        if (!file || !file->userdata || !mem)
+            return 0;
+        *mem = ((picozip__mem_file *)file->userdata)->mem.data;
+        return ((picozip__mem_file *)file->userdata)->mem.size;
+    }
+
+    int picozip_free_mem(picozip_file *file)
+    {
+        picozip__mem_file *mem_file;
+
+        if (!file || !file->userdata)
+            return PICOZIP_EINVAL;
+
+        /* the allocator of a stage lives in <mem_file>, so it goes last */
+        mem_file = (picozip__mem_file *)file->userdata;
+        file->free_cb(file->userdata, mem_file->mem.data);
+        picozip_free(file);
+        mem_file->free_cb(mem_file->userdata, mem_file);
+        return PICOZIP_OK;
+    }
+
+    int picozip_new_stage(picozip_file *file, picozip_file **ostage)
+    {
+        int err;
+
+        if (!file || !ostage)
+            return PICOZIP_EINVAL;
+        /* the stage allocates through the callbacks of <file>, which must be thread safe when it is filled from another thread */
+        if ((err = picozip__new_mem(ostage, file->alloc_cb, file->free_cb, file->userdata)) != PICOZIP_OK)
+            return err;
+
+#ifdef PICOZIP_THREADS
+        picozip__mutex_lock(&file->lock);
+#endif
+        (*ostage)->codec = file->codec;
+        (*ostage)->codec_level = file->codec_level;
+        (*ostage)->utc_offset = file->utc_offset;
+        (*ostage)->read_buf_size = file->read_buf_size;
+        (*ostage)->keep_entries = 1;
+#ifdef PICOZIP_THREADS
+        picozip__mutex_unlock(&file->lock);
+#endif
+#ifndef PICOZIP_NO_DEFLATE
+        /* stages are filled from other threads, which must not race on the static tables */
+        picozip__deflate_init();
+#endif
+        return PICOZIP_OK;
+    }
+
+    int picozip_commit_stage(picozip_file *file, picozip_file *stage)
+    {
+        picozip__mem_file *mem_file;
+        picozip__entry *entry, *copy;
+        picozip_iovec iov;
+        size_t i, metadata_len;
+        uint64_t base;
+        int err;
+
+        if (!file || !stage || file == stage || !PICOZIP__IS_MEM(stage))
+            return PICOZIP_EINVAL;
+
+        /* everything the stage still holds back has to be in its output first */
+        if ((err = picozip__pool_drain(stage)) != PICOZIP_OK || (err = picozip__flush(stage)) != PICOZIP_OK)
+            return err;
+        mem_file = (picozip__mem_file *)stage->userdata;
+
+#ifdef PICOZIP_THREADS
+        picozip__mutex_lock(&file->lock);
+#endif
+        if ((err = picozip__backlog_ready(file)) == PICOZIP_OK && (err = picozip__pool_drain(file)) == PICOZIP_OK)
+        {
+            /* the entries are copied before writing anything, so running out of memory leaves the archive as it was */
+            base = file->offset;
+            for (i = 0; i < stage->num_entries; i++)
+            {
+                entry = ((picozip__entry **)stage->entries.data)[i];
+                metadata_len = entry->filename_len + entry->extra_field_len + entry->comment_len;
+                if (!(copy = picozip__alloc_entry(file, metadata_len)))
+                {
+                    err = PICOZIP_ENOMEM;
+                    break;
+                }
+                memcpy(copy, entry, sizeof(picozip__entry) + metadata_len);
+                copy->header_offset += base;
+                PICOZIP__TRACE(file, PICOZIP_TRACE_BEGIN, copy);
+            }
+
+            iov.base = mem_file->mem.data;
+            iov.len = mem_file->mem.size;
+            if (err == PICOZIP_OK && (err = picozip__writev(file, &iov, 1)) != PICOZIP_OK)
+                i = stage->num_entries;
+            if (err != PICOZIP_OK)
+            {
+                while (i--)
+                    picozip__free_last_entry(file);
+            }
+            else
+            {
+                picozip__entries_done(file);
+                picozip__seal_entries(file, 0);
+            }
+        }
+#ifdef PICOZIP_THREADS
+        picozip__mutex_unlock(&file->lock);
+#endif
+        if (err != PICOZIP_OK)
+            return err;
+
+        /* the stage starts over, ready for the next batch */
+        picozip__free_entries(stage);
+        mem_file->mem.size = 0;
+        stage->offset = 0;
+        return PICOZIP_OK;
+    }
+
+    /** An entry of a pull reader, written out when picozip_read reaches it. */
+    typedef struct picozip__source
+    {
+        picozip__entry *entry;
+        const picozip_codec *codec;
+        int codec_level;
+        const uint8_t *data; /* in-memory content */
+        uint64_t size;       /* of the content, unless it comes from <read_cb> */
+        picozip_read_callback read_cb; /* or content from a callback */
+        picozip_pread_callback pread_cb; /* or from a callback at an offset */
+        void *read_userdata;
+        char *file_path; /* or from a file, opened when the entry is reached */
+        int has_crc;     /* whether the CRC of a planned entry is known */
+    } picozip__source;
+
+    /** The state of a pull reader. */
+    typedef struct picozip__reader
+    {
+        picozip__vec sources;
+        size_t next;      /* index of the next source to start */
+        int active, done; /* whether a source is being written, and the central directory too */
+        int err;          /* sticky, the archive can't be resumed after an error */
+        uint64_t pos;     /* bytes of the active source written so far */
+        void *state;      /* codec state of the active source */
+#ifndef PICOZIP_NO_STDIO
+        FILE *fptr;                  /* the active file source */
+        picozip__source *fptr_owner; /* the source <fptr> was opened for */
+#endif
+        int planned;          /* whether picozip_plan laid out the archive */
+        uint64_t size;        /* of the planned archive */
+        uint64_t cd_offset;   /* of the planned central directory */
+        uint64_t *cd_offsets; /* of each record from <cd_offset>, and the end of the central directory */
+        uint64_t read_pos;    /* next byte of a planned archive returned by picozip_read */
+        uint8_t *out; /* the buffer passed to picozip_read */
+        size_t out_size, out_used;
+        uint8_t chunk[PICOZIP_READ_BUF];
+    } picozip__reader;
+
+    /* copies as much as fits in the buffer passed to picozip_read, the rest is kept in the backlog */
+    static size_t picozip__reader_write(void *userdata, const void *mem, size_t len)
+    {
+        picozip__reader *reader = (picozip__reader *)userdata;
+
+        if (len > reader->out_size - reader->out_used)
+            len = reader->out_size - reader->out_used;
+        if (len)
+            memcpy(reader->out + reader->out_used, mem, len);
+        reader->out_used += len;
+        return len;
+    }
+
+#define PICOZIP__IS_READER(FILE) ((FILE)->write_cb == picozip__reader_write)
+
+    int picozip_new_reader(picozip_file **ofile)
+    {
+        picozip__reader *reader;
+        int err;
+
+        if (!ofile)
+            return PICOZIP_EINVAL;
+
+        if (!(reader = (picozip__reader *)picozip__mem_alloc(NULL, sizeof(picozip__reader))))
+            return PICOZIP_ENOMEM;
+        memset(reader, 0, sizeof(picozip__reader));
+
+        if ((err = picozip_new(ofile, picozip__reader_write, picozip__mem_alloc, picozip__mem_free, reader)) != PICOZIP_OK)
+        {
+            picozip__mem_free(NULL, reader);
+            return err;
+        }
+        /* whatever doesn't fit in the caller's buffer waits in the backlog for the next call */
+        (*ofile)->nonblocking = 1;
+        (*ofile)->backlog_limit = (size_t)-1;
+        (*ofile)->keep_entries = 1; /* the sources point at them */
+        return PICOZIP_OK;
+    }
+
+    /* adds a source whose entry will be written when the reader reaches it */
+    static int picozip__queue_source(picozip_file *file, const char *const path, time_t mod_time, const char *const comment, size_t comment_len, picozip__source **osource)
+    {
+        picozip__reader *reader = (picozip__reader *)file->userdata;
+        picozip__source *source;
+        picozip__entry *entry;
+
+        /* the entries have to be known before the first byte of the archive is read */
+        if (reader->next)
+            return PICOZIP_EINVAL;
+        if (!picozip__vec_alloc(&reader->sources, sizeof(picozip__source), PICOZIP__ALLOCATOR(file)))
+            return PICOZIP_ENOMEM;
+        if (!(entry = picozip__new_sized_entry(file, path, 0, mod_time, comment, comment_len)))
+            return PICOZIP_ENOMEM;
+
+        source = (picozip__source *)((uint8_t *)reader->sources.data + reader->sources.size);
+        reader->sources.size += sizeof(picozip__source);
+        memset(source, 0, sizeof(picozip__source));
+        source->entry = entry;
+        source->codec = file->codec;
+        source->codec_level = file->codec_level;
+        *osource = source;
+        return PICOZIP_OK;
+    }
+
+    int picozip_queue_entry_mem(picozip_file *file, const char *const path, const uint8_t *data, size_t size, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        picozip__source *source;
+        int err;
+
+        if (!file || !path || (size && !data) || (comment_len && !comment) || !PICOZIP__IS_READER(file))
+            return PICOZIP_EINVAL;
+
+        if ((err = picozip__queue_source(file, path, mod_time, comment, comment_len, &source)) != PICOZIP_OK)
+            return err;
+        source->data = data;
+        source->size = size;
+        return PICOZIP_OK;
+    }
+
+    int picozip_queue_entry_cb(picozip_file *file, const char *const path, picozip_read_callback read_cb, void *userdata, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        picozip__source *source;
+        int err;
+
+        if (!file || !path || !read_cb || (comment_len && !comment) || !PICOZIP__IS_READER(file))
+            return PICOZIP_EINVAL;
+
+        if ((err = picozip__queue_source(file, path, mod_time, comment, comment_len, &source)) != PICOZIP_OK)
+            return err;
+        source->read_cb = read_cb;
+        source->read_userdata = userdata;
+        return PICOZIP_OK;
+    }
+
+    int picozip_queue_entry_pread(picozip_file *file, const char *const path, picozip_pread_callback pread_cb, void *userdata, uint64_t size, uint32_t crc32, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        picozip__source *source;
+        int err;
+
+        if (!file || !path || !pread_cb || (comment_len && !comment) || !PICOZIP__IS_READER(file))
+            return PICOZIP_EINVAL;
+
+        if ((err = picozip__queue_source(file, path, mod_time, comment, comment_len, &source)) != PICOZIP_OK)
+            return err;
+        source->pread_cb = pread_cb;
+        source->read_userdata = userdata;
+        source->size = size;
+        source->entry->crc32 = crc32;
+        source->has_crc = 1;
+        return PICOZIP_OK;
+    }
+
+#ifndef PICOZIP_NO_STDIO
+#if defined(_WIN32)
+#define picozip__fseek(F, O) _fseeki64((F), (__int64)(O), SEEK_SET)
+#define picozip__ftell(F) _ftelli64(F)
+#elif defined(PICOZIP__UNIX)
+#define picozip__fseek(F, O) fseeko((F), (off_t)(O), SEEK_SET)
+#define picozip__ftell(F) ftello(F)
+#else
+#define picozip__fseek(F, O) fseek((F), (long)(O), SEEK_SET)
+#define picozip__ftell(F) ftell(F)
+#endif
+
+    /* opens a file source, picking up its size and modification time */
+    static int picozip__source_open(picozip_file *file, picozip__reader *reader, picozip__source *source)
+    {
+#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
+        picozip__entry *entry = source->entry;
+        picozip__stat f_stat;
+#else
+        long end;
+#endif
+
+        if (reader->fptr_owner == source)
+            return PICOZIP_OK;
+        if (reader->fptr)
+            fclose(reader->fptr);
+        reader->fptr_owner = NULL;
+        if (!(reader->fptr = fopen(source->file_path, "rb")))
+            return errno;
+
+#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
+        if (picozip__fstat(picozip__fileno(reader->fptr), &f_stat) != 0)
+            return errno;
+        source->size = (uint64_t)f_stat.st_size;
+        entry->mod_time = f_stat.st_mtime;
+        picozip__entry_dostime(file, entry);
+        PICOZIP__WRITE_LE32(entry->metadata, entry->filename_len + 5, ((uint32_t)entry->mod_time));
+#else
+        (void)(file);
+        if (fseek(reader->fptr, 0, SEEK_END) != 0 || (end = ftell(reader->fptr)) < 0 || fseek(reader->fptr, 0, SEEK_SET) != 0)
+            return PICOZIP_EIO;
+        source->size = (uint64_t)end;
+#endif
+        reader->fptr_owner = source;
+        return PICOZIP_OK;
+    }
+
+    static void picozip__source_close(picozip__reader *reader)
+    {
+        if (reader->fptr)
+            fclose(reader->fptr);
+        reader->fptr = NULL;
+        reader->fptr_owner = NULL;
+    }
+#endif
+
+    /* reads <size> bytes of a source with a known size, from <offset> */
+    static int picozip__source_pread(picozip_file *file, picozip__reader *reader, picozip__source *source, uint64_t offset, uint8_t *dst, size_t size)
+    {
+        size_t n;
+#ifndef PICOZIP_NO_STDIO
+        int err;
+#endif
+
+        if (source->pread_cb)
+        {
+            for (; size; size -= n, offset += n, dst += n)
+            {
+                if ((n = source->pread_cb(source->read_userdata, dst, size, offset)) == PICOZIP_READ_ERROR || !n || n > size)
+                    return PICOZIP_EIO;
+            }
+            return PICOZIP_OK;
+        }
+#ifndef PICOZIP_NO_STDIO
+        if (source->file_path)
+        {
+            if ((err = picozip__source_open(file, reader, source)) != PICOZIP_OK)
+                return err;
+            if (offset + size > source->size || picozip__fseek(reader->fptr, offset) != 0 || fread(dst, sizeof(uint8_t), size, reader->fptr) != size)
+                return PICOZIP_EIO;
+            return PICOZIP_OK;
+        }
+#endif
+        (void)(file);
+        (void)(reader);
+        memcpy(dst, source->data + offset, size);
+        return PICOZIP_OK;
+    }
+
+    /* makes sure the CRC of a planned entry is known, reading its content if needed */
+    static int picozip__source_crc(picozip_file *file, picozip__reader *reader, picozip__source *source)
+    {
+        uint64_t offset;
+        size_t n;
+        int err;
+
+        if (source->has_crc)
+            return PICOZIP_OK;
+
+        if (!source->file_path)
+            source->entry->crc32 = picozip__file_crc32(file, source->data, (size_t)source->size, PICOZIP__CRC_START);
+        else
+        {
+            source->entry->crc32 = PICOZIP__CRC_START;
+            for (offset = 0; offset < source->size; offset += n)
+            {
+                n = source->size - offset > PICOZIP_READ_BUF ? PICOZIP_READ_BUF : (size_t)(source->size - offset);
+                if ((err = picozip__source_pread(file, reader, source, offset, reader->chunk, n)) != PICOZIP_OK)
+                    return err;
+                source->entry->crc32 = picozip__file_crc32(file, reader->chunk, n, source->entry->crc32);
+            }
+        }
+        source->has_crc = 1;
+        return PICOZIP_OK;
+    }
+
+    /* opens the next source and writes the local header of its entry */
+    static int picozip__reader_begin(picozip_file *file, picozip__reader *reader, picozip__source *source)
+    {
+        picozip__entry *entry = source->entry;
+        picozip_iovec iov[3];
+        int err;
+
+#ifndef PICOZIP_NO_STDIO
+        /* the modification time is only known now */
+        if (source->file_path && (err = picozip__source_open(file, reader, source)) != PICOZIP_OK)
+            return err;
+#endif
+
+        entry->header_offset = file->offset;
+        reader->pos = 0;
+        reader->active = 1;
+        file->codec = source->codec;
+        file->codec_level = source->codec_level;
+        entry->uncomp_size = source->read_cb ? (uint64_t)-1 : source->size;
+        if (file->codec)
+        {
+            if ((err = picozip__codec_begin(file, entry, &reader->state)) != PICOZIP_OK)
+                reader->state = NULL;
+            return err;
+        }
+
+        /* the sizes and CRC are only known at the end, like picozip_new_entry_file */
+        entry->flags = PICOZIP__FLAG_DATADESC;
+        entry->crc32 = PICOZIP__CRC_START;
+        picozip__prepare_datadesc(entry, entry->uncomp_size);
+        entry->comp_size = entry->uncomp_size = 0;
+        return picozip__writev(file, iov, picozip__encode_local_header(entry, file->scratch, iov));
+    }
+
+    /* writes the next chunk of the active source, and its data descriptor after the last one */
+    static int picozip__reader_step(picozip_file *file, picozip__reader *reader, picozip__source *source)
+    {
+        picozip__entry *entry = source->entry;
+        const uint8_t *data = reader->chunk;
+        uint8_t desc[PICOZIP__DATADESC64_SIZE];
+        picozip_iovec iov[2];
+        size_t n, room, limit;
+        int last, err;
+
+        if (source->read_cb)
+        {
+            if ((n = source->read_cb(source->read_userdata, reader->chunk, PICOZIP_READ_BUF)) == PICOZIP_READ_ERROR || n > PICOZIP_READ_BUF)
+                return PICOZIP_EIO;
+            last = !n;
+        }
+        else if (source->pread_cb)
+        {
+            n = source->size - reader->pos > PICOZIP_READ_BUF ? PICOZIP_READ_BUF : (size_t)(source->size - reader->pos);
+            if ((err = picozip__source_pread(file, reader, source, reader->pos, reader->chunk, n)) != PICOZIP_OK)
+                return err;
+            reader->pos += n;
+            last = reader->pos == source->size;
+        }
+#ifndef PICOZIP_NO_STDIO
+        else if (reader->fptr)
+        {
+            n = fread(reader->chunk, sizeof(uint8_t), PICOZIP_READ_BUF, reader->fptr);
+            if (ferror(reader->fptr))
+                return PICOZIP_EIO;
+            last = n != PICOZIP_READ_BUF;
+        }
+#endif
+        else
+        {
+            /* stored content goes straight to the caller's buffer, as much as it takes */
+            room = reader->out_size - reader->out_used;
+            limit = file->codec || room < PICOZIP_READ_BUF ? PICOZIP_READ_BUF : room;
+            n = source->size - reader->pos > limit ? limit : (size_t)(source->size - reader->pos);
+            data = source->data + reader->pos;
+            reader->pos += n;
+            last = reader->pos == source->size;
+        }
+
+        if (file->codec)
+        {
+            err = picozip__codec_feed(file, entry, reader->state, data, n, last ? PICOZIP_FLUSH_FINISH : PICOZIP_FLUSH_NONE, 1);
+            if (last)
+            {
+                err = picozip__codec_end(file, entry, reader->state, err);
+                reader->state = NULL;
+            }
+        }
+        else
+        {
+            entry->crc32 = picozip__file_crc32(file, data, n, entry->crc32);
+            entry->comp_size += n;
+            entry->uncomp_size += n;
+            iov[0].base = data;
+            iov[0].len = n;
+            iov[1].base = desc;
+            iov[1].len = last ? picozip__encode_datadesc(entry, desc) : 0;
+            err = picozip__writev(file, iov, 2);
+        }
+
+        if (last)
+        {
+#ifndef PICOZIP_NO_STDIO
+            picozip__source_close(reader);
+#endif
+            reader->active = 0;
+        }
+        return err;
+    }
+
+    /* copies the part of [<pos>, <end>) covered by the chunks, which start at <start> in the archive, to <dst> */
+    static uint64_t picozip__range_copy(const picozip_iovec *iov, size_t iovcnt, uint64_t start, uint64_t pos, uint64_t end, uint8_t *dst)
+    {
+        size_t i, n;
+
+        for (i = 0; i < iovcnt && pos < end; start += iov[i++].len)
+        {
+            if (pos < start || pos >= start + iov[i].len)
+                continue;
+            n = (size_t)((start + iov[i].len < end ? start + iov[i].len : end) - pos);
+            memcpy(dst, (const uint8_t *)iov[i].base + (pos - start), n);
+            dst += n;
+            pos += n;
+        }
+        return pos;
+    }
+
+    int picozip_plan(picozip_file *file, uint64_t *osize, uint64_t *offsets)
+    {
+        uint8_t header[PICOZIP__CD_HEADER_SIZE + PICOZIP__ZIP64_CD_SIZE];
+        uint8_t eocd[PICOZIP__ZIP64_EOCD_SIZE + PICOZIP__ZIP64_LOCATOR_SIZE + PICOZIP__EOCD_SIZE];
+        picozip__reader *reader;
+        picozip__source *source;
+        picozip__entry *entry;
+        picozip_iovec iov[4];
+        uint64_t offset;
+        size_t i, n;
+#ifndef PICOZIP_NO_STDIO
+        int err;
+#endif
+
+        if (!file || !osize || !PICOZIP__IS_READER(file))
+            return PICOZIP_EINVAL;
+
+        reader = (picozip__reader *)file->userdata;
+        n = reader->sources.size / sizeof(picozip__source);
+        if (reader->next || reader->planned)
+            return PICOZIP_EINVAL;
+
+        /* only stored entries with a known size can be laid out in advance */
+        for (i = 0; i < n; i++)
+        {
+            source = &((picozip__source *)reader->sources.data)[i];
+            if (source->codec || source->read_cb)
+                return PICOZIP_EINVAL;
+        }
+        if (!(reader->cd_offsets = (uint64_t *)picozip__alloc(file, (n + 1) * sizeof(uint64_t))))
+            return PICOZIP_ENOMEM;
+
+        offset = 0;
+        reader->cd_offsets[0] = 0;
+        for (i = 0; i < n; i++)
+        {
+            source = &((picozip__source *)reader->sources.data)[i];
+            entry = source->entry;
+#ifndef PICOZIP_NO_STDIO
+            if (source->file_path)
+            {
+                err = picozip__source_open(file, reader, source);
+                picozip__source_close(reader);
+                if (err != PICOZIP_OK)
+                {
+                    file->free_cb(file->userdata, reader->cd_offsets);
+                    reader->cd_offsets = NULL;
+                    return err;
+                }
+            }
+#endif
+            entry->flags = entry->comp_method = 0;
+            entry->version_extract = source->size >= PICOZIP__ZIP64_LIMIT ? PICOZIP__ZIP64_VERSION : PICOZIP__MIN_VERSION;
+            entry->comp_size = entry->uncomp_size = source->size;
+            entry->header_offset = offset;
+            if (offsets)
+                offsets[i] = offset;
+            offset += picozip__iov_len(iov, picozip__encode_local_header(entry, file->scratch, iov)) + source->size;
+            reader->cd_offsets[i + 1] = reader->cd_offsets[i] + picozip__iov_len(iov, picozip__encode_central(entry, header, iov));
+        }
+
+        reader->cd_offset = offset;
+        reader->size = offset + reader->cd_offsets[n] + picozip__encode_eocd(n, reader->cd_offsets[n], offset, 0, eocd);
+        reader->planned = 1;
+        *osize = reader->size;
+        return PICOZIP_OK;
+    }
+
+    int picozip_read_at(picozip_file *file, uint64_t offset, void *buf, size_t size, size_t *oread)
+    {
+        uint8_t header[PICOZIP__CD_HEADER_SIZE + PICOZIP__ZIP64_CD_SIZE];
+        uint8_t eocd[PICOZIP__ZIP64_EOCD_SIZE + PICOZIP__ZIP64_LOCATOR_SIZE + PICOZIP__EOCD_SIZE];
+        picozip__reader *reader;
+        picozip__source *sources;
+        picozip__entry *entry;
+        picozip_iovec iov[4];
+        uint64_t pos, end, start, cd_size;
+        size_t i, lo, hi, n, len;
+        int err;
+
+        if (!file || (size && !buf) || !oread || !PICOZIP__IS_READER(file) || !((picozip__reader *)file->userdata)->planned)
+            return PICOZIP_EINVAL;
+
+        reader = (picozip__reader *)file->userdata;
+        sources = (picozip__source *)reader->sources.data;
+        n = reader->sources.size / sizeof(picozip__source);
+        cd_size = reader->cd_offsets[n];
+        *oread = 0;
+        if (offset >= reader->size)
+            return PICOZIP_OK;
+        if (size > reader->size - offset)
+            size = (size_t)(reader->size - offset);
+        pos = offset;
+        end = offset + size;
+
+        /* the local entries, starting with the last one whose header is at or before <pos> */
+        for (lo = 0, hi = n; hi - lo > 1;)
+        {
+            i = lo + (hi - lo) / 2;
+            if (sources[i].entry->header_offset <= pos)
+                lo = i;
+            else
+                hi = i;
+        }
+        for (i = lo; i < n && pos < end && pos < reader->cd_offset; i++)
+        {
+            entry = sources[i].entry;
+            if ((err = picozip__source_crc(file, reader, &sources[i])) != PICOZIP_OK)
+                return err;
+            len = picozip__encode_local_header(entry, file->scratch, iov);
+            pos = picozip__range_copy(iov, len, entry->header_offset, pos, end, (uint8_t *)buf + (pos - offset));
+
+            start = entry->header_offset + picozip__iov_len(iov, len);
+            if (pos < end && pos >= start && pos < start + sources[i].size)
+            {
+                len = (size_t)((start + sources[i].size < end ? start + sources[i].size : end) - pos);
+                if ((err = picozip__source_pread(file, reader, &sources[i], pos - start, (uint8_t *)buf + (pos - offset), len)) != PICOZIP_OK)
+                    return err;
+                pos += len;
+            }
+        }
+
+        /* then the central directory records */
+        if (pos < end && pos < reader->cd_offset + cd_size)
+        {
+            for (lo = 0, hi = n; hi - lo > 1;)
+            {
+                i = lo + (hi - lo) / 2;
+                if (reader->cd_offset + reader->cd_offsets[i] <= pos)
+                    lo = i;
+                else
+                    hi = i;
+            }
+            for (i = lo; i < n && pos < end; i++)
+            {
+                if ((err = picozip__source_crc(file, reader, &sources[i])) != PICOZIP_OK)
+                    return err;
+                len = picozip__encode_central(sources[i].entry, header, iov);
+                pos = picozip__range_copy(iov, len, reader->cd_offset + reader->cd_offsets[i], pos, end, (uint8_t *)buf + (pos - offset));
+            }
+        }
+
+        /* and the end records */
+        if (pos < end)
+        {
+            iov[0].base = eocd;
+            iov[0].len = picozip__encode_eocd(n, cd_size, reader->cd_offset, 0, eocd);
+            pos = picozip__range_copy(iov, 1, reader->cd_offset + cd_size, pos, end, (uint8_t *)buf + (pos - offset));
+        }
+
+        *oread = (size_t)(pos - offset);
+        return PICOZIP_OK;
+    }
+
+    int picozip_read(picozip_file *file, void *buf, size_t size, size_t *oread)
+    {
+        picozip__reader *reader;
+        picozip__source *sources;
+        int err;
+
+        if (!file || !buf || !size || !oread || !PICOZIP__IS_READER(file))
+            return PICOZIP_EINVAL;
+
+        reader = (picozip__reader *)file->userdata;
+        *oread = 0;
+        if (reader->err)
+            return reader->err;
+
+        /* a planned archive is read in ranges, with nothing left over between calls */
+        if (reader->planned)
+        {
+            err = picozip_read_at(file, reader->read_pos, buf, size, oread);
+            reader->read_pos += *oread;
+            return err;
+        }
+
+        reader->out = (uint8_t *)buf;
+        reader->out_size = size;
+        reader->out_used = 0;
+        sources = (picozip__source *)reader->sources.data;
+        err = PICOZIP_OK;
+        while (reader->out_used < size)
+        {
+            /* what didn't fit last time goes first, the archive is only generated once the backlog is out */
+            if ((err = picozip__backlog_write(file)) != PICOZIP_OK || reader->done)
+                break;
+            if (reader->active)
+                err = picozip__reader_step(file, reader, &sources[reader->next - 1]);
+            else if (reader->next * sizeof(picozip__source) < reader->sources.size)
+                err = picozip__reader_begin(file, reader, &sources[reader->next++]);
+            else if ((err = picozip_end(file)) == PICOZIP_OK)
+                reader->done = 1;
+            if (err != PICOZIP_OK)
+                break;
+        }
+        *oread = reader->out_used;
+        reader->out = NULL;
+        reader->out_size = reader->out_used = 0;
+
+        /* a full buffer isn't an error */
+        if (err == PICOZIP_EAGAIN)
+            err = PICOZIP_OK;
+        reader->err = err;
+        return err;
+    }
+
+    int picozip_free_reader(picozip_file *file)
+    {
+        picozip__reader *reader;
+        size_t i;
+
+        if (!file || !PICOZIP__IS_READER(file))
+            return PICOZIP_EINVAL;
+
+        reader = (picozip__reader *)file->userdata;
+        if (reader->state)
+            file->codec->end(reader->state);
+#ifndef PICOZIP_NO_STDIO
+        picozip__source_close(reader);
+#endif
+        file->free_cb(file->userdata, reader->cd_offsets);
+        for (i = 0; i < reader->sources.size / sizeof(picozip__source); i++)
+            file->free_cb(file->userdata, ((picozip__source *)reader->sources.data)[i].file_path);
+        file->free_cb(file->userdata, reader->sources.data);
+        picozip_free(file);
+        picozip__mem_free(NULL, reader);
+        return PICOZIP_OK;
+    }
+
+#ifndef PICOZIP_NO_STDIO
+
+    /* tells the OS that <fptr> is going to be read once, from start to end */
+    static void picozip__advise_sequential(FILE *fptr)
+    {
+#if defined(PICOZIP__UNIX) && defined(POSIX_FADV_SEQUENTIAL)
+        posix_fadvise(picozip__fileno(fptr), 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+        (void)(fptr);
+#endif
+    }
+
+    /* drops the pages of a file opened by picozip from the page cache once it has been archived */
+    static void picozip__advise_done(FILE *fptr)
+    {
+#if defined(PICOZIP__UNIX) && defined(POSIX_FADV_DONTNEED)
+        posix_fadvise(picozip__fileno(fptr), 0, 0, POSIX_FADV_DONTNEED);
+#else
+        (void)(fptr);
+#endif
+    }
+
+#ifdef PICOZIP__URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/* syscall() is only declared with _DEFAULT_SOURCE, C++ compilers define _GNU_SOURCE */
+#ifndef __cplusplus
+    extern long syscall(long number, ...);
+#endif
+
+/* number of requests in flight, and the size of the buffer each of them uses */
+#define PICOZIP__URING_DEPTH 4
+#define PICOZIP__URING_BUF 131072
+
+/* smaller files are read with stdio, setting up the reads would cost more than they save */
+#define PICOZIP__URING_MIN (2 * PICOZIP__URING_BUF)
+
+    /** An io_uring with a buffer for each request in flight, reading or writing one file in order. */
+    typedef struct picozip__uring
+    {
+        int ring_fd, fd;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size, sqes_size;
+        int fixed;        /* the buffers are registered with the ring */
+        int writing;
+        struct iovec bufs[PICOZIP__URING_DEPTH];
+        struct iovec reqs[PICOZIP__URING_DEPTH]; /* the part of each buffer its request uses */
+        int busy[PICOZIP__URING_DEPTH];
+        size_t res[PICOZIP__URING_DEPTH];        /* bytes read or written by the last request of each buffer */
+        unsigned in_flight;
+        unsigned cur;     /* buffer being filled or emptied */
+        size_t pos;       /* bytes filled or emptied from it */
+        uint64_t offset;  /* of the next request */
+        uint64_t total;   /* bytes read so far */
+        int eof, err;
+        FILE *fptr;       /* the output of picozip_new_path */
+    } picozip__uring;
+
+    /* sets up a ring and its buffers, registering them if the kernel lets us */
+    static int picozip__uring_init(picozip_alloc_callback alloc_cb, picozip_free_callback free_cb, void *userdata, picozip__uring **oring)
+    {
+        struct io_uring_params params;
+        picozip__uring *ring;
+        uint8_t *mem;
+        unsigned i;
+
+        if (!(mem = (uint8_t *)alloc_cb(userdata, sizeof(picozip__uring) + PICOZIP__URING_DEPTH * PICOZIP__URING_BUF)))
+            return PICOZIP_ENOMEM;
+        ring = (picozip__uring *)mem;
+        memset(ring, 0, sizeof(picozip__uring));
+        memset(&params, 0, sizeof(params));
+        if ((ring->ring_fd = (int)syscall(__NR_io_uring_setup, PICOZIP__URING_DEPTH, &params)) < 0)
+        {
+            free_cb(userdata, mem);
+            return errno;
+        }
+
+        ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->ring_fd, IORING_OFF_SQ_RING);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            ring->cq_ring = ring->sq_ring;
+        else
+            ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->ring_fd, IORING_OFF_CQ_RING);
+        ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->ring_fd, IORING_OFF_SQES);
+        if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || (void *)ring->sqes == MAP_FAILED)
+        {
+            picozip__uring_free(ring, free_cb, userdata);
+            return PICOZIP_ENOMEM;
+        }
+
+        ring->sq_head = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.head);
+        ring->sq_tail = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.tail);
+        ring->sq_mask = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)((uint8_t *)ring->sq_ring + params.sq_off.array);
+        ring->cq_head = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.head);
+        ring->cq_tail = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.tail);
+        ring->cq_mask = (unsigned *)((uint8_t *)ring->cq_ring + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ring + params.cq_off.cqes);
+
+        /* registered buffers save mapping the pages on every request, but count against RLIMIT_MEMLOCK */
+        for (i = 0; i < PICOZIP__URING_DEPTH; i++)
+        {
+            ring->bufs[i].iov_base = mem + sizeof(picozip__uring) + i * PICOZIP__URING_BUF;
+            ring->bufs[i].iov_len = PICOZIP__URING_BUF;
+        }
+        ring->fixed = syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS, ring->bufs, PICOZIP__URING_DEPTH) == 0;
+        *oring = ring;
+        return PICOZIP_OK;
+    }
+
+    /* waits for a request to complete */
+    static int picozip__uring_reap(picozip__uring *ring)
+    {
+        struct io_uring_cqe *cqe;
+        unsigned head, i;
+
+        head = *ring->cq_head;
+        while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (syscall(__NR_io_uring_enter, ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return ring->err = errno;
+        }
+
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        i = (unsigned)cqe->user_data;
+        if (cqe->res < 0)
+        {
+            if (!ring->err)
+                ring->err = -cqe->res;
+            ring->res[i] = 0;
+        }
+        else
+        {
+            ring->res[i] = (size_t)cqe->res;
+            /* regular files are only written short when something went wrong */
+            if (ring->writing && ring->res[i] != ring->reqs[i].iov_len && !ring->err)
+                ring->err = PICOZIP_EIO;
+        }
+        ring->busy[i] = 0;
+        ring->in_flight--;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        return PICOZIP_OK;
+    }
+
+    /* submits a request for the first <len> bytes of buffer <i>, at the next offset */
+    static int picozip__uring_queue(picozip__uring *ring, unsigned i, size_t len)
+    {
+        struct io_uring_sqe *sqe;
+        unsigned tail, index;
+        long n;
+
+        tail = *ring->sq_tail;
+        index = tail & *ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        ring->reqs[i].iov_base = ring->bufs[i].iov_base;
+        ring->reqs[i].iov_len = len;
+        if (ring->fixed)
+        {
+            sqe->opcode = ring->writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->addr = (uint64_t)(uintptr_t)ring->bufs[i].iov_base;
+            sqe->len = (uint32_t)len;
+            sqe->buf_index = (uint16_t)i;
+        }
+        else
+        {
+            sqe->opcode = ring->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->addr = (uint64_t)(uintptr_t)&ring->reqs[i];
+            sqe->len = 1;
+        }
+        sqe->fd = ring->fd;
+        sqe->off = ring->offset;
+        sqe->user_data = i;
+        ring->sq_array[index] = index;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        while ((n = syscall(__NR_io_uring_enter, ring->ring_fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR)
+            ;
+        if (n != 1)
+            return ring->err = n < 0 ? errno : PICOZIP_EIO;
+        ring->offset += len;
+        ring->busy[i] = 1;
+        ring->in_flight++;
+        return PICOZIP_OK;
+    }
+
+    /* waits for every request in flight */
+    static void picozip__uring_wait(picozip__uring *ring)
+    {
+        while (ring->in_flight && picozip__uring_reap(ring) == PICOZIP_OK)
+            ;
+    }
+
+    static void picozip__uring_free(picozip__uring *ring, picozip_free_callback free_cb, void *userdata)
+    {
+        picozip__uring_wait(ring);
+        if (ring->sqes && (void *)ring->sqes != MAP_FAILED)
+            munmap((void *)ring->sqes, ring->sqes_size);
+        if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->ring_fd);
+        free_cb(userdata, ring);
+    }
+
+    /* copies the output into the buffers, writing each one out as it fills up while the next one is filled */
+    static size_t picozip__uring_write(void *userdata, const void *mem, size_t len)
+    {
+        picozip__uring *ring;
+        size_t n, done;
+
+        ring = (picozip__uring *)userdata;
+        for (done = 0; done < len && !ring->err; done += n)
+        {
+            if (ring->pos == PICOZIP__URING_BUF)
+            {
+                if (picozip__uring_queue(ring, ring->cur, ring->pos) != PICOZIP_OK)
+                    break;
+                ring->cur = (ring->cur + 1) % PICOZIP__URING_DEPTH;
+                ring->pos = 0;
+                while (ring->busy[ring->cur] && picozip__uring_reap(ring) == PICOZIP_OK)
+                    ;
+                if (ring->err)
+                    break;
+            }
+            n = len - done < PICOZIP__URING_BUF - ring->pos ? len - done : PICOZIP__URING_BUF - ring->pos;
+            memcpy((uint8_t *)ring->bufs[ring->cur].iov_base + ring->pos, (const uint8_t *)mem + done, n);
+            ring->pos += n;
+        }
+        return ring->err ? 0 : len;
+    }
+
+    /* writes out the buffer being filled and waits for every write, returning the first error */
+    static int picozip__uring_flush(picozip__uring *ring)
+    {
+        if (ring->pos && !ring->err && picozip__uring_queue(ring, ring->cur, ring->pos) == PICOZIP_OK)
+        {
+            ring->cur = (ring->cur + 1) % PICOZIP__URING_DEPTH;
+            ring->pos = 0;
+        }
+        picozip__uring_wait(ring);
+        return ring->err;
+    }
+
+    /* returns the ring picozip_new_entry_file reads with, or NULL to use stdio */
+    static picozip__uring *picozip__uring_input(picozip_file *file)
+    {
+        if (!file->uring_in && !file->uring_failed && picozip__uring_init(PICOZIP__ALLOCATOR(file), &file->uring_in) != PICOZIP_OK)
+            file->uring_failed = 1;
+        return file->uring_in;
+    }
+
+    /* starts reading <fd> from <offset> with every buffer in flight */
+    static int picozip__uring_begin_read(picozip__uring *ring, int fd, uint64_t offset)
+    {
+        unsigned i;
+
+        ring->fd = fd;
+        ring->offset = offset;
+        ring->writing = 0;
+        ring->cur = 0;
+        ring->pos = 0;
+        ring->total = 0;
+        ring->eof = ring->err = 0;
+        for (i = 0; i < PICOZIP__URING_DEPTH; i++)
+        {
+            if (picozip__uring_queue(ring, i, PICOZIP__URING_BUF) != PICOZIP_OK)
+                break;
+        }
+        return i ? PICOZIP_OK : ring->err;
+    }
+
+    /* hands out the buffers in order as their reads complete, reading further into each one once it is used up */
+    static size_t picozip__uring_read(void *userdata, void *mem, size_t size)
+    {
+        picozip__uring *ring;
+        size_t n, done;
+        unsigned i;
+
+        ring = (picozip__uring *)userdata;
+        for (done = 0; done < size && !ring->eof;)
+        {
+            i = ring->cur;
+            while (ring->busy[i] && !ring->err)
+                picozip__uring_reap(ring);
+            if (ring->err)
+                return PICOZIP_READ_ERROR;
+
+            if (ring->pos < ring->res[i])
+            {
+                n = size - done < ring->res[i] - ring->pos ? size - done : ring->res[i] - ring->pos;
+                memcpy((uint8_t *)mem + done, (uint8_t *)ring->bufs[i].iov_base + ring->pos, n);
+                ring->pos += n;
+                done += n;
+                continue;
+            }
+
+            /* a short read is the end of the file, and the reads after it come back empty */
+            if (ring->res[i] < PICOZIP__URING_BUF)
+            {
+                ring->eof = 1;
+                break;
+            }
+            if (picozip__uring_queue(ring, i, PICOZIP__URING_BUF) != PICOZIP_OK)
+                return PICOZIP_READ_ERROR;
+            ring->cur = (i + 1) % PICOZIP__URING_DEPTH;
+            ring->pos = 0;
+        }
+        ring->total += done;
+        return done;
+    }
+#endif /* ifdef PICOZIP__URING */
+
+    int picozip_new_entry_file(picozip_file *file, const char *const path, FILE *fptr, const char *const comment, size_t comment_len)
+    {
+        picozip_read_callback read_cb;
+        void *read_userdata;
+        size_t data_read, bound;
+        uint8_t *buffer;
+        picozip__entry *entry;
+        time_t mod_time;
+        int err;
+#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
+        picozip__stat f_stat;
+#endif
+#ifdef PICOZIP__URING
+        picozip__uring *ring;
+        off_t start;
+#endif
+
+        if (!file || !path || !fptr || (comment_len && !comment))
+            return PICOZIP_EINVAL;
+
+#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
+        if (picozip__fstat(picozip__fileno(fptr), &f_stat) != 0)
+            return errno;
+        mod_time = f_stat.st_mtime;
+#else
+        mod_time = time(NULL);
+#endif
+
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+        if (!PICOZIP__POOL_STREAM(file) && (err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        picozip__advise_sequential(fptr);
+
+        /* the content is bounded by the size of a regular file, and only needs ZIP64 sizes near 4 GiB */
+        bound = (size_t)-1;
+#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
+        if (picozip__isreg(f_stat.st_mode) && f_stat.st_size >= 0 && (uint64_t)f_stat.st_size < (uint64_t)(size_t)-1)
+            bound = (size_t)f_stat.st_size;
+#endif
+        entry = picozip__new_sized_entry(file, path, bound, mod_time, comment, comment_len);
+        if (!entry)
+            return PICOZIP_ENOMEM;
+
+        read_cb = picozip__fread;
+        read_userdata = fptr;
+#ifdef PICOZIP__URING
+        /* large files are read by the kernel while the content read before is checksummed and written */
+        ring = NULL;
+        if (S_ISREG(f_stat.st_mode) && f_stat.st_size >= PICOZIP__URING_MIN && !picozip__pool_usable(file) && !file->nonblocking &&
+            (start = ftello(fptr)) >= 0 && (ring = picozip__uring_input(file)) && picozip__uring_begin_read(ring, picozip__fileno(fptr), (uint64_t)start) == PICOZIP_OK)
+        {
+            read_cb = picozip__uring_read;
+            read_userdata = ring;
+        }
+        else
+            ring = NULL;
+#endif
+
+        if (PICOZIP__POOL_STREAM(file))
+            err = picozip__pool_stream(file, entry, read_cb, read_userdata, (size_t)-1, 1, 0, &data_read);
+        else if (!(buffer = picozip__read_buffer(file)))
+            err = PICOZIP_ENOMEM;
+        else
+        {
+            /* an entry left for picozip_pump is never read by io_uring */
+            picozip__stream_input(file, read_cb, read_userdata, buffer, file->read_buf_size, (uint64_t)-1);
+            if ((err = picozip__stream_begin(file, entry)) == PICOZIP_EAGAIN)
+                return err;
+        }
+
+#ifdef PICOZIP__URING
+        /* the reads past the end are still in flight, and the stream is left where stdio would leave it */
+        if (ring)
+        {
+            picozip__uring_wait(ring);
+            if (fseeko(fptr, start + (off_t)ring->total, SEEK_SET) != 0 && err == PICOZIP_OK)
+                err = PICOZIP_EIO;
+        }
+#endif
+
+        return picozip__end_entry(file, err);
+    }
+
+/* used by mapped files and, unless their CRC has to be verified, streams */
+#if defined(PICOZIP__UNIX) && defined(__linux__) && !defined(PICOZIP_NO_KERNEL_COPY) && (defined(PICOZIP__MMAP) || !defined(PICOZIP_VERIFY_CRC))
+#define PICOZIP__KCOPY
+#include <unistd.h>
+#include <sys/sendfile.h>
+#if defined(_GNU_SOURCE) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define PICOZIP__COPY_FILE_RANGE
+#endif
+
+/** Smallest file copied by the kernel, below this the syscalls cost more than the copy. */
+#define PICOZIP__KCOPY_MIN 65536
+/** Largest chunk passed to a single copy syscall. */
+#define PICOZIP__KCOPY_CHUNK (1 << 30)
+
+    static size_t picozip__file_write(void *userdata, const void *mem, size_t len);
+
+    /* whether the content can be copied by the kernel, which needs an output it can seek in (not a pipe) */
+    static int picozip__kernel_copy_usable(picozip_file *file)
+    {
+        picozip__stat f_stat;
+
+        if (file->write_cb != picozip__file_write || file->writev_cb || file->codec || file->nonblocking)
+            return 0;
+        return picozip__fstat(picozip__fileno((FILE *)file->userdata), &f_stat) == 0 && S_ISREG(f_stat.st_mode);
+    }
+
+    /*
+     * copies <size> bytes at <off_in> in <fd_in> to the output stream without going through user space.
+     * a system call that fails (EINVAL, EXDEV, ESPIPE...) stops the copy early, and the caller writes
+     * the <ocopied> bytes onwards itself.
+     */
+    static int picozip__kernel_copy(picozip_file *file, int fd_in, off_t off_in, size_t size, size_t *ocopied)
+    {
+        FILE *out;
+        off_t pos;
+        ssize_t n;
+        size_t copied;
+        int fd_out;
+
+        out = (FILE *)file->userdata;
+        *ocopied = 0;
+        if (fflush(out) != 0)
+            return PICOZIP_EIO;
+        /* nothing is copied if the output can't seek, and the caller writes the content itself */
+        if ((pos = ftello(out)) < 0)
+            return PICOZIP_OK;
+
+        fd_out = picozip__fileno(out);
+        copied = 0;
+#ifdef PICOZIP__COPY_FILE_RANGE
+        {
+            /* copy_file_range() can share the extents (reflinks) on filesystems that support it */
+            off_t off_out = pos;
+            while (copied < size && (n = copy_file_range(fd_in, &off_in, fd_out, &off_out, size - copied > PICOZIP__KCOPY_CHUNK ? PICOZIP__KCOPY_CHUNK : size - copied, 0)) > 0)
+                copied += (size_t)n;
+        }
+#endif
+        /* sendfile() writes at the file offset of the output, which fflush() left at <pos> */
+        if (copied < size && (copied == 0 || lseek(fd_out, pos + (off_t)copied, SEEK_SET) >= 0))
+        {
+            while (copied < size && (n = sendfile(fd_out, fd_in, &off_in, size - copied > PICOZIP__KCOPY_CHUNK ? PICOZIP__KCOPY_CHUNK : size - copied)) > 0)
+                copied += (size_t)n;
+        }
+
+        /* move the stream past the copied content */
+        if (fseeko(out, pos + (off_t)copied, SEEK_SET) != 0)
             return PICOZIP_EIO;
-        });
+        PICOZIP__STAT_ADD(file, bytes_written, copied);
+        *ocopied = copied;
+        return PICOZIP_OK;
+    }
+#endif /* ifdef PICOZIP__KCOPY */
+
+#ifdef PICOZIP__MMAP
+#if defined(PICOZIP__WIN)
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
+    /** A file mapped in memory. */
+    typedef struct picozip__mapping
+    {
+        const uint8_t *data; /* NULL for empty files */
+        size_t size;
+        time_t mod_time;
+#if defined(PICOZIP__WIN)
+        HANDLE handle;
+#endif
+    } picozip__mapping;
+
+    /* maps a whole regular file in memory */
+    static int picozip__map_file(FILE *fptr, picozip__mapping *map)
+    {
+        picozip__stat f_stat;
+        void *mem;
+
+        map->data = NULL;
+        map->size = 0;
+        map->mod_time = 0;
+        if (picozip__fstat(picozip__fileno(fptr), &f_stat) != 0)
+            return errno;
 
+        /* only regular files have a meaningful size */
+        if (!picozip__isreg(f_stat.st_mode) || f_stat.st_size < 0 || (uint64_t)f_stat.st_size > (uint64_t)(size_t)-1)
+            return PICOZIP_EINVAL;
+
+        map->size = (size_t)f_stat.st_size;
+        map->mod_time = f_stat.st_mtime;
+        if (!map->size)
+            return PICOZIP_OK;
+
+#if defined(PICOZIP__WIN)
+        if (!(map->handle = CreateFileMappingA((HANDLE)_get_osfhandle(picozip__fileno(fptr)), NULL, PAGE_READONLY, 0, 0, NULL)))
+            return PICOZIP_EIO;
+        if (!(mem = MapViewOfFile(map->handle, FILE_MAP_READ, 0, 0, 0)))
+        {
+            CloseHandle(map->handle);
+            return PICOZIP_EIO;
+        }
+#else
+        if ((mem = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, picozip__fileno(fptr), 0)) == MAP_FAILED)
+            return errno;
+#ifdef POSIX_MADV_SEQUENTIAL
+        posix_madvise(mem, map->size, POSIX_MADV_SEQUENTIAL);
+#endif
+#endif
+        map->data = (const uint8_t *)mem;
         return PICOZIP_OK;
     }
 
-    int picozip_new_entry_mem(picozip_file *file, const char *const path, const uint8_t *data, size_t size)
+    static void picozip__unmap_file(picozip__mapping *map)
+    {
+        if (!map->data)
+            return;
+#if defined(PICOZIP__WIN)
+        UnmapViewOfFile(map->data);
+        CloseHandle(map->handle);
+#else
+        munmap((void *)map->data, map->size);
+#endif
+    }
+
+#ifdef PICOZIP__KCOPY
+    static int picozip__new_entry_kernel_copy(picozip_file *file, const char *const path, FILE *fptr, const picozip__mapping *map, const char *const comment, size_t comment_len)
+    {
+        int err;
+        size_t copied;
+        picozip_iovec iov;
+        picozip__entry *entry;
+
+        if ((err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        entry = picozip__new_sized_entry(file, path, map->size, map->mod_time, comment, comment_len);
+        if (!entry)
+            return PICOZIP_ENOMEM;
+
+        /* the CRC still needs a pass over the mapping, but the content is never copied in user space */
+        entry->crc32 = picozip__pool_crc32(file, map->data, map->size);
+        if ((err = picozip__write_local_entry(file, entry, NULL, 0)) == PICOZIP_OK && (err = picozip__flush(file)) == PICOZIP_OK && (err = picozip__kernel_copy(file, picozip__fileno(fptr), 0, map->size, &copied)) == PICOZIP_OK)
+        {
+            file->offset += copied;
+            /* write whatever the kernel refused to copy (e.g. an output opened for appending) */
+            if (copied < map->size)
+            {
+                iov.base = map->data + copied;
+                iov.len = map->size - copied;
+                err = picozip__writev(file, &iov, 1);
+            }
+        }
+
+        return picozip__end_entry(file, err);
+    }
+#endif /* ifdef PICOZIP__KCOPY */
+#endif /* ifdef PICOZIP__MMAP */
+
+    int picozip_new_entry_path(picozip_file *file, const char *const path, const char *const file_path, const char *const comment, size_t comment_len)
+    {
+        FILE *fptr;
+        int err;
+#ifdef PICOZIP__MMAP
+        picozip__mapping map;
+#endif
+
+        if (!file || !path || !file_path || (comment_len && !comment))
+            return PICOZIP_EINVAL;
+
+        /* don't bother opening the file if the entry is going to be refused */
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+
+        /* open the file for reading */
+        fptr = fopen(file_path, "rb");
+        if (!fptr)
+            return errno;
+
+#ifdef PICOZIP__MMAP
+        /* the size is known up front, so the file can be written like an in-memory entry (unless it has to stop at the backlog limit) */
+        if (!file->nonblocking && picozip__map_file(fptr, &map) == PICOZIP_OK)
+        {
+#ifdef PICOZIP__KCOPY
+            /* large files written to a plain output file are copied by the kernel */
+            if (map.size >= PICOZIP__KCOPY_MIN && picozip__kernel_copy_usable(file))
+                err = picozip__new_entry_kernel_copy(file, path, fptr, &map, comment, comment_len);
+            else
+#endif
+                err = picozip_new_entry_mem_ex(file, path, map.data, map.size, map.mod_time, comment, comment_len);
+            picozip__unmap_file(&map);
+            picozip__advise_done(fptr);
+            fclose(fptr);
+            return err;
+        }
+#endif
+
+        /* an entry left for picozip_pump closes the file once it is done */
+        if ((err = picozip_new_entry_file(file, path, fptr, comment, comment_len)) == PICOZIP_EAGAIN && file->stream.entry)
+        {
+            file->stream.fptr = fptr;
+            return err;
+        }
+        picozip__advise_done(fptr);
+        fclose(fptr);
+        return err;
+    }
+
+    int picozip_new_entry_stream(picozip_file *file, const char *const path, FILE *fptr, size_t size, uint32_t crc32, time_t mod_time, const char *const comment, size_t comment_len)
+    {
+        int err, header;
+        size_t copied;
+        uint8_t *buf;
+        picozip__entry *entry;
+#if defined(PICOZIP__KCOPY) && !defined(PICOZIP_VERIFY_CRC)
+        off_t pos;
+#endif
+
+        if (!file || !path || !fptr || (comment_len && !comment))
+            return PICOZIP_EINVAL;
+
+        if ((err = picozip__backlog_ready(file)) != PICOZIP_OK)
+            return err;
+        if (!PICOZIP__POOL_STREAM(file) && (err = picozip__pool_drain(file)) != PICOZIP_OK)
+            return err;
+
+        entry = picozip__new_sized_entry(file, path, size, mod_time, comment, comment_len);
+        if (!entry)
+            return PICOZIP_ENOMEM;
+
+        picozip__advise_sequential(fptr);
+        if (PICOZIP__POOL_STREAM(file))
+        {
+            /* the entry can only be dropped once none of its blocks are pending */
+#ifdef PICOZIP_VERIFY_CRC
+            if ((err = picozip__pool_stream(file, entry, picozip__fread, fptr, size, 1, 0, &copied)) == PICOZIP_OK && (err = picozip__pool_drain(file)) == PICOZIP_OK && entry->crc32 != crc32)
+                err = PICOZIP_EINVAL;
+#else
+            if ((err = picozip__pool_stream(file, entry, picozip__fread, fptr, size, 0, crc32, &copied)) == PICOZIP_OK && copied != size)
+                err = picozip__pool_drain(file);
+#endif
+            if (err == PICOZIP_OK && copied != size)
+                err = PICOZIP_EIO;
+            return picozip__end_entry(file, err);
+        }
+
+        if (!(buf = picozip__read_buffer(file)))
+        {
+            picozip__free_last_entry(file);
+            return PICOZIP_ENOMEM;
+        }
+
+        header = 1;
+        copied = 0;
+#if defined(PICOZIP__KCOPY) && !defined(PICOZIP_VERIFY_CRC)
+        /* with nothing to checksum, large regular files never need to leave the kernel */
+        if (!file->codec && size >= PICOZIP__KCOPY_MIN && picozip__kernel_copy_usable(file) && (pos = ftello(fptr)) >= 0)
+        {
+            entry->crc32 = crc32;
+            if ((err = picozip__write_local_entry(file, entry, NULL, 0)) == PICOZIP_OK && (err = picozip__flush(file)) == PICOZIP_OK && (err = picozip__kernel_copy(file, picozip__fileno(fptr), pos, size, &copied)) == PICOZIP_OK)
+            {
+                file->offset += copied;
+                /* resync the stream, the kernel doesn't move its file offset */
+                if (copied && fseeko(fptr, pos + (off_t)copied, SEEK_SET) != 0)
+                    err = PICOZIP_EIO;
+            }
+            if (err != PICOZIP_OK)
+                return picozip__end_entry(file, err);
+            header = 0;
+        }
+#endif
+
+        /* the rest is read with its size and CRC known, the first chunk of stored content going out with the header */
+        picozip__stream_input(file, picozip__fread, fptr, buf, file->read_buf_size, size - copied);
+        file->stream.exact = 1;
+        file->stream.header = header;
+        file->stream.given = crc32;
+#ifdef PICOZIP_VERIFY_CRC
+        file->stream.verify = 1;
+#else
+        file->stream.checksum = 0;
+#endif
+        if ((err = picozip__stream_begin(file, entry)) == PICOZIP_EAGAIN)
+            return err;
+
+        return picozip__end_entry(file, err);
+    }
+
+    static size_t picozip__file_write(void *userdata, const void *mem, size_t len)
     {
-        return picozip_new_entry_mem_ex(file, path, data, size, time(NULL), NULL, 0);
+        return userdata ? fwrite(mem, 1, len, (FILE *)userdata) : 0;
     }
 
-    int picozip_end_ex(picozip_file *file, const char *const comment, size_t comment_len)
+    int picozip_queue_entry_path(picozip_file *file, const char *const path, const char *const file_path, const char *const comment, size_t comment_len)
     {
-        picozip__entry *entry;
-        uint16_t dos_date, dos_time;
-        size_t cd_size, cd_offset, i;
+        picozip__source *source;
+        size_t len;
+        int err;
 
-        if (!file || (comment_len && !comment))
+        if (!file || !path || !file_path || (comment_len && !comment) || !PICOZIP__IS_READER(file))
             return PICOZIP_EINVAL;
 
-        cd_size = 0;
-        cd_offset = file->offset;
-        for (i = 0; i < file->num_entries; i++)
-        {
-            entry = ((picozip__entry **)file->entries.data)[i];
-            PICOZIP__WRITE_LE32(file->scratch, 0, PICOZIP__CENTRAL_MAGIC);
-            PICOZIP__WRITE_LE16(file->scratch, 4, entry->version_made);
-            PICOZIP__WRITE_LE16(file->scratch, 6, entry->version_extract);
-            PICOZIP__WRITE_LE16(file->scratch, 8, entry->flags);
-            PICOZIP__WRITE_LE16(file->scratch, 10, entry->comp_method);
-            picozip__time_to_dostime(entry->mod_time, &dos_date, &dos_time);
-            PICOZIP__WRITE_LE16(file->scratch, 12, dos_time);
-            PICOZIP__WRITE_LE16(file->scratch, 14, dos_date);
-            PICOZIP__WRITE_LE32(file->scratch, 16, entry->crc32);
-            PICOZIP__WRITE_LE32(file->scratch, 20, entry->comp_size);
-            PICOZIP__WRITE_LE32(file->scratch, 24, entry->uncomp_size);
-            PICOZIP__WRITE_LE16(file->scratch, 28, entry->filename_len);
-            PICOZIP__WRITE_LE16(file->scratch, 30, entry->extra_field_len);
-            PICOZIP__WRITE_LE16(file->scratch, 32, entry->comment_len);
-            PICOZIP__WRITE_LE16(file->scratch, 34, 0); /* disk start */
-            PICOZIP__WRITE_LE16(file->scratch, 36, entry->internal_attr);
-            PICOZIP__WRITE_LE32(file->scratch, 38, entry->external_attr);
-            PICOZIP__WRITE_LE32(file->scratch, 42, entry->header_offset);
-            PICOZIP__FLUSH(file, file->scratch, PICOZIP__CD_HEADER_SIZE, { return PICOZIP_EIO; });
-            PICOZIP__FLUSH(file, entry->metadata, entry->filename_len + entry->extra_field_len + entry->comment_len, { return PICOZIP_EIO; });
-            cd_size += PICOZIP__CD_HEADER_SIZE + entry->filename_len + entry->extra_field_len + entry->comment_len;
-        }
-
-        PICOZIP__WRITE_LE32(file->scratch, 0, PICOZIP__EOCD_MAGIC);
-        PICOZIP__WRITE_LE16(file->scratch, 4, 0);                  /* disk offset */
-        PICOZIP__WRITE_LE16(file->scratch, 6, 0);                  /* central directory disk offset */
-        PICOZIP__WRITE_LE16(file->scratch, 8, file->num_entries);  /* total number of records in the disk */
-        PICOZIP__WRITE_LE16(file->scratch, 10, file->num_entries); /* total number of records */
-        PICOZIP__WRITE_LE32(file->scratch, 12, cd_size);           /* central directory size */
-        PICOZIP__WRITE_LE32(file->scratch, 16, cd_offset);         /* central directory offset */
-        PICOZIP__WRITE_LE16(file->scratch, 20, comment_len);       /* comment length */
-        PICOZIP__FLUSH(file, file->scratch, PICOZIP__EOCD_SIZE, { return PICOZIP_EIO; });
-
-        if (comment)
-            PICOZIP__FLUSH(file, comment, comment_len, { return PICOZIP_EIO; });
-
+        if ((err = picozip__queue_source(file, path, 0, comment, comment_len, &source)) != PICOZIP_OK)
+            return err;
+        /* the file is opened when the reader reaches it, so only its path is kept */
+        len = strlen(file_path) + 1;
+        if (!(source->file_path = (char *)picozip__alloc(file, len)))
+        {
+            picozip__free_last_entry(file);
+            ((picozip__reader *)file->userdata)->sources.size -= sizeof(picozip__source);
+            return PICOZIP_ENOMEM;
+        }
+        memcpy(source->file_path, file_path, len);
         return PICOZIP_OK;
     }
 
-    int picozip_end(picozip_file *file)
+    int picozip_new_file(picozip_file **ofile, FILE *fptr)
     {
-        return file ? picozip_end_ex(file, NULL, 0) : PICOZIP_EINVAL;
+        if (!ofile || !fptr)
+            return PICOZIP_EINVAL;
+
+        return picozip_new(ofile, picozip__file_write, picozip__mem_alloc, picozip__mem_free, (void *)fptr);
     }
 
-    int picozip_free(picozip_file *file)
+    int picozip_new_path(picozip_file **ofile, const char *const path, const char *const mode)
     {
-        size_t i;
+        FILE *fptr;
+#ifdef PICOZIP__URING
+        picozip__uring *ring;
+        off_t start;
+        int err;
+#endif
 
-        if (!file)
+        if (!ofile || !path || !mode)
             return PICOZIP_EINVAL;
 
-        for (i = 0; i < file->num_entries; i++)
+        fptr = fopen(path, mode);
+        if (!fptr)
+            return errno;
+
+#ifdef PICOZIP__URING
+        /* writes go out at known offsets, which files opened for appending ignore */
+        if (!strchr(mode, 'a') && (start = ftello(fptr)) >= 0 && picozip__uring_init(picozip__mem_alloc, picozip__mem_free, NULL, &ring) == PICOZIP_OK)
         {
-            file->free_cb(file->userdata, ((picozip__entry **)file->entries.data)[i]);
+            ring->fd = picozip__fileno(fptr);
+            ring->fptr = fptr;
+            ring->writing = 1;
+            ring->offset = (uint64_t)start;
+            if ((err = picozip_new(ofile, picozip__uring_write, picozip__mem_alloc, picozip__mem_free, ring)) != PICOZIP_OK)
+            {
+                picozip__uring_free(ring, picozip__mem_free, NULL);
+                fclose(fptr);
+            }
+            return err;
         }
-        file->free_cb(file->userdata, file->entries.data);
-        file->free_cb(file->userdata, file);
-        return PICOZIP_OK;
+#endif
+
+        return picozip_new_file(ofile, fptr);
     }
 
-    static void *picozip__mem_alloc(void *userdata, size_t size)
+    static int picozip__restore_central(picozip_file *file);
+
+    int picozip_free_path(picozip_file *file)
     {
-        (void)(userdata);
-        return malloc(size);
+#ifdef PICOZIP__URING
+        FILE *fptr;
+#endif
+        int err;
+
+        if (!file || !file->userdata)
+            return PICOZIP_EINVAL;
+
+#ifdef PICOZIP__URING
+        if (file->write_cb == picozip__uring_write)
+        {
+            /* the writes in flight finish before the file is closed */
+            fptr = ((picozip__uring *)file->userdata)->fptr;
+            picozip__uring_free((picozip__uring *)file->userdata, file->free_cb, file->userdata);
+            fclose(fptr);
+            file->userdata = NULL;
+            return picozip_free(file);
+        }
+#endif
+        /* an archive that was appended to without being ended gets its central directory back */
+        err = file->appending ? picozip__restore_central(file) : PICOZIP_OK;
+        fclose((FILE *)file->userdata);
+        file->userdata = NULL;
+        picozip_free(file);
+        return err;
     }
 
-    static void picozip__mem_free(void *userdata, void *mem)
+    /* reads <size> bytes at <offset> in <fptr> */
+    static int picozip__read_at(FILE *fptr, uint64_t offset, uint8_t *buf, size_t size)
     {
-        (void)(userdata);
-        free(mem);
+        if (picozip__fseek(fptr, offset) != 0 || fread(buf, sizeof(uint8_t), size, fptr) != size)
+            return PICOZIP_EIO;
+        return PICOZIP_OK;
     }
 
-    static size_t picozip__mem_write(void *userdata, const void *mem, size_t len)
+    /* finds the central directory of the archive in <fptr>, from the end of the file, and keeps the comment of the archive */
+    static int picozip__find_central(picozip_file *file, FILE *fptr, uint64_t *ocount, uint64_t *osize, uint64_t *ooffset)
     {
-        picozip__mem_file *file;
-        uint8_t *data;
+        uint8_t z64[PICOZIP__ZIP64_EOCD_SIZE], *buf, *comment;
+        uint64_t end, cd_end;
+        size_t i, tail_len, len;
+        int err;
 
-        file = (picozip__mem_file *)userdata;
-        if (!file)
-            return 0;
+        if (fseek(fptr, 0, SEEK_END) != 0 || picozip__ftell(fptr) < 0)
+            return PICOZIP_EIO;
+        end = (uint64_t)picozip__ftell(fptr);
 
-        if (!(data = (uint8_t *)picozip__vec_alloc(&file->mem, len, file->file->alloc_cb, file->file->free_cb, file->file->userdata)))
-            return 0;
+        /* the EOCD is followed by a comment of up to 65535 bytes, and preceded by the ZIP64 locator */
+        tail_len = PICOZIP__ZIP64_LOCATOR_SIZE + PICOZIP__EOCD_SIZE + 0xFFFF;
+        if (end < tail_len)
+            tail_len = (size_t)end;
+        if (tail_len < PICOZIP__EOCD_SIZE)
+            return PICOZIP_EINVAL;
+        if (!(buf = (uint8_t *)picozip__alloc(file, tail_len)))
+            return PICOZIP_ENOMEM;
+        if ((err = picozip__read_at(fptr, end - tail_len, buf, tail_len)) != PICOZIP_OK)
+        {
+            file->free_cb(file->userdata, buf);
+            return err;
+        }
 
-        memcpy(data + file->mem.size, mem, len);
-        file->mem.size += len;
+        err = PICOZIP_EINVAL;
+        for (i = tail_len - PICOZIP__EOCD_SIZE + 1; i--;)
+        {
+            if (PICOZIP__READ_LE32(buf, i) != PICOZIP__EOCD_MAGIC || i + PICOZIP__EOCD_SIZE + PICOZIP__READ_LE16(buf, i + 20) != tail_len)
+                continue;
+            /* archives split over several disks are not supported */
+            if (PICOZIP__READ_LE16(buf, i + 4) || PICOZIP__READ_LE16(buf, i + 6))
+                break;
+            *ocount = PICOZIP__READ_LE16(buf, i + 10);
+            *osize = PICOZIP__READ_LE32(buf, i + 12);
+            *ooffset = PICOZIP__READ_LE32(buf, i + 16);
+            cd_end = end - tail_len + i;
+            err = PICOZIP_OK;
 
-        return len;
+            len = PICOZIP__READ_LE16(buf, i + 20);
+            file->old_comment.size = 0;
+            if (len && !(comment = (uint8_t *)picozip__vec_alloc(&file->old_comment, len, PICOZIP__ALLOCATOR(file))))
+            {
+                err = PICOZIP_ENOMEM;
+                break;
+            }
+            if (len)
+                memcpy(comment, buf + i + PICOZIP__EOCD_SIZE, len);
+            file->old_comment.size = len;
+
+            /* the ZIP64 EOCD has the values that don't fit */
+            if (i >= PICOZIP__ZIP64_LOCATOR_SIZE && PICOZIP__READ_LE32(buf, i - PICOZIP__ZIP64_LOCATOR_SIZE) == PICOZIP__ZIP64_LOCATOR_MAGIC)
+            {
+                cd_end = PICOZIP__READ_LE64(buf, i - PICOZIP__ZIP64_LOCATOR_SIZE + 8);
+                if ((err = picozip__read_at(fptr, cd_end, z64, sizeof(z64))) == PICOZIP_OK && PICOZIP__READ_LE32(z64, 0) != PICOZIP__ZIP64_EOCD_MAGIC)
+                    err = PICOZIP_EINVAL;
+                *ocount = PICOZIP__READ_LE64(z64, 32);
+                *osize = PICOZIP__READ_LE64(z64, 40);
+                *ooffset = PICOZIP__READ_LE64(z64, 48);
+            }
+
+            /* the offsets are only right if nothing comes before the archive */
+            if (err == PICOZIP_OK && (*ooffset > cd_end || cd_end - *ooffset != *osize))
+                err = PICOZIP_EINVAL;
+            break;
+        }
+        file->free_cb(file->userdata, buf);
+        return err;
     }
 
-    int picozip_new_mem(picozip_file **ofile)
+    /* loads the central directory records of the archive in <fptr> as they are */
+    static int picozip__load_central(picozip_file *file, FILE *fptr)
     {
-        picozip__mem_file *mem_file;
-        int result;
-
-        if (!ofile)
-            return PICOZIP_EINVAL;
+        uint64_t count, cd_size, cd_offset, n;
+        picozip__slab *block;
+        uint8_t *cd;
+        size_t pos;
+        int err;
 
-        if (!(mem_file = (picozip__mem_file *)picozip__mem_alloc(NULL, sizeof(picozip__mem_file))))
+        if ((err = picozip__find_central(file, fptr, &count, &cd_size, &cd_offset)) != PICOZIP_OK)
+            return err;
+        if (cd_size > (uint64_t)((size_t)-1 - PICOZIP__SLAB_HEADER_SIZE))
             return PICOZIP_ENOMEM;
-        memset(mem_file, 0, sizeof(picozip__mem_file));
 
-        result = picozip_new(ofile, picozip__mem_write, picozip__mem_alloc, picozip__mem_free, (void *)mem_file);
-        if (result == PICOZIP_OK)
-            mem_file->file = *ofile;
+        if (cd_size)
+        {
+            if (!(block = picozip__cd_block(file, (size_t)cd_size)))
+                return PICOZIP_ENOMEM;
+            cd = PICOZIP__SLAB_DATA(block);
+            if ((err = picozip__read_at(fptr, cd_offset, cd, (size_t)cd_size)) != PICOZIP_OK)
+                return err;
+
+            /* the records are kept encoded, they just have to add up */
+            for (n = 0, pos = 0; pos + PICOZIP__CD_HEADER_SIZE <= cd_size && PICOZIP__READ_LE32(cd, pos) == PICOZIP__CENTRAL_MAGIC; n++)
+                pos += PICOZIP__CD_HEADER_SIZE + PICOZIP__READ_LE16(cd, pos + 28) + PICOZIP__READ_LE16(cd, pos + 30) + PICOZIP__READ_LE16(cd, pos + 32);
+            if (pos != cd_size || n != count || n > (uint64_t)((size_t)-1))
+                return PICOZIP_EINVAL;
+            block->used = (size_t)cd_size;
+        }
+
+        file->cd_size = cd_size;
+        file->num_sealed = (size_t)count;
+        file->offset = cd_offset;
 
-        return result;
+        /* new entries overwrite the old central directory, which is only cut off once the new one is written */
+        if (fflush(fptr) != 0 || picozip__fseek(fptr, cd_offset) != 0)
+            return PICOZIP_EIO;
+        file->old_cd_size = cd_size;
+        file->old_cd_offset = cd_offset;
+        file->old_count = (size_t)count;
+        file->appending = 1;
+        return PICOZIP_OK;
     }
 
-    size_t picozip_get_mem(picozip_file *file, void **mem)
+    /* cuts the file of an archive opened for appending where the archive now ends */
+    static int picozip__cut_file(picozip_file *file)
     {
-        if (!file || !file->userdata || !mem)
-            return 0;
-        *mem = ((picozip__mem_file *)file->userdata)->mem.data;
-        return ((picozip__mem_file *)file->userdata)->mem.size;
+        FILE *fptr = (FILE *)file->userdata;
+
+        if (fflush(fptr) != 0 || picozip__ftell(fptr) < 0)
+            return PICOZIP_EIO;
+#if defined(PICOZIP__UNIX)
+        if (ftruncate(picozip__fileno(fptr), (off_t)picozip__ftell(fptr)) != 0)
+            return errno;
+#elif defined(PICOZIP__WIN)
+        if (_chsize_s(picozip__fileno(fptr), (__int64)picozip__ftell(fptr)) != 0)
+            return errno;
+#endif
+        return PICOZIP_OK;
     }
 
-    int picozip_free_mem(picozip_file *file)
+    /* writes the records loaded by picozip_open_append back after whatever was written since, leaving the archive as it was */
+    static int picozip__restore_central(picozip_file *file)
     {
-        if (!file || !file->userdata)
-            return PICOZIP_EINVAL;
+        uint8_t eocd[PICOZIP__ZIP64_EOCD_SIZE + PICOZIP__ZIP64_LOCATOR_SIZE + PICOZIP__EOCD_SIZE];
+        picozip_iovec tail[2];
+        FILE *fptr;
+        int err;
 
-        file->free_cb(file->userdata, ((picozip__mem_file *)file->userdata)->mem.data);
-        file->free_cb(file->userdata, file->userdata);
-        return picozip_free(file);
-    }
+        /* nothing reached the file, so the old central directory is still there */
+        if (file->offset == file->old_cd_offset)
+            return PICOZIP_OK;
 
-#ifndef PICOZIP_NO_STDIO
+        /* what was left to write is thrown away, and the records go right after what the file got */
+#ifdef PICOZIP_THREADS
+        picozip__pool_destroy(file, 1);
+#endif
+        if (file->stream.entry)
+            picozip__stream_end(file, PICOZIP_EIO);
+        file->nonblocking = 0;
+        file->backlog.size = file->backlog_pos = 0;
+        file->buf_used = 0;
+        fptr = (FILE *)file->userdata;
+        if (fflush(fptr) != 0 || picozip__ftell(fptr) < 0)
+            return PICOZIP_EIO;
+        file->offset = (uint64_t)picozip__ftell(fptr);
 
-    int picozip_new_entry_file(picozip_file *file, const char *const path, FILE *fptr, const char *const comment, size_t comment_len)
+        tail[0].base = eocd;
+        tail[0].len = picozip__encode_eocd(file->old_count, file->old_cd_size, file->offset, file->old_comment.size, eocd);
+        tail[1].base = file->old_comment.data;
+        tail[1].len = file->old_comment.size;
+        if ((err = picozip__write_central(file, file->old_cd_size, tail, 2)) != PICOZIP_OK || (err = picozip__flush(file)) != PICOZIP_OK)
+            return err;
+        return picozip__cut_file(file);
+    }
+
+    int picozip_open_append(picozip_file **ofile, const char *const path)
     {
-        size_t filename_len, data_read, file_size;
-        uint8_t buffer[PICOZIP_READ_BUF];
-        picozip__entry *entry;
-        time_t mod_time;
+        FILE *fptr;
         int err;
-#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
-        picozip__stat f_stat;
-#endif
 
-        if (!file || !path || !fptr || (comment_len && !comment))
+        if (!ofile || !path)
             return PICOZIP_EINVAL;
 
-#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
-        if (picozip__fstat(picozip__fileno(fptr), &f_stat) != 0)
+        if (!(fptr = fopen(path, "r+b")))
             return errno;
-        mod_time = f_stat.st_mtime;
+        if ((err = picozip_new_file(ofile, fptr)) != PICOZIP_OK)
+        {
+            fclose(fptr);
+            return err;
+        }
+        if ((err = picozip__load_central(*ofile, fptr)) != PICOZIP_OK)
+        {
+            picozip_free_path(*ofile);
+            *ofile = NULL;
+        }
+        return err;
+    }
+
+#if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX)
+#if defined(PICOZIP__WIN)
+#include <windows.h>
 #else
-        mod_time = time(NULL);
+#include <dirent.h>
 #endif
 
-        filename_len = strlen(path);
-        entry = picozip__alloc_entry(file, filename_len + comment_len + PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE);
-        if (!entry)
-            return PICOZIP_ENOMEM;
+    /** A file or directory found by picozip_add_tree, waiting to be added. */
+    typedef struct picozip__tree_item
+    {
+        char *path;       /* the path on disk, followed by the entry name */
+        const char *name;
+        time_t mod_time;
+        int is_dir;
+    } picozip__tree_item;
 
-        /* populate the entry */
-        entry->version_made = 0;
-        entry->version_extract = PICOZIP__MIN_VERSION;
-        entry->flags = PICOZIP__FLAG_DATADESC;
-        entry->comp_method = entry->internal_attr = entry->external_attr = 0;
-        entry->header_offset = file->offset;
-        entry->mod_time = mod_time;
-        entry->comp_size = entry->uncomp_size = entry->crc32 = 0; /* set in data descriptor */
-        entry->filename_len = filename_len;
-        entry->extra_field_len = PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE;
-        entry->comment_len = comment_len;
-        /* write the filename */
-        memcpy(entry->metadata, path, filename_len);
-        /* write the timestamp field */
-        PICOZIP__WRITE_LE16(entry->metadata, filename_len, PICOZIP__TIMESTAMP_MAGIC);
-        PICOZIP__WRITE_LE16(entry->metadata, filename_len + 2, PICOZIP__LOCAL_TIMESTAMP_SIZE);
-        entry->metadata[filename_len + 4] = 1; /* modtime flag set */
-        PICOZIP__WRITE_LE32(entry->metadata, filename_len + 5, ((uint32_t)entry->mod_time));
-        /* write the comment */
-        memcpy(entry->metadata + filename_len + PICOZIP__ATTR_SIZE + PICOZIP__LOCAL_TIMESTAMP_SIZE, comment, comment_len);
+    /** The files and directories picozip_add_tree has found, in the order they are added. */
+    typedef struct picozip__tree
+    {
+        picozip_file *file;
+        picozip_filter_callback filter_cb;
+        void *userdata;
+        picozip__tree_item items[PICOZIP_TREE_WINDOW];
+        size_t head, count; /* oldest item of the window, and number of items in it */
+        int err;            /* first error hit while adding the items */
+    } picozip__tree;
+
+    /* has the OS start reading <item> into the page cache, ahead of the entry reading it */
+    static void picozip__tree_prefetch(picozip__tree *tree, picozip__tree_item *item)
+    {
+#if defined(PICOZIP__UNIX) && defined(POSIX_FADV_WILLNEED)
+        int fd;
 
-        /* write the header to the output */
-        if ((err = picozip__write_local_entry(file, entry)) != PICOZIP_OK)
+        if (!item->is_dir && (fd = open(item->path, O_RDONLY)) >= 0)
         {
-            picozip__free_last_entry(file);
-            return err;
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
         }
+#else
+        (void)(item);
+#endif
+        tree->count++;
+    }
 
-        /* reset CRC */
-        entry->crc32 = PICOZIP__CRC_START;
-        file_size = 0;
-        do
-        {
-            data_read = fread(buffer, sizeof(uint8_t), PICOZIP_READ_BUF, fptr);
-            entry->crc32 = picozip__crc32(buffer, data_read, entry->crc32);
-            PICOZIP__FLUSH(file, buffer, data_read, {
-                picozip__free_last_entry(file);
-                return PICOZIP_EIO;
-            });
-            file_size += data_read;
-        } while (data_read == PICOZIP_READ_BUF);
-
-        entry->comp_size = entry->uncomp_size = file_size;
-
-        /* write data descriptor */
-        PICOZIP__WRITE_LE32(file->scratch, 0, PICOZIP__DATADESC_MAGIC);
-        PICOZIP__WRITE_LE32(file->scratch, 4, entry->crc32);
-        PICOZIP__WRITE_LE32(file->scratch, 8, entry->comp_size);
-        PICOZIP__WRITE_LE32(file->scratch, 12, entry->uncomp_size);
-        PICOZIP__FLUSH(file, file->scratch, PICOZIP__DATADESC_SIZE, {
-            picozip__free_last_entry(file);
-            return PICOZIP_EIO;
-        });
+    /* takes the oldest item out of the window, adding it to the archive unless adding an item failed before */
+    static void picozip__tree_pop(picozip__tree *tree)
+    {
+        picozip__tree_item *item;
 
-        return PICOZIP_OK;
+        item = &tree->items[tree->head];
+        tree->head = (tree->head + 1) % PICOZIP_TREE_WINDOW;
+        tree->count--;
+
+        /* the slot is only reused by the next item found, after this */
+        if (!tree->err)
+        {
+            if (item->is_dir)
+                tree->err = picozip_new_entry_mem_ex(tree->file, item->name, NULL, 0, item->mod_time, NULL, 0);
+            else
+                tree->err = picozip_new_entry_path(tree->file, item->name, item->path, NULL, 0);
+        }
+        tree->file->free_cb(tree->file->userdata, item->path);
     }
 
-    int picozip_new_entry_path(picozip_file *file, const char *const path, const char *const file_path, const char *const comment, size_t comment_len)
+    /* queues the entry <name> for the file or directory at <path>, making room in the window first */
+    static int picozip__tree_push(picozip__tree *tree, const char *path, size_t path_len, const char *name, size_t name_len, const picozip__stat *f_stat, int is_dir)
     {
-        FILE *fptr;
-        int err;
+        picozip__tree_item *item;
+        char *mem;
 
-        if (!file || !path || !file_path || (comment_len && !comment))
-            return PICOZIP_EINVAL;
+        if (tree->count == PICOZIP_TREE_WINDOW)
+            picozip__tree_pop(tree);
+        if (tree->err)
+            return tree->err;
 
-        /* open the file for reading */
-        fptr = fopen(file_path, "rb");
-        if (!fptr)
-            return errno;
+        if (!(mem = (char *)picozip__alloc(tree->file, path_len + name_len + 3)))
+            return PICOZIP_ENOMEM;
+        memcpy(mem, path, path_len);
+        mem[path_len] = '\0';
+        memcpy(mem + path_len + 1, name, name_len);
+        if (is_dir)
+            mem[path_len + 1 + name_len++] = '/';
+        mem[path_len + 1 + name_len] = '\0';
 
-        err = picozip_new_entry_file(file, path, fptr, comment, comment_len);
-        fclose(fptr);
-        return err;
+        item = &tree->items[(tree->head + tree->count) % PICOZIP_TREE_WINDOW];
+        item->path = mem;
+        item->name = mem + path_len + 1;
+        item->mod_time = f_stat->st_mtime;
+        item->is_dir = is_dir;
+        picozip__tree_prefetch(tree, item);
+        return PICOZIP_OK;
     }
 
-    static size_t picozip__file_write(void *userdata, const void *mem, size_t len)
+    static int picozip__tree_compare(const void *a, const void *b)
     {
-        return userdata ? fwrite(mem, 1, len, (FILE *)userdata) : 0;
+        return strcmp(*(const char *const *)a, *(const char *const *)b);
     }
 
-    int picozip_new_file(picozip_file **ofile, FILE *fptr)
+    /* lists the names in the directory at <path> (of <path_len> bytes) into <names>, NUL separated */
+    static int picozip__tree_list(picozip_file *file, picozip__vec *path, size_t path_len, picozip__vec *names, size_t *ocount)
     {
-        if (!ofile || !fptr)
-            return PICOZIP_EINVAL;
+        char *dst;
+        size_t len;
+        int err;
+#if defined(PICOZIP__WIN)
+        WIN32_FIND_DATAA data;
+        HANDLE handle;
 
-        return picozip_new(ofile, picozip__file_write, picozip__mem_alloc, picozip__mem_free, (void *)fptr);
+        path->size = path_len;
+        if (!(dst = (char *)picozip__vec_alloc(path, 3, PICOZIP__ALLOCATOR(file))))
+            return PICOZIP_ENOMEM;
+        memcpy(dst + path_len, "/*", 3);
+        if ((handle = FindFirstFileA(dst, &data)) == INVALID_HANDLE_VALUE)
+            return GetLastError() == ERROR_FILE_NOT_FOUND ? PICOZIP_OK : PICOZIP_EIO;
+        err = PICOZIP_OK;
+        do
+        {
+            if (!strcmp(data.cFileName, ".") || !strcmp(data.cFileName, ".."))
+                continue;
+            len = strlen(data.cFileName) + 1;
+            if (!(dst = (char *)picozip__vec_alloc(names, len, PICOZIP__ALLOCATOR(file))))
+            {
+                err = PICOZIP_ENOMEM;
+                break;
+            }
+            memcpy(dst + names->size, data.cFileName, len);
+            names->size += len;
+            ++*ocount;
+        } while (FindNextFileA(handle, &data));
+        FindClose(handle);
+#else
+        struct dirent *ent;
+        DIR *dir;
+
+        (void)(path_len);
+        if (!(dir = opendir((const char *)path->data)))
+            return errno;
+        err = PICOZIP_OK;
+        while ((ent = readdir(dir)))
+        {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+            len = strlen(ent->d_name) + 1;
+            if (!(dst = (char *)picozip__vec_alloc(names, len, PICOZIP__ALLOCATOR(file))))
+            {
+                err = PICOZIP_ENOMEM;
+                break;
+            }
+            memcpy(dst + names->size, ent->d_name, len);
+            names->size += len;
+            ++*ocount;
+        }
+        closedir(dir);
+#endif
+        return err;
     }
 
-    int picozip_new_path(picozip_file **ofile, const char *const path, const char *const mode)
+    /* adds the content of the directory at <path>, whose entries are named after the part past <root_len> */
+    static int picozip__tree_walk(picozip__tree *tree, picozip__vec *path, size_t path_len, size_t root_len)
     {
-        FILE *fptr;
+        picozip_file *file;
+        picozip__vec names;
+        picozip__stat f_stat;
+        const char **sorted;
+        size_t i, count, len, name_len;
+        char *dst, *name;
+        int err, is_dir;
 
-        if (!ofile || !path || !mode)
-            return PICOZIP_EINVAL;
+        file = tree->file;
+        memset(&names, 0, sizeof(names));
+        count = 0;
+        sorted = NULL;
+        if ((err = picozip__tree_list(file, path, path_len, &names, &count)) != PICOZIP_OK || !count)
+            goto done;
 
-        fptr = fopen(path, mode);
-        if (!fptr)
-            return errno;
+        /* entries are added in byte order, whatever order the OS lists them in */
+        if (count > ((size_t)-1) / sizeof(char *) || !(sorted = (const char **)picozip__alloc(file, count * sizeof(char *))))
+        {
+            err = PICOZIP_ENOMEM;
+            goto done;
+        }
+        for (name = (char *)names.data, i = 0; i < count; name += strlen(name) + 1, i++)
+            sorted[i] = name;
+        qsort((void *)sorted, count, sizeof(char *), picozip__tree_compare);
 
-        return picozip_new_file(ofile, fptr);
+        for (i = 0; i < count; i++)
+        {
+            /* room for the separator, the name and a trailing slash */
+            len = strlen(sorted[i]);
+            path->size = path_len;
+            if (!(dst = (char *)picozip__vec_alloc(path, len + 3, PICOZIP__ALLOCATOR(file))))
+            {
+                err = PICOZIP_ENOMEM;
+                break;
+            }
+            dst[path_len] = '/';
+            memcpy(dst + path_len + 1, sorted[i], len + 1);
+            len += path_len + 1;
+            name = dst + root_len + 1;
+            name_len = len - root_len - 1;
+
+#if defined(PICOZIP__UNIX)
+            /* links to files are followed like picozip_new_entry_path does, links to directories aren't */
+            if (lstat(dst, &f_stat) != 0)
+            {
+                err = errno;
+                break;
+            }
+            if (S_ISLNK(f_stat.st_mode) && (picozip__pathstat(dst, &f_stat) != 0 || S_ISDIR(f_stat.st_mode)))
+                continue;
+            is_dir = S_ISDIR(f_stat.st_mode);
+            if (!is_dir && !S_ISREG(f_stat.st_mode))
+                continue;
+#else
+            if (picozip__pathstat(dst, &f_stat) != 0)
+            {
+                err = errno;
+                break;
+            }
+            is_dir = (f_stat.st_mode & _S_IFMT) == _S_IFDIR;
+            if (!is_dir && (f_stat.st_mode & _S_IFMT) != _S_IFREG)
+                continue;
+#endif
+
+            /* the filter sees the name as it would be in the archive */
+            if (is_dir)
+                memcpy(dst + len, "/", 2);
+            if (tree->filter_cb && !tree->filter_cb(tree->userdata, name, is_dir))
+                continue;
+            dst[len] = '\0';
+
+            if ((err = picozip__tree_push(tree, dst, len, name, name_len, &f_stat, is_dir)) != PICOZIP_OK)
+                break;
+            if (is_dir && (err = picozip__tree_walk(tree, path, len, root_len)) != PICOZIP_OK)
+                break;
+        }
+
+    done:
+        ((char *)path->data)[path_len] = '\0';
+        file->free_cb(file->userdata, (void *)sorted);
+        file->free_cb(file->userdata, names.data);
+        return err;
     }
 
-    int picozip_free_path(picozip_file *file)
+    int picozip_add_tree(picozip_file *file, const char *const root, picozip_filter_callback filter_cb, void *userdata)
     {
-        if (!file || !file->userdata)
+        picozip__tree *tree;
+        picozip__vec path;
+        size_t root_len;
+        int err;
+
+        /* an entry refused halfway through can't be picked up again */
+        if (!file || !root || file->nonblocking)
             return PICOZIP_EINVAL;
 
-        fclose((FILE *)file->userdata);
-        file->userdata = NULL;
-        return picozip_free(file);
+        root_len = strlen(root);
+        while (root_len > 1 && (root[root_len - 1] == '/' || root[root_len - 1] == '\\'))
+            root_len--;
+        memset(&path, 0, sizeof(path));
+        if (!picozip__vec_alloc(&path, root_len + 1, PICOZIP__ALLOCATOR(file)))
+            return PICOZIP_ENOMEM;
+        memcpy(path.data, root, root_len);
+        ((char *)path.data)[root_len] = '\0';
+
+        if (!(tree = (picozip__tree *)picozip__alloc(file, sizeof(picozip__tree))))
+        {
+            file->free_cb(file->userdata, path.data);
+            return PICOZIP_ENOMEM;
+        }
+        tree->file = file;
+        tree->filter_cb = filter_cb;
+        tree->userdata = userdata;
+        tree->head = tree->count = 0;
+        tree->err = PICOZIP_OK;
+
+        err = picozip__tree_walk(tree, &path, root_len, root_len);
+        while (tree->count)
+            picozip__tree_pop(tree);
+        if (err == PICOZIP_OK)
+            err = tree->err;
+
+        file->free_cb(file->userdata, tree);
+        file->free_cb(file->userdata, path.data);
+        return err;
+    }
+#else
+    int picozip_add_tree(picozip_file *file, const char *const root, picozip_filter_callback filter_cb, void *userdata)
+    {
+        /* directories can't be listed without the OS */
+        (void)(file);
+        (void)(root);
+        (void)(filter_cb);
+        (void)(userdata);
+        return PICOZIP_EINVAL;
     }
+#endif /* if defined(PICOZIP__WIN) || defined(PICOZIP__UNIX) */
 
 #endif /* ifndef PICOZIP_NO_STDIO */
 
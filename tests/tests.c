@@ -4,6 +4,7 @@
 #if defined(_WIN32)
 #define PICOZIP__WIN
 #include <windows.h>
+#include <direct.h>
 
 static int set_file_time(const char *filename, time_t t)
 {
@@ -25,9 +26,25 @@ static int set_file_time(const char *filename, time_t t)
 #define PICOZIP__UNIX
 #include <utime.h>
 
+/* not declared in strict C modes */
+FILE *popen(const char *command, const char *mode);
+int pclose(FILE *stream);
+#ifdef PICOZIP_THREADS
+#include <pthread.h>
+#endif
+
+#endif
+
+/* picozip_new_entry_path writes the sizes in the local header when it can map the file */
+#ifdef PICOZIP__MMAP
+#define PATH_ENTRY_FLAG 0
+#else
+#define PATH_ENTRY_FLAG (1 << 3)
 #endif
 
 static size_t num_alloc_success = -1;
+static size_t num_alloc_calls = 0;
+static size_t num_write_calls = 0;
 static size_t num_write_success = -1;
 static picozip_file *file = NULL;
 
@@ -35,6 +52,7 @@ typedef struct file_entry
 {
     uint16_t flag, extra_field_len, comment_len;
     int check_mod_time;
+    int zip64_desc; /* streamed: a zero-filled ZIP64 extra field in the local header and 64-bit data descriptor sizes */
     time_t mod_time;
     uint32_t crc32, size, local_offset;
     const char *const filename;
@@ -69,7 +87,7 @@ TEST assert_zip_file(file_entry *entries, size_t entry_len, uint8_t *comment, si
 #define ZIP_DATADESC_MAGIC 0x08074b50
 
     uint8_t *data;
-    size_t size, i, cd_start_offset, offset;
+    size_t size, i, cd_start_offset, offset, local_extra_len;
     uint16_t dos_date, dos_time;
 
     ASSERT_EQ(0, picozip_end(file));
@@ -79,8 +97,8 @@ TEST assert_zip_file(file_entry *entries, size_t entry_len, uint8_t *comment, si
     /* check for local header and content */
     for (offset = i = 0; i < entry_len; i++)
     {
-        ASSERT_EQ(ZIP_MAGIC, READ_LE32(data, offset));           /* magic */
-        ASSERT_EQ(0x14, READ_LE16(data, offset + 4));            /* version (2.0) */
+        ASSERT_EQ(ZIP_MAGIC, READ_LE32(data, offset));                                         /* magic */
+        ASSERT_EQ(entries[i].zip64_desc ? 45 : 0x14, READ_LE16(data, offset + 4));            /* version (2.0, 4.5 for ZIP64) */
         ASSERT_EQ(entries[i].flag, READ_LE16(data, offset + 6)); /* flags */
         ASSERT_EQ(0, READ_LE16(data, offset + 8));               /* compression */
         if (entries[i].check_mod_time)
@@ -92,9 +110,9 @@ TEST assert_zip_file(file_entry *entries, size_t entry_len, uint8_t *comment, si
         if (entries[i].flag == (1 << 3))
         {
             /* when data descriptor is used, crc, comp and uncomp is 0 */
-            ASSERT_EQ(0, READ_LE32(data, offset + 14)); /* crc32 */
-            ASSERT_EQ(0, READ_LE32(data, offset + 18)); /* comp size */
-            ASSERT_EQ(0, READ_LE32(data, offset + 22)); /* uncomp size */
+            ASSERT_EQ(0, READ_LE32(data, offset + 14));                                        /* crc32 */
+            ASSERT_EQ(entries[i].zip64_desc ? 0xFFFFFFFF : 0, READ_LE32(data, offset + 18)); /* comp size */
+            ASSERT_EQ(entries[i].zip64_desc ? 0xFFFFFFFF : 0, READ_LE32(data, offset + 22)); /* uncomp size */
         }
         else
         {
@@ -105,20 +123,33 @@ TEST assert_zip_file(file_entry *entries, size_t entry_len, uint8_t *comment, si
         }
 
         ASSERT_EQ(strlen(entries[i].filename), READ_LE16(data, offset + 26));                /* filename length */
-        ASSERT_EQ(entries[i].extra_field_len, READ_LE16(data, offset + 28));                 /* extra field length */
+        local_extra_len = entries[i].extra_field_len + (entries[i].zip64_desc ? 20 : 0);
+        ASSERT_EQ(local_extra_len, READ_LE16(data, offset + 28));                            /* extra field length */
         ASSERT_MEM_EQ(entries[i].filename, data + offset + 30, strlen(entries[i].filename)); /* filename */
 
         if (entries[i].extra_field)
             ASSERT_MEM_EQ(entries[i].extra_field, data + offset + 30 + strlen(entries[i].filename), entries[i].extra_field_len); /* extra fields */
+        if (entries[i].zip64_desc)
+            ASSERT_MEM_EQ("\x01\x00\x10\x00\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", data + offset + 30 + strlen(entries[i].filename) + entries[i].extra_field_len, 20); /* zero-filled ZIP64 field */
 
-        ASSERT_MEM_EQ(entries[i].data, data + offset + 30 + strlen(entries[i].filename) + entries[i].extra_field_len, entries[i].size); /* actual data */
+        ASSERT_MEM_EQ(entries[i].data, data + offset + 30 + strlen(entries[i].filename) + local_extra_len, entries[i].size); /* actual data */
 
         /* store offset for verification later */
         entries[i].local_offset = offset;
-        offset += 30 + strlen(entries[i].filename) + entries[i].extra_field_len + entries[i].size;
+        offset += 30 + strlen(entries[i].filename) + local_extra_len + entries[i].size;
 
-        /* check if data descriptor is present */
-        if (entries[i].flag == (1 << 3))
+        /* check if data descriptor is present, with 64-bit sizes after a ZIP64 field */
+        if (entries[i].zip64_desc)
+        {
+            ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(data, offset));
+            ASSERT_EQ(entries[i].crc32, READ_LE32(data, offset + 4));
+            ASSERT_EQ(entries[i].size, READ_LE32(data, offset + 8));
+            ASSERT_EQ(0, READ_LE32(data, offset + 12));
+            ASSERT_EQ(entries[i].size, READ_LE32(data, offset + 16));
+            ASSERT_EQ(0, READ_LE32(data, offset + 20));
+            offset += 24;
+        }
+        else if (entries[i].flag == (1 << 3))
         {
             ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(data, offset));
             ASSERT_EQ(entries[i].crc32, READ_LE32(data, offset + 4));
@@ -133,8 +164,8 @@ TEST assert_zip_file(file_entry *entries, size_t entry_len, uint8_t *comment, si
     {
         ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(data, offset));   /* magic */
         ASSERT_EQ(0, READ_LE16(data, offset + 4));               /* version created */
-        ASSERT_EQ(0x14, READ_LE16(data, offset + 6));            /* version (2.0) */
-        ASSERT_EQ(entries[i].flag, READ_LE16(data, offset + 8)); /* flags */
+        ASSERT_EQ(entries[i].zip64_desc ? 45 : 0x14, READ_LE16(data, offset + 6)); /* version (2.0, 4.5 for ZIP64) */
+        ASSERT_EQ(entries[i].flag, READ_LE16(data, offset + 8));                    /* flags */
         ASSERT_EQ(0, READ_LE16(data, offset + 10));              /* compression */
         if (entries[i].check_mod_time)
         {
@@ -252,6 +283,52 @@ TEST test_picozip_end_ex(void)
     PASS();
 }
 
+TEST test_picozip_end_zip64(void)
+{
+    size_t size, cd_size, i;
+    uint8_t *mem = NULL, *eocd;
+    char name[8];
+
+    /* more than 65534 entries need the ZIP64 EOCD */
+    for (i = 0; i < 65536; i++)
+    {
+        sprintf(name, "%05x", (unsigned int)i);
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(file, name, NULL, 0, 0, NULL, 0));
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    size = picozip_get_mem(file, (void **)&mem);
+    cd_size = 65536 * (46 + 5 + 9);
+
+    eocd = mem + size - 22;
+    ASSERT_EQ(ZIP_EOCD_MAGIC, READ_LE32(eocd, 0));
+    ASSERT_EQ(0xFFFF, READ_LE16(eocd, 8));
+    ASSERT_EQ(0xFFFF, READ_LE16(eocd, 10));
+    ASSERT_EQ(cd_size, READ_LE32(eocd, 12));
+    ASSERT_EQ(size - 22 - 20 - 56 - cd_size, READ_LE32(eocd, 16));
+
+    /* the locator points at the ZIP64 EOCD, right after the central directory */
+    eocd -= 20;
+    ASSERT_EQ(0x07064b50, READ_LE32(eocd, 0));
+    ASSERT_EQ(size - 22 - 20 - 56, READ_LE32(eocd, 8));
+    ASSERT_EQ(0, READ_LE32(eocd, 12));
+    ASSERT_EQ(1, READ_LE32(eocd, 16));
+
+    eocd -= 56;
+    ASSERT_EQ(0x06064b50, READ_LE32(eocd, 0));
+    ASSERT_EQ(44, READ_LE32(eocd, 4));
+    ASSERT_EQ(45, READ_LE16(eocd, 14));
+    ASSERT_EQ(65536, READ_LE32(eocd, 24));
+    ASSERT_EQ(65536, READ_LE32(eocd, 32));
+    ASSERT_EQ(cd_size, READ_LE32(eocd, 40));
+    ASSERT_EQ(size - 22 - 20 - 56 - cd_size, READ_LE32(eocd, 48));
+
+    /* records that fit are left alone */
+    ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(mem, size - 22 - 20 - 56 - cd_size));
+    ASSERT_EQ(20, READ_LE16(mem, size - 22 - 20 - 56 - cd_size + 6));
+    ASSERT_EQ(9, READ_LE16(mem, size - 22 - 20 - 56 - cd_size + 30));
+    PASS();
+}
+
 TEST test_picozip_end_ex_einval(void)
 {
     ASSERT_EQ(PICOZIP_EINVAL, picozip_end_ex(NULL, "this is a comment", 17));
@@ -339,6 +416,77 @@ TEST test_picozip_new_entry_mem_ex(void)
     PASS();
 }
 
+TEST test_picozip_new_entries_mem(void)
+{
+    file_entry entries[] = {
+        {
+            .filename = "lorem.txt",
+            .flag = 0,
+            .size = 25,
+            .check_mod_time = 1,
+            .mod_time = 1730559952,
+            .extra_field = "UT\x05\x00\x01\xD0\x3F\x26\x67", /* UT, 5, mod time set (1), 1730559952 */
+            .extra_field_len = 9,
+            .data = "lorem ipsum dolor si amet",
+            .crc32 = 0xd650527a,
+            .comment_len = 0,
+            .comment = NULL,
+        },
+        {
+            .filename = "magic.txt",
+            .flag = 0,
+            .size = 4,
+            .check_mod_time = 1,
+            .mod_time = 0,
+            .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", /* UT, 5, mod time set (1), 0 */
+            .extra_field_len = 9,
+            .data = "\x01\x15\x00\x04",
+            .crc32 = 0x84781dfb,
+            .comment_len = 21,
+            .comment = "this is a binary file",
+        },
+        {
+            .filename = "empty/",
+            .flag = 0,
+            .size = 0,
+            .check_mod_time = 1,
+            .mod_time = 0,
+            .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", /* UT, 5, mod time set (1), 0 */
+            .extra_field_len = 9,
+            .data = "",
+            .crc32 = 0,
+            .comment_len = 0,
+            .comment = NULL,
+        },
+    };
+    picozip_entry_desc descs[] = {
+        {"lorem.txt", (uint8_t *)"lorem ipsum dolor si amet", 25, 1730559952, NULL, 0},
+        {"magic.txt", (uint8_t *)"\x01\x15\x00\x04", 4, 0, "this is a binary file", 21},
+        {"empty/", NULL, 0, 0, NULL, 0},
+    };
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entries_mem(file, descs, 0, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entries_mem(file, descs, 3, NULL));
+    CHECK_CALL(assert_zip_file(entries, 3, NULL, 0));
+    PASS();
+}
+
+TEST test_picozip_new_entries_mem_einval(void)
+{
+    picozip_entry_desc descs[] = {
+        {"test.txt", (uint8_t *)"hello world", 11, 0, NULL, 0},
+        {"test.txt", NULL, 11, 0, NULL, 0},
+    };
+    void *mem;
+
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entries_mem(NULL, descs, 1, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entries_mem(file, NULL, 1, NULL));
+    /* nothing is written if any of the entries is invalid */
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entries_mem(file, descs, 2, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(22, picozip_get_mem(file, &mem));
+    PASS();
+}
+
 TEST test_picozip_new_entry_mem_ex_einval(void)
 {
     ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_mem_ex(NULL, "test.txt", (uint8_t *)"hello world", 11, 0, "this is a comment", 17));
@@ -348,6 +496,259 @@ TEST test_picozip_new_entry_mem_ex_einval(void)
     PASS();
 }
 
+TEST test_picozip_new_entry_mem_ex2(void)
+{
+    file_entry entries[] = {
+        {
+            .filename = "lorem.txt",
+            .flag = 0,
+            .size = 25,
+            .check_mod_time = 1,
+            .mod_time = 1730559952,
+            .extra_field = "UT\x05\x00\x01\xD0\x3F\x26\x67", /* UT, 5, mod time set (1), 1730559952 */
+            .extra_field_len = 9,
+            .data = "lorem ipsum dolor si amet",
+            .crc32 = 0xd650527a,
+            .comment_len = 0,
+            .comment = NULL,
+        },
+        {
+            .filename = "magic.txt",
+            .flag = 0,
+            .size = 4,
+            .check_mod_time = 1,
+            .mod_time = 0,
+            .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", /* UT, 5, mod time set (1), 0 */
+            .extra_field_len = 9,
+            .data = "\x01\x15\x00\x04",
+            .crc32 = 0x84781dfb,
+            .comment_len = 21,
+            .comment = "this is a binary file",
+        },
+    };
+#ifdef PICOZIP_VERIFY_CRC
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_mem_ex2(file, "lorem.txt", (uint8_t *)"lorem ipsum dolor si amet", 25, 0, 1730559952, NULL, 0));
+#endif
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex2(file, "lorem.txt", (uint8_t *)"lorem ipsum dolor si amet", 25, 0xd650527a, 1730559952, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex2(file, "magic.txt", (uint8_t *)"\x01\x15\x00\x04", 4, 0x84781dfb, 0, "this is a binary file", 21));
+    CHECK_CALL(assert_zip_file(entries, 2, NULL, 0));
+    PASS();
+}
+
+TEST test_picozip_new_entry_mem_ex2_einval(void)
+{
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_mem_ex2(NULL, "test.txt", (uint8_t *)"hello world", 11, 0x0d4a1185, 0, "this is a comment", 17));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_mem_ex2(file, NULL, (uint8_t *)"hello world", 11, 0x0d4a1185, 0, "this is a comment", 17));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_mem_ex2(file, "test.txt", NULL, 11, 0x0d4a1185, 0, "this is a comment", 17));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_mem_ex2(file, "test.txt", (uint8_t *)"hello world", 11, 0x0d4a1185, 0, NULL, 17));
+    PASS();
+}
+
+TEST test_picozip_crc32(void)
+{
+    static uint8_t buf[4100];
+    size_t i;
+
+    /* sizes around the SIMD kernel boundaries, read from an unaligned offset */
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)(i * 7 + 3);
+    {
+        file_entry entries[] = {
+            {.filename = "1.bin", .size = 1, .extra_field_len = 9, .data = (char *)buf + 1, .crc32 = 0x32d70693},
+            {.filename = "15.bin", .size = 15, .extra_field_len = 9, .data = (char *)buf + 1, .crc32 = 0x0bbfc1df},
+            {.filename = "63.bin", .size = 63, .extra_field_len = 9, .data = (char *)buf + 1, .crc32 = 0x1cd025dc},
+            {.filename = "64.bin", .size = 64, .extra_field_len = 9, .data = (char *)buf + 1, .crc32 = 0x5f16325d},
+            {.filename = "65.bin", .size = 65, .extra_field_len = 9, .data = (char *)buf + 1, .crc32 = 0xbc36ff58},
+            {.filename = "200.bin", .size = 200, .extra_field_len = 9, .data = (char *)buf + 1, .crc32 = 0x96f60f0a},
+            {.filename = "4099.bin", .size = 4099, .extra_field_len = 9, .data = (char *)buf + 1, .crc32 = 0x00e7f4fb},
+        };
+        for (i = 0; i < sizeof(entries) / sizeof(entries[0]); i++)
+            ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, entries[i].filename, buf + 1, entries[i].size));
+        CHECK_CALL(assert_zip_file(entries, sizeof(entries) / sizeof(entries[0]), NULL, 0));
+    }
+    PASS();
+}
+
+TEST test_picozip_reserve(void)
+{
+    void *mem, *reserved;
+
+    ASSERT_EQ(PICOZIP_OK, picozip_reserve(file, 4, 4096));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello world", 11));
+    picozip_get_mem(file, &reserved);
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "magic.txt", (uint8_t *)"\x01\x15\x00\x04", 4));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    picozip_get_mem(file, &mem);
+    ASSERT_EQ(reserved, mem); /* the output buffer never moved */
+
+    /* reserving less than what is already used is a no-op */
+    ASSERT_EQ(PICOZIP_OK, picozip_reserve(file, 0, 0));
+    PASS();
+}
+
+TEST test_picozip_reserve_einval(void)
+{
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_reserve(NULL, 4, 4096));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_reserve(file, (size_t)-1, 4096));
+    PASS();
+}
+
+static uint8_t spill_mem[524288];
+static size_t spill_used = 0, spill_pos = 0;
+
+static size_t spill_write(void *userdata, const void *mem, size_t size)
+{
+    if (size > sizeof(spill_mem) - spill_used)
+        return PICOZIP_WRITE_ERROR;
+    memcpy(spill_mem + spill_used, mem, size);
+    spill_used += size;
+    return size;
+}
+
+static size_t spill_read(void *userdata, void *mem, size_t size)
+{
+    if (size > spill_used - spill_pos)
+        size = spill_used - spill_pos;
+    memcpy(mem, spill_mem + spill_pos, size);
+    spill_pos += size;
+    return size;
+}
+
+/* adds enough entries for the central directory to take a few blocks */
+static enum greatest_test_res add_spill_entries(picozip_file *zip)
+{
+    char name[32];
+    size_t i;
+
+    for (i = 0; i < 4000; i++)
+    {
+        sprintf(name, "dir/file%05u.txt", (unsigned int)i);
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(zip, name, (uint8_t *)"hello", 5, 0, NULL, 0));
+    }
+    PASS();
+}
+
+TEST test_picozip_set_spill(void)
+{
+    picozip_file *plain, *spilled;
+    void *expected, *mem;
+    size_t size;
+
+    /* spilling doesn't change the output */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&plain));
+    CHECK_CALL(add_spill_entries(plain));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(plain));
+    size = picozip_get_mem(plain, &expected);
+
+    spill_used = spill_pos = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_set_spill(file, 0, spill_write, spill_read, NULL));
+    CHECK_CALL(add_spill_entries(file));
+    ASSERT(spill_used > 0);
+    ASSERT_EQ(0, spill_pos);
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(spill_used, spill_pos);
+    ASSERT_EQ(size, picozip_get_mem(file, &mem));
+    ASSERT_MEM_EQ(expected, mem, size);
+
+    /* the records already spilled stay where they are */
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_spill(file, 0, spill_write, spill_read, NULL));
+
+    /* a temporary file by default */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&spilled));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_spill(spilled, 65536, NULL, NULL, NULL));
+    CHECK_CALL(add_spill_entries(spilled));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(spilled));
+    ASSERT_EQ(size, picozip_get_mem(spilled, &mem));
+    ASSERT_MEM_EQ(expected, mem, size);
+
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(spilled));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(plain));
+    PASS();
+}
+
+TEST test_picozip_set_spill_einval(void)
+{
+    picozip_file *stage;
+
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_spill(NULL, 0, spill_write, spill_read, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_spill(file, 0, spill_write, NULL, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_spill(file, 0, NULL, spill_read, NULL));
+
+    /* stages keep their entries until they are committed */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_stage(file, &stage));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_spill(stage, 0, spill_write, spill_read, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(stage));
+
+    /* a spill that fails can't be read back */
+    spill_used = sizeof(spill_mem);
+    ASSERT_EQ(PICOZIP_OK, picozip_set_spill(file, 0, spill_write, spill_read, NULL));
+    CHECK_CALL(add_spill_entries(file));
+    ASSERT_EQ(PICOZIP_EIO, picozip_end(file));
+    PASS();
+}
+
+TEST test_picozip_set_arena(void)
+{
+    file_entry entries[] = {
+        {.filename = "test.txt", .size = 11, .extra_field_len = 9, .data = "hello world", .crc32 = 0x0d4a1185},
+        {.filename = "magic.txt", .size = 4, .extra_field_len = 9, .data = "\x01\x15\x00\x04", .crc32 = 0x84781dfb},
+    };
+    /* slabs smaller than an entry, so every entry gets its own */
+    ASSERT_EQ(PICOZIP_OK, picozip_set_arena(file, 16));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello world", 11));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "magic.txt", (uint8_t *)"\x01\x15\x00\x04", 4));
+    CHECK_CALL(assert_zip_file(entries, 2, NULL, 0));
+    PASS();
+}
+
+TEST test_picozip_set_arena_einval(void)
+{
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_arena(NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello world", 11));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_arena(file, 0)); /* entries were already added */
+    PASS();
+}
+
+TEST test_picozip_set_timezone(void)
+{
+    uint8_t *data;
+
+    ASSERT_EQ(PICOZIP_OK, picozip_set_timezone(file, 0)); /* 2024-11-02 15:05:52 */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(file, "utc.txt", (uint8_t *)"hello", 5, 1730559952, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_timezone(file, 9 * 3600)); /* 2024-11-03 00:05:52 */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(file, "jst.txt", (uint8_t *)"hello", 5, 1730559952, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_timezone(file, 0)); /* clamped to 1980-01-01 00:00:00 */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(file, "old.txt", (uint8_t *)"hello", 5, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    picozip_get_mem(file, (void **)&data);
+
+    ASSERT_MEM_EQ("\xba\x78\x62\x59", data + 10, 4);              /* modtime, moddate */
+    ASSERT_MEM_EQ("\xba\x00\x63\x59", data + 51 + 10, 4);        /* each entry is 30 + 7 + 9 + 5 bytes */
+    ASSERT_MEM_EQ("\x00\x00\x21\x00", data + 51 * 2 + 10, 4);
+    PASS();
+}
+
+TEST test_picozip_set_timezone_einval(void)
+{
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_timezone(NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_timezone(file, 100000));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_timezone(file, PICOZIP_TZ_LOCAL));
+    PASS();
+}
+
+TEST test_picozip_set_buffer_mem(void)
+{
+    file_entry entries[] = {
+        {.filename = "test.txt", .size = 11, .extra_field_len = 9, .data = "hello world", .crc32 = 0x0d4a1185},
+        {.filename = "magic.txt", .size = 4, .extra_field_len = 9, .data = "\x01\x15\x00\x04", .crc32 = 0x84781dfb},
+    };
+    ASSERT_EQ(PICOZIP_OK, picozip_set_buffer(file, 16));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello world", 11));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "magic.txt", (uint8_t *)"\x01\x15\x00\x04", 4));
+    CHECK_CALL(assert_zip_file(entries, 2, NULL, 0));
+    PASS();
+}
+
 TEST test_picozip_free_mem(void)
 {
     picozip_file *file;
@@ -368,7 +769,7 @@ TEST test_picozip_new_entry_path(void)
     file_entry entries[] = {
         {
             .filename = "test.txt",
-            .flag = 1 << 3,
+            .flag = PATH_ENTRY_FLAG,
             .size = 12,
             .check_mod_time = 1,
             .mod_time = 0,
@@ -381,7 +782,7 @@ TEST test_picozip_new_entry_path(void)
         },
         {
             .filename = "test2.txt",
-            .flag = 1 << 3,
+            .flag = PATH_ENTRY_FLAG,
             .size = 11,
             .check_mod_time = 1,
             .mod_time = 1730609280,
@@ -446,53 +847,249 @@ TEST test_picozip_new_path_einval()
     PASS();
 }
 
-TEST test_picozip_free_path()
+TEST test_picozip_open_append(void)
 {
-    picozip_file *f;
+    picozip_file *f, *mem;
+    FILE *fptr;
+    uint8_t *expected, actual[512];
+    size_t size;
+
+    /* adding to an archive gives the same result as writing all the entries at once */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_path(&f, "test.zip", "wb"));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(f, "a.txt", (uint8_t *)"hello world!", 12, 0, "comment", 7));
+    ASSERT_EQ(PICOZIP_OK, picozip_end_ex(f, "archive comment", 15));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+
+    ASSERT_EQ(PICOZIP_OK, picozip_open_append(&f, "test.zip"));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(f, "b.txt", (uint8_t *)"hello", 5, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(f));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&mem));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "a.txt", (uint8_t *)"hello world!", 12, 0, "comment", 7));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "b.txt", (uint8_t *)"hello", 5, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(mem));
+    size = picozip_get_mem(mem, (void **)&expected);
+    ASSERT(size < sizeof(actual));
+
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(size, fread(actual, 1, sizeof(actual), fptr));
+    fclose(fptr);
+    ASSERT_MEM_EQ(expected, actual, size);
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(mem));
+
+    /* an empty archive */
     ASSERT_EQ(PICOZIP_OK, picozip_new_path(&f, "test.zip", "wb"));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(f));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+    ASSERT_EQ(PICOZIP_OK, picozip_open_append(&f, "test.zip"));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(f));
     ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(22, fread(actual, 1, sizeof(actual), fptr));
+    fclose(fptr);
     PASS();
 }
 
-TEST test_picozip_free_path_einval()
+TEST test_picozip_open_append_free(void)
 {
-    ASSERT_EQ(PICOZIP_EINVAL, picozip_free_path(NULL));
+    picozip_file *f;
+    FILE *fptr;
+    uint8_t expected[512], actual[512];
+    size_t size, n, cd_offset;
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_path(&f, "test.zip", "wb"));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(f, "a.txt", (uint8_t *)"hello world!", 12, 0, "comment", 7));
+    ASSERT_EQ(PICOZIP_OK, picozip_end_ex(f, "archive comment", 15));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    size = fread(expected, 1, sizeof(expected), fptr);
+    fclose(fptr);
+    ASSERT(size > 22 + 15 && size < sizeof(expected));
+    cd_offset = READ_LE32(expected, size - 15 - 22 + 16);
+
+    /* freed without adding anything, the archive is left as it was */
+    ASSERT_EQ(PICOZIP_OK, picozip_open_append(&f, "test.zip"));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(size, fread(actual, 1, sizeof(actual), fptr));
+    fclose(fptr);
+    ASSERT_MEM_EQ(expected, actual, size);
+
+    /* an entry went over the old central directory and the next one failed, so the old records
+       and the comment are written back after it */
+    ASSERT_EQ(PICOZIP_OK, picozip_open_append(&f, "test.zip"));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(f, "b.txt", (uint8_t *)"hello", 5, 0, NULL, 0));
+    ASSERT_NEQ(PICOZIP_OK, picozip_new_entry_path(f, "c.txt", "tests/nonexistent.txt", NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    n = fread(actual, 1, sizeof(actual), fptr);
+    fclose(fptr);
+    ASSERT(n > size && n < sizeof(actual));
+    ASSERT_MEM_EQ(expected, actual, cd_offset);
+    ASSERT_MEM_EQ(expected + cd_offset, actual + n - (size - cd_offset), size - cd_offset - 15 - 22 + 16);
+    ASSERT_EQ(n - (size - cd_offset), READ_LE32(actual, n - 15 - 22 + 16));
+    ASSERT_MEM_EQ("archive comment", actual + n - 15, 15);
+
+    /* and it can be appended to again */
+    ASSERT_EQ(PICOZIP_OK, picozip_open_append(&f, "test.zip"));
+    ASSERT_EQ(PICOZIP_OK, picozip_end_ex(f, "archive comment", 15));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(n, fread(actual, 1, sizeof(actual), fptr));
+    fclose(fptr);
+    ASSERT_EQ(1, READ_LE16(actual, n - 15 - 22 + 10));
     PASS();
 }
 
-TEST test_picozip_get_mem()
+TEST test_picozip_open_append_einval(void)
 {
-    void *mem;
-    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
-    ASSERT_EQ(22, picozip_get_mem(file, &mem));
-    ASSERT_NEQ(NULL, mem);
-
-    mem = NULL;
-    ASSERT_EQ(0, picozip_get_mem(NULL, &mem));
-    ASSERT_EQ(NULL, mem);
-
-    ASSERT_EQ(0, picozip_get_mem(file, NULL));
+    picozip_file *f = NULL;
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_open_append(NULL, "test.zip"));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_open_append(&f, NULL));
+    ASSERT_NEQ(PICOZIP_OK, picozip_open_append(&f, "tests/nonexistent.zip"));
+    /* not an archive */
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_open_append(&f, "tests/test.txt"));
+    ASSERT_EQ(NULL, f);
     PASS();
 }
 
-static void *custom_alloc(void *userdata, size_t size)
+#ifdef picozip__pathstat
+static int skip_filter(void *userdata, const char *path, int is_dir)
 {
-    if (!num_alloc_success)
-        return NULL;
-    num_alloc_success--;
-    return malloc(size);
+    (*(size_t *)userdata)++;
+    return is_dir || strcmp(path, "skip.txt") != 0;
 }
 
-static void custom_free(void *userdata, void *mem)
+static void write_file(const char *path, const char *content)
 {
-    free(mem);
+    FILE *fptr = fopen(path, "wb");
+    if (fptr)
+    {
+        fputs(content, fptr);
+        fclose(fptr);
+    }
 }
 
-static size_t custom_write(void *userdata, const void *mem, size_t size)
+TEST test_picozip_add_tree(void)
+{
+    picozip_file *f, *mem;
+    picozip__stat dir_stat;
+    void *expected, *actual;
+    size_t size, num_filtered = 0;
+
+    /* directories are listed in byte order, with the files and directories in them after them */
+#if defined(PICOZIP__WIN)
+    _mkdir("tests/tree");
+    _mkdir("tests/tree/a");
+#else
+    mkdir("tests/tree", 0755);
+    mkdir("tests/tree/a", 0755);
+#endif
+    write_file("tests/tree/b.txt", "hello world!");
+    write_file("tests/tree/a/c.txt", "hello");
+    write_file("tests/tree/skip.txt", "skipped");
+    ASSERT_EQ(0, picozip__pathstat("tests/tree/a", &dir_stat));
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&f));
+    ASSERT_EQ(PICOZIP_OK, picozip_add_tree(f, "tests/tree/", skip_filter, &num_filtered));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(f));
+    ASSERT_EQ(4, num_filtered);
+
+    /* the same entries as picozip_new_entry_path */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&mem));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "a/", NULL, 0, dir_stat.st_mtime, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_path(mem, "a/c.txt", "tests/tree/a/c.txt", NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_path(mem, "b.txt", "tests/tree/b.txt", NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(mem));
+
+    size = picozip_get_mem(mem, &expected);
+    ASSERT_EQ(size, picozip_get_mem(f, &actual));
+    ASSERT_MEM_EQ(expected, actual, size);
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(mem));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(f));
+
+    remove("tests/tree/a/c.txt");
+    remove("tests/tree/b.txt");
+    remove("tests/tree/skip.txt");
+#if defined(PICOZIP__WIN)
+    _rmdir("tests/tree/a");
+    _rmdir("tests/tree");
+#else
+    rmdir("tests/tree/a");
+    rmdir("tests/tree");
+#endif
+    PASS();
+}
+
+TEST test_picozip_add_tree_einval(void)
+{
+    picozip_file *f;
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&f));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_add_tree(NULL, "tests", NULL, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_add_tree(f, NULL, NULL, NULL));
+    ASSERT_NEQ(PICOZIP_OK, picozip_add_tree(f, "tests/nonexistent", NULL, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(f));
+    PASS();
+}
+#endif
+
+TEST test_picozip_free_path()
+{
+    picozip_file *f;
+    ASSERT_EQ(PICOZIP_OK, picozip_new_path(&f, "test.zip", "wb"));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+    PASS();
+}
+
+TEST test_picozip_free_path_einval()
+{
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_free_path(NULL));
+    PASS();
+}
+
+TEST test_picozip_get_mem()
+{
+    void *mem;
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(22, picozip_get_mem(file, &mem));
+    ASSERT_NEQ(NULL, mem);
+
+    mem = NULL;
+    ASSERT_EQ(0, picozip_get_mem(NULL, &mem));
+    ASSERT_EQ(NULL, mem);
+
+    ASSERT_EQ(0, picozip_get_mem(file, NULL));
+    PASS();
+}
+
+static void *custom_alloc(void *userdata, size_t size)
+{
+    if (!num_alloc_success)
+        return NULL;
+    num_alloc_success--;
+    num_alloc_calls++;
+    return malloc(size);
+}
+
+static void custom_free(void *userdata, void *mem)
+{
+    free(mem);
+}
+
+static size_t custom_write(void *userdata, const void *mem, size_t size)
 {
     if (!num_write_success)
         return 0;
     num_write_success--;
+    num_write_calls++;
     return size;
 }
 
@@ -575,30 +1172,1804 @@ TEST test_picozip_write_error()
     PASS();
 }
 
-SUITE(picozip_mem_path_tests)
+TEST test_picozip_arena_alloc()
 {
-    SET_SETUP(mem_setup_cb, NULL);
-    SET_TEARDOWN(mem_teardown_cb, NULL);
+    size_t i;
 
-    RUN_TEST(test_picozip_end);
-    RUN_TEST(test_picozip_end_einval);
-    RUN_TEST(test_picozip_end_ex);
-    RUN_TEST(test_picozip_end_ex_einval);
-    RUN_TEST(test_picozip_free_mem);
-    RUN_TEST(test_picozip_free_mem_einval);
+    num_alloc_success = num_write_success = -1; /* unlimited */
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, custom_write, custom_alloc, custom_free, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_arena(file, 0));
 
-    RUN_TEST(test_picozip_new_mem);
-    RUN_TEST(test_picozip_new_mem_einval);
-    RUN_TEST(test_picozip_new_entry_mem);
-    RUN_TEST(test_picozip_new_entry_mem_einval);
-    RUN_TEST(test_picozip_new_entry_mem_ex);
-    RUN_TEST(test_picozip_new_entry_mem_ex_einval);
+    num_alloc_calls = 0;
+    for (i = 0; i < 100; i++)
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+    ASSERT(num_alloc_calls < 10); /* a slab and a few entry list reallocations */
 
-    RUN_TEST(test_picozip_new_entry_path);
-    RUN_TEST(test_picozip_new_entry_path_einval);
+    num_write_success = 0; /* failed entries are rolled back from the slab */
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+    num_write_success = -1;
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
 
-    RUN_TEST(test_picozip_new_path);
-    RUN_TEST(test_picozip_new_path_einval);
+    num_alloc_success = 0; /* test slab allocation */
+    for (i = 0; i < 1000; i++)
+    {
+        if (picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5) != PICOZIP_OK)
+            break;
+    }
+    ASSERT(i < 1000);
+
+    num_alloc_success = -1;
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    PASS();
+}
+
+TEST test_picozip_new_stage_alloc()
+{
+    picozip_file *stage;
+    size_t calls;
+
+    num_alloc_success = num_write_success = -1; /* unlimited */
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, custom_write, custom_alloc, custom_free, NULL));
+
+    /* stages allocate through the callbacks of their file */
+    num_alloc_success = 0;
+    ASSERT_EQ(PICOZIP_ENOMEM, picozip_new_stage(file, &stage));
+    num_alloc_success = -1;
+    calls = num_alloc_calls;
+    ASSERT_EQ(PICOZIP_OK, picozip_new_stage(file, &stage));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(stage, "test.txt", (uint8_t *)"hello", 5));
+    ASSERT(num_alloc_calls > calls);
+    calls = num_alloc_calls;
+    num_alloc_success = 0;
+    ASSERT_EQ(PICOZIP_ENOMEM, picozip_new_entry_mem(stage, "test2.txt", (uint8_t *)"hello", 5));
+    num_alloc_success = -1;
+    ASSERT_EQ(calls, num_alloc_calls);
+
+    ASSERT_EQ(PICOZIP_OK, picozip_commit_stage(file, stage));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(stage));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    PASS();
+}
+
+static size_t num_writev_calls = 0;
+
+static size_t custom_writev(void *userdata, const picozip_iovec *iov, size_t iovcnt)
+{
+    size_t i, total = 0;
+    if (!num_write_success)
+        return 0;
+    num_write_success--;
+    num_writev_calls++;
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].len;
+    return total;
+}
+
+TEST test_picozip_set_writev_callback()
+{
+    size_t i;
+
+    num_alloc_success = num_write_success = -1; /* unlimited */
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_writev_callback(NULL, custom_writev));
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, custom_write, custom_alloc, custom_free, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_writev_callback(file, custom_writev));
+
+    num_writev_calls = 0;
+    for (i = 0; i < 40; i++)
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+    ASSERT_EQ(40, num_writev_calls); /* header, metadata and content at once */
+
+    num_writev_calls = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(1, num_writev_calls); /* the central directory with the EOCD */
+
+    num_write_success = 0;
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+    ASSERT_EQ(PICOZIP_EIO, picozip_end(file));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    PASS();
+}
+
+TEST test_picozip_new_entries_mem_writev()
+{
+    picozip_entry_desc descs[40];
+    size_t i, added;
+
+    num_alloc_success = num_write_success = -1; /* unlimited */
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, custom_write, custom_alloc, custom_free, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_writev_callback(file, custom_writev));
+    for (i = 0; i < 40; i++)
+    {
+        descs[i].path = "test.txt";
+        descs[i].data = (const uint8_t *)"hello";
+        descs[i].size = 5;
+        descs[i].mod_time = 0;
+        descs[i].comment = NULL;
+        descs[i].comment_len = 0;
+    }
+
+    num_writev_calls = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entries_mem(file, descs, 40, &added));
+    ASSERT_EQ(2, num_writev_calls); /* a group of 32 entries, then the 8 left */
+    ASSERT_EQ(40, added);
+
+    /* the entries of the failed group are left out */
+    num_write_success = 1;
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entries_mem(file, descs, 40, &added));
+    ASSERT_EQ(32, added);
+    num_write_success = 0;
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entries_mem(file, descs, 40, &added));
+    ASSERT_EQ(0, added);
+
+#ifndef PICOZIP_NO_DEFLATE
+    /* compressed entries are added one by one, and stay in the archive up to the one that failed */
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, picozip_codec_deflate(), 6));
+    num_write_success = 3;
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entries_mem(file, descs, 40, &added));
+    ASSERT(added > 0 && added < 40);
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, NULL, 0));
+#endif
+    num_write_success = -1;
+    num_writev_calls = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(1, num_writev_calls);
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    PASS();
+}
+
+TEST test_picozip_set_buffer()
+{
+    static uint8_t big[8192];
+    size_t i;
+
+    num_alloc_success = num_write_success = -1; /* unlimited */
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_buffer(NULL, 4096));
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, custom_write, custom_alloc, custom_free, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_buffer(file, 4096));
+
+    num_write_calls = 0;
+    for (i = 0; i < 40; i++)
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+    ASSERT_EQ(0, num_write_calls); /* 40 * 57 bytes still fit in the buffer */
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "big.bin", big, sizeof(big)));
+    ASSERT_EQ(2, num_write_calls); /* the buffered data, then the content bypassing the buffer */
+
+    num_write_calls = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(1, num_write_calls); /* central directory + EOCD */
+
+    num_alloc_success = 0;
+    ASSERT_EQ(PICOZIP_ENOMEM, picozip_set_buffer(file, 4096));
+    num_alloc_success = -1;
+    ASSERT_EQ(PICOZIP_OK, picozip_set_buffer(file, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    PASS();
+}
+
+typedef struct slice_reader
+{
+    const uint8_t *data;
+    size_t left;
+} slice_reader;
+
+/* hands out <userdata> (a slice_reader) 7000 bytes at a time */
+static size_t slice_read(void *userdata, void *mem, size_t size)
+{
+    slice_reader *reader = (slice_reader *)userdata;
+
+    if (size > reader->left)
+        size = reader->left;
+    if (size > 7000)
+        size = 7000;
+    memcpy(mem, reader->data, size);
+    reader->data += size;
+    reader->left -= size;
+    return size;
+}
+
+static uint8_t throttled_out[262144];
+static size_t throttled_used = 0;
+static size_t throttled_budget = 0;
+
+/* a non-blocking sink that takes at most <throttled_budget> bytes until it is refilled */
+static size_t throttled_write(void *userdata, const void *mem, size_t size)
+{
+    if (size > throttled_budget)
+        size = throttled_budget;
+    if (size > sizeof(throttled_out) - throttled_used)
+        return PICOZIP_WRITE_ERROR;
+    memcpy(throttled_out + throttled_used, mem, size);
+    throttled_used += size;
+    throttled_budget -= size;
+    return size;
+}
+
+TEST test_picozip_set_nonblocking()
+{
+    picozip_file *expected;
+    void *mem;
+    size_t i, size, again;
+    char name[16];
+    int err;
+#ifndef PICOZIP_NO_DEFLATE
+    picozip_entry_desc descs[12];
+    char names[12][16];
+#endif
+
+    /* the same archive, written in one go */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&expected));
+    for (i = 0; i < 20; i++)
+    {
+        sprintf(name, "test%d.txt", (int)i);
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(expected, name, (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_end(expected));
+    size = picozip_get_mem(expected, &mem);
+
+    num_alloc_success = -1; /* unlimited */
+    throttled_used = throttled_budget = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, throttled_write, custom_alloc, custom_free, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 1, 64));
+
+    /* the sink takes 10 bytes per round */
+    for (again = i = 0; i < 20;)
+    {
+        sprintf(name, "test%d.txt", (int)i);
+        if ((err = picozip_new_entry_mem_ex(file, name, (uint8_t *)"hello world!", 12, 0, NULL, 0)) == PICOZIP_EAGAIN)
+        {
+            again++;
+            throttled_budget = 10;
+            continue;
+        }
+        ASSERT_EQ(PICOZIP_OK, err);
+        i++;
+    }
+    ASSERT(again > 0);
+    while ((err = picozip_end(file)) == PICOZIP_EAGAIN)
+        throttled_budget = 10;
+    ASSERT_EQ(PICOZIP_OK, err);
+    while ((err = picozip_pump(file)) == PICOZIP_EAGAIN)
+        throttled_budget = 10;
+    ASSERT_EQ(PICOZIP_OK, err);
+
+    ASSERT_EQ(size, throttled_used);
+    ASSERT_MEM_EQ(mem, throttled_out, size);
+
+    /* write errors are still reported */
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 0, 0));
+    throttled_used = sizeof(throttled_out);
+    throttled_budget = 10;
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 1, 0));
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_nonblocking(NULL, 1, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_pump(NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(expected));
+
+#ifndef PICOZIP_NO_DEFLATE
+    /* compressed batches are added one entry at a time, but retried as a whole */
+    for (i = 0; i < 12; i++)
+    {
+        sprintf(names[i], "n%d.txt", (int)i);
+        descs[i].path = names[i];
+        descs[i].data = (const uint8_t *)"hello hello hello world!";
+        descs[i].size = 24;
+        descs[i].mod_time = 0;
+        descs[i].comment = NULL;
+        descs[i].comment_len = 0;
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&expected));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(expected, picozip_codec_deflate(), 6));
+    for (i = 0; i < 12; i += 4)
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entries_mem(expected, descs + i, 4, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(expected));
+    size = picozip_get_mem(expected, &mem);
+
+    throttled_used = throttled_budget = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, throttled_write, custom_alloc, custom_free, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, picozip_codec_deflate(), 6));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 1, 64));
+    for (again = i = 0; i < 12;)
+    {
+        if ((err = picozip_new_entries_mem(file, descs + i, 4, NULL)) == PICOZIP_EAGAIN)
+        {
+            again++;
+            throttled_budget = 10;
+            continue;
+        }
+        ASSERT_EQ(PICOZIP_OK, err);
+        i += 4;
+    }
+    ASSERT(again > 0);
+    while ((err = picozip_end(file)) == PICOZIP_EAGAIN)
+        throttled_budget = 10;
+    ASSERT_EQ(PICOZIP_OK, err);
+    while ((err = picozip_pump(file)) == PICOZIP_EAGAIN)
+        throttled_budget = 10;
+    ASSERT_EQ(PICOZIP_OK, err);
+
+    ASSERT_EQ(size, throttled_used);
+    ASSERT_MEM_EQ(mem, throttled_out, size);
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(expected));
+#endif
+    PASS();
+}
+
+/* streams <size> bytes of <data> through a callback entry then adds a small one, with a 2 KiB backlog limit */
+TEST assert_nonblocking_stream(const uint8_t *data, size_t size, int codec)
+{
+    picozip_file *expected;
+    slice_reader reader;
+    size_t again, len;
+    void *mem;
+    int err;
+
+    /* the same archive, written in one go */
+    reader.data = data;
+    reader.left = size;
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&expected));
+    if (codec)
+        ASSERT_EQ(PICOZIP_OK, picozip_set_codec(expected, picozip_codec_deflate(), 6));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(expected, "stream.bin", slice_read, &reader, 1024, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(expected, "test.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(expected));
+    len = picozip_get_mem(expected, &mem);
+
+    reader.data = data;
+    reader.left = size;
+    throttled_used = throttled_budget = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, throttled_write, custom_alloc, custom_free, NULL));
+    if (codec)
+        ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, picozip_codec_deflate(), 6));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 1, 2048));
+
+    /* the entry stops reading once the backlog passes the limit, and nothing else starts meanwhile */
+    ASSERT_EQ(PICOZIP_EAGAIN, picozip_new_entry_cb(file, "stream.bin", slice_read, &reader, 1024, 0, NULL, 0));
+    ASSERT(reader.left > 0);
+    ASSERT_EQ(PICOZIP_EAGAIN, picozip_new_entry_mem_ex(file, "test.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EAGAIN, picozip_set_codec(file, NULL, 0));
+    ASSERT_EQ(PICOZIP_EAGAIN, picozip_end(file));
+
+    /* the read position is kept while the sink takes 1000 bytes per round, stored content staying near the output */
+    for (again = 0; (err = picozip_pump(file)) == PICOZIP_EAGAIN; again++)
+    {
+        ASSERT(codec || size - reader.left <= throttled_used + 2048 + 1024);
+        throttled_budget = 1000;
+    }
+    ASSERT_EQ(PICOZIP_OK, err);
+    ASSERT(again > 0);
+    ASSERT_EQ(0, reader.left);
+
+    while ((err = picozip_new_entry_mem_ex(file, "test.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0)) == PICOZIP_EAGAIN)
+        throttled_budget = 1000;
+    ASSERT_EQ(PICOZIP_OK, err);
+    while ((err = picozip_end(file)) == PICOZIP_EAGAIN)
+        throttled_budget = 1000;
+    ASSERT_EQ(PICOZIP_OK, err);
+    while ((err = picozip_pump(file)) == PICOZIP_EAGAIN)
+        throttled_budget = 1000;
+    ASSERT_EQ(PICOZIP_OK, err);
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+
+    ASSERT_EQ(len, throttled_used);
+    ASSERT_MEM_EQ(mem, throttled_out, len);
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(expected));
+    PASS();
+}
+
+TEST test_picozip_set_nonblocking_stream(void)
+{
+    static uint8_t data[131072];
+    slice_reader reader;
+    uint32_t seed;
+    size_t i;
+
+    /* noise, so that the compressed content passes the limit too */
+    for (seed = 1, i = 0; i < sizeof(data); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (uint8_t)(seed >> 16);
+    }
+    num_alloc_success = -1; /* unlimited */
+    CHECK_CALL(assert_nonblocking_stream(data, sizeof(data), 0));
+#ifndef PICOZIP_NO_DEFLATE
+    CHECK_CALL(assert_nonblocking_stream(data, sizeof(data), 1));
+#endif
+
+    /* restoring blocking writes finishes the entry */
+    reader.data = data;
+    reader.left = sizeof(data);
+    throttled_used = throttled_budget = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, throttled_write, custom_alloc, custom_free, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 1, 2048));
+    ASSERT_EQ(PICOZIP_EAGAIN, picozip_new_entry_cb(file, "stream.bin", slice_read, &reader, 1024, 0, NULL, 0));
+    throttled_budget = sizeof(throttled_out);
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 0, 0));
+    ASSERT_EQ(0, reader.left);
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello", 5));
+
+    /* and an entry that never finished is freed with the file */
+    throttled_used = throttled_budget = 0;
+    reader.data = data;
+    reader.left = sizeof(data);
+    ASSERT_EQ(PICOZIP_OK, picozip_set_nonblocking(file, 1, 0));
+    ASSERT_EQ(PICOZIP_EAGAIN, picozip_new_entry_cb(file, "stream.bin", slice_read, &reader, 0, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    PASS();
+}
+
+TEST test_picozip_new_entry_stream(void)
+{
+    FILE *fptr;
+    file_entry entries[] = {
+        {
+            .filename = "test.txt",
+            .flag = 0,
+            .size = 12,
+            .check_mod_time = 1,
+            .mod_time = 1730609280,
+            .extra_field = "UT\x05\x00\x01\x80\x00\x27\x67", /* UT, 5, mod time set (1), 1730609280 */
+            .extra_field_len = 9,
+            .data = "hello world!",
+            .crc32 = 0x03b4c26d,
+            .comment_len = 7,
+            .comment = "comment",
+        },
+        {
+            .filename = "world.txt",
+            .flag = 0,
+            .size = 6,
+            .check_mod_time = 1,
+            .mod_time = 0,
+            .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", /* UT, 5, mod time set (1), 0 */
+            .extra_field_len = 9,
+            .data = "world!",
+            .crc32 = 0x718498e8,
+            .comment_len = 0,
+            .comment = NULL,
+        },
+    };
+
+    /* the second entry continues from where the first one stopped */
+    fptr = fopen("tests/test.txt", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_stream(file, "test.txt", fptr, 12, 0x03b4c26d, 1730609280, "comment", 7));
+    ASSERT_EQ(0, fseek(fptr, 6, SEEK_SET));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_stream(file, "world.txt", fptr, 6, 0x718498e8, 0, NULL, 0));
+    fclose(fptr);
+    CHECK_CALL(assert_zip_file(entries, 2, NULL, 0));
+    PASS();
+}
+
+TEST test_picozip_new_entry_stream_einval(void)
+{
+    FILE *fptr;
+
+    fptr = fopen("tests/test.txt", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_stream(NULL, "test.txt", fptr, 12, 0x03b4c26d, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_stream(file, NULL, fptr, 12, 0x03b4c26d, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_stream(file, "test.txt", NULL, 12, 0x03b4c26d, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_stream(file, "test.txt", fptr, 12, 0x03b4c26d, 0, NULL, 7));
+    /* the stream is shorter than the size */
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_stream(file, "test.txt", fptr, 13, 0x03b4c26d, 0, NULL, 0));
+    fclose(fptr);
+    PASS();
+}
+
+TEST test_picozip_new_entry_path_copy(void)
+{
+    static uint8_t buf[256 * 1024];
+    picozip_file *f, *mem;
+    FILE *fptr;
+    uint8_t *expected, *actual;
+    size_t i, size;
+    long actual_size;
+
+    /* large enough to be copied by the kernel (if available), the output must match picozip_new_mem */
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)(i * 7 + 3);
+    fptr = fopen("tests/large.bin", "wb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(sizeof(buf), fwrite(buf, 1, sizeof(buf), fptr));
+    fclose(fptr);
+#if defined(PICOZIP__WIN)
+    ASSERT_EQ(0, set_file_time("tests/large.bin", 0));
+#elif defined(PICOZIP__UNIX)
+    ASSERT_EQ(0, utime("tests/large.bin", (struct utimbuf *)&(struct utimbuf){.actime = 0, .modtime = 0}));
+#endif
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_path(&f, "test.zip", "wb"));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_path(f, "large.bin", "tests/large.bin", NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_path(f, "large2.bin", "tests/large.bin", "comment", 7));
+    fptr = fopen("tests/large.bin", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(0, fseek(fptr, 1, SEEK_SET));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_stream(f, "large3.bin", fptr, sizeof(buf) - 2, 0x52d157ac, 0, NULL, 0));
+    fclose(fptr);
+    ASSERT_EQ(PICOZIP_OK, picozip_end(f));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&mem));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "large.bin", buf, sizeof(buf), 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "large2.bin", buf, sizeof(buf), 0, "comment", 7));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "large3.bin", buf + 1, sizeof(buf) - 2, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(mem));
+    size = picozip_get_mem(mem, (void **)&expected);
+
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(0, fseek(fptr, 0, SEEK_END));
+    actual_size = ftell(fptr);
+    ASSERT_EQ(0, fseek(fptr, 0, SEEK_SET));
+    actual = malloc(actual_size);
+    ASSERT_NEQ(NULL, actual);
+    ASSERT_EQ((size_t)actual_size, fread(actual, 1, actual_size, fptr));
+    fclose(fptr);
+    remove("tests/large.bin");
+
+#if !defined(PICOZIP__MMAP)
+    /* without mmap the entries have a data descriptor */
+    ASSERT_EQ(size + 32, (size_t)actual_size);
+    ASSERT_EQ(1 << 3, actual[6]);
+#else
+    ASSERT_EQ(size, (size_t)actual_size);
+    ASSERT_MEM_EQ(expected, actual, size);
+#endif
+    free(actual);
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(mem));
+    PASS();
+}
+
+#if defined(PICOZIP__UNIX)
+TEST test_picozip_new_entry_path_pipe(void)
+{
+    static uint8_t buf[256 * 1024];
+    picozip_file *f, *mem;
+    FILE *fptr, *out;
+    uint8_t *expected, *actual;
+    size_t i, size;
+    long actual_size;
+
+    /* a pipe can't be copied into by the kernel, the content must be written from the mapping instead */
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)(i * 7 + 3);
+    fptr = fopen("tests/large.bin", "wb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(sizeof(buf), fwrite(buf, 1, sizeof(buf), fptr));
+    fclose(fptr);
+    ASSERT_EQ(0, utime("tests/large.bin", (struct utimbuf *)&(struct utimbuf){.actime = 0, .modtime = 0}));
+
+    out = popen("cat > test.zip", "w");
+    ASSERT_NEQ(NULL, out);
+    ASSERT_EQ(PICOZIP_OK, picozip_new_file(&f, out));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_path(f, "large.bin", "tests/large.bin", NULL, 0));
+    fptr = fopen("tests/large.bin", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(0, fseek(fptr, 1, SEEK_SET));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_stream(f, "large2.bin", fptr, sizeof(buf) - 2, 0x52d157ac, 0, NULL, 0));
+    fclose(fptr);
+    ASSERT_EQ(PICOZIP_OK, picozip_end(f));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(f));
+    ASSERT_EQ(0, pclose(out));
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&mem));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "large.bin", buf, sizeof(buf), 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "large2.bin", buf + 1, sizeof(buf) - 2, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(mem));
+    size = picozip_get_mem(mem, (void **)&expected);
+
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(0, fseek(fptr, 0, SEEK_END));
+    actual_size = ftell(fptr);
+    ASSERT_EQ(0, fseek(fptr, 0, SEEK_SET));
+    actual = malloc(actual_size);
+    ASSERT_NEQ(NULL, actual);
+    ASSERT_EQ((size_t)actual_size, fread(actual, 1, actual_size, fptr));
+    fclose(fptr);
+    remove("tests/large.bin");
+
+#if !defined(PICOZIP__MMAP)
+    /* without mmap the path entry has a data descriptor */
+    ASSERT_EQ(size + 16, (size_t)actual_size);
+    ASSERT_EQ(1 << 3, actual[6]);
+#else
+    ASSERT_EQ(size, (size_t)actual_size);
+    ASSERT_MEM_EQ(expected, actual, size);
+#endif
+    free(actual);
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(mem));
+    PASS();
+}
+#endif
+
+#ifdef PICOZIP__URING
+/* checks that the archives <a> and <b> hold the same entries and content, however their records are laid out */
+TEST assert_same_entries(const uint8_t *a, size_t a_size, const uint8_t *b, size_t b_size)
+{
+    size_t n, i, cd_a, cd_b, data_a, data_b;
+
+    n = READ_LE16(a, a_size - 22 + 10);
+    ASSERT_EQ(n, READ_LE16(b, b_size - 22 + 10));
+    cd_a = READ_LE32(a, a_size - 22 + 16);
+    cd_b = READ_LE32(b, b_size - 22 + 16);
+    for (i = 0; i < n; i++)
+    {
+        ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(a, cd_a));
+        ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(b, cd_b));
+        ASSERT_EQ(READ_LE16(a, cd_a + 8), READ_LE16(b, cd_b + 8));   /* flags */
+        ASSERT_EQ(READ_LE32(a, cd_a + 16), READ_LE32(b, cd_b + 16)); /* crc32 */
+        ASSERT_EQ(READ_LE32(a, cd_a + 20), READ_LE32(b, cd_b + 20)); /* comp size */
+        ASSERT_EQ(READ_LE32(a, cd_a + 24), READ_LE32(b, cd_b + 24)); /* uncomp size */
+        ASSERT_EQ(READ_LE16(a, cd_a + 28), READ_LE16(b, cd_b + 28)); /* filename length */
+        ASSERT_MEM_EQ(a + cd_a + 46, b + cd_b + 46, READ_LE16(a, cd_a + 28));
+
+        data_a = READ_LE32(a, cd_a + 42);
+        data_a += 30 + READ_LE16(a, data_a + 26) + READ_LE16(a, data_a + 28);
+        data_b = READ_LE32(b, cd_b + 42);
+        data_b += 30 + READ_LE16(b, data_b + 26) + READ_LE16(b, data_b + 28);
+        ASSERT_MEM_EQ(a + data_a, b + data_b, READ_LE32(a, cd_a + 20));
+
+        cd_a += 46 + READ_LE16(a, cd_a + 28) + READ_LE16(a, cd_a + 30) + READ_LE16(a, cd_a + 32);
+        cd_b += 46 + READ_LE16(b, cd_b + 28) + READ_LE16(b, cd_b + 30) + READ_LE16(b, cd_b + 32);
+    }
+    PASS();
+}
+
+static size_t stdio_read(void *userdata, void *mem, size_t size)
+{
+    size_t n = fread(mem, 1, size, (FILE *)userdata);
+    return n < size && ferror((FILE *)userdata) ? PICOZIP_READ_ERROR : n;
+}
+
+TEST test_picozip_uring(void)
+{
+    static uint8_t buf[512 * 1024 + 1000];
+    picozip_file *f, *mem;
+    FILE *fptr;
+    uint8_t *expected, *actual;
+    size_t i, size;
+    long actual_size;
+
+    /* the archive and large input files go through io_uring, the entries must match stdio */
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)(i * 13 + 5);
+    fptr = fopen("tests/large.bin", "wb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(sizeof(buf), fwrite(buf, 1, sizeof(buf), fptr));
+    fclose(fptr);
+    ASSERT_EQ(0, utime("tests/large.bin", (struct utimbuf *)&(struct utimbuf){.actime = 0, .modtime = 0}));
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_path(&f, "test.zip", "wb"));
+    for (i = 0; i < 2; i++)
+    {
+        fptr = fopen("tests/large.bin", "rb");
+        ASSERT_NEQ(NULL, fptr);
+        ASSERT_EQ(0, fseek(fptr, (long)i * 1000, SEEK_SET));
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_file(f, i ? "large2.bin" : "large.bin", fptr, NULL, 0));
+        /* the stream is left at the end of the file, as stdio would */
+        ASSERT_EQ((long)sizeof(buf), ftell(fptr));
+        ASSERT_EQ(EOF, fgetc(fptr));
+        fclose(fptr);
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(f, "small.txt", buf, 100, 0, NULL, 0));
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_end(f));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_path(f));
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&mem));
+    for (i = 0; i < 2; i++)
+    {
+        fptr = fopen("tests/large.bin", "rb");
+        ASSERT_NEQ(NULL, fptr);
+        ASSERT_EQ(0, fseek(fptr, (long)i * 1000, SEEK_SET));
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(mem, i ? "large2.bin" : "large.bin", stdio_read, fptr, 0, 0, NULL, 0));
+        fclose(fptr);
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "small.txt", buf, 100, 0, NULL, 0));
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_end(mem));
+    size = picozip_get_mem(mem, (void **)&expected);
+
+    fptr = fopen("test.zip", "rb");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(0, fseek(fptr, 0, SEEK_END));
+    actual_size = ftell(fptr);
+    ASSERT_EQ(0, fseek(fptr, 0, SEEK_SET));
+    actual = malloc(actual_size);
+    ASSERT_NEQ(NULL, actual);
+    ASSERT_EQ((size_t)actual_size, fread(actual, 1, actual_size, fptr));
+    fclose(fptr);
+
+    /* the callback has no size, so its entries have room for ZIP64 sizes and the files don't */
+    CHECK_CALL(assert_same_entries(expected, size, actual, (size_t)actual_size));
+    ASSERT_EQ(size, (size_t)actual_size + 2 * (20 + 8));
+    free(actual);
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(mem));
+
+    /* a file that can't be read fails the entry, and the archive can still be finished */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&mem));
+    fptr = fopen("tests/large.bin", "ab");
+    ASSERT_NEQ(NULL, fptr);
+    ASSERT_EQ(0, fseek(fptr, 0, SEEK_SET));
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_file(mem, "large.bin", fptr, NULL, 0));
+    fclose(fptr);
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(mem, "small.txt", buf, 100, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(mem));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(mem));
+    remove("tests/large.bin");
+    PASS();
+}
+#endif
+
+static int codec_calls = 0;
+
+static void *passthrough_begin(void *userdata, int level, picozip_alloc_callback alloc_cb, picozip_free_callback free_cb, void *alloc_userdata)
+{
+    codec_calls++;
+    return userdata;
+}
+
+static int passthrough_compress(void *state, const uint8_t *data, size_t size, int flush, picozip_write_callback write_cb, void *write_userdata)
+{
+    codec_calls++;
+    return write_cb(write_userdata, data, size) == size ? PICOZIP_OK : PICOZIP_EIO;
+}
+
+static void passthrough_end(void *state)
+{
+    codec_calls++;
+}
+
+#ifndef PICOZIP_NO_DEFLATE
+TEST test_picozip_set_codec(void)
+{
+    static uint8_t a[1000];
+    uint8_t *data;
+    size_t size, cd, offset;
+
+    memset(a, 'a', sizeof(a));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, picozip_codec_deflate(), 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello world!", 12));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, picozip_codec_deflate(), PICOZIP_LEVEL_DEFAULT));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "a.txt", a, sizeof(a)));
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "b.txt", (uint8_t *)"b", 1));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    size = picozip_get_mem(file, (void **)&data);
+
+    /* level 0 writes a stored block, the sizes and CRC are in the data descriptor */
+    ASSERT_EQ(1 << 3, READ_LE16(data, 6));
+    ASSERT_EQ(PICOZIP_METHOD_DEFLATE, READ_LE16(data, 8));
+    ASSERT_EQ(0, READ_LE32(data, 14));
+    ASSERT_EQ(0, READ_LE32(data, 18));
+    ASSERT_EQ(0, READ_LE32(data, 22));
+    ASSERT_MEM_EQ("\x01\x0c\x00\xf3\xffhello world!", data + 47, 17);
+    ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(data, 64));
+    ASSERT_EQ(0x03b4c26d, READ_LE32(data, 68));
+    ASSERT_EQ(17, READ_LE32(data, 72));
+    ASSERT_EQ(12, READ_LE32(data, 76));
+
+    /* the compressed size is reported separately from the uncompressed size */
+    cd = READ_LE32(data, size - 22 + 16);
+    cd += 46 + READ_LE16(data, cd + 28) + READ_LE16(data, cd + 30) + READ_LE16(data, cd + 32);
+    ASSERT_EQ(PICOZIP_METHOD_DEFLATE, READ_LE16(data, cd + 10));
+    ASSERT_EQ(0x9a38da03, READ_LE32(data, cd + 16));
+    ASSERT_GT(20, READ_LE32(data, cd + 20));
+    ASSERT_EQ(1000, READ_LE32(data, cd + 24));
+    offset = READ_LE32(data, cd + 42);
+    ASSERT_EQ(80, offset);
+    offset += 30 + 5 + 9 + READ_LE32(data, cd + 20);
+    ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(data, offset));
+    ASSERT_EQ(0x9a38da03, READ_LE32(data, offset + 4));
+
+    /* entries are stored again after resetting the codec */
+    offset += 16;
+    ASSERT_EQ(ZIP_MAGIC, READ_LE32(data, offset));
+    ASSERT_EQ(0, READ_LE16(data, offset + 6));
+    ASSERT_EQ(0, READ_LE16(data, offset + 8));
+    ASSERT_EQ(1, READ_LE32(data, offset + 18));
+    PASS();
+}
+
+/* a small inflater (after zlib's puff) to check the output of the built-in compressor */
+typedef struct inflate_state
+{
+    const uint8_t *in;
+    size_t in_len, in_pos;
+    uint8_t *out;
+    size_t out_cap, out_pos;
+    long bitbuf;
+    int bitcnt;
+} inflate_state;
+
+typedef struct inflate_huffman
+{
+    short count[16];
+    short symbol[288];
+} inflate_huffman;
+
+/* returns the next <need> bits of the input, or -1 past its end */
+static long inflate_bits(inflate_state *s, int need)
+{
+    long val = s->bitbuf;
+
+    while (s->bitcnt < need)
+    {
+        if (s->in_pos == s->in_len)
+            return -1;
+        val |= (long)s->in[s->in_pos++] << s->bitcnt;
+        s->bitcnt += 8;
+    }
+    s->bitbuf = val >> need;
+    s->bitcnt -= need;
+    return val & ((1L << need) - 1);
+}
+
+/* builds the canonical code for <lens>, returning -1 if it is oversubscribed */
+static int inflate_build(inflate_huffman *h, const short *lens, int n)
+{
+    short offs[16];
+    int sym, len, left;
+
+    memset(h->count, 0, sizeof(h->count));
+    for (sym = 0; sym < n; sym++)
+        h->count[lens[sym]]++;
+    for (left = 1, len = 1; len < 16; len++)
+    {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return -1;
+    }
+    for (offs[1] = 0, len = 1; len < 15; len++)
+        offs[len + 1] = (short)(offs[len] + h->count[len]);
+    for (sym = 0; sym < n; sym++)
+    {
+        if (lens[sym])
+            h->symbol[offs[lens[sym]]++] = (short)sym;
+    }
+    return 0;
+}
+
+static int inflate_decode(inflate_state *s, const inflate_huffman *h)
+{
+    int code = 0, first = 0, index = 0, len;
+    long bit;
+
+    for (len = 1; len < 16; len++)
+    {
+        if ((bit = inflate_bits(s, 1)) < 0)
+            return -1;
+        code |= (int)bit;
+        if (code - h->count[len] < first)
+            return h->symbol[index + (code - first)];
+        index += h->count[len];
+        first = (first + h->count[len]) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static int inflate_codes(inflate_state *s, const inflate_huffman *lencode, const inflate_huffman *distcode)
+{
+    static const short lbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const short lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const short dbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const short dext[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    long len, dist, bits;
+    int sym;
+
+    while ((sym = inflate_decode(s, lencode)) != 256)
+    {
+        if (sym < 0 || sym > 285)
+            return -1;
+        if (sym < 256)
+        {
+            if (s->out_pos == s->out_cap)
+                return -1;
+            s->out[s->out_pos++] = (uint8_t)sym;
+            continue;
+        }
+        if ((bits = inflate_bits(s, lext[sym - 257])) < 0)
+            return -1;
+        len = lbase[sym - 257] + bits;
+        if ((sym = inflate_decode(s, distcode)) < 0 || sym > 29 || (bits = inflate_bits(s, dext[sym])) < 0)
+            return -1;
+        dist = dbase[sym] + bits;
+        if ((size_t)dist > s->out_pos || (size_t)len > s->out_cap - s->out_pos)
+            return -1;
+        for (; len; len--, s->out_pos++)
+            s->out[s->out_pos] = s->out[s->out_pos - dist];
+    }
+    return 0;
+}
+
+static int inflate_dynamic(inflate_state *s, inflate_huffman *lencode, inflate_huffman *distcode)
+{
+    static const short order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    short lens[320];
+    long nlen, ndist, ncode, bits, rep;
+    int index, sym;
+
+    if ((nlen = inflate_bits(s, 5)) < 0 || (ndist = inflate_bits(s, 5)) < 0 || (ncode = inflate_bits(s, 4)) < 0)
+        return -1;
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    if (nlen > 286 || ndist > 30)
+        return -1;
+    memset(lens, 0, sizeof(lens));
+    for (index = 0; index < ncode; index++)
+    {
+        if ((bits = inflate_bits(s, 3)) < 0)
+            return -1;
+        lens[order[index]] = (short)bits;
+    }
+    if (inflate_build(lencode, lens, 19) < 0)
+        return -1;
+
+    for (index = 0; index < nlen + ndist;)
+    {
+        if ((sym = inflate_decode(s, lencode)) < 0)
+            return -1;
+        if (sym < 16)
+        {
+            lens[index++] = (short)sym;
+            continue;
+        }
+        if (sym == 16 && !index)
+            return -1;
+        bits = inflate_bits(s, sym == 16 ? 2 : sym == 17 ? 3 : 7);
+        if (bits < 0)
+            return -1;
+        rep = bits + (sym == 18 ? 11 : 3);
+        if (index + rep > nlen + ndist)
+            return -1;
+        for (sym = sym == 16 ? lens[index - 1] : 0; rep; rep--)
+            lens[index++] = (short)sym;
+    }
+    if (!lens[256] || inflate_build(lencode, lens, (int)nlen) < 0 || inflate_build(distcode, lens + nlen, (int)ndist) < 0)
+        return -1;
+    return inflate_codes(s, lencode, distcode);
+}
+
+/* inflates <in> into <out>, returning the number of blocks or -1 if the stream is invalid */
+static int inflate_mem(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap, size_t *out_len)
+{
+    inflate_state s;
+    inflate_huffman lencode, distcode;
+    short lens[288];
+    long last, type, len;
+    int blocks, i;
+
+    memset(&s, 0, sizeof(s));
+    s.in = in;
+    s.in_len = in_len;
+    s.out = out;
+    s.out_cap = out_cap;
+    for (blocks = 0, last = 0; !last; blocks++)
+    {
+        if ((last = inflate_bits(&s, 1)) < 0 || (type = inflate_bits(&s, 2)) < 0)
+            return -1;
+        if (type == 0)
+        {
+            s.bitbuf = 0;
+            s.bitcnt = 0;
+            if (s.in_len - s.in_pos < 4)
+                return -1;
+            len = s.in[s.in_pos] | (s.in[s.in_pos + 1] << 8);
+            if ((len ^ 0xffff) != (s.in[s.in_pos + 2] | (s.in[s.in_pos + 3] << 8)))
+                return -1;
+            s.in_pos += 4;
+            if ((size_t)len > s.in_len - s.in_pos || (size_t)len > s.out_cap - s.out_pos)
+                return -1;
+            memcpy(s.out + s.out_pos, s.in + s.in_pos, (size_t)len);
+            s.in_pos += (size_t)len;
+            s.out_pos += (size_t)len;
+        }
+        else if (type == 1)
+        {
+            for (i = 0; i < 288; i++)
+                lens[i] = (short)(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+            inflate_build(&lencode, lens, 288);
+            for (i = 0; i < 30; i++)
+                lens[i] = 5;
+            inflate_build(&distcode, lens, 30);
+            if (inflate_codes(&s, &lencode, &distcode) < 0)
+                return -1;
+        }
+        else if (type != 2 || inflate_dynamic(&s, &lencode, &distcode) < 0)
+            return -1;
+    }
+    *out_len = s.out_pos;
+    return s.in_pos == s.in_len ? blocks : -1;
+}
+
+TEST test_picozip_set_codec_inflate(void)
+{
+    static const char *const words[] = {"lorem ", "ipsum ", "dolor ", "sit ", "amet, ", "consectetur ", "adipiscing ", "elit. ", "sed ", "do\n"};
+    static const int levels[] = {0, 1, 2, 6, 9};
+    static uint8_t text[300000], out[300000];
+    slice_reader reader;
+    uint8_t *data;
+    size_t size, len, cd, offset, i;
+    uint32_t seed;
+    int level, blocks;
+
+    /* compressible, but not so much that the symbols of several blocks fit in one */
+    for (seed = 1, len = 0; len < sizeof(text);)
+    {
+        seed = seed * 1103515245 + 12345;
+        i = strlen(words[(seed >> 16) % 10]);
+        if (i > sizeof(text) - len)
+            i = sizeof(text) - len;
+        memcpy(text + len, words[(seed >> 16) % 10], i);
+        len += i;
+        if ((seed >> 8) % 4 == 0 && len < sizeof(text))
+            text[len++] = (uint8_t)('0' + (seed >> 20) % 10);
+    }
+
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+    {
+        ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, picozip_codec_deflate(), levels[i]));
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "mem.txt", text, sizeof(text)));
+        reader.data = text;
+        reader.left = sizeof(text);
+        ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(file, "cb.txt", slice_read, &reader, 0, 0, NULL, 0));
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    size = picozip_get_mem(file, (void **)&data);
+
+    /* every entry inflates back to the text, over several blocks */
+    cd = READ_LE32(data, size - 22 + 16);
+    for (i = 0; i < 2 * sizeof(levels) / sizeof(levels[0]); i++)
+    {
+        level = levels[i / 2];
+        ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(data, cd));
+        ASSERT_EQ(PICOZIP_METHOD_DEFLATE, READ_LE16(data, cd + 10));
+        ASSERT_EQ(sizeof(text), READ_LE32(data, cd + 24));
+        if (level)
+            ASSERT_GT(sizeof(text) / 2, READ_LE32(data, cd + 20));
+        offset = READ_LE32(data, cd + 42);
+        offset += 30 + READ_LE16(data, offset + 26) + READ_LE16(data, offset + 28);
+        memset(out, 0, sizeof(out));
+        blocks = inflate_mem(data + offset, READ_LE32(data, cd + 20), out, sizeof(out), &len);
+        ASSERT_GT(blocks, 1);
+        ASSERT_EQ(sizeof(text), len);
+        ASSERT_MEM_EQ(text, out, sizeof(text));
+        ASSERT_EQ(0x958ae60c, READ_LE32(data, cd + 16));
+        cd += 46 + READ_LE16(data, cd + 28) + READ_LE16(data, cd + 30) + READ_LE16(data, cd + 32);
+    }
+    PASS();
+}
+#endif
+
+TEST test_picozip_commit_stage(void)
+{
+    picozip_file *stage1, *stage2;
+    file_entry entries[] = {
+        {.filename = "a.txt", .size = 12, .extra_field_len = 9, .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", .data = "hello world!", .crc32 = 0x03b4c26d},
+        {.filename = "c.txt", .size = 4, .extra_field_len = 9, .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", .data = "\x01\x15\x00\x04", .crc32 = 0x84781dfb},
+        {.filename = "d.txt", .size = 12, .extra_field_len = 9, .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", .data = "hello world!", .crc32 = 0x03b4c26d},
+        {.filename = "b.txt", .size = 25, .extra_field_len = 9, .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", .data = "lorem ipsum dolor si amet", .crc32 = 0xd650527a},
+        {.filename = "e.txt", .size = 4, .extra_field_len = 9, .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00", .data = "\x01\x15\x00\x04", .crc32 = 0x84781dfb},
+    };
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(file, "a.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_stage(file, &stage1));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_stage(file, &stage2));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(stage1, "b.txt", (uint8_t *)"lorem ipsum dolor si amet", 25, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(stage2, "c.txt", (uint8_t *)"\x01\x15\x00\x04", 4, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(stage2, "d.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+
+    /* entries are appended in the order stages are committed, and stages can be reused */
+    ASSERT_EQ(PICOZIP_OK, picozip_commit_stage(file, stage2));
+    ASSERT_EQ(PICOZIP_OK, picozip_commit_stage(file, stage1));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex(stage2, "e.txt", (uint8_t *)"\x01\x15\x00\x04", 4, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_commit_stage(file, stage2));
+    ASSERT_EQ(PICOZIP_OK, picozip_commit_stage(file, stage1));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(stage1));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(stage2));
+    CHECK_CALL(assert_zip_file(entries, sizeof(entries) / sizeof(entries[0]), NULL, 0));
+    PASS();
+}
+
+#if defined(PICOZIP_THREADS) && defined(PICOZIP__UNIX)
+#define STAGE_THREADS 4
+#define STAGE_ROUNDS 8
+#define STAGE_ENTRIES 5
+
+typedef struct stage_thread
+{
+    picozip_file *stage;
+    int id, err;
+} stage_thread;
+
+/* fills the stage of a thread and commits it to <file>, a few times over */
+static void *stage_thread_main(void *userdata)
+{
+    stage_thread *thread = (stage_thread *)userdata;
+    char name[32];
+    int round, i;
+
+    for (round = 0; round < STAGE_ROUNDS && thread->err == PICOZIP_OK; round++)
+    {
+        for (i = 0; i < STAGE_ENTRIES && thread->err == PICOZIP_OK; i++)
+        {
+            sprintf(name, "t%d-%d-%d.txt", thread->id, round, i);
+            thread->err = picozip_new_entry_mem_ex(thread->stage, name, (uint8_t *)name, strlen(name), 0, NULL, 0);
+        }
+        if (thread->err == PICOZIP_OK)
+            thread->err = picozip_commit_stage(file, thread->stage);
+    }
+    return NULL;
+}
+
+TEST test_picozip_commit_stage_threads(void)
+{
+    stage_thread threads[STAGE_THREADS];
+    pthread_t ids[STAGE_THREADS];
+    int seen[STAGE_THREADS][STAGE_ROUNDS][STAGE_ENTRIES];
+    uint8_t *data;
+    size_t size, cd, offset, i, name_len;
+    int id, round, entry, next[STAGE_THREADS];
+    char name[32];
+
+    for (i = 0; i < STAGE_THREADS; i++)
+    {
+        threads[i].id = (int)i;
+        threads[i].err = PICOZIP_OK;
+        ASSERT_EQ(PICOZIP_OK, picozip_new_stage(file, &threads[i].stage));
+    }
+    for (i = 0; i < STAGE_THREADS; i++)
+        ASSERT_EQ(0, pthread_create(&ids[i], NULL, stage_thread_main, &threads[i]));
+    for (i = 0; i < STAGE_THREADS; i++)
+    {
+        ASSERT_EQ(0, pthread_join(ids[i], NULL));
+        ASSERT_EQ(PICOZIP_OK, threads[i].err);
+        ASSERT_EQ(PICOZIP_OK, picozip_free_mem(threads[i].stage));
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    size = picozip_get_mem(file, (void **)&data);
+
+    /* every entry is there once, in the order its thread added it, and its record points at its own content */
+    memset(seen, 0, sizeof(seen));
+    memset(next, 0, sizeof(next));
+    ASSERT_EQ(ZIP_EOCD_MAGIC, READ_LE32(data, size - 22));
+    ASSERT_EQ(STAGE_THREADS * STAGE_ROUNDS * STAGE_ENTRIES, READ_LE16(data, size - 22 + 10));
+    cd = READ_LE32(data, size - 22 + 16);
+    for (i = 0; i < STAGE_THREADS * STAGE_ROUNDS * STAGE_ENTRIES; i++)
+    {
+        ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(data, cd));
+        name_len = READ_LE16(data, cd + 28);
+        ASSERT(name_len < sizeof(name));
+        memcpy(name, data + cd + 46, name_len);
+        name[name_len] = '\0';
+        ASSERT_EQ(3, sscanf(name, "t%d-%d-%d.txt", &id, &round, &entry));
+        ASSERT(id >= 0 && id < STAGE_THREADS && round >= 0 && round < STAGE_ROUNDS && entry >= 0 && entry < STAGE_ENTRIES);
+        ASSERT_EQ(0, seen[id][round][entry]++);
+        ASSERT_EQ(next[id], round * STAGE_ENTRIES + entry);
+        next[id]++;
+
+        offset = READ_LE32(data, cd + 42);
+        ASSERT_EQ(ZIP_MAGIC, READ_LE32(data, offset));
+        ASSERT_EQ(name_len, READ_LE16(data, offset + 26));
+        ASSERT_MEM_EQ(name, data + offset + 30, name_len);
+        ASSERT_EQ(name_len, READ_LE32(data, offset + 22));
+        ASSERT_EQ(READ_LE32(data, cd + 16), READ_LE32(data, offset + 14));
+        ASSERT_MEM_EQ(name, data + offset + 30 + name_len + READ_LE16(data, offset + 28), name_len);
+        cd += 46 + name_len + READ_LE16(data, cd + 30) + READ_LE16(data, cd + 32);
+    }
+    PASS();
+}
+#endif
+
+TEST test_picozip_commit_stage_einval(void)
+{
+    picozip_file *stage;
+
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_stage(NULL, &stage));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_stage(file, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_commit_stage(file, file));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_commit_stage(file, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_commit_stage(NULL, file));
+    PASS();
+}
+
+/* hands out <userdata> (a NUL-terminated string) 3 bytes at a time */
+static size_t chunked_read(void *userdata, void *mem, size_t size)
+{
+    const char **str = (const char **)userdata;
+    size_t len = strlen(*str);
+
+    if (len > 3)
+        len = 3;
+    if (len > size)
+        len = size;
+    memcpy(mem, *str, len);
+    *str += len;
+    return len;
+}
+
+TEST test_picozip_new_entry_cb(void)
+{
+    const char *lorem = "lorem ipsum dolor si amet";
+    file_entry entries[] = {
+        {
+            .filename = "test.txt",
+            .flag = 1 << 3,
+            .zip64_desc = 1,
+            .size = 25,
+            .extra_field_len = 9,
+            .extra_field = "UT\x05\x00\x01\x00\x00\x00\x00",
+            .data = "lorem ipsum dolor si amet",
+            .crc32 = 0xd650527a,
+        },
+    };
+
+    /* a buffer smaller than what the callback returns at once; the size isn't known, so it may need ZIP64 */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(file, "test.txt", chunked_read, &lorem, 2, 0, NULL, 0));
+    CHECK_CALL(assert_zip_file(entries, sizeof(entries) / sizeof(entries[0]), NULL, 0));
+    PASS();
+}
+
+/* where the output of a >4 GiB archive goes: only its size, start and end are kept */
+typedef struct discard_sink
+{
+    uint64_t total;
+    uint8_t head[128], tail[256];
+} discard_sink;
+
+static size_t discard_write(void *userdata, const void *mem, size_t size)
+{
+    discard_sink *sink = (discard_sink *)userdata;
+    const uint8_t *data = (const uint8_t *)mem;
+
+    if (sink->total < sizeof(sink->head))
+        memcpy(sink->head + sink->total, data, size < sizeof(sink->head) - sink->total ? size : sizeof(sink->head) - (size_t)sink->total);
+    if (size >= sizeof(sink->tail))
+        memcpy(sink->tail, data + size - sizeof(sink->tail), sizeof(sink->tail));
+    else
+    {
+        memmove(sink->tail, sink->tail + size, sizeof(sink->tail) - size);
+        memcpy(sink->tail + sizeof(sink->tail) - size, data, size);
+    }
+    sink->total += size;
+    return size;
+}
+
+/* hands out as many zeros as <userdata> (a uint64_t) says */
+static size_t zero_read(void *userdata, void *mem, size_t size)
+{
+    uint64_t *left = (uint64_t *)userdata;
+
+    if (size > *left)
+        size = (size_t)*left;
+    memset(mem, 0, size);
+    *left -= size;
+    return size;
+}
+
+TEST test_picozip_new_entry_cb_zip64(void)
+{
+    const uint64_t size = ((uint64_t)4097) << 20; /* 4 GiB and 1 MiB */
+    discard_sink sink;
+    uint64_t left;
+    uint8_t *end, *cd, *desc;
+
+    memset(&sink, 0, sizeof(sink));
+    num_alloc_success = -1;
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, discard_write, custom_alloc, custom_free, &sink));
+    left = size;
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(file, "zero.bin", zero_read, &left, 1 << 20, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    ASSERT_EQ(0, left);
+    ASSERT_EQ(30 + 8 + 9 + 20 + size + 24 + 46 + 8 + 9 + 20 + 56 + 20 + 22, sink.total);
+
+    /* the local header has room for 64-bit sizes, which are only known at the end */
+    ASSERT_EQ(ZIP_MAGIC, READ_LE32(sink.head, 0));
+    ASSERT_EQ(45, READ_LE16(sink.head, 4));
+    ASSERT_EQ(1 << 3, READ_LE16(sink.head, 6));
+    ASSERT_EQ(0, READ_LE32(sink.head, 14));
+    ASSERT_EQ(0xFFFFFFFF, READ_LE32(sink.head, 18));
+    ASSERT_EQ(0xFFFFFFFF, READ_LE32(sink.head, 22));
+    ASSERT_EQ(9 + 20, READ_LE16(sink.head, 28));
+    ASSERT_MEM_EQ("\x01\x00\x10\x00\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", sink.head + 30 + 8 + 9, 20);
+
+    /* the data descriptor has 64-bit sizes, and so has the central directory record */
+    end = sink.tail + sizeof(sink.tail);
+    cd = end - 22 - 20 - 56 - (46 + 8 + 9 + 20);
+    desc = cd - 24;
+    ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(desc, 0));
+    ASSERT_EQ(0xc6a48b28, READ_LE32(desc, 4));
+    ASSERT_EQ(size & 0xFFFFFFFF, READ_LE32(desc, 8));
+    ASSERT_EQ(size >> 32, READ_LE32(desc, 12));
+    ASSERT_EQ(size & 0xFFFFFFFF, READ_LE32(desc, 16));
+    ASSERT_EQ(size >> 32, READ_LE32(desc, 20));
+
+    ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(cd, 0));
+    ASSERT_EQ(45, READ_LE16(cd, 6));
+    ASSERT_EQ(0xc6a48b28, READ_LE32(cd, 16));
+    ASSERT_EQ(0xFFFFFFFF, READ_LE32(cd, 20));
+    ASSERT_EQ(0xFFFFFFFF, READ_LE32(cd, 24));
+    ASSERT_EQ(9 + 20, READ_LE16(cd, 30));
+    ASSERT_EQ(0, READ_LE32(cd, 42));
+    ASSERT_EQ(1, READ_LE16(cd, 46 + 8 + 9));
+    ASSERT_EQ(16, READ_LE16(cd, 46 + 8 + 9 + 2));
+    ASSERT_EQ(size & 0xFFFFFFFF, READ_LE32(cd, 46 + 8 + 9 + 4));
+    ASSERT_EQ(size >> 32, READ_LE32(cd, 46 + 8 + 9 + 8));
+    ASSERT_EQ(size & 0xFFFFFFFF, READ_LE32(cd, 46 + 8 + 9 + 12));
+    ASSERT_EQ(size >> 32, READ_LE32(cd, 46 + 8 + 9 + 16));
+
+    /* the central directory starts past 4 GiB */
+    ASSERT_EQ(0x06064b50, READ_LE32(end - 22 - 20 - 56, 0));
+    ASSERT_EQ(0xFFFFFFFF, READ_LE32(end - 22, 16));
+    PASS();
+}
+
+static size_t largest_read = 0;
+
+/* reads a string, remembering the largest buffer it was given */
+static size_t sized_read(void *userdata, void *mem, size_t size)
+{
+    const char **data = (const char **)userdata;
+    size_t len = strlen(*data);
+
+    if (size > largest_read)
+        largest_read = size;
+    if (len > size)
+        len = size;
+    memcpy(mem, *data, len);
+    *data += len;
+    return len;
+}
+
+TEST test_picozip_set_read_buffer(void)
+{
+    const char *hello = "hello world!", *lorem = "lorem ipsum dolor si amet";
+
+    num_alloc_success = num_write_success = -1; /* unlimited */
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_read_buffer(NULL, 4));
+    ASSERT_EQ(PICOZIP_OK, picozip_new(&file, custom_write, custom_alloc, custom_free, NULL));
+
+    /* the default buffer */
+    largest_read = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(file, "a.txt", sized_read, &hello, 0, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_READ_BUF, largest_read);
+
+    /* a smaller one, replacing the one already allocated */
+    largest_read = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_set_read_buffer(file, 4));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(file, "b.txt", sized_read, &lorem, 0, 0, NULL, 0));
+    ASSERT_EQ(4, largest_read);
+
+    /* a size of its own takes precedence */
+    largest_read = 0;
+    lorem = "lorem ipsum dolor si amet";
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(file, "c.txt", sized_read, &lorem, 16, 0, NULL, 0));
+    ASSERT_EQ(16, largest_read);
+
+    ASSERT_EQ(PICOZIP_OK, picozip_set_read_buffer(file, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_EQ(PICOZIP_OK, picozip_free(file));
+    PASS();
+}
+
+static size_t failing_read(void *userdata, void *mem, size_t size)
+{
+    return PICOZIP_READ_ERROR;
+}
+
+TEST test_picozip_new_entry_cb_einval(void)
+{
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_cb(NULL, "test.txt", chunked_read, NULL, 0, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_cb(file, NULL, chunked_read, NULL, 0, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_cb(file, "test.txt", NULL, NULL, 0, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_entry_cb(file, "test.txt", chunked_read, NULL, 0, 0, NULL, 1));
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_cb(file, "test.txt", failing_read, NULL, 0, 0, NULL, 0));
+    CHECK_CALL(assert_zip_file(NULL, 0, NULL, 0));
+    PASS();
+}
+
+TEST test_picozip_read(void)
+{
+    static uint8_t out[512];
+    const char *lorem = "lorem ipsum dolor si amet";
+    picozip_file *reader;
+    size_t size, n, offset;
+    int err;
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_reader(&reader));
+    ASSERT_EQ(PICOZIP_OK, picozip_queue_entry_mem(reader, "a.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_queue_entry_cb(reader, "b.txt", chunked_read, &lorem, 0, NULL, 0));
+
+    /* pull the archive 5 bytes at a time */
+    for (size = 0; (err = picozip_read(reader, out + size, 5, &n)) == PICOZIP_OK && n; size += n)
+        ASSERT(size + 5 <= sizeof(out));
+    ASSERT_EQ(PICOZIP_OK, err);
+    ASSERT_EQ(0, n);
+
+    /* both entries have a data descriptor, like picozip_new_entry_file */
+    ASSERT_EQ(ZIP_MAGIC, READ_LE32(out, 0));
+    ASSERT_EQ(1 << 3, READ_LE16(out, 6));
+    ASSERT_MEM_EQ("hello world!", out + 44, 12);
+    ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(out, 56));
+    ASSERT_EQ(0x03b4c26d, READ_LE32(out, 60));
+    ASSERT_EQ(12, READ_LE32(out, 64));
+    offset = 72;
+    ASSERT_EQ(ZIP_MAGIC, READ_LE32(out, offset));
+    /* the size of a callback isn't known up front, so there is room for 64-bit sizes */
+    ASSERT_EQ(45, READ_LE16(out, offset + 4));
+    ASSERT_EQ(29, READ_LE16(out, offset + 28));
+    ASSERT_EQ(1, READ_LE16(out, offset + 44));
+    ASSERT_MEM_EQ("lorem ipsum dolor si amet", out + offset + 64, 25);
+    ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(out, offset + 89));
+    ASSERT_EQ(0xd650527a, READ_LE32(out, offset + 93));
+    ASSERT_EQ(25, READ_LE32(out, offset + 97));
+    ASSERT_EQ(25, READ_LE32(out, offset + 105));
+    offset += 113;
+    ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(out, offset));
+    ASSERT_EQ(0, READ_LE32(out, offset + 42));
+    ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(out, offset + 60));
+    ASSERT_EQ(45, READ_LE16(out, offset + 66));
+    ASSERT_EQ(72, READ_LE32(out, offset + 102));
+    ASSERT_EQ(ZIP_EOCD_MAGIC, READ_LE32(out, offset + 120));
+    ASSERT_EQ(2, READ_LE16(out, offset + 128));
+    ASSERT_EQ(offset, READ_LE32(out, offset + 136));
+    ASSERT_EQ(offset + 142, size);
+
+    /* the entries can't change once the archive is being read */
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_queue_entry_mem(reader, "c.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_reader(reader));
+    PASS();
+}
+
+/* the bytes 0, 1, 2... at <offset> */
+static size_t counting_pread(void *userdata, void *mem, size_t size, uint64_t offset)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        ((uint8_t *)mem)[i] = (uint8_t)(offset + i);
+    return size;
+}
+
+TEST test_picozip_plan(void)
+{
+    static uint8_t out[512], range[512];
+    const char *lorem = "lorem ipsum dolor si amet";
+    picozip_file *reader;
+    uint64_t size, offsets[2], a;
+    size_t n, total;
+
+    ASSERT_EQ(PICOZIP_OK, picozip_new_reader(&reader));
+    ASSERT_EQ(PICOZIP_OK, picozip_queue_entry_mem(reader, "a.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_queue_entry_pread(reader, "b.bin", counting_pread, NULL, 4, 0x8bb98613, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_read_at(reader, 0, range, sizeof(range), &n));
+    ASSERT_EQ(PICOZIP_OK, picozip_plan(reader, &size, offsets));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_plan(reader, &size, offsets));
+
+    /* planned entries are stored with their sizes and CRC in the local header */
+    ASSERT_EQ(0, offsets[0]);
+    ASSERT_EQ(56, offsets[1]);
+    ASSERT_EQ(104 + 2 * 60 + 22, size);
+
+    for (total = 0; picozip_read(reader, out + total, 7, &n) == PICOZIP_OK && n; total += n)
+        ;
+    ASSERT_EQ(size, total);
+    ASSERT_EQ(0, READ_LE16(out, 6));
+    ASSERT_EQ(0x03b4c26d, READ_LE32(out, 14));
+    ASSERT_EQ(12, READ_LE32(out, 18));
+    ASSERT_MEM_EQ("hello world!", out + 44, 12);
+    ASSERT_MEM_EQ("\x00\x01\x02\x03", out + 100, 4);
+    ASSERT_EQ(0x8bb98613, READ_LE32(out, 56 + 14));
+    ASSERT_EQ(ZIP_CENTRAL_MAGIC, READ_LE32(out, 104));
+    ASSERT_EQ(56, READ_LE32(out, 164 + 42));
+
+    /* any range can be generated on its own */
+    for (a = 0; a < size; a += 13)
+    {
+        ASSERT_EQ(PICOZIP_OK, picozip_read_at(reader, a, range, 29, &n));
+        ASSERT_EQ(a + 29 > size ? size - a : 29, n);
+        ASSERT_MEM_EQ(out + a, range, n);
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_read_at(reader, size, range, 29, &n));
+    ASSERT_EQ(0, n);
+    ASSERT_EQ(PICOZIP_OK, picozip_free_reader(reader));
+
+    /* the size of streamed and compressed entries isn't known up front */
+    ASSERT_EQ(PICOZIP_OK, picozip_new_reader(&reader));
+    ASSERT_EQ(PICOZIP_OK, picozip_queue_entry_cb(reader, "b.txt", chunked_read, &lorem, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_plan(reader, &size, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_plan(NULL, &size, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_plan(file, &size, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_reader(reader));
+    PASS();
+}
+
+TEST test_picozip_read_einval(void)
+{
+    uint8_t buf[16];
+    size_t n;
+
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_new_reader(NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_read(file, buf, sizeof(buf), &n));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_queue_entry_mem(file, "a.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_queue_entry_cb(file, "a.txt", chunked_read, NULL, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_free_reader(file));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_free_reader(NULL));
+    PASS();
+}
+
+#if defined(PICOZIP_THREADS) && !defined(PICOZIP_NO_DEFLATE)
+/* adds the same entries to <zip>, returning the output */
+static size_t threads_entries(picozip_file *zip, const uint8_t *big, size_t big_size, uint8_t **data)
+{
+    if (picozip_set_codec(zip, picozip_codec_deflate(), 1) != PICOZIP_OK ||
+        picozip_new_entry_mem_ex(zip, "test.txt", (uint8_t *)"hello world!", 12, 0, NULL, 0) != PICOZIP_OK ||
+        picozip_new_entry_mem_ex(zip, "big.bin", big, big_size, 0, NULL, 0) != PICOZIP_OK ||
+        picozip_new_entry_mem_ex(zip, "test2.txt", big, 1000, 0, NULL, 0) != PICOZIP_OK ||
+        picozip_end(zip) != PICOZIP_OK)
+        return 0;
+    return picozip_get_mem(zip, (void **)data);
+}
+
+TEST test_picozip_set_threads(void)
+{
+    static uint8_t big[3 * PICOZIP_THREAD_BLOCK + 5];
+    picozip_file *single;
+    uint8_t *data, *expected;
+    size_t size, expected_size, cd, expected_cd, offset, i;
+    uint32_t x;
+
+    for (x = 1, i = 0; i < sizeof(big); i++)
+    {
+        x = x * 1103515245 + 12345;
+        big[i] = 'a' + (x >> 16) % 8;
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_new_mem(&single));
+    expected_size = threads_entries(single, big, sizeof(big), &expected);
+    ASSERT_GT(expected_size, 0);
+    ASSERT_EQ(PICOZIP_OK, picozip_set_threads(file, 4));
+    size = threads_entries(file, big, sizeof(big), &data);
+    ASSERT_GT(size, 0);
+    cd = READ_LE32(data, size - 22 + 16);
+    expected_cd = READ_LE32(expected, expected_size - 22 + 16);
+
+    /* small entries are compressed by a single worker exactly like they are without threads */
+    ASSERT_MEM_EQ(expected, data, 30 + 8 + 9 + READ_LE32(expected, expected_cd + 20) + 16);
+
+    /* large entries are split in blocks, but have the same CRC and size */
+    for (i = 0; i < 3; i++)
+    {
+        ASSERT_EQ(READ_LE32(expected, expected_cd + 16), READ_LE32(data, cd + 16));
+        ASSERT_EQ(READ_LE32(expected, expected_cd + 24), READ_LE32(data, cd + 24));
+        offset = READ_LE32(data, cd + 42);
+        ASSERT_EQ(ZIP_MAGIC, READ_LE32(data, offset));
+        offset += 30 + READ_LE16(data, offset + 26) + READ_LE16(data, offset + 28) + READ_LE32(data, cd + 20);
+        ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(data, offset));
+        ASSERT_EQ(READ_LE32(data, cd + 16), READ_LE32(data, offset + 4));
+        ASSERT_EQ(READ_LE32(data, cd + 24), READ_LE32(data, offset + 12));
+        expected_cd += 46 + READ_LE16(expected, expected_cd + 28) + READ_LE16(expected, expected_cd + 30);
+        cd += 46 + READ_LE16(data, cd + 28) + READ_LE16(data, cd + 30);
+    }
+    ASSERT_EQ(PICOZIP_OK, picozip_set_threads(file, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(single));
+    PASS();
+}
+
+TEST test_picozip_set_threads_crc(void)
+{
+    static uint8_t big[PICOZIP_THREAD_CRC_MIN + 7];
+    uint8_t *data;
+    size_t size, i;
+    uint32_t x;
+
+    for (x = 1, i = 0; i < sizeof(big); i++)
+    {
+        x = x * 1103515245 + 12345;
+        big[i] = (uint8_t)(x >> 16);
+    }
+
+    /* the CRC of large stored entries is split in slices, then combined */
+    ASSERT_EQ(PICOZIP_OK, picozip_set_threads(file, 3));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "big.bin", big, sizeof(big)));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem_ex2(file, "big2.bin", big, sizeof(big), 0xeac5668d, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    size = picozip_get_mem(file, (void **)&data);
+    ASSERT_EQ(0, READ_LE16(data, 6));
+    ASSERT_EQ(0xeac5668d, READ_LE32(data, 14));
+    ASSERT_EQ(sizeof(big), READ_LE32(data, 22));
+    ASSERT_EQ(0xeac5668d, READ_LE32(data, READ_LE32(data, size - 22 + 16) + 16));
+    PASS();
+}
+
+TEST test_picozip_set_threads_einval(void)
+{
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_threads(NULL, 4));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_threads(file, (size_t)-1));
+    PASS();
+}
+#endif
+
+#ifdef PICOZIP_STATS
+static char trace_log[256];
+
+/* appends the event and the path to trace_log */
+static void trace_entry(void *userdata, int event, const char *path, size_t path_len)
+{
+    size_t len = strlen(trace_log);
+
+    (void)userdata;
+    if (len + path_len + 3 > sizeof(trace_log))
+        return;
+    trace_log[len++] = event == PICOZIP_TRACE_BEGIN ? '+' : event == PICOZIP_TRACE_END ? '-' : '!';
+    memcpy(trace_log + len, path, path_len);
+    trace_log[len + path_len] = ' ';
+    trace_log[len + path_len + 1] = '\0';
+}
+
+TEST test_picozip_get_stats(void)
+{
+    const char *lorem = "lorem ipsum dolor si amet";
+    picozip_stats stats;
+    uint8_t *data;
+    size_t size;
+
+    trace_log[0] = '\0';
+    ASSERT_EQ(PICOZIP_OK, picozip_set_trace(file, trace_entry, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "a.txt", (uint8_t *)"hello world!", 12));
+    /* the end is traced as soon as the data is written, not when the next entry starts */
+    ASSERT_STR_EQ("+a.txt -a.txt ", trace_log);
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_cb(file, "b.txt", chunked_read, &lorem, 0, 0, NULL, 0));
+    ASSERT_STR_EQ("+a.txt -a.txt +b.txt -b.txt ", trace_log);
+    ASSERT_EQ(PICOZIP_EIO, picozip_new_entry_cb(file, "c.txt", failing_read, NULL, 0, 0, NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "d/", NULL, 0));
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    ASSERT_STR_EQ("+a.txt -a.txt +b.txt -b.txt +c.txt !c.txt +d/ -d/ ", trace_log);
+
+    size = picozip_get_mem(file, (void **)&data);
+    ASSERT_EQ(PICOZIP_OK, picozip_get_stats(file, &stats));
+    ASSERT_EQ(size, stats.bytes_written);
+    ASSERT(stats.write_calls > 0);
+    ASSERT(stats.alloc_calls > 0);
+    ASSERT(stats.alloc_bytes > 0);
+    ASSERT_EQ(2, stats.sized_entries);
+    ASSERT_EQ(1, stats.datadesc_entries);
+    PASS();
+}
+
+TEST test_picozip_get_stats_einval(void)
+{
+    picozip_file *stage;
+    picozip_stats stats;
+
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_get_stats(NULL, &stats));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_get_stats(file, NULL));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_trace(NULL, trace_entry, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_stage(file, &stage));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_trace(stage, trace_entry, NULL));
+    ASSERT_EQ(PICOZIP_OK, picozip_free_mem(stage));
+    PASS();
+}
+#endif
+
+TEST test_picozip_set_codec_custom(void)
+{
+    picozip_codec codec = {PICOZIP_METHOD_ZSTD, 63, &codec_calls, passthrough_begin, passthrough_compress, passthrough_end, 0};
+    uint8_t *data;
+
+    codec_calls = 0;
+    ASSERT_EQ(PICOZIP_OK, picozip_set_codec(file, &codec, 3));
+    ASSERT_EQ(PICOZIP_OK, picozip_new_entry_mem(file, "test.txt", (uint8_t *)"hello world!", 12));
+    ASSERT_EQ(3, codec_calls);
+    ASSERT_EQ(PICOZIP_OK, picozip_end(file));
+    picozip_get_mem(file, (void **)&data);
+
+    ASSERT_EQ(63, READ_LE16(data, 4));
+    ASSERT_EQ(PICOZIP_METHOD_ZSTD, READ_LE16(data, 8));
+    ASSERT_MEM_EQ("hello world!", data + 47, 12);
+    ASSERT_EQ(ZIP_DATADESC_MAGIC, READ_LE32(data, 59));
+    ASSERT_EQ(0x03b4c26d, READ_LE32(data, 63));
+    ASSERT_EQ(12, READ_LE32(data, 67));
+    ASSERT_EQ(12, READ_LE32(data, 71));
+    PASS();
+}
+
+TEST test_picozip_set_codec_einval(void)
+{
+    picozip_codec codec = {PICOZIP_METHOD_ZSTD, 63, NULL, passthrough_begin, NULL, passthrough_end, 0};
+
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_codec(NULL, NULL, 0));
+    ASSERT_EQ(PICOZIP_EINVAL, picozip_set_codec(file, &codec, 0));
+    PASS();
+}
+
+SUITE(picozip_mem_path_tests)
+{
+    SET_SETUP(mem_setup_cb, NULL);
+    SET_TEARDOWN(mem_teardown_cb, NULL);
+
+    RUN_TEST(test_picozip_end);
+    RUN_TEST(test_picozip_end_einval);
+    RUN_TEST(test_picozip_end_ex);
+    RUN_TEST(test_picozip_end_ex_einval);
+    RUN_TEST(test_picozip_end_zip64);
+    RUN_TEST(test_picozip_free_mem);
+    RUN_TEST(test_picozip_free_mem_einval);
+
+    RUN_TEST(test_picozip_new_mem);
+    RUN_TEST(test_picozip_new_mem_einval);
+    RUN_TEST(test_picozip_new_entry_mem);
+    RUN_TEST(test_picozip_new_entry_mem_einval);
+    RUN_TEST(test_picozip_new_entry_mem_ex);
+    RUN_TEST(test_picozip_new_entry_mem_ex_einval);
+    RUN_TEST(test_picozip_new_entries_mem);
+    RUN_TEST(test_picozip_new_entries_mem_einval);
+    RUN_TEST(test_picozip_new_entry_mem_ex2);
+    RUN_TEST(test_picozip_new_entry_mem_ex2_einval);
+    RUN_TEST(test_picozip_crc32);
+    RUN_TEST(test_picozip_reserve);
+    RUN_TEST(test_picozip_reserve_einval);
+    RUN_TEST(test_picozip_set_spill);
+    RUN_TEST(test_picozip_set_spill_einval);
+    RUN_TEST(test_picozip_set_arena);
+    RUN_TEST(test_picozip_set_arena_einval);
+    RUN_TEST(test_picozip_set_timezone);
+    RUN_TEST(test_picozip_set_timezone_einval);
+    RUN_TEST(test_picozip_set_buffer_mem);
+#ifndef PICOZIP_NO_DEFLATE
+    RUN_TEST(test_picozip_set_codec);
+    RUN_TEST(test_picozip_set_codec_inflate);
+#endif
+    RUN_TEST(test_picozip_set_codec_custom);
+    RUN_TEST(test_picozip_set_codec_einval);
+    RUN_TEST(test_picozip_commit_stage);
+    RUN_TEST(test_picozip_commit_stage_einval);
+#if defined(PICOZIP_THREADS) && defined(PICOZIP__UNIX)
+    RUN_TEST(test_picozip_commit_stage_threads);
+#endif
+    RUN_TEST(test_picozip_new_entry_cb);
+    RUN_TEST(test_picozip_new_entry_cb_einval);
+    RUN_TEST(test_picozip_read);
+    RUN_TEST(test_picozip_read_einval);
+    RUN_TEST(test_picozip_plan);
+#if defined(PICOZIP_THREADS) && !defined(PICOZIP_NO_DEFLATE)
+    RUN_TEST(test_picozip_set_threads);
+    RUN_TEST(test_picozip_set_threads_crc);
+    RUN_TEST(test_picozip_set_threads_einval);
+#endif
+#ifdef PICOZIP_STATS
+    RUN_TEST(test_picozip_get_stats);
+    RUN_TEST(test_picozip_get_stats_einval);
+#endif
+
+    RUN_TEST(test_picozip_new_entry_path);
+    RUN_TEST(test_picozip_new_entry_path_einval);
+    RUN_TEST(test_picozip_new_entry_stream);
+    RUN_TEST(test_picozip_new_entry_stream_einval);
+    RUN_TEST(test_picozip_new_entry_path_copy);
+#if defined(PICOZIP__UNIX)
+    RUN_TEST(test_picozip_new_entry_path_pipe);
+#endif
+#ifdef PICOZIP__URING
+    RUN_TEST(test_picozip_uring);
+#endif
+
+    RUN_TEST(test_picozip_new_path);
+    RUN_TEST(test_picozip_new_path_einval);
+    RUN_TEST(test_picozip_open_append);
+    RUN_TEST(test_picozip_open_append_free);
+    RUN_TEST(test_picozip_open_append_einval);
+#ifdef picozip__pathstat
+    RUN_TEST(test_picozip_add_tree);
+    RUN_TEST(test_picozip_add_tree_einval);
+#endif
     RUN_TEST(test_picozip_free_path);
     RUN_TEST(test_picozip_free_path_einval);
 
@@ -612,6 +2983,15 @@ SUITE(picozip_tests)
     RUN_TEST(test_picozip_free);
     RUN_TEST(test_picozip_alloc_error);
     RUN_TEST(test_picozip_write_error);
+    RUN_TEST(test_picozip_arena_alloc);
+    RUN_TEST(test_picozip_new_stage_alloc);
+    RUN_TEST(test_picozip_new_entry_cb_zip64);
+    RUN_TEST(test_picozip_set_writev_callback);
+    RUN_TEST(test_picozip_new_entries_mem_writev);
+    RUN_TEST(test_picozip_set_buffer);
+    RUN_TEST(test_picozip_set_read_buffer);
+    RUN_TEST(test_picozip_set_nonblocking);
+    RUN_TEST(test_picozip_set_nonblocking_stream);
 }
 
 GREATEST_MAIN_DEFS();